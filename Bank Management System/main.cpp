@@ -2,12 +2,62 @@
 #include <string>
 #include <vector>
 #include <memory>
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
 #include <mysql.h>
 #include <ctime>
 #include <iomanip>
 #include <functional>
 #include <thread>
 #include <chrono>
+#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cctype>
+#include <future>
+#include <condition_variable>
+#include <deque>
+#include <shared_mutex>
+#include <charconv>
+#include <string_view>
+#include <cmath>
+#include <cerrno>
+#include <fcntl.h>
+#include <set>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <csignal>
+#include <climits>
+#include <limits>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <direct.h>
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#endif
 
 // Configuration for database connection
 struct DBConfig {
@@ -16,9 +66,27 @@ struct DBConfig {
     const char* password;
     const char* database;
     unsigned int port;
+    // AUTO_INCREMENT step and offset for every session, 0 keeps the server's;
+    // shards use them to keep their ids apart (see ShardMap)
+    unsigned int autoIncrementIncrement;
+    unsigned int autoIncrementOffset;
 
     DBConfig() : host("localhost"), user("root"), password("030910"), 
-                 database("bank"), port(3306) {}
+                 database("bank"), port(3306), autoIncrementIncrement(0), autoIncrementOffset(0) {}
+    
+    // Same credentials and schema on another server, e.g. a read replica
+    DBConfig(const char* host, unsigned int port) : DBConfig() {
+        this->host = host;
+        this->port = port;
+    }
+};
+
+// Outcome of an asynchronously executed query
+struct QueryResult {
+    bool success;
+    std::vector<std::vector<std::string>> rows;
+    
+    QueryResult() : success(false) {}
 };
 
 // Interface for database operations - follows Interface Segregation Principle
@@ -29,6 +97,455 @@ public:
     virtual bool disconnect() = 0;
     virtual bool executeQuery(const std::string& query) = 0;
     virtual bool executeQuery(const std::string& query, std::vector<std::vector<std::string>>& results) = 0;
+    
+    // Implementations without their own executor complete the query on the calling thread
+    virtual std::future<QueryResult> executeQueryAsync(const std::string& query) {
+        std::promise<QueryResult> promise;
+        QueryResult result;
+        result.success = executeQuery(query, result.rows);
+        promise.set_value(std::move(result));
+        return promise.get_future();
+    }
+    
+    // Hands rows to onRow one at a time; onRow returns false to stop early.
+    // The row vector is reused between calls.
+    virtual bool streamQuery(const std::string& query,
+                             const std::function<bool(const std::vector<std::string>&)>& onRow) {
+        std::vector<std::vector<std::string>> results;
+        if (!executeQuery(query, results)) {
+            return false;
+        }
+        for (const auto& row : results) {
+            if (!onRow(row)) {
+                break;
+            }
+        }
+        return true;
+    }
+    
+    // Runs the statements in order on one connection; results[i] holds the rows
+    // of statements[i]. Implementations that can, send the batch in one round trip.
+    virtual bool executeBatch(const std::vector<std::string>& statements,
+                              std::vector<std::vector<std::vector<std::string>>>& results) {
+        results.assign(statements.size(), std::vector<std::vector<std::string>>());
+        
+        for (size_t i = 0; i < statements.size(); i++) {
+            if (!executeQuery(statements[i], results[i])) {
+                executeQuery("ROLLBACK");
+                return false;
+            }
+        }
+        
+        return true;
+    }
+};
+
+// Escapes a value for use inside a single-quoted SQL string literal
+inline std::string sqlEscape(const std::string& value) {
+    std::string escaped;
+    escaped.reserve(value.size());
+    
+    for (char c : value) {
+        switch (c) {
+            case '\0':   escaped += "\\0"; break;
+            case '\n':   escaped += "\\n"; break;
+            case '\r':   escaped += "\\r"; break;
+            case '\x1a': escaped += "\\Z"; break;
+            case '\'':   escaped += "\\'"; break;
+            case '"':    escaped += "\\\""; break;
+            case '\\':   escaped += "\\\\"; break;
+            default:     escaped += c;
+        }
+    }
+    
+    return escaped;
+}
+
+// Priority class of database work, used by RequestScheduler. Lower values are
+// served first.
+enum class RequestPriority : std::uint8_t {
+    Interactive = 0,    // tellers, console, network clients
+    Batch = 1           // back-office jobs
+};
+
+const size_t kRequestPriorityCount = 2;
+
+inline const char* requestPriorityName(RequestPriority priority) {
+    return priority == RequestPriority::Batch ? "batch" : "interactive";
+}
+
+// Priority of the work issued by the current thread; Interactive unless a
+// ScopedPriority says otherwise
+inline RequestPriority& currentRequestPriority() {
+    thread_local RequestPriority priority = RequestPriority::Interactive;
+    return priority;
+}
+
+// Runs the current thread at another priority for the lifetime of the object
+class ScopedPriority {
+private:
+    RequestPriority previous;
+    
+public:
+    explicit ScopedPriority(RequestPriority priority) : previous(currentRequestPriority()) {
+        currentRequestPriority() = priority;
+    }
+    
+    ~ScopedPriority() {
+        currentRequestPriority() = previous;
+    }
+    
+    ScopedPriority(const ScopedPriority&) = delete;
+    ScopedPriority& operator=(const ScopedPriority&) = delete;
+};
+
+// Database session of the current thread, which ReplicaRoutingDatabase keeps
+// on the primary after a write. Every thread starts a session of its own.
+inline std::uint64_t& currentDatabaseSession() {
+    static std::atomic<std::uint64_t> nextSession(1);
+    thread_local std::uint64_t session = nextSession.fetch_add(1);
+    return session;
+}
+
+// Runs the current thread in another database session for the lifetime of the object
+class ScopedSession {
+private:
+    std::uint64_t previous;
+    
+public:
+    explicit ScopedSession(std::uint64_t session) : previous(currentDatabaseSession()) {
+        currentDatabaseSession() = session;
+    }
+    
+    ~ScopedSession() {
+        currentDatabaseSession() = previous;
+    }
+    
+    ScopedSession(const ScopedSession&) = delete;
+    ScopedSession& operator=(const ScopedSession&) = delete;
+};
+
+// Fixed-size thread pool shared by asynchronous database and service operations
+class WorkerPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable taskAvailable;
+    bool stopping;
+    
+    void workerLoop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                taskAvailable.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+    
+public:
+    explicit WorkerPool(size_t threadCount) : stopping(false) {
+        if (threadCount == 0) {
+            threadCount = 1;
+        }
+        for (size_t i = 0; i < threadCount; i++) {
+            workers.emplace_back(&WorkerPool::workerLoop, this);
+        }
+    }
+    
+    // Finishes queued work before joining
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        taskAvailable.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+    
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    
+    template <typename Task>
+    auto submit(Task task) -> std::future<decltype(task())> {
+        using Result = decltype(task());
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+        std::future<Result> future = packaged->get_future();
+        // Tasks run at the priority, and in the database session, of the thread that submitted them
+        RequestPriority priority = currentRequestPriority();
+        std::uint64_t session = currentDatabaseSession();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace_back([packaged, priority, session] {
+                ScopedPriority scope(priority);
+                ScopedSession inSession(session);
+                (*packaged)();
+            });
+        }
+        taskAvailable.notify_one();
+        return future;
+    }
+    
+    size_t size() const { return workers.size(); }
+    
+    size_t pending() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return tasks.size();
+    }
+};
+
+// Application metrics in the Prometheus text format (version 0.0.4).
+// Counters, gauges and histograms are registered once and then updated with
+// relaxed atomics, so the hot paths never take a lock. Values other classes
+// already keep are exported through functions read at scrape time. Labels
+// are passed preformatted, e.g. operation="deposit".
+class MetricsRegistry {
+public:
+    class Counter {
+    private:
+        std::atomic<unsigned long long> value;
+        
+    public:
+        Counter() : value(0) {}
+        
+        void increment(unsigned long long by = 1) {
+            value.fetch_add(by, std::memory_order_relaxed);
+        }
+        
+        unsigned long long get() const {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+    
+    class Gauge {
+    private:
+        std::atomic<long long> value;
+        
+    public:
+        Gauge() : value(0) {}
+        
+        void set(long long to) {
+            value.store(to, std::memory_order_relaxed);
+        }
+        
+        void add(long long by) {
+            value.fetch_add(by, std::memory_order_relaxed);
+        }
+        
+        long long get() const {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+    
+    // Fixed buckets given by their upper bounds in seconds
+    class Histogram {
+    private:
+        std::vector<double> bounds;
+        std::unique_ptr<std::atomic<unsigned long long>[]> counts;     // per bucket, the last one is +Inf
+        std::atomic<unsigned long long> count;
+        std::atomic<unsigned long long> sumNanos;
+        
+    public:
+        explicit Histogram(std::vector<double> upperBounds)
+            : bounds(std::move(upperBounds)), counts(new std::atomic<unsigned long long>[bounds.size() + 1]),
+              count(0), sumNanos(0) {
+            std::sort(bounds.begin(), bounds.end());
+            for (size_t i = 0; i <= bounds.size(); i++) {
+                counts[i].store(0, std::memory_order_relaxed);
+            }
+        }
+        
+        void observe(double seconds) {
+            size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), seconds) - bounds.begin();
+            counts[bucket].fetch_add(1, std::memory_order_relaxed);
+            count.fetch_add(1, std::memory_order_relaxed);
+            sumNanos.fetch_add(static_cast<unsigned long long>(std::max(0.0, seconds) * 1e9),
+                               std::memory_order_relaxed);
+        }
+        
+        void observe(std::chrono::steady_clock::duration elapsed) {
+            observe(std::chrono::duration<double>(elapsed).count());
+        }
+        
+        void render(std::string& out, const std::string& name, const std::string& labels) const {
+            std::string prefix = labels.empty() ? "" : labels + ",";
+            unsigned long long cumulative = 0;
+            for (size_t i = 0; i <= bounds.size(); i++) {
+                cumulative += counts[i].load(std::memory_order_relaxed);
+                out += name + "_bucket{" + prefix + "le=\"";
+                if (i < bounds.size()) {
+                    appendValue(out, bounds[i]);
+                } else {
+                    out += "+Inf";
+                }
+                out += "\"} " + std::to_string(cumulative) + "\n";
+            }
+            std::string selector = labels.empty() ? "" : "{" + labels + "}";
+            out += name + "_sum" + selector + " ";
+            appendValue(out, sumNanos.load(std::memory_order_relaxed) / 1e9);
+            out += "\n" + name + "_count" + selector + " " + std::to_string(count.load(std::memory_order_relaxed)) + "\n";
+        }
+    };
+    
+private:
+    struct Series {
+        std::string labels;
+        std::shared_ptr<Counter> counter;
+        std::shared_ptr<Gauge> gauge;
+        std::shared_ptr<Histogram> histogram;
+        std::function<double()> read;
+    };
+    
+    struct Family {
+        std::string name;
+        std::string help;
+        std::string type;
+        std::vector<Series> series;
+    };
+    
+    std::mutex mutex;
+    std::vector<Family> families;   // in registration order
+    
+    // Requires mutex
+    Series& series(const std::string& name, const std::string& help, const char* type, const std::string& labels) {
+        auto family = std::find_if(families.begin(), families.end(),
+                                   [&name](const Family& candidate) { return candidate.name == name; });
+        if (family == families.end()) {
+            families.push_back({ name, help, type, {} });
+            family = families.end() - 1;
+        } else if (family->type != type) {
+            std::cerr << "Metric " << name << " is already registered as a " << family->type << std::endl;
+        }
+        
+        for (auto& existing : family->series) {
+            if (existing.labels == labels) {
+                return existing;
+            }
+        }
+        family->series.push_back(Series());
+        family->series.back().labels = labels;
+        return family->series.back();
+    }
+    
+public:
+    static void appendValue(std::string& out, double value) {
+        if (std::isnan(value)) {
+            out += "NaN";
+        } else if (std::isinf(value)) {
+            out += value > 0 ? "+Inf" : "-Inf";
+        } else if (value == std::floor(value) && std::fabs(value) < 1e15) {
+            out += std::to_string(static_cast<long long>(value));
+        } else {
+            char text[32];
+            std::snprintf(text, sizeof(text), "%.9g", value);
+            out += text;
+        }
+    }
+    
+    // Joins two preformatted label lists
+    static std::string joinLabels(const std::string& first, const std::string& second) {
+        if (first.empty() || second.empty()) {
+            return first + second;
+        }
+        return first + "," + second;
+    }
+    
+    // Request latencies from half a millisecond to ten seconds
+    static std::vector<double> latencyBuckets() {
+        return { 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+    }
+    
+    // Registering the same name and labels again returns the existing metric
+    std::shared_ptr<Counter> counter(const std::string& name, const std::string& help,
+                                     const std::string& labels = "") {
+        std::lock_guard<std::mutex> lock(mutex);
+        Series& entry = series(name, help, "counter", labels);
+        if (!entry.counter) {
+            entry.counter = std::make_shared<Counter>();
+        }
+        return entry.counter;
+    }
+    
+    std::shared_ptr<Gauge> gauge(const std::string& name, const std::string& help, const std::string& labels = "") {
+        std::lock_guard<std::mutex> lock(mutex);
+        Series& entry = series(name, help, "gauge", labels);
+        if (!entry.gauge) {
+            entry.gauge = std::make_shared<Gauge>();
+        }
+        return entry.gauge;
+    }
+    
+    std::shared_ptr<Histogram> histogram(const std::string& name, const std::string& help,
+                                         const std::string& labels = "",
+                                         const std::vector<double>& bounds = latencyBuckets()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Series& entry = series(name, help, "histogram", labels);
+        if (!entry.histogram) {
+            entry.histogram = std::make_shared<Histogram>(bounds);
+        }
+        return entry.histogram;
+    }
+    
+    // read is called on every scrape and must be thread-safe
+    void counterFunction(const std::string& name, const std::string& help, const std::string& labels,
+                         std::function<double()> read) {
+        std::lock_guard<std::mutex> lock(mutex);
+        series(name, help, "counter", labels).read = std::move(read);
+    }
+    
+    void gaugeFunction(const std::string& name, const std::string& help, const std::string& labels,
+                       std::function<double()> read) {
+        std::lock_guard<std::mutex> lock(mutex);
+        series(name, help, "gauge", labels).read = std::move(read);
+    }
+    
+    std::string render() {
+        std::string out;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& family : families) {
+            out += "# HELP " + family.name + " " + family.help + "\n";
+            out += "# TYPE " + family.name + " " + family.type + "\n";
+            for (const auto& entry : family.series) {
+                if (entry.histogram) {
+                    entry.histogram->render(out, family.name, entry.labels);
+                    continue;
+                }
+                
+                out += family.name;
+                if (!entry.labels.empty()) {
+                    out += "{" + entry.labels + "}";
+                }
+                out += ' ';
+                if (entry.counter) {
+                    out += std::to_string(entry.counter->get());
+                } else if (entry.gauge) {
+                    out += std::to_string(entry.gauge->get());
+                } else {
+                    appendValue(out, entry.read ? entry.read() : 0.0);
+                }
+                out += '\n';
+            }
+        }
+        return out;
+    }
+};
+
+// Components that keep their own statistics export them through this;
+// BankApplication::initialize registers every source it was given
+class IMetricsSource {
+public:
+    virtual ~IMetricsSource() {}
+    // labels are added to every series the source registers
+    virtual void registerMetrics(MetricsRegistry& metrics, const std::string& labels) = 0;
 };
 
 // MySQL database implementation - follows Single Responsibility Principle
@@ -36,6 +553,7 @@ class MySQLDatabase : public IDatabase {
 private:
     MYSQL* connection;
     DBConfig config;
+    std::mutex connectionMutex;  // a MYSQL handle must not be used by two threads at once
     
 public:
     MySQLDatabase(const DBConfig& cfg) : connection(nullptr), config(cfg) {}
@@ -59,17 +577,31 @@ public:
                                config.password, 
                                config.database, 
                                config.port, 
-                               nullptr, 0)) {
+                               nullptr, CLIENT_MULTI_STATEMENTS)) {
             std::cerr << "Connection error: " << mysql_error(connection) << std::endl;
             mysql_close(connection);
             connection = nullptr;
             return false;
         }
         
+        if (config.autoIncrementIncrement > 0) {
+            std::string settings = "SET SESSION auto_increment_increment=" +
+                std::to_string(config.autoIncrementIncrement) +
+                ", auto_increment_offset=" + std::to_string(config.autoIncrementOffset);
+            if (mysql_query(connection, settings.c_str())) {
+                std::cerr << "Session setup error: " << mysql_error(connection) << std::endl;
+                mysql_close(connection);
+                connection = nullptr;
+                return false;
+            }
+        }
+        
         return true;
     }
     
     bool disconnect() override {
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        
         if (connection) {
             mysql_close(connection);
             connection = nullptr;
@@ -78,6 +610,8 @@ public:
     }
     
     bool executeQuery(const std::string& query) override {
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        
         if (!connection) {
             std::cerr << "Not connected to database" << std::endl;
             return false;
@@ -93,6 +627,7 @@ public:
     
     bool executeQuery(const std::string& query, std::vector<std::vector<std::string>>& results) override {
         results.clear();
+        std::lock_guard<std::mutex> lock(connectionMutex);
         
         if (!connection) {
             std::cerr << "Not connected to database" << std::endl;
@@ -134,1567 +669,12007 @@ public:
         mysql_free_result(result);
         return true;
     }
-};
-
-// Base entity class for all bank entities
-class Entity {
-protected:
-    int id;
     
-public:
-    Entity(int id = 0) : id(id) {}
-    virtual ~Entity() {}
-    
-    int getId() const { return id; }
-    void setId(int id) { this->id = id; }
+    // Unbuffered read: rows arrive from the server as the caller consumes them
+    bool streamQuery(const std::string& query,
+                     const std::function<bool(const std::vector<std::string>&)>& onRow) override {
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        
+        if (!connection) {
+            std::cerr << "Not connected to database" << std::endl;
+            return false;
+        }
+        
+        if (mysql_query(connection, query.c_str())) {
+            std::cerr << "Query execution error: " << mysql_error(connection) << std::endl;
+            return false;
+        }
+        
+        MYSQL_RES* result = mysql_use_result(connection);
+        if (!result) {
+            if (mysql_field_count(connection) == 0) {
+                return true;
+            }
+            std::cerr << "Failed to retrieve result set: " << mysql_error(connection) << std::endl;
+            return false;
+        }
+        
+        int numFields = mysql_num_fields(result);
+        std::vector<std::string> rowData(numFields);
+        MYSQL_ROW row;
+        
+        while ((row = mysql_fetch_row(result))) {
+            unsigned long* lengths = mysql_fetch_lengths(result);
+            for (int i = 0; i < numFields; i++) {
+                if (row[i]) {
+                    rowData[i].assign(row[i], lengths[i]);
+                } else {
+                    rowData[i] = "NULL";
+                }
+            }
+            if (!onRow(rowData)) {
+                break;
+            }
+        }
+        
+        // Discards any rows left unread when onRow stopped early
+        mysql_free_result(result);
+        return true;
+    }
     
-    virtual void display() const = 0;
+    // Sends all statements as one multi-statement query and splits the result sets
+    bool executeBatch(const std::vector<std::string>& statements,
+                      std::vector<std::vector<std::vector<std::string>>>& results) override {
+        results.assign(statements.size(), std::vector<std::vector<std::string>>());
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        
+        if (!connection) {
+            std::cerr << "Not connected to database" << std::endl;
+            return false;
+        }
+        
+        std::string batch;
+        for (const auto& statement : statements) {
+            if (!batch.empty()) {
+                batch += ";";
+            }
+            batch += statement;
+        }
+        
+        if (mysql_real_query(connection, batch.c_str(), static_cast<unsigned long>(batch.size()))) {
+            std::cerr << "Batch execution error: " << mysql_error(connection) << std::endl;
+            mysql_query(connection, "ROLLBACK");
+            return false;
+        }
+        
+        size_t index = 0;
+        int status = 0;
+        
+        do {
+            MYSQL_RES* result = mysql_store_result(connection);
+            
+            if (result) {
+                int numFields = mysql_num_fields(result);
+                MYSQL_ROW row;
+                
+                while ((row = mysql_fetch_row(result))) {
+                    std::vector<std::string> rowData;
+                    for (int i = 0; i < numFields; i++) {
+                        rowData.push_back(row[i] ? row[i] : "NULL");
+                    }
+                    if (index < results.size()) {
+                        results[index].push_back(rowData);
+                    }
+                }
+                
+                mysql_free_result(result);
+            } else if (mysql_field_count(connection) != 0) {
+                std::cerr << "Failed to retrieve result set: " << mysql_error(connection) << std::endl;
+                status = 1;
+                break;
+            }
+            
+            index++;
+            status = mysql_next_result(connection);
+        } while (status == 0);
+        
+        if (status > 0) {
+            // A statement failed; the rest of the batch was not executed
+            std::cerr << "Batch execution error in statement " << (index + 1) << ": "
+                      << mysql_error(connection) << std::endl;
+            mysql_query(connection, "ROLLBACK");
+            return false;
+        }
+        
+        return true;
+    }
 };
 
-// Customer entity
-class Customer : public Entity {
+// Pool of MySQL connections - lets several threads query concurrently and
+// runs executeQueryAsync on its own workers, one per connection. Every query
+// in flight blocks one thread on its connection, so at most poolSize queries
+// run at once and further asynchronous queries wait for a free worker. The
+// non-blocking client calls (mysql_real_query_nonblocking in MySQL 8.0.16+,
+// mysql_real_query_start in MariaDB) are not used.
+class ConnectionPoolDatabase : public IDatabase, public IMetricsSource {
 private:
-    std::string name;
-    std::string address;
-    std::string phone;
-    std::string email;
-    
-public:
-    Customer(int id = 0, const std::string& name = "", const std::string& address = "",
-             const std::string& phone = "", const std::string& email = "")
-        : Entity(id), name(name), address(address), phone(phone), email(email) {}
+    DBConfig config;
+    size_t poolSize;
+    std::vector<std::unique_ptr<MySQLDatabase>> connections;
+    std::vector<MySQLDatabase*> idle;
+    bool closing;                               // disconnect() is waiting for leased connections
+    std::mutex mutex;
+    std::condition_variable connectionReleased;
+    std::condition_variable allReleased;
+    std::unique_ptr<WorkerPool> asyncWorkers;
     
-    std::string getName() const { return name; }
-    void setName(const std::string& name) { this->name = name; }
+    // Checks a connection out of the pool for the lifetime of the lease
+    class Lease {
+    private:
+        ConnectionPoolDatabase& pool;
+        MySQLDatabase* connection;
+        
+    public:
+        explicit Lease(ConnectionPoolDatabase& pool) : pool(pool), connection(nullptr) {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.connectionReleased.wait(lock, [&pool] {
+                return !pool.idle.empty() || pool.connections.empty() || pool.closing;
+            });
+            if (!pool.idle.empty() && !pool.closing) {
+                connection = pool.idle.back();
+                pool.idle.pop_back();
+            }
+        }
+        
+        ~Lease() {
+            if (connection) {
+                bool closing;
+                {
+                    std::lock_guard<std::mutex> lock(pool.mutex);
+                    pool.idle.push_back(connection);
+                    closing = pool.closing;
+                }
+                pool.connectionReleased.notify_one();
+                if (closing) {
+                    pool.allReleased.notify_all();
+                }
+            }
+        }
+        
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        
+        MySQLDatabase* get() const { return connection; }
+    };
     
-    std::string getAddress() const { return address; }
-    void setAddress(const std::string& address) { this->address = address; }
+public:
+    ConnectionPoolDatabase(const DBConfig& cfg, size_t poolSize = 4)
+        : config(cfg), poolSize(poolSize ? poolSize : 1), closing(false) {}
     
-    std::string getPhone() const { return phone; }
-    void setPhone(const std::string& phone) { this->phone = phone; }
+    ~ConnectionPoolDatabase() {
+        disconnect();
+    }
     
-    std::string getEmail() const { return email; }
-    void setEmail(const std::string& email) { this->email = email; }
+    bool connect() override {
+        std::vector<std::unique_ptr<MySQLDatabase>> opened;
+        
+        for (size_t i = 0; i < poolSize; i++) {
+            auto connection = std::make_unique<MySQLDatabase>(config);
+            if (!connection->connect()) {
+                return false;
+            }
+            opened.push_back(std::move(connection));
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            connections = std::move(opened);
+            closing = false;
+            idle.clear();
+            for (auto& connection : connections) {
+                idle.push_back(connection.get());
+            }
+        }
+        
+        asyncWorkers = std::make_unique<WorkerPool>(poolSize);
+        return true;
+    }
     
-    void display() const override {
-        std::cout << "Customer ID: " << id << std::endl;
-        std::cout << "Name: " << name << std::endl;
-        std::cout << "Address: " << address << std::endl;
-        std::cout << "Phone: " << phone << std::endl;
-        std::cout << "Email: " << email << std::endl;
+    bool disconnect() override {
+        // Let queued asynchronous queries finish before closing their connections
+        asyncWorkers.reset();
+        
+        // Queries still running on other threads keep their connection until they
+        // return it; new ones fail with "Not connected" from here on
+        std::unique_lock<std::mutex> lock(mutex);
+        closing = true;
+        connectionReleased.notify_all();
+        allReleased.wait(lock, [this] { return idle.size() == connections.size(); });
+        idle.clear();
+        connections.clear();
+        return true;
     }
-};
-
-// Account entity
-class Account : public Entity {
-protected:
-    int customerId;
-    double balance;
-    std::string accountNumber;
-    std::string accountType;
-    std::string dateOpened;
     
-public:
-    Account(int id = 0, int customerId = 0, double balance = 0.0,
-            const std::string& accountNumber = "", const std::string& accountType = "",
-            const std::string& dateOpened = "")
-        : Entity(id), customerId(customerId), balance(balance), 
-          accountNumber(accountNumber), accountType(accountType), dateOpened(dateOpened) {}
+    bool executeQuery(const std::string& query) override {
+        Lease lease(*this);
+        if (!lease.get()) {
+            std::cerr << "Not connected to database" << std::endl;
+            return false;
+        }
+        return lease.get()->executeQuery(query);
+    }
     
-    virtual ~Account() {}
+    bool executeQuery(const std::string& query, std::vector<std::vector<std::string>>& results) override {
+        Lease lease(*this);
+        if (!lease.get()) {
+            results.clear();
+            std::cerr << "Not connected to database" << std::endl;
+            return false;
+        }
+        return lease.get()->executeQuery(query, results);
+    }
     
-    int getCustomerId() const { return customerId; }
-    void setCustomerId(int customerId) { this->customerId = customerId; }
+    bool streamQuery(const std::string& query,
+                     const std::function<bool(const std::vector<std::string>&)>& onRow) override {
+        Lease lease(*this);
+        if (!lease.get()) {
+            std::cerr << "Not connected to database" << std::endl;
+            return false;
+        }
+        return lease.get()->streamQuery(query, onRow);
+    }
     
-    double getBalance() const { return balance; }
-    void setBalance(double balance) { this->balance = balance; }
+    bool executeBatch(const std::vector<std::string>& statements,
+                      std::vector<std::vector<std::vector<std::string>>>& results) override {
+        Lease lease(*this);
+        if (!lease.get()) {
+            results.clear();
+            std::cerr << "Not connected to database" << std::endl;
+            return false;
+        }
+        return lease.get()->executeBatch(statements, results);
+    }
     
-    std::string getAccountNumber() const { return accountNumber; }
-    void setAccountNumber(const std::string& accountNumber) { this->accountNumber = accountNumber; }
+    std::future<QueryResult> executeQueryAsync(const std::string& query) override {
+        if (!asyncWorkers) {
+            return IDatabase::executeQueryAsync(query);
+        }
+        
+        return asyncWorkers->submit([this, query] {
+            QueryResult result;
+            result.success = executeQuery(query, result.rows);
+            return result;
+        });
+    }
     
-    std::string getAccountType() const { return accountType; }
-    void setAccountType(const std::string& accountType) { this->accountType = accountType; }
+    size_t size() const { return poolSize; }
     
-    std::string getDateOpened() const { return dateOpened; }
-    void setDateOpened(const std::string& dateOpened) { this->dateOpened = dateOpened; }
+    size_t inUse() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return connections.size() - idle.size();
+    }
     
-    void display() const override {
-        std::cout << "Account ID: " << id << std::endl;
-        std::cout << "Customer ID: " << customerId << std::endl;
-        std::cout << "Account Number: " << accountNumber << std::endl;
-        std::cout << "Account Type: " << accountType << std::endl;
-        std::cout << "Balance: $" << std::fixed << std::setprecision(2) << balance << std::endl;
-        std::cout << "Date Opened: " << dateOpened << std::endl;
+    void registerMetrics(MetricsRegistry& metrics, const std::string& labels) override {
+        metrics.gaugeFunction("bank_db_pool_connections", "Connections in the database pool", labels,
+                              [this] { return static_cast<double>(poolSize); });
+        metrics.gaugeFunction("bank_db_pool_in_use", "Pooled connections currently checked out", labels,
+                              [this] { return static_cast<double>(inUse()); });
     }
+};
+
+// Load snapshot for one endpoint behind ReplicaRoutingDatabase
+struct EndpointLoad {
+    std::string name;
+    bool primary;
+    bool available;
+    unsigned long long reads;
+    unsigned long long writes;
+    unsigned long long errors;
+    unsigned int inFlight;
+    double averageLatencyMs;
+};
+
+// Routes read-only queries to replicas and everything else to the primary.
+// After a write, the same session keeps reading from the primary for
+// stickyWindow so it always sees its own writes. A session is the calling
+// thread together with the WorkerPool tasks it submits (currentDatabaseSession);
+// threads started some other way do not share it.
+class ReplicaRoutingDatabase : public IDatabase {
+private:
+    struct Endpoint {
+        std::string name;
+        std::shared_ptr<IDatabase> db;
+        bool isPrimary;
+        std::atomic<bool> available;
+        std::atomic<unsigned long long> reads;
+        std::atomic<unsigned long long> writes;
+        std::atomic<unsigned long long> errors;
+        std::atomic<unsigned long long> totalMicros;
+        std::atomic<unsigned int> inFlight;
+        
+        Endpoint(const std::string& name, std::shared_ptr<IDatabase> db, bool isPrimary)
+            : name(name), db(db), isPrimary(isPrimary), available(false), reads(0), writes(0),
+              errors(0), totalMicros(0), inFlight(0) {}
+    };
     
-    virtual bool deposit(double amount) {
-        if (amount <= 0) {
-            std::cerr << "Invalid deposit amount" << std::endl;
+    std::unique_ptr<Endpoint> primary;
+    std::vector<std::unique_ptr<Endpoint>> replicas;
+    std::chrono::milliseconds stickyWindow;
+    std::atomic<unsigned int> nextReplica;
+    
+    std::mutex sessionMutex;
+    std::unordered_map<std::uint64_t, std::chrono::steady_clock::time_point> lastWriteBySession;
+    
+    static bool startsWithKeyword(const std::string& text, size_t pos, const char* keyword) {
+        size_t length = std::strlen(keyword);
+        if (text.size() - pos < length) {
             return false;
         }
-        
-        balance += amount;
+        for (size_t i = 0; i < length; i++) {
+            if (std::toupper(static_cast<unsigned char>(text[pos + i])) != keyword[i]) {
+                return false;
+            }
+        }
         return true;
     }
     
-    virtual bool withdraw(double amount) {
-        if (amount <= 0) {
-            std::cerr << "Invalid withdrawal amount" << std::endl;
-            return false;
+    static bool containsKeyword(const std::string& text, const char* keyword) {
+        for (size_t pos = 0; pos < text.size(); pos++) {
+            if (startsWithKeyword(text, pos, keyword)) {
+                return true;
+            }
         }
-        
-        if (amount > balance) {
-            std::cerr << "Insufficient funds" << std::endl;
+        return false;
+    }
+    
+    void markWrite() {
+        std::lock_guard<std::mutex> lock(sessionMutex);
+        lastWriteBySession[currentDatabaseSession()] = std::chrono::steady_clock::now();
+    }
+    
+    bool isSticky() {
+        std::lock_guard<std::mutex> lock(sessionMutex);
+        auto it = lastWriteBySession.find(currentDatabaseSession());
+        if (it == lastWriteBySession.end()) {
             return false;
         }
-        
-        balance -= amount;
-        return true;
+        if (std::chrono::steady_clock::now() - it->second < stickyWindow) {
+            return true;
+        }
+        lastWriteBySession.erase(it);
+        return false;
     }
-};
-
-// Savings Account - follows Open/Closed Principle
-class SavingsAccount : public Account {
-private:
-    double interestRate;
-    
-public:
-    SavingsAccount(int id = 0, int customerId = 0, double balance = 0.0,
-                  const std::string& accountNumber = "", const std::string& dateOpened = "",
-                  double interestRate = 0.0)
-        : Account(id, customerId, balance, accountNumber, "Savings", dateOpened), 
-          interestRate(interestRate) {}
     
-    double getInterestRate() const { return interestRate; }
-    void setInterestRate(double rate) { interestRate = rate; }
+    // Least in-flight available replica, round robin between equals
+    Endpoint* pickReplica() {
+        Endpoint* best = nullptr;
+        size_t count = replicas.size();
+        size_t start = count ? nextReplica.fetch_add(1) % count : 0;
+        
+        for (size_t i = 0; i < count; i++) {
+            Endpoint* candidate = replicas[(start + i) % count].get();
+            if (!candidate->available) {
+                continue;
+            }
+            if (!best || candidate->inFlight < best->inFlight) {
+                best = candidate;
+            }
+        }
+        
+        return best;
+    }
     
-    void calculateInterest() {
-        double interest = balance * interestRate / 100;
-        balance += interest;
+    template <typename Operation>
+    bool run(Endpoint& endpoint, bool write, Operation operation) {
+        endpoint.inFlight++;
+        auto started = std::chrono::steady_clock::now();
+        bool ok = operation(*endpoint.db);
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started);
+        endpoint.inFlight--;
+        
+        (write ? endpoint.writes : endpoint.reads)++;
+        endpoint.totalMicros += static_cast<unsigned long long>(elapsed.count());
+        if (!ok) {
+            endpoint.errors++;
+        }
+        return ok;
     }
     
-    void display() const override {
-        Account::display();
-        std::cout << "Interest Rate: " << interestRate << "%" << std::endl;
+    // delivered, when given, is set once the operation has handed out rows
+    // that a second attempt would hand out again
+    template <typename Operation>
+    bool route(const std::string& query, Operation operation, const bool* delivered = nullptr) {
+        if (!isReadOnlyQuery(query)) {
+            markWrite();
+            return run(*primary, true, operation);
+        }
+        
+        Endpoint* replica = isSticky() ? nullptr : pickReplica();
+        if (replica) {
+            if (run(*replica, false, operation)) {
+                return true;
+            }
+            if (delivered && *delivered) {
+                return false;
+            }
+            // Fall back to the primary rather than failing a read
+        }
+        
+        return run(*primary, false, operation);
     }
-};
-
-// Checking Account - follows Open/Closed Principle
-class CheckingAccount : public Account {
-private:
-    double overdraftLimit;
     
 public:
-    CheckingAccount(int id = 0, int customerId = 0, double balance = 0.0,
-                   const std::string& accountNumber = "", const std::string& dateOpened = "",
-                   double overdraftLimit = 0.0)
-        : Account(id, customerId, balance, accountNumber, "Checking", dateOpened), 
-          overdraftLimit(overdraftLimit) {}
+    ReplicaRoutingDatabase(std::shared_ptr<IDatabase> primaryDb,
+                           std::chrono::milliseconds stickyWindow = std::chrono::milliseconds(2000))
+        : primary(new Endpoint("primary", primaryDb, true)), stickyWindow(stickyWindow), nextReplica(0) {}
     
-    double getOverdraftLimit() const { return overdraftLimit; }
-    void setOverdraftLimit(double limit) { overdraftLimit = limit; }
+    ~ReplicaRoutingDatabase() {
+        disconnect();
+    }
     
-    bool withdraw(double amount) override {
-        if (amount <= 0) {
-            std::cerr << "Invalid withdrawal amount" << std::endl;
+    void addReplica(const std::string& name, std::shared_ptr<IDatabase> replicaDb) {
+        replicas.push_back(std::unique_ptr<Endpoint>(new Endpoint(name, replicaDb, false)));
+    }
+    
+    // Only plain SELECT-style statements are safe to serve from a replica;
+    // locking reads and session-dependent functions must see the primary
+    static bool isReadOnlyQuery(const std::string& query) {
+        size_t pos = 0;
+        while (pos < query.size() && (std::isspace(static_cast<unsigned char>(query[pos])) || query[pos] == '(')) {
+            pos++;
+        }
+        
+        bool readKeyword = startsWithKeyword(query, pos, "SELECT") || startsWithKeyword(query, pos, "SHOW") ||
+                           startsWithKeyword(query, pos, "DESCRIBE") || startsWithKeyword(query, pos, "EXPLAIN");
+        if (!readKeyword) {
             return false;
         }
         
-        if (amount > balance + overdraftLimit) {
-            std::cerr << "Exceeds overdraft limit" << std::endl;
+        return !containsKeyword(query, "FOR UPDATE") && !containsKeyword(query, "LOCK IN SHARE MODE") &&
+               !containsKeyword(query, "LAST_INSERT_ID") && !containsKeyword(query, "ROW_COUNT") &&
+               query.find('@') == std::string::npos;
+    }
+    
+    bool connect() override {
+        primary->available = primary->db->connect();
+        if (!primary->available) {
             return false;
         }
         
-        balance -= amount;
+        // A replica that cannot be reached simply takes no reads
+        for (auto& replica : replicas) {
+            replica->available = replica->db->connect();
+            if (!replica->available) {
+                std::cerr << "Replica " << replica->name << " unavailable, reads go to primary" << std::endl;
+            }
+        }
+        
         return true;
     }
     
-    void display() const override {
-        Account::display();
-        std::cout << "Overdraft Limit: $" << std::fixed << std::setprecision(2) << overdraftLimit << std::endl;
+    bool disconnect() override {
+        for (auto& replica : replicas) {
+            replica->db->disconnect();
+            replica->available = false;
+        }
+        primary->db->disconnect();
+        primary->available = false;
+        return true;
     }
-};
-
-// Transaction entity
-class Transaction : public Entity {
-private:
-    int accountId;
-    std::string type;
-    double amount;
-    std::string dateTime;
-    std::string description;
-    
-public:
-    Transaction(int id = 0, int accountId = 0, const std::string& type = "",
-               double amount = 0.0, const std::string& dateTime = "",
-               const std::string& description = "")
-        : Entity(id), accountId(accountId), type(type), amount(amount),
-          dateTime(dateTime), description(description) {}
     
-    int getAccountId() const { return accountId; }
-    void setAccountId(int accountId) { this->accountId = accountId; }
+    bool executeQuery(const std::string& query) override {
+        return route(query, [&query](IDatabase& db) { return db.executeQuery(query); });
+    }
     
-    std::string getType() const { return type; }
-    void setType(const std::string& type) { this->type = type; }
+    bool executeQuery(const std::string& query, std::vector<std::vector<std::string>>& results) override {
+        return route(query, [&query, &results](IDatabase& db) { return db.executeQuery(query, results); });
+    }
     
-    double getAmount() const { return amount; }
-    void setAmount(double amount) { this->amount = amount; }
+    bool streamQuery(const std::string& query,
+                     const std::function<bool(const std::vector<std::string>&)>& onRow) override {
+        // A replica failing part way through is not retried: the caller has already seen its rows
+        bool delivered = false;
+        auto deliver = [&onRow, &delivered](const std::vector<std::string>& row) {
+            delivered = true;
+            return onRow(row);
+        };
+        return route(query, [&query, &deliver](IDatabase& db) { return db.streamQuery(query, deliver); }, &delivered);
+    }
     
-    std::string getDateTime() const { return dateTime; }
-    void setDateTime(const std::string& dateTime) { this->dateTime = dateTime; }
+    // Batches carry the multi-step money movements, so they always go to the primary
+    bool executeBatch(const std::vector<std::string>& statements,
+                      std::vector<std::vector<std::vector<std::string>>>& results) override {
+        markWrite();
+        return run(*primary, true, [&statements, &results](IDatabase& db) {
+            return db.executeBatch(statements, results);
+        });
+    }
     
-    std::string getDescription() const { return description; }
-    void setDescription(const std::string& description) { this->description = description; }
+    std::vector<EndpointLoad> getEndpointLoad() const {
+        std::vector<EndpointLoad> load;
+        
+        auto snapshot = [&load](const Endpoint& endpoint) {
+            EndpointLoad entry;
+            entry.name = endpoint.name;
+            entry.primary = endpoint.isPrimary;
+            entry.available = endpoint.available;
+            entry.reads = endpoint.reads;
+            entry.writes = endpoint.writes;
+            entry.errors = endpoint.errors;
+            entry.inFlight = endpoint.inFlight;
+            unsigned long long total = entry.reads + entry.writes;
+            entry.averageLatencyMs = total ? endpoint.totalMicros / 1000.0 / total : 0.0;
+            load.push_back(entry);
+        };
+        
+        snapshot(*primary);
+        for (const auto& replica : replicas) {
+            snapshot(*replica);
+        }
+        
+        return load;
+    }
     
-    void display() const override {
-        std::cout << "Transaction ID: " << id << std::endl;
-        std::cout << "Account ID: " << accountId << std::endl;
-        std::cout << "Type: " << type << std::endl;
-        std::cout << "Amount: $" << std::fixed << std::setprecision(2) << amount << std::endl;
-        std::cout << "Date/Time: " << dateTime << std::endl;
-        std::cout << "Description: " << description << std::endl;
+    void reportLoad(std::ostream& out) const {
+        out << "\n------------ Database Endpoint Load ------------\n";
+        for (const auto& endpoint : getEndpointLoad()) {
+            out << endpoint.name << (endpoint.primary ? " (primary)" : " (replica)")
+                << (endpoint.available ? "" : " [down]")
+                << ": reads=" << endpoint.reads
+                << ", writes=" << endpoint.writes
+                << ", errors=" << endpoint.errors
+                << ", in-flight=" << endpoint.inFlight
+                << ", avg latency=" << std::fixed << std::setprecision(3) << endpoint.averageLatencyMs << " ms\n";
+        }
     }
 };
 
-// Repository interface - Dependency Inversion Principle
-template <typename T>
-class IRepository {
-public:
-    virtual ~IRepository() {}
-    virtual bool add(const T& entity) = 0;
-    virtual bool update(const T& entity) = 0;
-    virtual bool remove(int id) = 0;
-    virtual std::unique_ptr<T> getById(int id) = 0;
-    virtual std::vector<std::unique_ptr<T>> getAll() = 0;
-};
-
-// Customer Repository
-class CustomerRepository : public IRepository<Customer> {
+// Latency distribution in microseconds with fixed memory: exact below 16 us,
+// then four buckets per power of two (about 19% resolution). Thread-safe.
+class LatencyHistogram {
 private:
-    std::shared_ptr<IDatabase> db;
+    static const size_t kLinearBuckets = 16;
+    static const size_t kBucketCount = kLinearBuckets + 4 * 36;
     
-public:
-    CustomerRepository(std::shared_ptr<IDatabase> db) : db(db) {}
+    std::atomic<unsigned long long> buckets[kBucketCount];
+    std::atomic<unsigned long long> count;
+    std::atomic<unsigned long long> totalMicros;
+    std::atomic<unsigned long long> maxMicros;
     
-    bool add(const Customer& customer) override {
-        std::string query = "INSERT INTO customers (name, address, phone, email) VALUES ('" +
-            customer.getName() + "', '" + customer.getAddress() + "', '" +
-            customer.getPhone() + "', '" + customer.getEmail() + "')";
-        
-        return db->executeQuery(query);
+    static size_t bucketOf(unsigned long long micros) {
+        if (micros < kLinearBuckets) {
+            return static_cast<size_t>(micros);
+        }
+        unsigned int exponent = 4;
+        while (micros >> (exponent + 1)) {
+            exponent++;
+        }
+        size_t bucket = kLinearBuckets + (exponent - 4) * 4 + ((micros >> (exponent - 2)) & 3);
+        return bucket < kBucketCount ? bucket : kBucketCount - 1;
     }
     
-    bool update(const Customer& customer) override {
-        std::string query = "UPDATE customers SET name='" + customer.getName() +
-            "', address='" + customer.getAddress() + "', phone='" + customer.getPhone() +
-            "', email='" + customer.getEmail() + "' WHERE customer_id=" + 
-            std::to_string(customer.getId());
-        
-        return db->executeQuery(query);
+    static unsigned long long upperBoundOf(size_t bucket) {
+        if (bucket < kLinearBuckets) {
+            return bucket;
+        }
+        unsigned int exponent = static_cast<unsigned int>((bucket - kLinearBuckets) / 4 + 4);
+        unsigned long long step = 1ULL << (exponent - 2);
+        return (4 + (bucket - kLinearBuckets) % 4) * step + step - 1;
     }
     
-    bool remove(int id) override {
-        std::string query = "DELETE FROM customers WHERE customer_id=" + std::to_string(id);
-        return db->executeQuery(query);
+public:
+    LatencyHistogram() : count(0), totalMicros(0), maxMicros(0) {
+        for (auto& bucket : buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
     }
     
-    std::unique_ptr<Customer> getById(int id) override {
-        std::string query = "SELECT * FROM customers WHERE customer_id=" + std::to_string(id);
-        std::vector<std::vector<std::string>> results;
-        
-        if (db->executeQuery(query, results) && !results.empty()) {
-            const auto& row = results[0];
-            return std::make_unique<Customer>(
-                std::stoi(row[0]),  // id
-                row[1],             // name
-                row[2],             // address
-                row[3],             // phone
-                row[4]              // email
-            );
+    void record(std::chrono::steady_clock::duration elapsed) {
+        long long micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        record(static_cast<unsigned long long>(micros > 0 ? micros : 0));
+    }
+    
+    void record(unsigned long long micros) {
+        buckets[bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        totalMicros.fetch_add(micros, std::memory_order_relaxed);
+        unsigned long long seen = maxMicros.load(std::memory_order_relaxed);
+        while (micros > seen && !maxMicros.compare_exchange_weak(seen, micros, std::memory_order_relaxed)) {
         }
-        
-        return nullptr;
     }
     
-    std::vector<std::unique_ptr<Customer>> getAll() override {
-        std::string query = "SELECT * FROM customers";
-        std::vector<std::vector<std::string>> results;
-        std::vector<std::unique_ptr<Customer>> customers;
-        
-        if (db->executeQuery(query, results)) {
-            for (const auto& row : results) {
-                customers.push_back(std::make_unique<Customer>(
-                    std::stoi(row[0]),  // id
-                    row[1],             // name
-                    row[2],             // address
-                    row[3],             // phone
-                    row[4]              // email
-                ));
+    unsigned long long getCount() const {
+        return count.load(std::memory_order_relaxed);
+    }
+    
+    double averageMicros() const {
+        unsigned long long samples = getCount();
+        return samples ? static_cast<double>(totalMicros.load(std::memory_order_relaxed)) / samples : 0.0;
+    }
+    
+    unsigned long long getMaxMicros() const {
+        return maxMicros.load(std::memory_order_relaxed);
+    }
+    
+    // Upper bound of the bucket holding the given fraction (e.g. 0.99) of samples
+    unsigned long long percentileMicros(double fraction) const {
+        unsigned long long samples = getCount();
+        if (samples == 0) {
+            return 0;
+        }
+        unsigned long long rank = static_cast<unsigned long long>(std::ceil(fraction * samples));
+        unsigned long long seen = 0;
+        for (size_t i = 0; i < kBucketCount; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank && seen > 0) {
+                return std::min(upperBoundOf(i), getMaxMicros());
             }
         }
-        
-        return customers;
+        return getMaxMicros();
     }
 };
 
-// Account Repository
-class AccountRepository : public IRepository<Account> {
-private:
-    std::shared_ptr<IDatabase> db;
+// Limits for one priority class of RequestScheduler
+struct PriorityClassConfig {
+    double ratePerSecond;               // token bucket refill, 0 for no rate limit
+    double burst;                       // token bucket size
+    size_t maxConcurrent;               // requests of the class running at once
+    size_t maxQueued;                   // further requests are shed
+    std::chrono::milliseconds maxWait;  // requests queued longer are shed, 0 waits for good
     
-public:
-    AccountRepository(std::shared_ptr<IDatabase> db) : db(db) {}
+    PriorityClassConfig()
+        : ratePerSecond(0), burst(1), maxConcurrent(1), maxQueued(1024), maxWait(0) {}
+};
+
+struct RequestSchedulerConfig {
+    size_t slots;       // requests running at once
+    size_t nestedSlots; // extra requests issued by a thread that already holds a slot
+    PriorityClassConfig classes[kRequestPriorityCount];
     
-    bool add(const Account& account) override {
-        std::string query = "INSERT INTO accounts (customer_id, balance, account_number, account_type, date_opened) VALUES (" +
-            std::to_string(account.getCustomerId()) + ", " + 
-            std::to_string(account.getBalance()) + ", '" +
-            account.getAccountNumber() + "', '" + 
-            account.getAccountType() + "', '" +
-            account.getDateOpened() + "')";
-        
-        return db->executeQuery(query);
+    // Interactive requests may take every slot and are shed after two seconds in
+    // the queue; batch requests get half the slots and 200 starts a second, and
+    // wait as long as it takes
+    explicit RequestSchedulerConfig(size_t slots = 4) : slots(slots ? slots : 1), nestedSlots(1) {
+        PriorityClassConfig& interactive = classes[static_cast<size_t>(RequestPriority::Interactive)];
+        interactive.maxConcurrent = this->slots;
+        interactive.maxQueued = 512;
+        interactive.maxWait = std::chrono::milliseconds(2000);
+        
+        PriorityClassConfig& batch = classes[static_cast<size_t>(RequestPriority::Batch)];
+        batch.ratePerSecond = 200;
+        batch.burst = 20;
+        batch.maxConcurrent = this->slots > 1 ? this->slots / 2 : 1;
+        batch.maxQueued = 4096;
     }
     
-    bool update(const Account& account) override {
-        std::string query = "UPDATE accounts SET customer_id=" + 
-            std::to_string(account.getCustomerId()) +
-            ", balance=" + std::to_string(account.getBalance()) +
-            ", account_number='" + account.getAccountNumber() +
-            "', account_type='" + account.getAccountType() +
-            "', date_opened='" + account.getDateOpened() +
-            "' WHERE account_id=" + std::to_string(account.getId());
+    // Connections the database behind the scheduler needs: one per slot and nested slot
+    size_t connections() const {
+        return slots + nestedSlots;
+    }
+};
+
+// Snapshot of one priority class of RequestScheduler
+struct PriorityClassStats {
+    const char* name;
+    unsigned long long admitted;
+    unsigned long long shed;
+    size_t queued;
+    size_t running;
+    unsigned long long waitP99Micros;       // time spent queued
+    unsigned long long latencyP50Micros;    // queued plus running
+    unsigned long long latencyP99Micros;
+    unsigned long long latencyMaxMicros;
+};
+
+// Admission control in front of a shared resource such as the database. At
+// most slots requests run at once. Freed slots go to the highest priority
+// class with a queued request that is under its concurrency limit and has a
+// token in its bucket, so batch work only runs on capacity interactive work
+// leaves over and cannot take more than its own share of it. Requests beyond
+// a class's queue bound or wait limit are shed rather than left to pile up.
+//
+// A request made by a thread that already holds a slot here, say from a
+// streamQuery callback, needs a second connection while the first is still in
+// use. Queueing it for an ordinary slot could deadlock once every slot holder
+// did the same, so it takes one of the nested slots instead, whose connections
+// only such requests use. Holding a slot on one scheduler gives nothing on
+// another: a request to a second shard is admitted there as usual.
+class RequestScheduler : public IMetricsSource {
+private:
+    struct Waiter {
+        std::condition_variable wake;
+        bool granted;
         
-        return db->executeQuery(query);
+        Waiter() : granted(false) {}
+    };
+    
+    struct PriorityClass {
+        PriorityClassConfig config;
+        std::deque<Waiter*> queue;
+        size_t running;
+        double tokens;
+        std::chrono::steady_clock::time_point refilledAt;
+        std::atomic<unsigned long long> admitted;
+        std::atomic<unsigned long long> shed;
+        LatencyHistogram waitTimes;
+        LatencyHistogram latencies;
+        // Registry histograms fed alongside, once registerMetrics has attached them
+        std::shared_ptr<MetricsRegistry::Histogram> waitMetric;
+        std::shared_ptr<MetricsRegistry::Histogram> latencyMetric;
+        std::atomic<MetricsRegistry::Histogram*> exportedWaits;
+        std::atomic<MetricsRegistry::Histogram*> exportedLatencies;
+        
+        PriorityClass() : running(0), tokens(0), admitted(0), shed(0), exportedWaits(nullptr),
+                          exportedLatencies(nullptr) {}
+    };
+    
+    std::mutex mutex;
+    size_t freeSlots;
+    size_t freeNestedSlots;
+    std::condition_variable nestedSlotReleased;
+    const size_t nestedSlotsTotal;
+    PriorityClass classes[kRequestPriorityCount];
+    
+    // Slots the current thread holds on each scheduler: 1 while it runs a
+    // request there, 2 while that request runs a nested one
+    static std::unordered_map<const RequestScheduler*, int>& heldSlots() {
+        thread_local std::unordered_map<const RequestScheduler*, int> held;
+        return held;
     }
     
-    bool remove(int id) override {
-        std::string query = "DELETE FROM accounts WHERE account_id=" + std::to_string(id);
-        return db->executeQuery(query);
+    // Requires mutex
+    static bool takeToken(PriorityClass& priorityClass, std::chrono::steady_clock::time_point now) {
+        if (priorityClass.config.ratePerSecond <= 0) {
+            return true;
+        }
+        double elapsed = std::chrono::duration<double>(now - priorityClass.refilledAt).count();
+        priorityClass.tokens = std::min(priorityClass.config.burst,
+                                        priorityClass.tokens + elapsed * priorityClass.config.ratePerSecond);
+        priorityClass.refilledAt = now;
+        if (priorityClass.tokens < 1) {
+            return false;
+        }
+        priorityClass.tokens -= 1;
+        return true;
     }
     
-    std::unique_ptr<Account> getById(int id) override {
-        std::string query = "SELECT * FROM accounts WHERE account_id=" + std::to_string(id);
-        std::vector<std::vector<std::string>> results;
+    // Hands free slots to queued requests, highest priority first. Requires mutex.
+    void dispatch() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto& priorityClass : classes) {
+            while (freeSlots > 0 && !priorityClass.queue.empty() &&
+                   priorityClass.running < priorityClass.config.maxConcurrent && takeToken(priorityClass, now)) {
+                Waiter* waiter = priorityClass.queue.front();
+                priorityClass.queue.pop_front();
+                priorityClass.running++;
+                freeSlots--;
+                waiter->granted = true;
+                waiter->wake.notify_one();
+            }
+        }
+    }
+    
+    // Waits for a slot; false when the request was shed. queuedAt is passed back to release().
+    bool admit(RequestPriority priority, std::chrono::steady_clock::time_point& queuedAt) {
+        PriorityClass& priorityClass = classes[static_cast<size_t>(priority)];
+        const PriorityClassConfig& config = priorityClass.config;
+        queuedAt = std::chrono::steady_clock::now();
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        if (priorityClass.queue.size() >= config.maxQueued) {
+            priorityClass.shed++;
+            return false;
+        }
         
-        if (db->executeQuery(query, results) && !results.empty()) {
-            const auto& row = results[0];
-            std::string accountType = row[4];
+        Waiter waiter;
+        priorityClass.queue.push_back(&waiter);
+        dispatch();
+        while (!waiter.granted) {
+            auto now = std::chrono::steady_clock::now();
+            if (config.maxWait.count() > 0 && now - queuedAt >= config.maxWait) {
+                priorityClass.queue.erase(std::find(priorityClass.queue.begin(), priorityClass.queue.end(), &waiter));
+                priorityClass.shed++;
+                return false;
+            }
             
-            if (accountType == "Savings") {
-                // Get interest rate for savings account
-                std::string savingsQuery = "SELECT interest_rate FROM savings_accounts WHERE account_id=" + row[0];
-                std::vector<std::vector<std::string>> savingsResults;
-                double interestRate = 0.0;
-                
-                if (db->executeQuery(savingsQuery, savingsResults) && !savingsResults.empty()) {
-                    interestRate = std::stod(savingsResults[0][0]);
-                }
-                
-                return std::make_unique<SavingsAccount>(
-                    std::stoi(row[0]),         // id
-                    std::stoi(row[1]),         // customer_id
-                    std::stod(row[2]),         // balance
-                    row[3],                    // account_number
-                    row[5],                    // date_opened
-                    interestRate               // interest_rate
-                );
-            } else if (accountType == "Checking") {
-                // Get overdraft limit for checking account
-                std::string checkingQuery = "SELECT overdraft_limit FROM checking_accounts WHERE account_id=" + row[0];
-                std::vector<std::vector<std::string>> checkingResults;
-                double overdraftLimit = 0.0;
-                
-                if (db->executeQuery(checkingQuery, checkingResults) && !checkingResults.empty()) {
-                    overdraftLimit = std::stod(checkingResults[0][0]);
-                }
-                
-                return std::make_unique<CheckingAccount>(
-                    std::stoi(row[0]),         // id
-                    std::stoi(row[1]),         // customer_id
-                    std::stod(row[2]),         // balance
-                    row[3],                    // account_number
-                    row[5],                    // date_opened
-                    overdraftLimit             // overdraft_limit
-                );
+            bool timed = config.maxWait.count() > 0;
+            auto wakeAt = queuedAt + config.maxWait;
+            if (config.ratePerSecond > 0 && priorityClass.tokens < 1) {
+                // Nothing else wakes a request that only waits for a token
+                auto refill = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>((1 - priorityClass.tokens) / config.ratePerSecond));
+                auto tokenAt = now + std::max<std::chrono::steady_clock::duration>(refill, std::chrono::milliseconds(1));
+                wakeAt = timed ? std::min(wakeAt, tokenAt) : tokenAt;
+                timed = true;
+            }
+            if (timed) {
+                waiter.wake.wait_until(lock, wakeAt);
             } else {
-                return std::make_unique<Account>(
-                    std::stoi(row[0]),         // id
-                    std::stoi(row[1]),         // customer_id
-                    std::stod(row[2]),         // balance
-                    row[3],                    // account_number
-                    row[4],                    // account_type
-                    row[5]                     // date_opened
-                );
+                waiter.wake.wait(lock);
+            }
+            if (!waiter.granted) {
+                dispatch();
             }
         }
+        lock.unlock();
         
-        return nullptr;
+        priorityClass.admitted++;
+        auto waited = std::chrono::steady_clock::now() - queuedAt;
+        priorityClass.waitTimes.record(waited);
+        if (MetricsRegistry::Histogram* exported = priorityClass.exportedWaits.load(std::memory_order_acquire)) {
+            exported->observe(waited);
+        }
+        return true;
     }
     
-    std::vector<std::unique_ptr<Account>> getAll() override {
-        std::string query = "SELECT * FROM accounts";
-        std::vector<std::vector<std::string>> results;
-        std::vector<std::unique_ptr<Account>> accounts;
+    // Waits for a nested slot. Their holders never wait on this scheduler again,
+    // so one is always freed. False when there are none at all.
+    bool admitNested() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (nestedSlotsTotal == 0) {
+            return false;
+        }
+        nestedSlotReleased.wait(lock, [this] { return freeNestedSlots > 0; });
+        freeNestedSlots--;
+        return true;
+    }
+    
+    void releaseNested() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            freeNestedSlots++;
+        }
+        nestedSlotReleased.notify_one();
+    }
+    
+    template <typename Operation>
+    bool runNested(int& held, Operation operation, bool& shed) {
+        // A third connection could only come from an ordinary slot
+        if (held > 1 || !admitNested()) {
+            std::cerr << "Nested database request refused: no connection is kept for it" << std::endl;
+            shed = true;
+            return false;
+        }
         
-        if (db->executeQuery(query, results)) {
-            for (const auto& row : results) {
-                std::string accountType = row[4];
-                
-                if (accountType == "Savings") {
-                    // Get interest rate for savings account
-                    std::string savingsQuery = "SELECT interest_rate FROM savings_accounts WHERE account_id=" + row[0];
-                    std::vector<std::vector<std::string>> savingsResults;
-                    double interestRate = 0.0;
-                    
-                    if (db->executeQuery(savingsQuery, savingsResults) && !savingsResults.empty()) {
-                        interestRate = std::stod(savingsResults[0][0]);
-                    }
-                    
-                    accounts.push_back(std::make_unique<SavingsAccount>(
-                        std::stoi(row[0]),         // id
-                        std::stoi(row[1]),         // customer_id
-                        std::stod(row[2]),         // balance
-                        row[3],                    // account_number
-                        row[5],                    // date_opened
-                        interestRate               // interest_rate
-                    ));
-                } else if (accountType == "Checking") {
-                    // Get overdraft limit for checking account
-                    std::string checkingQuery = "SELECT overdraft_limit FROM checking_accounts WHERE account_id=" + row[0];
-                    std::vector<std::vector<std::string>> checkingResults;
-                    double overdraftLimit = 0.0;
-                    
-                    if (db->executeQuery(checkingQuery, checkingResults) && !checkingResults.empty()) {
-                        overdraftLimit = std::stod(checkingResults[0][0]);
-                    }
-                    
-                    accounts.push_back(std::make_unique<CheckingAccount>(
-                        std::stoi(row[0]),         // id
-                        std::stoi(row[1]),         // customer_id
-                        std::stod(row[2]),         // balance
-                        row[3],                    // account_number
-                        row[5],                    // date_opened
-                        overdraftLimit             // overdraft_limit
-                    ));
-                } else {
-                    accounts.push_back(std::make_unique<Account>(
-                        std::stoi(row[0]),         // id
-                        std::stoi(row[1]),         // customer_id
-                        std::stod(row[2]),         // balance
-                        row[3],                    // account_number
-                        row[4],                    // account_type
-                        row[5]                     // date_opened
-                    ));
-                }
+        struct Release {
+            RequestScheduler& scheduler;
+            int& held;
+            ~Release() {
+                held--;
+                scheduler.releaseNested();
+            }
+        } release{ *this, held };
+        held++;
+        return operation();
+    }
+    
+    void release(RequestPriority priority, std::chrono::steady_clock::time_point queuedAt) {
+        PriorityClass& priorityClass = classes[static_cast<size_t>(priority)];
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            priorityClass.running--;
+            freeSlots++;
+            dispatch();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - queuedAt;
+        priorityClass.latencies.record(elapsed);
+        if (MetricsRegistry::Histogram* exported = priorityClass.exportedLatencies.load(std::memory_order_acquire)) {
+            exported->observe(elapsed);
+        }
+    }
+    
+public:
+    explicit RequestScheduler(const RequestSchedulerConfig& config = RequestSchedulerConfig())
+        : freeSlots(config.slots ? config.slots : 1), freeNestedSlots(config.nestedSlots),
+          nestedSlotsTotal(config.nestedSlots) {
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < kRequestPriorityCount; i++) {
+            classes[i].config = config.classes[i];
+            if (classes[i].config.maxConcurrent == 0) {
+                classes[i].config.maxConcurrent = 1;
             }
+            classes[i].tokens = classes[i].config.burst;
+            classes[i].refilledAt = now;
         }
-        
-        return accounts;
     }
     
-    std::vector<std::unique_ptr<Account>> getByCustomerId(int customerId) {
-        std::string query = "SELECT * FROM accounts WHERE customer_id=" + std::to_string(customerId);
-        std::vector<std::vector<std::string>> results;
-        std::vector<std::unique_ptr<Account>> accounts;
+    RequestScheduler(const RequestScheduler&) = delete;
+    RequestScheduler& operator=(const RequestScheduler&) = delete;
+    
+    // Runs operation once admitted at the calling thread's priority (see
+    // ScopedPriority); shed is set and operation skipped when it was not admitted.
+    // A thread that already holds a slot here runs nested requests on a nested slot.
+    template <typename Operation>
+    bool run(Operation operation, bool& shed) {
+        shed = false;
+        auto held = heldSlots().find(this);
+        if (held != heldSlots().end()) {
+            return runNested(held->second, operation, shed);
+        }
         
-        if (db->executeQuery(query, results)) {
-            for (const auto& row : results) {
-                std::string accountType = row[4];
-                
-                if (accountType == "Savings") {
-                    // Get interest rate for savings account
-                    std::string savingsQuery = "SELECT interest_rate FROM savings_accounts WHERE account_id=" + row[0];
-                    std::vector<std::vector<std::string>> savingsResults;
-                    double interestRate = 0.0;
-                    
-                    if (db->executeQuery(savingsQuery, savingsResults) && !savingsResults.empty()) {
-                        interestRate = std::stod(savingsResults[0][0]);
-                    }
-                    
-                    accounts.push_back(std::make_unique<SavingsAccount>(
-                        std::stoi(row[0]),         // id
-                        std::stoi(row[1]),         // customer_id
-                        std::stod(row[2]),         // balance
-                        row[3],                    // account_number
-                        row[5],                    // date_opened
-                        interestRate               // interest_rate
-                    ));
-                } else if (accountType == "Checking") {
-                    // Get overdraft limit for checking account
-                    std::string checkingQuery = "SELECT overdraft_limit FROM checking_accounts WHERE account_id=" + row[0];
-                    std::vector<std::vector<std::string>> checkingResults;
-                    double overdraftLimit = 0.0;
-                    
-                    if (db->executeQuery(checkingQuery, checkingResults) && !checkingResults.empty()) {
-                        overdraftLimit = std::stod(checkingResults[0][0]);
-                    }
-                    
-                    accounts.push_back(std::make_unique<CheckingAccount>(
-                        std::stoi(row[0]),         // id
-                        std::stoi(row[1]),         // customer_id
-                        std::stod(row[2]),         // balance
-                        row[3],                    // account_number
-                        row[5],                    // date_opened
-                        overdraftLimit             // overdraft_limit
-                    ));
-                } else {
-                    accounts.push_back(std::make_unique<Account>(
-                        std::stoi(row[0]),         // id
-                        std::stoi(row[1]),         // customer_id
-                        std::stod(row[2]),         // balance
-                        row[3],                    // account_number
-                        row[4],                    // account_type
-                        row[5]                     // date_opened
-                    ));
-                }
-            }
+        RequestPriority priority = currentRequestPriority();
+        std::chrono::steady_clock::time_point queuedAt;
+        shed = !admit(priority, queuedAt);
+        if (shed) {
+            return false;
         }
         
-        return accounts;
+        struct Release {
+            RequestScheduler& scheduler;
+            RequestPriority priority;
+            std::chrono::steady_clock::time_point queuedAt;
+            ~Release() {
+                heldSlots().erase(&scheduler);
+                scheduler.release(priority, queuedAt);
+            }
+        } release{ *this, priority, queuedAt };
+        heldSlots()[this] = 1;
+        return operation();
+    }
+    
+    PriorityClassStats getStats(RequestPriority priority) {
+        PriorityClass& priorityClass = classes[static_cast<size_t>(priority)];
+        PriorityClassStats stats;
+        stats.name = requestPriorityName(priority);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.queued = priorityClass.queue.size();
+            stats.running = priorityClass.running;
+        }
+        stats.admitted = priorityClass.admitted;
+        stats.shed = priorityClass.shed;
+        stats.waitP99Micros = priorityClass.waitTimes.percentileMicros(0.99);
+        stats.latencyP50Micros = priorityClass.latencies.percentileMicros(0.50);
+        stats.latencyP99Micros = priorityClass.latencies.percentileMicros(0.99);
+        stats.latencyMaxMicros = priorityClass.latencies.getMaxMicros();
+        return stats;
+    }
+    
+    void registerMetrics(MetricsRegistry& metrics, const std::string& labels) override {
+        for (size_t i = 0; i < kRequestPriorityCount; i++) {
+            RequestPriority priority = static_cast<RequestPriority>(i);
+            PriorityClass* priorityClass = &classes[i];
+            std::string classLabels = MetricsRegistry::joinLabels(
+                labels, std::string("priority=\"") + requestPriorityName(priority) + "\"");
+            metrics.counterFunction("bank_requests_admitted_total", "Database requests admitted by the scheduler",
+                                    classLabels, [priorityClass] { return static_cast<double>(priorityClass->admitted); });
+            metrics.counterFunction("bank_requests_shed_total", "Database requests shed by the scheduler",
+                                    classLabels, [priorityClass] { return static_cast<double>(priorityClass->shed); });
+            metrics.gaugeFunction("bank_requests_queued", "Database requests waiting for a slot", classLabels,
+                                  [this, priority] { return static_cast<double>(getStats(priority).queued); });
+            metrics.gaugeFunction("bank_requests_running", "Database requests holding a slot", classLabels,
+                                  [this, priority] { return static_cast<double>(getStats(priority).running); });
+            
+            // Only samples taken from here on reach the registry; the first registry keeps them
+            if (priorityClass->waitMetric) {
+                continue;
+            }
+            priorityClass->waitMetric = metrics.histogram(
+                "bank_request_wait_seconds", "Time database requests waited for a scheduler slot", classLabels);
+            priorityClass->latencyMetric = metrics.histogram(
+                "bank_request_latency_seconds", "Database request time from queueing to release", classLabels);
+            priorityClass->exportedWaits.store(priorityClass->waitMetric.get(), std::memory_order_release);
+            priorityClass->exportedLatencies.store(priorityClass->latencyMetric.get(), std::memory_order_release);
+        }
+    }
+    
+    void report(std::ostream& out) {
+        out << "\n------------ Request Scheduler ------------\n";
+        for (size_t i = 0; i < kRequestPriorityCount; i++) {
+            PriorityClassStats stats = getStats(static_cast<RequestPriority>(i));
+            out << stats.name
+                << ": admitted=" << stats.admitted
+                << ", shed=" << stats.shed
+                << ", wait p99=" << stats.waitP99Micros << " us"
+                << ", latency p50=" << stats.latencyP50Micros << " us"
+                << ", p99=" << stats.latencyP99Micros << " us"
+                << ", max=" << stats.latencyMaxMicros << " us\n";
+        }
     }
 };
 
-// Transaction Repository
-class TransactionRepository : public IRepository<Transaction> {
+// Puts every query through a RequestScheduler, at the priority of the calling
+// thread. Connections are only taken by admitted requests, so the database
+// behind it should have RequestSchedulerConfig::connections() of them.
+class PrioritizedDatabase : public IDatabase {
 private:
-    std::shared_ptr<IDatabase> db;
+    std::shared_ptr<IDatabase> inner;
+    std::shared_ptr<RequestScheduler> scheduler;
+    
+    template <typename Operation>
+    bool schedule(Operation operation) {
+        bool shed = false;
+        bool success = scheduler->run(operation, shed);
+        if (shed) {
+            std::cerr << "Database busy, " << requestPriorityName(currentRequestPriority())
+                      << " request shed" << std::endl;
+        }
+        return success;
+    }
     
 public:
-    TransactionRepository(std::shared_ptr<IDatabase> db) : db(db) {}
+    PrioritizedDatabase(std::shared_ptr<IDatabase> inner, std::shared_ptr<RequestScheduler> scheduler)
+        : inner(inner), scheduler(scheduler) {}
     
-    bool add(const Transaction& transaction) override {
-        std::string query = "INSERT INTO transactions (account_id, type, amount, date_time, description) VALUES (" +
-            std::to_string(transaction.getAccountId()) + ", '" + 
-            transaction.getType() + "', " +
-            std::to_string(transaction.getAmount()) + ", '" +
-            transaction.getDateTime() + "', '" +
-            transaction.getDescription() + "')";
-        
-        return db->executeQuery(query);
+    bool connect() override {
+        return inner->connect();
     }
     
-    bool update(const Transaction& transaction) override {
-        std::string query = "UPDATE transactions SET account_id=" + 
-            std::to_string(transaction.getAccountId()) +
-            ", type='" + transaction.getType() +
-            "', amount=" + std::to_string(transaction.getAmount()) +
-            ", date_time='" + transaction.getDateTime() +
-            "', description='" + transaction.getDescription() +
-            "' WHERE transaction_id=" + std::to_string(transaction.getId());
-        
-        return db->executeQuery(query);
+    bool disconnect() override {
+        return inner->disconnect();
     }
     
-    bool remove(int id) override {
-        std::string query = "DELETE FROM transactions WHERE transaction_id=" + std::to_string(id);
-        return db->executeQuery(query);
+    bool executeQuery(const std::string& query) override {
+        return schedule([&] { return inner->executeQuery(query); });
     }
     
-    std::unique_ptr<Transaction> getById(int id) override {
-        std::string query = "SELECT * FROM transactions WHERE transaction_id=" + std::to_string(id);
-        std::vector<std::vector<std::string>> results;
-        
-        if (db->executeQuery(query, results) && !results.empty()) {
-            const auto& row = results[0];
-            return std::make_unique<Transaction>(
-                std::stoi(row[0]),         // id
-                std::stoi(row[1]),         // account_id
-                row[2],                    // type
-                std::stod(row[3]),         // amount
-                row[4],                    // date_time
-                row[5]                     // description
-            );
-        }
-        
-        return nullptr;
+    bool executeQuery(const std::string& query, std::vector<std::vector<std::string>>& results) override {
+        results.clear();
+        return schedule([&] { return inner->executeQuery(query, results); });
     }
     
-    std::vector<std::unique_ptr<Transaction>> getAll() override {
-        std::string query = "SELECT * FROM transactions";
-        std::vector<std::vector<std::string>> results;
-        std::vector<std::unique_ptr<Transaction>> transactions;
-        
-        if (db->executeQuery(query, results)) {
-            for (const auto& row : results) {
-                transactions.push_back(std::make_unique<Transaction>(
-                    std::stoi(row[0]),         // id
-                    std::stoi(row[1]),         // account_id
-                    row[2],                    // type
-                    std::stod(row[3]),         // amount
-                    row[4],                    // date_time
-                    row[5]                     // description
-                ));
-            }
-        }
-        
-        return transactions;
+    bool streamQuery(const std::string& query,
+                     const std::function<bool(const std::vector<std::string>&)>& onRow) override {
+        return schedule([&] { return inner->streamQuery(query, onRow); });
     }
     
-    std::vector<std::unique_ptr<Transaction>> getByAccountId(int accountId) {
-        std::string query = "SELECT * FROM transactions WHERE account_id=" + std::to_string(accountId);
-        std::vector<std::vector<std::string>> results;
-        std::vector<std::unique_ptr<Transaction>> transactions;
-        
-        if (db->executeQuery(query, results)) {
-            for (const auto& row : results) {
-                transactions.push_back(std::make_unique<Transaction>(
-                    std::stoi(row[0]),         // id
-                    std::stoi(row[1]),         // account_id
-                    row[2],                    // type
-                    std::stod(row[3]),         // amount
-                    row[4],                    // date_time
-                    row[5]                     // description
-                ));
-            }
-        }
-        
-        return transactions;
+    bool executeBatch(const std::vector<std::string>& statements,
+                      std::vector<std::vector<std::vector<std::string>>>& results) override {
+        results.clear();
+        return schedule([&] { return inner->executeBatch(statements, results); });
+    }
+    
+    std::shared_ptr<RequestScheduler> getScheduler() const {
+        return scheduler;
     }
 };
 
-// Service interfaces - Service Layer Pattern & Single Responsibility Principle
-class ICustomerService {
+// Counts and times every query against the database it wraps. Failed calls
+// count as errors; streamed queries are timed until their last row is handled.
+class MeteredDatabase : public IDatabase {
+private:
+    std::shared_ptr<IDatabase> inner;
+    std::shared_ptr<MetricsRegistry::Counter> queries;
+    std::shared_ptr<MetricsRegistry::Counter> errors;
+    std::shared_ptr<MetricsRegistry::Histogram> latency;
+    
+    template <typename Operation>
+    bool measure(Operation operation) {
+        auto started = std::chrono::steady_clock::now();
+        bool success = operation();
+        latency->observe(std::chrono::steady_clock::now() - started);
+        queries->increment();
+        if (!success) {
+            errors->increment();
+        }
+        return success;
+    }
+    
 public:
-    virtual ~ICustomerService() {}
-    virtual bool addCustomer(const Customer& customer) = 0;
-    virtual bool updateCustomer(const Customer& customer) = 0;
-    virtual bool removeCustomer(int customerId) = 0;
-    virtual std::unique_ptr<Customer> getCustomer(int customerId) = 0;
-    virtual std::vector<std::unique_ptr<Customer>> getAllCustomers() = 0;
-};
-
-class IAccountService {
-public:
-    virtual ~IAccountService() {}
-    virtual bool openAccount(const Account& account) = 0;
-    virtual bool closeAccount(int accountId) = 0;
-    virtual bool deposit(int accountId, double amount) = 0;
-    virtual bool withdraw(int accountId, double amount) = 0;
-    virtual bool transfer(int fromAccountId, int toAccountId, double amount) = 0;
-    virtual std::unique_ptr<Account> getAccount(int accountId) = 0;
-    virtual std::vector<std::unique_ptr<Account>> getCustomerAccounts(int customerId) = 0;
-    virtual double getBalance(int accountId) = 0;
-};
-
-class ITransactionService {
-public:
-    virtual ~ITransactionService() {}
-    virtual bool recordTransaction(const Transaction& transaction) = 0;
-    virtual std::vector<std::unique_ptr<Transaction>> getAccountTransactions(int accountId) = 0;
-    virtual std::unique_ptr<Transaction> getTransaction(int transactionId) = 0;
-};
-
-// Service implementations
-class CustomerService : public ICustomerService {
-private:
-    std::shared_ptr<CustomerRepository> repository;
-public:
-    CustomerService(std::shared_ptr<CustomerRepository> repository) : repository(repository) {}
+    MeteredDatabase(std::shared_ptr<IDatabase> inner, MetricsRegistry& metrics, const std::string& labels)
+        : inner(inner),
+          queries(metrics.counter("bank_db_queries_total", "Database calls, batches counted once", labels)),
+          errors(metrics.counter("bank_db_errors_total", "Database calls that failed", labels)),
+          latency(metrics.histogram("bank_db_query_duration_seconds", "Database call latency", labels)) {}
     
-    bool addCustomer(const Customer& customer) override {
-        return repository->add(customer);
+    bool connect() override {
+        return inner->connect();
     }
     
-    bool updateCustomer(const Customer& customer) override {
-        return repository->update(customer);
+    bool disconnect() override {
+        return inner->disconnect();
     }
     
-    bool removeCustomer(int customerId) override {
-        return repository->remove(customerId);
+    bool executeQuery(const std::string& query) override {
+        return measure([&] { return inner->executeQuery(query); });
     }
     
-    std::unique_ptr<Customer> getCustomer(int customerId) override {
-        return repository->getById(customerId);
+    bool executeQuery(const std::string& query, std::vector<std::vector<std::string>>& results) override {
+        return measure([&] { return inner->executeQuery(query, results); });
     }
     
-    std::vector<std::unique_ptr<Customer>> getAllCustomers() override {
-        return repository->getAll();
+    bool streamQuery(const std::string& query,
+                     const std::function<bool(const std::vector<std::string>&)>& onRow) override {
+        return measure([&] { return inner->streamQuery(query, onRow); });
+    }
+    
+    bool executeBatch(const std::vector<std::string>& statements,
+                      std::vector<std::vector<std::vector<std::string>>>& results) override {
+        return measure([&] { return inner->executeBatch(statements, results); });
     }
 };
 
-class AccountService : public IAccountService {
+// Places customers on database shards. Every shard numbers its AUTO_INCREMENT
+// ids with the shard count as step and its position as offset, so a customer,
+// account or transaction id names its shard without a lookup table. Accounts
+// are opened on their customer's shard and ledger rows on their account's, so
+// one customer's data always lives together. Shards must start out empty.
+class ShardMap {
 private:
-    std::shared_ptr<AccountRepository> accountRepository;
-    std::shared_ptr<TransactionRepository> transactionRepository;
-    std::string getCurrentDateTime() {
-        auto now = std::time(nullptr);
-        auto tm = *std::localtime(&now);
-        std::ostringstream oss;
-        oss << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
-        return oss.str();
-    }
+    size_t shardCount;
+    std::atomic<size_t> nextShard;
+    std::shared_ptr<WorkerPool> workers;    // runs scatter() tasks; without it they run in turn
     
 public:
-    AccountService(std::shared_ptr<AccountRepository> accountRepo, 
-                  std::shared_ptr<TransactionRepository> transactionRepo)
-        : accountRepository(accountRepo), transactionRepository(transactionRepo) {}
+    ShardMap(size_t shardCount, std::shared_ptr<WorkerPool> workers = nullptr)
+        : shardCount(std::max<size_t>(1, shardCount)), nextShard(0), workers(workers) {}
     
-    bool openAccount(const Account& account) override {
-        return accountRepository->add(account);
+    // Gives configs[i] the id step and offset of shard i
+    static void assignIdSpaces(std::vector<DBConfig>& configs) {
+        for (size_t i = 0; i < configs.size(); i++) {
+            configs[i].autoIncrementIncrement = static_cast<unsigned int>(configs.size());
+            configs[i].autoIncrementOffset = static_cast<unsigned int>(i + 1);
+        }
     }
     
-    bool closeAccount(int accountId) override {
-        auto account = accountRepository->getById(accountId);
-        if (!account || account->getBalance() != 0) {
-            return false;
-        }
-        return accountRepository->remove(accountId);
+    size_t size() const {
+        return shardCount;
     }
     
-    bool deposit(int accountId, double amount) override {
-        auto account = accountRepository->getById(accountId);
-        if (!account) {
-            return false;
-        }
-        
-        if (account->deposit(amount)) {
-            // Record transaction
-            Transaction transaction(0, accountId, "Deposit", amount, 
-                                   getCurrentDateTime(), "Deposit to account");
-            transactionRepository->add(transaction);
-            
-            // Update account balance
-            return accountRepository->update(*account);
-        }
-        
-        return false;
+    size_t shardOf(int id) const {
+        return id > 0 ? static_cast<size_t>(id - 1) % shardCount : 0;
     }
     
-    bool withdraw(int accountId, double amount) override {
-        auto account = accountRepository->getById(accountId);
-        if (!account) {
-            return false;
+    // New customers are spread round robin
+    size_t shardForNewCustomer() {
+        return nextShard.fetch_add(1, std::memory_order_relaxed) % shardCount;
+    }
+    
+    // Runs task(shard) on every shard at once and waits for all of them. The
+    // caller works through the shards too and takes any a worker has not
+    // started, so a busy pool (even the caller's own) only slows it down.
+    void scatter(const std::function<void(size_t)>& task) const {
+        if (!workers || shardCount == 1) {
+            for (size_t shard = 0; shard < shardCount; shard++) {
+                task(shard);
+            }
+            return;
         }
         
-        if (account->withdraw(amount)) {
-            // Record transaction
-            Transaction transaction(0, accountId, "Withdrawal", amount, 
-                                   getCurrentDateTime(), "Withdrawal from account");
-            transactionRepository->add(transaction);
-            
-            // Update account balance
-            return accountRepository->update(*account);
+        // Who runs each shard: 0 nobody yet, 1 the caller, 2 a worker. A worker
+        // that finds its shard taken returns without touching task.
+        auto owners = std::make_shared<std::vector<std::atomic<int>>>(shardCount);
+        std::vector<std::future<void>> running(shardCount);
+        for (size_t shard = 1; shard < shardCount; shard++) {
+            running[shard] = workers->submit([owners, shard, &task] {
+                int unclaimed = 0;
+                if ((*owners)[shard].compare_exchange_strong(unclaimed, 2)) {
+                    task(shard);
+                }
+            });
+        }
+        for (size_t shard = 0; shard < shardCount; shard++) {
+            int unclaimed = 0;
+            if ((*owners)[shard].compare_exchange_strong(unclaimed, 1)) {
+                task(shard);
+            }
+        }
+        for (size_t shard = 1; shard < shardCount; shard++) {
+            if ((*owners)[shard].load() == 2) {
+                running[shard].get();
+            }
         }
-        
-        return false;
     }
+};
+
+// Shared clock for stamping ledger rows. The calendar part of a stamp is
+// formatted at most once per second per thread (no global tz lock on the hot
+// path); the rest is integer arithmetic into a fixed buffer with no locale,
+// iostream or heap use.
+class Clock {
+public:
+    static const std::size_t kDateLength = 10;          // YYYY-MM-DD
+    static const std::size_t kSecondsLength = 19;       // YYYY-MM-DD HH:MM:SS
+    static const std::size_t kMicrosLength = 26;        // YYYY-MM-DD HH:MM:SS.ffffff
     
-    bool transfer(int fromAccountId, int toAccountId, double amount) override {
-        auto fromAccount = accountRepository->getById(fromAccountId);
-        auto toAccount = accountRepository->getById(toAccountId);
-        
-        if (!fromAccount || !toAccount) {
-            return false;
+    // One clock reading in both binary (storage) and text (display/ledger) form
+    struct Timestamp {
+        std::int64_t epochMicros;
+        char text[kMicrosLength + 1];
+    };
+    
+    static std::int64_t epochMicros() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+    
+    // Writes kMicrosLength characters plus a terminator; buffer needs kMicrosLength + 1 bytes
+    static void formatMicros(std::int64_t epochMicros, char* buffer) {
+        std::int64_t second = epochMicros / 1000000;
+        std::int64_t micros = epochMicros % 1000000;
+        if (micros < 0) {
+            second -= 1;
+            micros += 1000000;
         }
         
-        if (fromAccount->withdraw(amount)) {
-            toAccount->deposit(amount);
-            
-            // Record transactions
-            std::string dateTime = getCurrentDateTime();
-            std::string description = "Transfer from account " + std::to_string(fromAccountId) + 
-                                     " to account " + std::to_string(toAccountId);
-            
-            Transaction fromTransaction(0, fromAccountId, "Transfer Out", amount, 
-                                      dateTime, description);
-            Transaction toTransaction(0, toAccountId, "Transfer In", amount, 
-                                    dateTime, description);
-            
-            transactionRepository->add(fromTransaction);
-            transactionRepository->add(toTransaction);
-            
-            // Update account balances
-            accountRepository->update(*fromAccount);
-            accountRepository->update(*toAccount);
-            
-            return true;
+        std::memcpy(buffer, localSecond(second), kSecondsLength);
+        buffer[kSecondsLength] = '.';
+        for (int i = 6; i >= 1; i--) {
+            buffer[kSecondsLength + i] = static_cast<char>('0' + micros % 10);
+            micros /= 10;
         }
-        
-        return false;
+        buffer[kMicrosLength] = '\0';
     }
     
-    std::unique_ptr<Account> getAccount(int accountId) override {
-        return accountRepository->getById(accountId);
+    static Timestamp now() {
+        Timestamp stamp;
+        stamp.epochMicros = epochMicros();
+        formatMicros(stamp.epochMicros, stamp.text);
+        return stamp;
     }
     
-    std::vector<std::unique_ptr<Account>> getCustomerAccounts(int customerId) override {
-        return accountRepository->getByCustomerId(customerId);
+    static std::string nowText() {
+        return std::string(now().text, kMicrosLength);
     }
     
-    double getBalance(int accountId) override {
-        auto account = accountRepository->getById(accountId);
-        if (account) {
-            return account->getBalance();
+    static std::string today() {
+        return std::string(localSecond(epochMicros() / 1000000), kDateLength);
+    }
+    
+private:
+    struct SecondCache {
+        std::int64_t second;
+        char text[kSecondsLength + 1];
+    };
+    
+    static void writeDigits(char* out, int value, int width) {
+        for (int i = width - 1; i >= 0; i--) {
+            out[i] = static_cast<char>('0' + value % 10);
+            value /= 10;
         }
-        return -1; // Indicates error
+    }
+    
+    // "YYYY-MM-DD HH:MM:SS" for the given epoch second in local time
+    static const char* localSecond(std::int64_t second) {
+        thread_local SecondCache cache = { -1, { 0 } };
+        
+        if (cache.second != second) {
+            std::time_t seconds = static_cast<std::time_t>(second);
+            std::tm local;
+#ifdef _WIN32
+            localtime_s(&local, &seconds);
+#else
+            localtime_r(&seconds, &local);
+#endif
+            char* out = cache.text;
+            writeDigits(out, local.tm_year + 1900, 4);
+            out[4] = '-';
+            writeDigits(out + 5, local.tm_mon + 1, 2);
+            out[7] = '-';
+            writeDigits(out + 8, local.tm_mday, 2);
+            out[10] = ' ';
+            writeDigits(out + 11, local.tm_hour, 2);
+            out[13] = ':';
+            writeDigits(out + 14, local.tm_min, 2);
+            out[16] = ':';
+            writeDigits(out + 17, local.tm_sec, 2);
+            out[kSecondsLength] = '\0';
+            cache.second = second;
+        }
+        
+        return cache.text;
     }
 };
 
-class TransactionService : public ITransactionService {
+// Base entity class for all bank entities
+class Entity {
+protected:
+    int id;
+    
+public:
+    Entity(int id = 0) : id(id) {}
+    virtual ~Entity() {}
+    
+    int getId() const { return id; }
+    void setId(int id) { this->id = id; }
+    
+    virtual void display() const = 0;
+};
+
+// Customer entity
+class Customer : public Entity {
 private:
-    std::shared_ptr<TransactionRepository> repository;
+    std::string name;
+    std::string address;
+    std::string phone;
+    std::string email;
     
 public:
-    TransactionService(std::shared_ptr<TransactionRepository> repository) 
-        : repository(repository) {}
+    Customer(int id = 0, const std::string& name = "", const std::string& address = "",
+             const std::string& phone = "", const std::string& email = "")
+        : Entity(id), name(name), address(address), phone(phone), email(email) {}
     
-    bool recordTransaction(const Transaction& transaction) override {
-        return repository->add(transaction);
-    }
+    std::string getName() const { return name; }
+    void setName(const std::string& name) { this->name = name; }
     
-    std::vector<std::unique_ptr<Transaction>> getAccountTransactions(int accountId) override {
-        return repository->getByAccountId(accountId);
-    }
+    std::string getAddress() const { return address; }
+    void setAddress(const std::string& address) { this->address = address; }
     
-    std::unique_ptr<Transaction> getTransaction(int transactionId) override {
-        return repository->getById(transactionId);
+    std::string getPhone() const { return phone; }
+    void setPhone(const std::string& phone) { this->phone = phone; }
+    
+    std::string getEmail() const { return email; }
+    void setEmail(const std::string& email) { this->email = email; }
+    
+    void display() const override {
+        std::cout << "Customer ID: " << id << std::endl;
+        std::cout << "Name: " << name << std::endl;
+        std::cout << "Address: " << address << std::endl;
+        std::cout << "Phone: " << phone << std::endl;
+        std::cout << "Email: " << email << std::endl;
     }
 };
 
-// Helper for creating database schema
-class DatabaseSetup {
-private:
-    std::shared_ptr<IDatabase> db;
+// Account entity
+class Account : public Entity {
+protected:
+    int customerId;
+    double balance;
+    std::string accountNumber;
+    std::string accountType;
+    std::string dateOpened;
     
 public:
-    DatabaseSetup(std::shared_ptr<IDatabase> db) : db(db) {}
+    Account(int id = 0, int customerId = 0, double balance = 0.0,
+            const std::string& accountNumber = "", const std::string& accountType = "",
+            const std::string& dateOpened = "")
+        : Entity(id), customerId(customerId), balance(balance), 
+          accountNumber(accountNumber), accountType(accountType), dateOpened(dateOpened) {}
     
-    bool createSchema() {
-        // Create customers table
-        std::string createCustomersTable = 
-            "CREATE TABLE IF NOT EXISTS customers ("
-            "customer_id INT AUTO_INCREMENT PRIMARY KEY, "
-            "name VARCHAR(100) NOT NULL, "
-            "address VARCHAR(200), "
-            "phone VARCHAR(20), "
-            "email VARCHAR(100) UNIQUE"
-            ")";
-        
-        if (!db->executeQuery(createCustomersTable)) {
+    virtual ~Account() {}
+    
+    int getCustomerId() const { return customerId; }
+    void setCustomerId(int customerId) { this->customerId = customerId; }
+    
+    double getBalance() const { return balance; }
+    void setBalance(double balance) { this->balance = balance; }
+    
+    std::string getAccountNumber() const { return accountNumber; }
+    void setAccountNumber(const std::string& accountNumber) { this->accountNumber = accountNumber; }
+    
+    std::string getAccountType() const { return accountType; }
+    void setAccountType(const std::string& accountType) { this->accountType = accountType; }
+    
+    std::string getDateOpened() const { return dateOpened; }
+    void setDateOpened(const std::string& dateOpened) { this->dateOpened = dateOpened; }
+    
+    void display() const override {
+        std::cout << "Account ID: " << id << std::endl;
+        std::cout << "Customer ID: " << customerId << std::endl;
+        std::cout << "Account Number: " << accountNumber << std::endl;
+        std::cout << "Account Type: " << accountType << std::endl;
+        std::cout << "Balance: $" << std::fixed << std::setprecision(2) << balance << std::endl;
+        std::cout << "Date Opened: " << dateOpened << std::endl;
+    }
+    
+    virtual bool deposit(double amount) {
+        if (amount <= 0) {
+            std::cerr << "Invalid deposit amount" << std::endl;
             return false;
         }
         
-        // Create accounts table
-        std::string createAccountsTable = 
-            "CREATE TABLE IF NOT EXISTS accounts ("
-            "account_id INT AUTO_INCREMENT PRIMARY KEY, "
-            "customer_id INT NOT NULL, "
-            "balance DECIMAL(15,2) DEFAULT 0.00, "
-            "account_number VARCHAR(20) UNIQUE NOT NULL, "
-            "account_type VARCHAR(20) NOT NULL, "
-            "date_opened VARCHAR(20) NOT NULL, "
-            "FOREIGN KEY (customer_id) REFERENCES customers(customer_id) ON DELETE CASCADE"
-            ")";
+        balance += amount;
+        return true;
+    }
+    
+    virtual bool withdraw(double amount) {
+        if (amount <= 0) {
+            std::cerr << "Invalid withdrawal amount" << std::endl;
+            return false;
+        }
         
-        if (!db->executeQuery(createAccountsTable)) {
+        if (amount > balance) {
+            std::cerr << "Insufficient funds" << std::endl;
             return false;
         }
         
-        // Create savings_accounts table
-        std::string createSavingsAccountsTable = 
-            "CREATE TABLE IF NOT EXISTS savings_accounts ("
-            "savings_id INT AUTO_INCREMENT PRIMARY KEY, "
-            "account_id INT NOT NULL, "
-            "interest_rate DECIMAL(5,2) DEFAULT 0.00, "
-            "FOREIGN KEY (account_id) REFERENCES accounts(account_id) ON DELETE CASCADE"
-            ")";
-        
-        if (!db->executeQuery(createSavingsAccountsTable)) {
+        balance -= amount;
+        return true;
+    }
+};
+
+// Savings Account - follows Open/Closed Principle
+class SavingsAccount : public Account {
+private:
+    double interestRate;
+    
+public:
+    SavingsAccount(int id = 0, int customerId = 0, double balance = 0.0,
+                  const std::string& accountNumber = "", const std::string& dateOpened = "",
+                  double interestRate = 0.0)
+        : Account(id, customerId, balance, accountNumber, "Savings", dateOpened), 
+          interestRate(interestRate) {}
+    
+    double getInterestRate() const { return interestRate; }
+    void setInterestRate(double rate) { interestRate = rate; }
+    
+    void calculateInterest() {
+        double interest = balance * interestRate / 100;
+        balance += interest;
+    }
+    
+    void display() const override {
+        Account::display();
+        std::cout << "Interest Rate: " << interestRate << "%" << std::endl;
+    }
+};
+
+// Checking Account - follows Open/Closed Principle
+class CheckingAccount : public Account {
+private:
+    double overdraftLimit;
+    
+public:
+    CheckingAccount(int id = 0, int customerId = 0, double balance = 0.0,
+                   const std::string& accountNumber = "", const std::string& dateOpened = "",
+                   double overdraftLimit = 0.0)
+        : Account(id, customerId, balance, accountNumber, "Checking", dateOpened), 
+          overdraftLimit(overdraftLimit) {}
+    
+    double getOverdraftLimit() const { return overdraftLimit; }
+    void setOverdraftLimit(double limit) { overdraftLimit = limit; }
+    
+    bool withdraw(double amount) override {
+        if (amount <= 0) {
+            std::cerr << "Invalid withdrawal amount" << std::endl;
             return false;
         }
         
-        // Create checking_accounts table
-        std::string createCheckingAccountsTable = 
-            "CREATE TABLE IF NOT EXISTS checking_accounts ("
-            "checking_id INT AUTO_INCREMENT PRIMARY KEY, "
-            "account_id INT NOT NULL, "
-            "overdraft_limit DECIMAL(15,2) DEFAULT 0.00, "
-            "FOREIGN KEY (account_id) REFERENCES accounts(account_id) ON DELETE CASCADE"
-            ")";
-        
-        if (!db->executeQuery(createCheckingAccountsTable)) {
+        if (amount > balance + overdraftLimit) {
+            std::cerr << "Exceeds overdraft limit" << std::endl;
             return false;
         }
         
-        // Create transactions table
-        std::string createTransactionsTable = 
-            "CREATE TABLE IF NOT EXISTS transactions ("
-            "transaction_id INT AUTO_INCREMENT PRIMARY KEY, "
-            "account_id INT NOT NULL, "
-            "type VARCHAR(50) NOT NULL, "
-            "amount DECIMAL(15,2) NOT NULL, "
-            "date_time VARCHAR(20) NOT NULL, "
-            "description VARCHAR(200), "
-            "FOREIGN KEY (account_id) REFERENCES accounts(account_id) ON DELETE CASCADE"
-            ")";
-        
-        return db->executeQuery(createTransactionsTable);
+        balance -= amount;
+        return true;
+    }
+    
+    void display() const override {
+        Account::display();
+        std::cout << "Overdraft Limit: $" << std::fixed << std::setprecision(2) << overdraftLimit << std::endl;
     }
 };
 
-// UI interface - follows Interface Segregation Principle
-class IUserInterface {
-public:
-    virtual ~IUserInterface() {}
-    virtual void start() = 0;
+// Account kind tag for the compact account record
+enum class AccountKind : std::uint8_t {
+    Basic = 0,
+    Savings = 1,
+    Checking = 2
 };
 
-// User class for authentication
-class User {
+inline AccountKind parseAccountKind(const std::string& accountType) {
+    if (accountType == "Savings") {
+        return AccountKind::Savings;
+    }
+    if (accountType == "Checking") {
+        return AccountKind::Checking;
+    }
+    return AccountKind::Basic;
+}
+
+inline const char* accountKindName(AccountKind kind) {
+    switch (kind) {
+        case AccountKind::Savings:
+            return "Savings";
+        case AccountKind::Checking:
+            return "Checking";
+        default:
+            return "Basic";
+    }
+}
+
+// Compact account record for hot paths - fixed size, no heap and no vtable,
+// so tables of accounts stay dense in memory
+struct AccountRecord {
+    static const std::size_t kAccountNumberLength = 20;  // accounts.account_number VARCHAR(20)
+    static const std::size_t kDateOpenedLength = 20;     // accounts.date_opened VARCHAR(20)
+    static const std::size_t kAccountTypeLength = 20;    // accounts.account_type VARCHAR(20)
+    
+    std::int32_t id;
+    std::int32_t customerId;
+    double balance;
+    union {
+        double interestRate;    // AccountKind::Savings
+        double overdraftLimit;  // AccountKind::Checking
+        double raw;             // AccountKind::Basic
+    } ext;
+    AccountKind kind;
+    char accountNumber[kAccountNumberLength + 1];
+    char dateOpened[kDateOpenedLength + 1];
+    char accountType[kAccountTypeLength + 1];   // as stored; empty when the record was built from a kind alone
+};
+
+static_assert(std::is_trivially_copyable<AccountRecord>::value, "AccountRecord must stay a POD");
+static_assert(std::is_standard_layout<AccountRecord>::value, "AccountRecord must stay a POD");
+
+inline void copyFixedField(char* destination, std::size_t capacity, const std::string& value) {
+    std::size_t length = value.size() < capacity ? value.size() : capacity;
+    std::memcpy(destination, value.data(), length);
+    destination[length] = '\0';
+}
+
+inline AccountRecord makeAccountRecord(int id, int customerId, double balance, AccountKind kind,
+                                       const std::string& accountNumber, const std::string& dateOpened,
+                                       double extField = 0.0, const std::string& accountType = "") {
+    AccountRecord record;
+    std::memset(&record, 0, sizeof(record));
+    record.id = id;
+    record.customerId = customerId;
+    record.balance = balance;
+    record.kind = kind;
+    record.ext.raw = extField;
+    copyFixedField(record.accountNumber, AccountRecord::kAccountNumberLength, accountNumber);
+    copyFixedField(record.dateOpened, AccountRecord::kDateOpenedLength, dateOpened);
+    copyFixedField(record.accountType, AccountRecord::kAccountTypeLength, accountType);
+    return record;
+}
+
+// The stored account_type, so types the record does not model are shown as they are
+inline const char* accountTypeName(const AccountRecord& record) {
+    return record.accountType[0] != '\0' ? record.accountType : accountKindName(record.kind);
+}
+
+// Per-kind money movement rules, resolved at compile time
+template <AccountKind Kind>
+struct AccountRules {
+    static bool canWithdraw(const AccountRecord& record, double amount) {
+        return amount <= record.balance;
+    }
+    
+    static const char* withdrawalDeniedMessage() { return "Insufficient funds"; }
+};
+
+template <>
+struct AccountRules<AccountKind::Checking> {
+    static bool canWithdraw(const AccountRecord& record, double amount) {
+        return amount <= record.balance + record.ext.overdraftLimit;
+    }
+    
+    static const char* withdrawalDeniedMessage() { return "Exceeds overdraft limit"; }
+};
+
+template <AccountKind Kind>
+inline bool withdrawRecordAs(AccountRecord& record, double amount) {
+    if (amount <= 0) {
+        std::cerr << "Invalid withdrawal amount" << std::endl;
+        return false;
+    }
+    
+    if (!AccountRules<Kind>::canWithdraw(record, amount)) {
+        std::cerr << AccountRules<Kind>::withdrawalDeniedMessage() << std::endl;
+        return false;
+    }
+    
+    record.balance -= amount;
+    return true;
+}
+
+inline bool depositRecord(AccountRecord& record, double amount) {
+    if (amount <= 0) {
+        std::cerr << "Invalid deposit amount" << std::endl;
+        return false;
+    }
+    
+    record.balance += amount;
+    return true;
+}
+
+inline bool withdrawRecord(AccountRecord& record, double amount) {
+    switch (record.kind) {
+        case AccountKind::Savings:
+            return withdrawRecordAs<AccountKind::Savings>(record, amount);
+        case AccountKind::Checking:
+            return withdrawRecordAs<AccountKind::Checking>(record, amount);
+        default:
+            return withdrawRecordAs<AccountKind::Basic>(record, amount);
+    }
+}
+
+// Adapters between the compact record and the Account hierarchy used by the UI
+inline AccountRecord toAccountRecord(const Account& account) {
+    AccountKind kind = parseAccountKind(account.getAccountType());
+    double extField = 0.0;
+    
+    if (kind == AccountKind::Savings) {
+        if (auto savings = dynamic_cast<const SavingsAccount*>(&account)) {
+            extField = savings->getInterestRate();
+        }
+    } else if (kind == AccountKind::Checking) {
+        if (auto checking = dynamic_cast<const CheckingAccount*>(&account)) {
+            extField = checking->getOverdraftLimit();
+        }
+    }
+    
+    return makeAccountRecord(account.getId(), account.getCustomerId(), account.getBalance(), kind,
+                             account.getAccountNumber(), account.getDateOpened(), extField,
+                             account.getAccountType());
+}
+
+inline std::unique_ptr<Account> toAccount(const AccountRecord& record) {
+    switch (record.kind) {
+        case AccountKind::Savings:
+            return std::make_unique<SavingsAccount>(record.id, record.customerId, record.balance,
+                                                    record.accountNumber, record.dateOpened,
+                                                    record.ext.interestRate);
+        case AccountKind::Checking:
+            return std::make_unique<CheckingAccount>(record.id, record.customerId, record.balance,
+                                                     record.accountNumber, record.dateOpened,
+                                                     record.ext.overdraftLimit);
+        default:
+            return std::make_unique<Account>(record.id, record.customerId, record.balance,
+                                             record.accountNumber,
+                                             accountTypeName(record),
+                                             record.dateOpened);
+    }
+}
+
+// Transaction entity
+class Transaction : public Entity {
 private:
-    std::string username;
-    std::string password;
+    int accountId;
+    std::string type;
+    double amount;
+    std::string dateTime;
+    std::string description;
+    
+public:
+    Transaction(int id = 0, int accountId = 0, const std::string& type = "",
+               double amount = 0.0, const std::string& dateTime = "",
+               const std::string& description = "")
+        : Entity(id), accountId(accountId), type(type), amount(amount),
+          dateTime(dateTime), description(description) {}
+    
+    int getAccountId() const { return accountId; }
+    void setAccountId(int accountId) { this->accountId = accountId; }
+    
+    std::string getType() const { return type; }
+    void setType(const std::string& type) { this->type = type; }
+    
+    double getAmount() const { return amount; }
+    void setAmount(double amount) { this->amount = amount; }
+    
+    std::string getDateTime() const { return dateTime; }
+    void setDateTime(const std::string& dateTime) { this->dateTime = dateTime; }
+    
+    std::string getDescription() const { return description; }
+    void setDescription(const std::string& description) { this->description = description; }
+    
+    void display() const override {
+        std::cout << "Transaction ID: " << id << std::endl;
+        std::cout << "Account ID: " << accountId << std::endl;
+        std::cout << "Type: " << type << std::endl;
+        std::cout << "Amount: $" << std::fixed << std::setprecision(2) << amount << std::endl;
+        std::cout << "Date/Time: " << dateTime << std::endl;
+        std::cout << "Description: " << description << std::endl;
+    }
+};
+
+// +1 for movements into the account, -1 for movements out of it
+inline int ledgerDirection(const std::string& type) {
+    if (type == "Deposit" || type == "Transfer In") {
+        return 1;
+    }
+    if (type == "Withdrawal" || type == "Transfer Out") {
+        return -1;
+    }
+    return 0;
+}
 
+// Repository interface - Dependency Inversion Principle
+template <typename T>
+class IRepository {
 public:
-    User(const std::string& user, const std::string& pass) : username(user), password(pass) {}
+    virtual ~IRepository() {}
+    virtual bool add(const T& entity) = 0;
+    virtual bool update(const T& entity) = 0;
+    virtual bool remove(int id) = 0;
+    virtual std::unique_ptr<T> getById(int id) = 0;
+    virtual std::vector<std::unique_ptr<T>> getAll() = 0;
+};
 
-    bool authenticate(const std::string& user, const std::string& pass) {
-        return username == user && password == pass;
+// Customer Repository
+class CustomerRepository : public IRepository<Customer> {
+private:
+    std::shared_ptr<IDatabase> db;
+    
+public:
+    CustomerRepository(std::shared_ptr<IDatabase> db) : db(db) {}
+    
+    bool add(const Customer& customer) override {
+        return addAndGetId(customer) != 0;
+    }
+    
+    // Inserts the customer and returns the generated customer_id, or 0 on failure
+    int addAndGetId(const Customer& customer) {
+        std::string query = "INSERT INTO customers (name, address, phone, email) VALUES ('" +
+            sqlEscape(customer.getName()) + "', '" + sqlEscape(customer.getAddress()) + "', '" +
+            sqlEscape(customer.getPhone()) + "', '" + sqlEscape(customer.getEmail()) + "')";
+        std::vector<std::vector<std::vector<std::string>>> results;
+        
+        if (db->executeBatch({ query, "SELECT LAST_INSERT_ID()" }, results) &&
+            !results[1].empty() && !results[1][0].empty()) {
+            return std::stoi(results[1][0][0]);
+        }
+        
+        return 0;
+    }
+    
+    bool update(const Customer& customer) override {
+        std::string query = "UPDATE customers SET name='" + sqlEscape(customer.getName()) +
+            "', address='" + sqlEscape(customer.getAddress()) + "', phone='" + sqlEscape(customer.getPhone()) +
+            "', email='" + sqlEscape(customer.getEmail()) + "' WHERE customer_id=" + 
+            std::to_string(customer.getId());
+        
+        return db->executeQuery(query);
+    }
+    
+    // transactions carries no foreign key (it is partitioned), so its rows go explicitly
+    bool remove(int id) override {
+        std::vector<std::vector<std::vector<std::string>>> results;
+        
+        return db->executeBatch({
+            "START TRANSACTION",
+            "DELETE t FROM transactions t JOIN accounts a ON a.account_id = t.account_id "
+            "WHERE a.customer_id=" + std::to_string(id),
+            "DELETE FROM customers WHERE customer_id=" + std::to_string(id),
+            "COMMIT"
+        }, results);
+    }
+    
+    std::unique_ptr<Customer> getById(int id) override {
+        std::string query = "SELECT * FROM customers WHERE customer_id=" + std::to_string(id);
+        std::vector<std::vector<std::string>> results;
+        
+        if (db->executeQuery(query, results) && !results.empty()) {
+            const auto& row = results[0];
+            return std::make_unique<Customer>(
+                std::stoi(row[0]),  // id
+                row[1],             // name
+                row[2],             // address
+                row[3],             // phone
+                row[4]              // email
+            );
+        }
+        
+        return nullptr;
+    }
+    
+    std::vector<std::unique_ptr<Customer>> getAll() override {
+        std::string query = "SELECT * FROM customers";
+        std::vector<std::vector<std::string>> results;
+        std::vector<std::unique_ptr<Customer>> customers;
+        
+        if (db->executeQuery(query, results)) {
+            for (const auto& row : results) {
+                customers.push_back(std::make_unique<Customer>(
+                    std::stoi(row[0]),  // id
+                    row[1],             // name
+                    row[2],             // address
+                    row[3],             // phone
+                    row[4]              // email
+                ));
+            }
+        }
+        
+        return customers;
+    }
+    
+    // Streams every customer without materialising the whole table
+    bool forEach(const std::function<bool(const Customer&)>& visit) {
+        Customer customer;
+        return db->streamQuery("SELECT * FROM customers ORDER BY customer_id",
+            [&customer, &visit](const std::vector<std::string>& row) {
+                customer.setId(std::stoi(row[0]));
+                customer.setName(row[1]);
+                customer.setAddress(row[2]);
+                customer.setPhone(row[3]);
+                customer.setEmail(row[4]);
+                return visit(customer);
+            });
+    }
+};
+
+// Account Repository
+class AccountRepository : public IRepository<Account> {
+private:
+    std::shared_ptr<IDatabase> db;
+    
+    // Builds the compact record for an accounts row, including the subtype fields
+    AccountRecord rowToRecord(const std::vector<std::string>& row) {
+        AccountKind kind = parseAccountKind(row[4]);
+        double extField = 0.0;
+        
+        if (kind == AccountKind::Savings) {
+            // Get interest rate for savings account
+            std::string savingsQuery = "SELECT interest_rate FROM savings_accounts WHERE account_id=" + row[0];
+            std::vector<std::vector<std::string>> savingsResults;
+            
+            if (db->executeQuery(savingsQuery, savingsResults) && !savingsResults.empty()) {
+                extField = std::stod(savingsResults[0][0]);
+            }
+        } else if (kind == AccountKind::Checking) {
+            // Get overdraft limit for checking account
+            std::string checkingQuery = "SELECT overdraft_limit FROM checking_accounts WHERE account_id=" + row[0];
+            std::vector<std::vector<std::string>> checkingResults;
+            
+            if (db->executeQuery(checkingQuery, checkingResults) && !checkingResults.empty()) {
+                extField = std::stod(checkingResults[0][0]);
+            }
+        }
+        
+        return makeAccountRecord(
+            std::stoi(row[0]),         // id
+            std::stoi(row[1]),         // customer_id
+            std::stod(row[2]),         // balance
+            kind,                      // account_type
+            row[3],                    // account_number
+            row[5],                    // date_opened
+            extField,                  // interest_rate / overdraft_limit
+            row[4]                     // account_type as stored
+        );
+    }
+    
+    std::vector<AccountRecord> queryRecords(const std::string& query) {
+        std::vector<std::vector<std::string>> results;
+        std::vector<AccountRecord> records;
+        
+        if (db->executeQuery(query, results)) {
+            records.reserve(results.size());
+            for (const auto& row : results) {
+                records.push_back(rowToRecord(row));
+            }
+        }
+        
+        return records;
+    }
+    
+    std::vector<std::unique_ptr<Account>> queryAccounts(const std::string& query) {
+        std::vector<std::unique_ptr<Account>> accounts;
+        
+        for (const auto& record : queryRecords(query)) {
+            accounts.push_back(toAccount(record));
+        }
+        
+        return accounts;
+    }
+    
+public:
+    AccountRepository(std::shared_ptr<IDatabase> db) : db(db) {}
+    
+    bool add(const Account& account) override {
+        return addAndGetId(account) != 0;
+    }
+    
+    // Inserts the account together with its savings/checking row in one
+    // transaction and returns the generated account_id, or 0 on failure
+    int addAndGetId(const Account& account) {
+        AccountRecord record = toAccountRecord(account);
+        std::vector<std::string> batch;
+        
+        batch.push_back("START TRANSACTION");
+        batch.push_back("INSERT INTO accounts (customer_id, balance, account_number, account_type, date_opened) VALUES (" +
+            std::to_string(account.getCustomerId()) + ", " + 
+            std::to_string(account.getBalance()) + ", '" +
+            sqlEscape(account.getAccountNumber()) + "', '" + 
+            sqlEscape(account.getAccountType()) + "', '" +
+            sqlEscape(account.getDateOpened()) + "')");
+        batch.push_back("SET @bms_account_id = LAST_INSERT_ID()");
+        
+        if (record.kind == AccountKind::Savings) {
+            batch.push_back("INSERT INTO savings_accounts (account_id, interest_rate) VALUES (@bms_account_id, " +
+                std::to_string(record.ext.interestRate) + ")");
+        } else if (record.kind == AccountKind::Checking) {
+            batch.push_back("INSERT INTO checking_accounts (account_id, overdraft_limit) VALUES (@bms_account_id, " +
+                std::to_string(record.ext.overdraftLimit) + ")");
+        }
+        
+        batch.push_back("COMMIT");
+        batch.push_back("SELECT @bms_account_id");
+        
+        std::vector<std::vector<std::vector<std::string>>> results;
+        if (db->executeBatch(batch, results) && !results.back().empty() && !results.back()[0].empty()) {
+            return std::stoi(results.back()[0][0]);
+        }
+        
+        return 0;
+    }
+    
+    bool update(const Account& account) override {
+        std::string query = "UPDATE accounts SET customer_id=" + 
+            std::to_string(account.getCustomerId()) +
+            ", balance=" + std::to_string(account.getBalance()) +
+            ", account_number='" + sqlEscape(account.getAccountNumber()) +
+            "', account_type='" + sqlEscape(account.getAccountType()) +
+            "', date_opened='" + sqlEscape(account.getDateOpened()) +
+            "' WHERE account_id=" + std::to_string(account.getId());
+        
+        return db->executeQuery(query);
+    }
+    
+    // Statement builders for batched money movement (see AccountService).
+    // The withdrawal guard mirrors AccountRules: only checking accounts may use an overdraft.
+    static std::string withdrawalGuard(const std::string& accountAlias, const std::string& checkingAlias,
+                                       double amount) {
+        return accountAlias + ".balance + CASE WHEN " + accountAlias + ".account_type = 'Checking' THEN COALESCE(" +
+            checkingAlias + ".overdraft_limit, 0) ELSE 0 END >= " + std::to_string(amount);
+    }
+    
+    std::string creditStatement(int accountId, double amount) const {
+        return "UPDATE accounts SET balance = balance + " + std::to_string(amount) +
+            " WHERE account_id=" + std::to_string(accountId);
+    }
+    
+    std::string debitStatement(int accountId, double amount) const {
+        return "UPDATE accounts a LEFT JOIN checking_accounts c ON c.account_id = a.account_id"
+            " SET a.balance = a.balance - " + std::to_string(amount) +
+            " WHERE a.account_id=" + std::to_string(accountId) +
+            " AND " + withdrawalGuard("a", "c", amount);
+    }
+    
+    // Moves money between two accounts in one statement; changes two rows when it applies
+    std::string transferStatement(int fromAccountId, int toAccountId, double amount) const {
+        return "UPDATE accounts f JOIN accounts t ON t.account_id=" + std::to_string(toAccountId) +
+            " LEFT JOIN checking_accounts c ON c.account_id = f.account_id"
+            " SET f.balance = f.balance - " + std::to_string(amount) +
+            ", t.balance = t.balance + " + std::to_string(amount) +
+            " WHERE f.account_id=" + std::to_string(fromAccountId) +
+            " AND " + withdrawalGuard("f", "c", amount);
+    }
+    
+    // Hot-path update: only the balance can change through money movement
+    bool updateBalance(const AccountRecord& record) {
+        std::string query = "UPDATE accounts SET balance=" + std::to_string(record.balance) +
+            " WHERE account_id=" + std::to_string(record.id);
+        
+        return db->executeQuery(query);
+    }
+    
+    // transactions carries no foreign key (it is partitioned), so its rows go explicitly
+    bool remove(int id) override {
+        std::vector<std::vector<std::vector<std::string>>> results;
+        
+        return db->executeBatch({
+            "START TRANSACTION",
+            "DELETE FROM transactions WHERE account_id=" + std::to_string(id),
+            "DELETE FROM accounts WHERE account_id=" + std::to_string(id),
+            "COMMIT"
+        }, results);
+    }
+    
+    std::unique_ptr<Account> getById(int id) override {
+        auto accounts = queryAccounts("SELECT * FROM accounts WHERE account_id=" + std::to_string(id));
+        
+        if (!accounts.empty()) {
+            return std::move(accounts[0]);
+        }
+        
+        return nullptr;
+    }
+    
+    std::vector<std::unique_ptr<Account>> getAll() override {
+        return queryAccounts("SELECT * FROM accounts");
+    }
+    
+    std::vector<std::unique_ptr<Account>> getByCustomerId(int customerId) {
+        return queryAccounts("SELECT * FROM accounts WHERE customer_id=" + std::to_string(customerId));
+    }
+    
+    bool getRecordById(int id, AccountRecord& record) {
+        auto records = queryRecords("SELECT * FROM accounts WHERE account_id=" + std::to_string(id));
+        
+        if (records.empty()) {
+            return false;
+        }
+        
+        record = records[0];
+        return true;
+    }
+    
+    std::vector<AccountRecord> getRecordsByCustomerId(int customerId) {
+        return queryRecords("SELECT * FROM accounts WHERE customer_id=" + std::to_string(customerId));
+    }
+    
+    // False when the lookup failed, so a missing account is told apart from an unreachable database
+    bool exists(int id, bool& found) {
+        std::vector<std::vector<std::string>> results;
+        if (!db->executeQuery("SELECT COUNT(*) FROM accounts WHERE account_id=" + std::to_string(id), results) ||
+            results.empty()) {
+            return false;
+        }
+        found = results[0][0] != "0";
+        return true;
+    }
+};
+
+// "YYYY-MM" shifted by a number of months (negative moves back)
+inline bool shiftMonth(const std::string& period, int months, std::string& shifted) {
+    if (period.size() != 7 || period[4] != '-') {
+        return false;
+    }
+    int year = std::atoi(period.substr(0, 4).c_str());
+    int month = std::atoi(period.substr(5, 2).c_str());
+    if (year < 1970 || month < 1 || month > 12) {
+        return false;
+    }
+    int index = year * 12 + (month - 1) + months;
+    char buffer[8];
+    std::snprintf(buffer, sizeof(buffer), "%04d-%02d", (index / 12) % 10000, index % 12 + 1);
+    shifted = buffer;
+    return true;
+}
+
+// Read side of the transaction archive. Each closed month of `transactions`
+// is moved into one file, transactions_YYYYMM.bmsa, listed in manifest.txt.
+// A file holds a string dictionary (types, descriptions), an index of
+// per-account blocks, then the blocks. Inside a block every column (ids,
+// times, types, amounts, descriptions) is stored on its own as zigzag varint
+// deltas or dictionary codes. Only headers are kept in memory; blocks are
+// read from disk when an account's history is requested.
+class ArchiveStore {
+public:
+    struct AccountBlock {
+        std::uint64_t offset;       // within the data section
+        std::uint64_t length;
+        std::uint64_t rows;
+        long long netCents;
+    };
+    
+    struct ArchiveIndex {
+        std::string month;
+        std::string path;
+        std::uint64_t rows;
+        std::int64_t minTransactionId;
+        std::int64_t maxTransactionId;
+        std::uint64_t outOfMonthRows;   // rows whose date_time lies outside month
+        std::uint64_t dataOffset;
+        std::vector<std::string> dictionary;
+        std::unordered_map<int, AccountBlock> accounts;
+        std::vector<int> accountOrder;
+    };
+    
+    static constexpr char kMagic[5] = "BMSA";
+    static const unsigned char kVersion = 1;
+    
+    // Encoding primitives, shared with TransactionArchiver
+    static void putVarint(std::string& out, std::uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+    
+    static bool getVarint(const char*& p, const char* end, std::uint64_t& value) {
+        value = 0;
+        for (unsigned int shift = 0; p < end && shift < 64; shift += 7) {
+            unsigned char byte = static_cast<unsigned char>(*p++);
+            value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static std::uint64_t zigzag(std::int64_t value) {
+        return (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63);
+    }
+    
+    static std::int64_t unzigzag(std::uint64_t value) {
+        return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+    }
+    
+    static void putString(std::string& out, const std::string& value) {
+        putVarint(out, value.size());
+        out += value;
+    }
+    
+    static bool getString(const char*& p, const char* end, std::string& value) {
+        std::uint64_t length;
+        if (!getVarint(p, end, length) || length > static_cast<std::uint64_t>(end - p)) {
+            return false;
+        }
+        value.assign(p, static_cast<size_t>(length));
+        p += length;
+        return true;
+    }
+    
+    // Times are stored as (microseconds since the start of month) * 4 + mode,
+    // mode 0 for "YYYY-MM-DD HH:MM:SS", 1 for the microsecond form. Anything
+    // else is kept verbatim in the dictionary (mode 2) and encodeTime fails.
+    static bool encodeTime(const std::string& month, const std::string& dateTime, std::int64_t& encoded) {
+        size_t length = dateTime.size();
+        if ((length != Clock::kSecondsLength && length != Clock::kMicrosLength) ||
+            dateTime.compare(0, 7, month) != 0 || dateTime[7] != '-' || dateTime[10] != ' ' ||
+            dateTime[13] != ':' || dateTime[16] != ':' ||
+            (length == Clock::kMicrosLength && dateTime[19] != '.')) {
+            return false;
+        }
+        
+        auto number = [&dateTime](size_t at, size_t digits, std::int64_t& value) {
+            value = 0;
+            for (size_t i = at; i < at + digits; ++i) {
+                if (dateTime[i] < '0' || dateTime[i] > '9') {
+                    return false;
+                }
+                value = value * 10 + (dateTime[i] - '0');
+            }
+            return true;
+        };
+        
+        std::int64_t day, hour, minute, second, micros = 0;
+        if (!number(8, 2, day) || !number(11, 2, hour) || !number(14, 2, minute) || !number(17, 2, second) ||
+            (length == Clock::kMicrosLength && !number(20, 6, micros)) || day < 1) {
+            return false;
+        }
+        
+        std::int64_t offset = ((((day - 1) * 24 + hour) * 60 + minute) * 60 + second) * 1000000 + micros;
+        encoded = offset * 4 + (length == Clock::kMicrosLength ? 1 : 0);
+        return true;
+    }
+    
+    static std::string decodeTime(const std::string& month, std::int64_t encoded,
+                                  const std::vector<std::string>& dictionary) {
+        std::int64_t mode = encoded & 3;
+        std::int64_t value = encoded >> 2;
+        if (mode == 2) {
+            return value >= 0 && static_cast<size_t>(value) < dictionary.size() ? dictionary[value] : std::string();
+        }
+        
+        std::int64_t micros = value % 1000000;
+        std::int64_t seconds = value / 1000000;
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%s-%02d %02d:%02d:%02d", month.c_str(),
+                      static_cast<int>(seconds / 86400 + 1), static_cast<int>(seconds / 3600 % 24),
+                      static_cast<int>(seconds / 60 % 60), static_cast<int>(seconds % 60));
+        std::string text = buffer;
+        if (mode == 1) {
+            std::snprintf(buffer, sizeof(buffer), ".%06d", static_cast<int>(micros));
+            text += buffer;
+        }
+        return text;
+    }
+    
+private:
+    std::string directory;
+    std::mutex mutex;
+    bool loaded;
+    std::vector<std::shared_ptr<const ArchiveIndex>> archives;     // oldest month first
+    
+    std::string manifestPath() const {
+        return directory + "/manifest.txt";
+    }
+    
+    static bool loadIndex(const std::string& path, ArchiveIndex& index) {
+        std::ifstream in(path, std::ios::binary);
+        char prefix[5 + 8];
+        if (!in.read(prefix, sizeof(prefix)) || std::memcmp(prefix, kMagic, 4) != 0 ||
+            static_cast<unsigned char>(prefix[4]) != kVersion) {
+            return false;
+        }
+        
+        std::uint64_t headerLength = 0;
+        for (int i = 0; i < 8; ++i) {
+            headerLength |= static_cast<std::uint64_t>(static_cast<unsigned char>(prefix[5 + i])) << (8 * i);
+        }
+        std::string header(static_cast<size_t>(headerLength), '\0');
+        if (!in.read(&header[0], static_cast<std::streamsize>(headerLength))) {
+            return false;
+        }
+        
+        const char* p = header.data();
+        const char* end = p + header.size();
+        std::uint64_t minId, maxId, dictionarySize, accountCount;
+        if (!getString(p, end, index.month) || !getVarint(p, end, index.rows) ||
+            !getVarint(p, end, minId) || !getVarint(p, end, maxId) ||
+            !getVarint(p, end, index.outOfMonthRows) || !getVarint(p, end, dictionarySize)) {
+            return false;
+        }
+        index.minTransactionId = unzigzag(minId);
+        index.maxTransactionId = unzigzag(maxId);
+        
+        index.dictionary.resize(static_cast<size_t>(dictionarySize));
+        for (auto& entry : index.dictionary) {
+            if (!getString(p, end, entry)) {
+                return false;
+            }
+        }
+        
+        if (!getVarint(p, end, accountCount)) {
+            return false;
+        }
+        std::int64_t accountId = 0;
+        std::uint64_t offset = 0;
+        for (std::uint64_t i = 0; i < accountCount; ++i) {
+            std::uint64_t delta, rows, net, length;
+            if (!getVarint(p, end, delta) || !getVarint(p, end, rows) ||
+                !getVarint(p, end, net) || !getVarint(p, end, length)) {
+                return false;
+            }
+            accountId += unzigzag(delta);
+            index.accounts[static_cast<int>(accountId)] = { offset, length, rows, unzigzag(net) };
+            index.accountOrder.push_back(static_cast<int>(accountId));
+            offset += length;
+        }
+        
+        index.path = path;
+        index.dataOffset = sizeof(prefix) + headerLength;
+        return true;
+    }
+    
+    void ensureLoaded() {
+        if (loaded) {
+            return;
+        }
+        loaded = true;
+        
+        std::ifstream manifest(manifestPath());
+        std::string month;
+        while (std::getline(manifest, month)) {
+            auto index = std::make_shared<ArchiveIndex>();
+            if (!month.empty() && loadIndex(pathFor(month), *index)) {
+                archives.push_back(index);
+            } else if (!month.empty()) {
+                std::cerr << "Unreadable transaction archive for " << month << std::endl;
+            }
+        }
+    }
+    
+    std::vector<std::shared_ptr<const ArchiveIndex>> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ensureLoaded();
+        return archives;
+    }
+    
+    static bool readBlock(const ArchiveIndex& index, int accountId, const AccountBlock& block,
+                          const std::function<bool(const Transaction&)>& visit, bool& stopped) {
+        std::string data(static_cast<size_t>(block.length), '\0');
+        std::ifstream in(index.path, std::ios::binary);
+        in.seekg(static_cast<std::streamoff>(index.dataOffset + block.offset));
+        if (!in.read(&data[0], static_cast<std::streamsize>(block.length))) {
+            return false;
+        }
+        
+        size_t rows = static_cast<size_t>(block.rows);
+        std::vector<std::int64_t> columns[5];
+        const char* p = data.data();
+        const char* end = p + data.size();
+        for (int column = 0; column < 5; ++column) {
+            columns[column].resize(rows);
+            std::int64_t previous = 0;
+            for (size_t row = 0; row < rows; ++row) {
+                std::uint64_t raw;
+                if (!getVarint(p, end, raw)) {
+                    return false;
+                }
+                // ids and times are deltas; types, amounts and descriptions are not
+                if (column <= 1) {
+                    previous += unzigzag(raw);
+                    columns[column][row] = previous;
+                } else {
+                    columns[column][row] = column == 3 ? unzigzag(raw) : static_cast<std::int64_t>(raw);
+                }
+            }
+        }
+        
+        Transaction transaction;
+        for (size_t row = 0; row < rows; ++row) {
+            if (static_cast<size_t>(columns[2][row]) >= index.dictionary.size() ||
+                static_cast<size_t>(columns[4][row]) >= index.dictionary.size()) {
+                return false;
+            }
+            transaction.setId(static_cast<int>(columns[0][row]));
+            transaction.setAccountId(accountId);
+            transaction.setDateTime(decodeTime(index.month, columns[1][row], index.dictionary));
+            transaction.setType(index.dictionary[columns[2][row]]);
+            transaction.setAmount(columns[3][row] / 100.0);
+            transaction.setDescription(index.dictionary[columns[4][row]]);
+            if (!visit(transaction)) {
+                stopped = true;
+                return true;
+            }
+        }
+        
+        return true;
+    }
+    
+public:
+    ArchiveStore(const std::string& directory) : directory(directory), loaded(false) {}
+    
+    const std::string& getDirectory() const { return directory; }
+    
+    std::string pathFor(const std::string& month) const {
+        return directory + "/transactions_" + month.substr(0, 4) + month.substr(5, 2) + ".bmsa";
+    }
+    
+    bool ensureDirectory() const {
+#ifdef _WIN32
+        int status = _mkdir(directory.c_str());
+#else
+        int status = ::mkdir(directory.c_str(), 0755);
+#endif
+        return status == 0 || errno == EEXIST;
+    }
+    
+    // Adds a freshly written file after checking it reads back with the expected row count
+    bool registerArchive(const std::string& month, std::uint64_t expectedRows) {
+        auto index = std::make_shared<ArchiveIndex>();
+        if (!loadIndex(pathFor(month), *index) || index->rows != expectedRows || index->month != month) {
+            return false;
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        ensureLoaded();
+        for (const auto& archive : archives) {
+            if (archive->month == month) {
+                return true;
+            }
+        }
+        
+        std::ofstream manifest(manifestPath(), std::ios::app);
+        if (!(manifest << month << '\n')) {
+            return false;
+        }
+        archives.push_back(index);
+        std::sort(archives.begin(), archives.end(),
+                  [](const std::shared_ptr<const ArchiveIndex>& a, const std::shared_ptr<const ArchiveIndex>& b) {
+                      return a->month < b->month;
+                  });
+        return true;
+    }
+    
+    bool isArchived(const std::string& month) {
+        for (const auto& archive : snapshot()) {
+            if (archive->month == month) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Start of live history ("YYYY-MM-01"); empty when nothing is archived
+    std::string horizon() {
+        auto current = snapshot();
+        std::string next;
+        if (current.empty() || !shiftMonth(current.back()->month, 1, next)) {
+            return std::string();
+        }
+        return next + "-01";
+    }
+    
+    // Visits an account's archived rows, oldest month first; visit returns false to stop
+    bool forEachAccountEntry(int accountId, const std::function<bool(const Transaction&)>& visit) {
+        bool stopped = false;
+        for (const auto& archive : snapshot()) {
+            auto block = archive->accounts.find(accountId);
+            if (block == archive->accounts.end()) {
+                continue;
+            }
+            if (!readBlock(*archive, accountId, block->second, visit, stopped)) {
+                std::cerr << "Corrupt transaction archive " << archive->path << std::endl;
+                return false;
+            }
+            if (stopped) {
+                break;
+            }
+        }
+        return true;
+    }
+    
+    bool forEach(const std::function<bool(const Transaction&)>& visit) {
+        bool stopped = false;
+        for (const auto& archive : snapshot()) {
+            for (int accountId : archive->accountOrder) {
+                if (!readBlock(*archive, accountId, archive->accounts.at(accountId), visit, stopped)) {
+                    std::cerr << "Corrupt transaction archive " << archive->path << std::endl;
+                    return false;
+                }
+                if (stopped) {
+                    return true;
+                }
+            }
+        }
+        return true;
+    }
+    
+    bool findTransaction(int transactionId, Transaction& found) {
+        bool matched = false;
+        for (const auto& archive : snapshot()) {
+            if (transactionId < archive->minTransactionId || transactionId > archive->maxTransactionId) {
+                continue;
+            }
+            
+            for (int accountId : archive->accountOrder) {
+                bool stopped = false;
+                readBlock(*archive, accountId, archive->accounts.at(accountId),
+                          [&](const Transaction& transaction) {
+                              if (transaction.getId() != transactionId) {
+                                  return true;
+                              }
+                              found = transaction;
+                              matched = true;
+                              return false;
+                          }, stopped);
+                if (matched) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    
+    // Net archived movement of an account, in cents, from the block index alone
+    long long accountNetCents(int accountId) {
+        long long net = 0;
+        for (const auto& archive : snapshot()) {
+            auto block = archive->accounts.find(accountId);
+            if (block != archive->accounts.end()) {
+                net += block->second.netCents;
+            }
+        }
+        return net;
+    }
+    
+    // Net archived movement of an account, in cents, over its rows with
+    // firstId <= transaction_id <= lastId and after < date_time <= until; an
+    // empty after or until leaves that end open. Months outside both ranges
+    // are skipped on the index alone, and blocks wholly inside them use their
+    // stored net, so only the blocks at the edges of the range are read.
+    long long accountNetCentsBetween(int accountId, std::int64_t firstId, std::int64_t lastId,
+                                     const std::string& after, const std::string& until) {
+        long long net = 0;
+        std::string afterMonth = after.substr(0, 7);
+        std::string untilMonth = until.substr(0, 7);
+        
+        for (const auto& archive : snapshot()) {
+            auto block = archive->accounts.find(accountId);
+            if (block == archive->accounts.end() ||
+                archive->maxTransactionId < firstId || archive->minTransactionId > lastId) {
+                continue;
+            }
+            bool inMonth = archive->outOfMonthRows == 0;
+            if (inMonth && ((!after.empty() && archive->month < afterMonth) ||
+                            (!until.empty() && archive->month > untilMonth))) {
+                continue;
+            }
+            if (inMonth && archive->minTransactionId >= firstId && archive->maxTransactionId <= lastId &&
+                (after.empty() || archive->month > afterMonth) && (until.empty() || archive->month < untilMonth)) {
+                net += block->second.netCents;
+                continue;
+            }
+            
+            bool stopped = false;
+            readBlock(*archive, accountId, block->second, [&](const Transaction& transaction) {
+                const std::string& dateTime = transaction.getDateTime();
+                if (transaction.getId() >= firstId && transaction.getId() <= lastId &&
+                    (after.empty() || dateTime > after) && (until.empty() || dateTime <= until)) {
+                    net += ledgerDirection(transaction.getType()) *
+                           static_cast<long long>(std::llround(transaction.getAmount() * 100));
+                }
+                return true;
+            }, stopped);
+        }
+        return net;
+    }
+};
+
+// One row of account_daily_rollups
+struct DailyRollup {
+    int accountId;
+    std::string day;                 // YYYY-MM-DD
+    double openingBalance;
+    double closingBalance;
+    int transactionCount;
+    double depositTotal;
+    double withdrawalTotal;
+    double transferInTotal;
+    double transferOutTotal;
+};
+
+// One side of a transfer between database shards (see DistributedAccountService)
+struct CrossShardTransfer {
+    std::string transferId;
+    int fromAccountId;
+    int toAccountId;
+    double amount;
+    std::string state;               // pending, completed or reversed at the source; credited at the destination
+    std::string createdAt;
+};
+
+// Outcome of one step of a cross-shard transfer on its shard
+enum class TransferLeg {
+    Applied,      // booked now or by an earlier attempt
+    Refused,      // the shard answered and will not book it
+    Unreachable   // no answer; the step may be retried
+};
+
+// Transaction Repository
+class TransactionRepository : public IRepository<Transaction> {
+private:
+    std::shared_ptr<IDatabase> db;
+    
+    // Per-account rollup history, loaded on first read and dropped on every write
+    bool cacheRollups;
+    // Ledger rows between balance checkpoints of one account
+    int checkpointInterval;
+    // Months moved out of the live table; reads fall through to it when set
+    std::shared_ptr<ArchiveStore> archive;
+    std::mutex rollupCacheMutex;
+    std::unordered_map<int, std::vector<DailyRollup>> rollupCache;
+    
+    std::vector<DailyRollup> loadRollups(int accountId) {
+        std::vector<std::vector<std::string>> results;
+        std::vector<DailyRollup> rollups;
+        
+        std::string query = "SELECT account_id, day, opening_balance, closing_balance, transaction_count, "
+            "deposit_total, withdrawal_total, transfer_in_total, transfer_out_total "
+            "FROM account_daily_rollups WHERE account_id=" + std::to_string(accountId) + " ORDER BY day";
+        
+        if (db->executeQuery(query, results)) {
+            for (const auto& row : results) {
+                rollups.push_back({
+                    std::stoi(row[0]),         // account_id
+                    row[1],                    // day
+                    std::stod(row[2]),         // opening_balance
+                    std::stod(row[3]),         // closing_balance
+                    std::stoi(row[4]),         // transaction_count
+                    std::stod(row[5]),         // deposit_total
+                    std::stod(row[6]),         // withdrawal_total
+                    std::stod(row[7]),         // transfer_in_total
+                    std::stod(row[8])          // transfer_out_total
+                });
+            }
+        }
+        
+        return rollups;
+    }
+    
+public:
+    TransactionRepository(std::shared_ptr<IDatabase> db, bool cacheRollups = true, int checkpointInterval = 256,
+                          std::shared_ptr<ArchiveStore> archive = nullptr)
+        : db(db), cacheRollups(cacheRollups), checkpointInterval(checkpointInterval), archive(archive) {}
+    
+    // Records a ledger row that does not move the balance, keeping the day's rollup in step
+    bool add(const Transaction& transaction) override {
+        std::string query = "INSERT INTO transactions (account_id, type, amount, date_time, description) VALUES (" +
+            std::to_string(transaction.getAccountId()) + ", '" + 
+            sqlEscape(transaction.getType()) + "', " +
+            std::to_string(transaction.getAmount()) + ", '" +
+            sqlEscape(transaction.getDateTime()) + "', '" +
+            sqlEscape(transaction.getDescription()) + "')";
+        std::vector<std::vector<std::vector<std::string>>> results;
+        
+        bool ok = db->executeBatch({
+            "START TRANSACTION",
+            query,
+            rollupStatement(transaction, "1 = 1", false),
+            "COMMIT"
+        }, results);
+        
+        invalidateRollups(transaction.getAccountId());
+        return ok;
+    }
+    
+    // Upserts the (account, day) rollup for a ledger row inside a batch. When
+    // balanceMoved is set the account row already carries the new balance, so
+    // the day's opening balance is the balance before this movement.
+    std::string rollupStatement(const Transaction& transaction, const std::string& condition,
+                                bool balanceMoved) const {
+        const std::string& type = transaction.getType();
+        std::string amount = std::to_string(transaction.getAmount());
+        std::string delta = balanceMoved
+            ? std::to_string(ledgerDirection(type) * transaction.getAmount())
+            : std::string("0");
+        auto totalFor = [&type, &amount](const char* totalType) {
+            return type == totalType ? amount : std::string("0");
+        };
+        
+        return "INSERT INTO account_daily_rollups (account_id, day, opening_balance, closing_balance, "
+            "transaction_count, deposit_total, withdrawal_total, transfer_in_total, transfer_out_total) "
+            "SELECT account_id, '" + sqlEscape(transaction.getDateTime().substr(0, Clock::kDateLength)) + "', "
+            "balance - (" + delta + "), balance, 1, " +
+            totalFor("Deposit") + ", " + totalFor("Withdrawal") + ", " +
+            totalFor("Transfer In") + ", " + totalFor("Transfer Out") +
+            " FROM accounts WHERE account_id=" + std::to_string(transaction.getAccountId()) +
+            " AND " + condition +
+            " ON DUPLICATE KEY UPDATE closing_balance = VALUES(closing_balance),"
+            " transaction_count = transaction_count + 1,"
+            " deposit_total = deposit_total + VALUES(deposit_total),"
+            " withdrawal_total = withdrawal_total + VALUES(withdrawal_total),"
+            " transfer_in_total = transfer_in_total + VALUES(transfer_in_total),"
+            " transfer_out_total = transfer_out_total + VALUES(transfer_out_total)";
+    }
+    
+    // Must directly follow insertStatement in a batch: once checkpointInterval rows
+    // have accumulated since the account's last checkpoint, stores the balance
+    // after the row just inserted (LAST_INSERT_ID()).
+    std::string checkpointStatement(const Transaction& transaction, const std::string& condition) const {
+        std::string accountId = std::to_string(transaction.getAccountId());
+        
+        return "INSERT INTO balance_checkpoints (account_id, transaction_id, date_time, balance_after) "
+            "SELECT a.account_id, LAST_INSERT_ID(), '" + sqlEscape(transaction.getDateTime()) + "', a.balance "
+            "FROM accounts a WHERE a.account_id=" + accountId + " AND " + condition +
+            " AND (SELECT COUNT(*) FROM transactions t WHERE t.account_id=" + accountId +
+            " AND t.transaction_id > COALESCE((SELECT MAX(c.transaction_id) FROM balance_checkpoints c"
+            " WHERE c.account_id=" + accountId + "), 0)) >= " + std::to_string(checkpointInterval);
+    }
+    
+    // getBalanceAsOf before the archive horizon, where every row up to the
+    // timestamp is on disk. Checkpoints are never archived, so the same replay
+    // from the nearest checkpoint works over the archived blocks instead.
+    bool getArchivedBalanceAsOf(int accountId, const std::string& timestamp, double& balance) {
+        std::vector<std::vector<std::string>> results;
+        std::string account = std::to_string(accountId);
+        std::string at = "'" + sqlEscape(timestamp) + "'";
+        const std::int64_t anyId = std::numeric_limits<std::int64_t>::max();
+        
+        // Forward replay from an earlier checkpoint
+        if (!db->executeQuery("SELECT transaction_id, balance_after FROM balance_checkpoints WHERE account_id=" +
+                              account + " AND date_time <= " + at +
+                              " ORDER BY date_time DESC, transaction_id DESC LIMIT 1", results)) {
+            return false;
+        }
+        if (!results.empty()) {
+            long long cents = std::llround(std::stod(results[0][1]) * 100) +
+                archive->accountNetCentsBetween(accountId, std::stoll(results[0][0]) + 1, anyId, "", timestamp);
+            balance = cents / 100.0;
+            return true;
+        }
+        
+        // Backward replay from a later checkpoint, which may already be live;
+        // the live rows up to it all lie after the timestamp
+        std::string signedAmount =
+            "COALESCE(SUM(CASE WHEN type IN ('Deposit', 'Transfer In') THEN amount "
+            "WHEN type IN ('Withdrawal', 'Transfer Out') THEN -amount ELSE 0 END), 0)";
+        if (!db->executeQuery("SELECT transaction_id, balance_after FROM balance_checkpoints WHERE account_id=" +
+                              account + " AND date_time > " + at +
+                              " ORDER BY date_time, transaction_id LIMIT 1", results)) {
+            return false;
+        }
+        std::string live = "SELECT a.balance, (SELECT " + signedAmount + " FROM transactions WHERE account_id=" +
+                           account + ") FROM accounts a WHERE a.account_id=" + account;
+        std::int64_t upTo = anyId;
+        long long cents = 0;
+        if (!results.empty()) {
+            upTo = std::stoll(results[0][0]);
+            cents = std::llround(std::stod(results[0][1]) * 100);
+            live = "SELECT 0, " + signedAmount + " FROM transactions WHERE account_id=" + account +
+                   " AND transaction_id <= " + results[0][0];
+        }
+        
+        // Without checkpoints the account is short: take the current balance back over every row after it
+        results.clear();
+        if (!db->executeQuery(live, results) || results.empty()) {
+            return false;
+        }
+        if (upTo == anyId) {
+            cents = std::llround(std::stod(results[0][0]) * 100);
+        }
+        cents -= std::llround(std::stod(results[0][1]) * 100) +
+                 archive->accountNetCentsBetween(accountId, 0, upTo, timestamp, "");
+        balance = cents / 100.0;
+        return true;
+    }
+    
+    // Balance at the given timestamp: the nearest checkpoint at or before it plus
+    // the rows since, else the nearest later checkpoint minus the rows in between,
+    // else the current balance minus everything after it
+    bool getBalanceAsOf(int accountId, const std::string& timestamp, double& balance) {
+        std::vector<std::vector<std::string>> results;
+        std::string account = std::to_string(accountId);
+        std::string at = "'" + sqlEscape(timestamp) + "'";
+        std::string signedAmount =
+            "COALESCE(SUM(CASE WHEN type IN ('Deposit', 'Transfer In') THEN amount "
+            "WHEN type IN ('Withdrawal', 'Transfer Out') THEN -amount ELSE 0 END), 0)";
+        
+        if (archive && timestamp < archive->horizon()) {
+            return getArchivedBalanceAsOf(accountId, timestamp, balance);
+        }
+        
+        // Forward replay from an earlier checkpoint
+        if (!db->executeQuery("SELECT transaction_id, balance_after FROM balance_checkpoints WHERE account_id=" +
+                              account + " AND date_time <= " + at +
+                              " ORDER BY date_time DESC, transaction_id DESC LIMIT 1", results)) {
+            return false;
+        }
+        if (!results.empty()) {
+            double checkpoint = std::stod(results[0][1]);
+            std::string since = results[0][0];
+            results.clear();
+            if (!db->executeQuery("SELECT " + signedAmount + " FROM transactions WHERE account_id=" + account +
+                                  " AND transaction_id > " + since + " AND date_time <= " + at, results) ||
+                results.empty()) {
+                return false;
+            }
+            balance = checkpoint + std::stod(results[0][0]);
+            return true;
+        }
+        
+        // Backward replay from a later checkpoint
+        if (!db->executeQuery("SELECT transaction_id, balance_after FROM balance_checkpoints WHERE account_id=" +
+                              account + " AND date_time > " + at +
+                              " ORDER BY date_time, transaction_id LIMIT 1", results)) {
+            return false;
+        }
+        if (!results.empty()) {
+            double checkpoint = std::stod(results[0][1]);
+            std::string upTo = results[0][0];
+            results.clear();
+            if (!db->executeQuery("SELECT " + signedAmount + " FROM transactions WHERE account_id=" + account +
+                                  " AND transaction_id <= " + upTo + " AND date_time > " + at, results) ||
+                results.empty()) {
+                return false;
+            }
+            balance = checkpoint - std::stod(results[0][0]);
+            return true;
+        }
+        
+        // No checkpoints yet: the account has fewer than checkpointInterval rows
+        if (!db->executeQuery("SELECT a.balance - (SELECT " + signedAmount + " FROM transactions "
+                              "WHERE account_id=" + account + " AND date_time > " + at + ") "
+                              "FROM accounts a WHERE a.account_id=" + account, results) ||
+            results.empty()) {
+            return false;
+        }
+        balance = std::stod(results[0][0]);
+        return true;
+    }
+    
+    // Daily history for [fromDay, toDay], both YYYY-MM-DD; days without activity have no row
+    std::vector<DailyRollup> getDailyRollups(int accountId, const std::string& fromDay, const std::string& toDay) {
+        std::vector<DailyRollup> history;
+        
+        if (cacheRollups) {
+            std::lock_guard<std::mutex> lock(rollupCacheMutex);
+            auto cached = rollupCache.find(accountId);
+            if (cached != rollupCache.end()) {
+                history = cached->second;
+            }
+        }
+        
+        if (history.empty()) {
+            history = loadRollups(accountId);
+            if (cacheRollups) {
+                std::lock_guard<std::mutex> lock(rollupCacheMutex);
+                rollupCache[accountId] = history;
+            }
+        }
+        
+        std::vector<DailyRollup> range;
+        for (const auto& rollup : history) {
+            if (rollup.day >= fromDay && rollup.day <= toDay) {
+                range.push_back(rollup);
+            }
+        }
+        
+        return range;
+    }
+    
+    void invalidateRollups(int accountId) {
+        if (cacheRollups) {
+            std::lock_guard<std::mutex> lock(rollupCacheMutex);
+            rollupCache.erase(accountId);
+        }
+    }
+    
+    // INSERT that only takes effect when condition holds, for use inside a batch
+    std::string insertStatement(const Transaction& transaction, const std::string& condition) const {
+        return "INSERT INTO transactions (account_id, type, amount, date_time, description) SELECT " +
+            std::to_string(transaction.getAccountId()) + ", '" +
+            sqlEscape(transaction.getType()) + "', " +
+            std::to_string(transaction.getAmount()) + ", '" +
+            sqlEscape(transaction.getDateTime()) + "', '" +
+            sqlEscape(transaction.getDescription()) + "' FROM DUAL WHERE " + condition;
+    }
+    
+    // Must directly follow insertStatement in a batch; ties the key to the row just inserted.
+    // Keys live in their own table because a partitioned table cannot enforce uniqueness on them.
+    std::string idempotencyKeyStatement(const std::string& idempotencyKey, const std::string& dateTime,
+                                        const std::string& condition) const {
+        return "INSERT INTO idempotency_keys (idempotency_key, transaction_id, created_at) SELECT '" +
+            sqlEscape(idempotencyKey) + "', LAST_INSERT_ID(), '" + sqlEscape(dateTime) +
+            "' FROM DUAL WHERE " + condition;
+    }
+    
+    // True when a ledger row was already written under this key
+    bool hasIdempotencyKey(const std::string& idempotencyKey) {
+        std::vector<std::vector<std::string>> results;
+        std::string query = "SELECT COUNT(*) FROM idempotency_keys WHERE idempotency_key='" +
+            sqlEscape(idempotencyKey) + "'";
+        
+        return db->executeQuery(query, results) && !results.empty() && results[0][0] != "0";
+    }
+    
+    // Records one side of a cross-shard transfer, for use inside a batch
+    std::string transferRecordStatement(const CrossShardTransfer& transfer, const std::string& condition) const {
+        return "INSERT INTO cross_shard_transfers (transfer_id, from_account_id, to_account_id, amount, state, "
+            "created_at) SELECT '" + sqlEscape(transfer.transferId) + "', " +
+            std::to_string(transfer.fromAccountId) + ", " +
+            std::to_string(transfer.toAccountId) + ", " +
+            std::to_string(transfer.amount) + ", '" +
+            sqlEscape(transfer.state) + "', '" +
+            sqlEscape(transfer.createdAt) + "' FROM DUAL WHERE " + condition;
+    }
+    
+    // Returns false when the query fails; found says whether the transfer is recorded here
+    bool getTransfer(const std::string& transferId, CrossShardTransfer& transfer, bool& found) {
+        std::vector<std::vector<std::string>> results;
+        std::string query = "SELECT transfer_id, from_account_id, to_account_id, amount, state, created_at "
+            "FROM cross_shard_transfers WHERE transfer_id='" + sqlEscape(transferId) + "'";
+        
+        if (!db->executeQuery(query, results)) {
+            return false;
+        }
+        
+        found = !results.empty();
+        if (found) {
+            const auto& row = results[0];
+            transfer = { row[0], std::stoi(row[1]), std::stoi(row[2]), std::stod(row[3]), row[4], row[5] };
+        }
+        return true;
+    }
+    
+    std::vector<CrossShardTransfer> getTransfersInState(const std::string& state) {
+        std::vector<std::vector<std::string>> results;
+        std::vector<CrossShardTransfer> transfers;
+        std::string query = "SELECT transfer_id, from_account_id, to_account_id, amount, state, created_at "
+            "FROM cross_shard_transfers WHERE state='" + sqlEscape(state) + "' ORDER BY created_at";
+        
+        if (db->executeQuery(query, results)) {
+            for (const auto& row : results) {
+                transfers.push_back({ row[0], std::stoi(row[1]), std::stoi(row[2]), std::stod(row[3]), row[4], row[5] });
+            }
+        }
+        
+        return transfers;
+    }
+    
+    // Moves a transfer from one state to the next; false unless it was in fromState
+    bool setTransferState(const std::string& transferId, const std::string& fromState, const std::string& toState) {
+        std::vector<std::vector<std::vector<std::string>>> results;
+        std::string query = "UPDATE cross_shard_transfers SET state='" + sqlEscape(toState) +
+            "' WHERE transfer_id='" + sqlEscape(transferId) + "' AND state='" + sqlEscape(fromState) + "'";
+        
+        return db->executeBatch({ query, "SELECT ROW_COUNT()" }, results) &&
+               !results[1].empty() && results[1][0][0] == "1";
+    }
+    
+    bool update(const Transaction& transaction) override {
+        std::string query = "UPDATE transactions SET account_id=" + 
+            std::to_string(transaction.getAccountId()) +
+            ", type='" + sqlEscape(transaction.getType()) +
+            "', amount=" + std::to_string(transaction.getAmount()) +
+            ", date_time='" + sqlEscape(transaction.getDateTime()) +
+            "', description='" + sqlEscape(transaction.getDescription()) +
+            "' WHERE transaction_id=" + std::to_string(transaction.getId());
+        
+        return db->executeQuery(query);
+    }
+    
+    bool remove(int id) override {
+        std::string query = "DELETE FROM transactions WHERE transaction_id=" + std::to_string(id);
+        return db->executeQuery(query);
+    }
+    
+    std::unique_ptr<Transaction> getById(int id) override {
+        std::string query = "SELECT * FROM transactions WHERE transaction_id=" + std::to_string(id);
+        std::vector<std::vector<std::string>> results;
+        
+        if (db->executeQuery(query, results) && !results.empty()) {
+            const auto& row = results[0];
+            return std::make_unique<Transaction>(
+                std::stoi(row[0]),         // id
+                std::stoi(row[1]),         // account_id
+                row[2],                    // type
+                std::stod(row[3]),         // amount
+                row[4],                    // date_time
+                row[5]                     // description
+            );
+        }
+        
+        Transaction archived;
+        if (archive && archive->findTransaction(id, archived)) {
+            return std::make_unique<Transaction>(archived);
+        }
+        
+        return nullptr;
+    }
+    
+    std::vector<std::unique_ptr<Transaction>> getAll() override {
+        std::string query = "SELECT * FROM transactions";
+        std::vector<std::vector<std::string>> results;
+        std::vector<std::unique_ptr<Transaction>> transactions;
+        
+        if (archive) {
+            archive->forEach([&transactions](const Transaction& transaction) {
+                transactions.push_back(std::make_unique<Transaction>(transaction));
+                return true;
+            });
+        }
+        
+        if (db->executeQuery(query, results)) {
+            for (const auto& row : results) {
+                transactions.push_back(std::make_unique<Transaction>(
+                    std::stoi(row[0]),         // id
+                    std::stoi(row[1]),         // account_id
+                    row[2],                    // type
+                    std::stod(row[3]),         // amount
+                    row[4],                    // date_time
+                    row[5]                     // description
+                ));
+            }
+        }
+        
+        return transactions;
+    }
+    
+    // Streams an account's ledger in posting order, archived months first
+    bool forEachByAccountId(int accountId, const std::function<bool(const Transaction&)>& visit) {
+        bool more = true;
+        if (archive && !archive->forEachAccountEntry(accountId, [&more, &visit](const Transaction& transaction) {
+                return more = visit(transaction);
+            })) {
+            return false;
+        }
+        if (!more) {
+            return true;
+        }
+        
+        Transaction transaction;
+        std::string query = "SELECT * FROM transactions WHERE account_id=" + std::to_string(accountId) +
+            " ORDER BY transaction_id";
+        
+        return db->streamQuery(query, [&transaction, &visit](const std::vector<std::string>& row) {
+            transaction.setId(std::stoi(row[0]));
+            transaction.setAccountId(std::stoi(row[1]));
+            transaction.setType(row[2]);
+            transaction.setAmount(std::stod(row[3]));
+            transaction.setDateTime(row[4]);
+            transaction.setDescription(row[5]);
+            return visit(transaction);
+        });
+    }
+    
+    // Keyset page of an account's ledger: rows with ids above afterId, in posting
+    // order, so each page is one index range scan however deep the client is
+    bool getPageByAccountId(int accountId, int afterId, size_t limit,
+                            std::vector<Transaction>& page, bool& more) {
+        page.clear();
+        more = false;
+        if (limit == 0) {
+            return true;
+        }
+        
+        if (archive && !archive->forEachAccountEntry(accountId, [&](const Transaction& transaction) {
+                if (transaction.getId() <= afterId) {
+                    return true;
+                }
+                if (page.size() == limit) {
+                    more = true;
+                    return false;
+                }
+                page.push_back(transaction);
+                return true;
+            })) {
+            return false;
+        }
+        if (more) {
+            return true;
+        }
+        if (!page.empty()) {
+            afterId = page.back().getId();
+        }
+        
+        // One extra row tells whether another page follows
+        std::string query = "SELECT * FROM transactions WHERE account_id=" + std::to_string(accountId) +
+            " AND transaction_id > " + std::to_string(afterId) +
+            " ORDER BY transaction_id LIMIT " + std::to_string(limit - page.size() + 1);
+        std::vector<std::vector<std::string>> results;
+        if (!db->executeQuery(query, results)) {
+            return false;
+        }
+        
+        for (const auto& row : results) {
+            if (page.size() == limit) {
+                more = true;
+                break;
+            }
+            page.emplace_back(std::stoi(row[0]), std::stoi(row[1]), row[2], std::stod(row[3]), row[4], row[5]);
+        }
+        return true;
+    }
+    
+    std::vector<std::unique_ptr<Transaction>> getByAccountId(int accountId) {
+        std::string query = "SELECT * FROM transactions WHERE account_id=" + std::to_string(accountId);
+        std::vector<std::vector<std::string>> results;
+        std::vector<std::unique_ptr<Transaction>> transactions;
+        
+        if (archive) {
+            archive->forEachAccountEntry(accountId, [&transactions](const Transaction& transaction) {
+                transactions.push_back(std::make_unique<Transaction>(transaction));
+                return true;
+            });
+        }
+        
+        if (db->executeQuery(query, results)) {
+            for (const auto& row : results) {
+                transactions.push_back(std::make_unique<Transaction>(
+                    std::stoi(row[0]),         // id
+                    std::stoi(row[1]),         // account_id
+                    row[2],                    // type
+                    std::stod(row[3]),         // amount
+                    row[4],                    // date_time
+                    row[5]                     // description
+                ));
+            }
+        }
+        
+        return transactions;
+    }
+};
+
+// Opt-in "hot account" mode for accounts that take a large share of credits,
+// such as merchant collection and payroll accounts. A credit to a hot account
+// goes to one of its sub-balance slots in account_balance_slots (one row per
+// slot and day, carrying that day's rollup totals) instead of the accounts
+// row, so concurrent credits seldom wait for the same row lock. The balance is
+// accounts.balance plus the slots. Folding moves the slots, and their rollup
+// totals, into the account; debits fold first, and HotAccountCompactor folds
+// periodically.
+class HotAccountRepository {
+private:
+    std::shared_ptr<IDatabase> db;
+    mutable std::shared_mutex mutex;
+    std::unordered_map<int, int> slotCounts;   // hot account id -> number of slots
+    std::atomic<bool> loaded;
+    
+public:
+    static const int kDefaultSlots = 16;
+    
+    explicit HotAccountRepository(std::shared_ptr<IDatabase> db) : db(db), loaded(false) {}
+    
+    // Re-reads hot_accounts, picking up accounts marked hot elsewhere
+    bool load() {
+        std::vector<std::vector<std::string>> results;
+        if (!db->executeQuery("SELECT account_id, slots FROM hot_accounts", results)) {
+            return false;
+        }
+        
+        std::unordered_map<int, int> counts;
+        for (const auto& row : results) {
+            counts[std::stoi(row[0])] = std::max(1, std::stoi(row[1]));
+        }
+        
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        slotCounts.swap(counts);
+        loaded = true;
+        return true;
+    }
+    
+    // Number of slots of a hot account, 0 for an ordinary one
+    int slotsOf(int accountId) {
+        if (!loaded) {
+            load();
+        }
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = slotCounts.find(accountId);
+        return it == slotCounts.end() ? 0 : it->second;
+    }
+    
+    bool enable(int accountId, int slots = kDefaultSlots) {
+        slots = std::max(1, slots);
+        std::string query = "INSERT INTO hot_accounts (account_id, slots) VALUES (" + std::to_string(accountId) +
+            ", " + std::to_string(slots) + ") ON DUPLICATE KEY UPDATE slots = VALUES(slots)";
+        
+        if (!db->executeQuery(query)) {
+            return false;
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        slotCounts[accountId] = slots;
+        return true;
+    }
+    
+    // Folds the slots one last time; the account takes plain credits again
+    bool disable(int accountId) {
+        std::vector<std::string> batch = { "START TRANSACTION" };
+        for (auto& statement : foldStatements(accountId)) {
+            batch.push_back(std::move(statement));
+        }
+        batch.push_back("DELETE FROM hot_accounts WHERE account_id=" + std::to_string(accountId));
+        batch.push_back("COMMIT");
+        
+        std::vector<std::vector<std::vector<std::string>>> results;
+        if (!db->executeBatch(batch, results)) {
+            return false;
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        slotCounts.erase(accountId);
+        return true;
+    }
+    
+    // Each thread keeps to its own slot, so up to `slots` threads never collide
+    static int pickSlot(int slots) {
+        static std::atomic<int> nextOrdinal(0);
+        thread_local int ordinal = nextOrdinal.fetch_add(1, std::memory_order_relaxed);
+        return ordinal % slots;
+    }
+    
+    // Credits one slot, for use as the balance statement of a batch. Affects one
+    // row when it creates the slot's row for the day and two when it adds to it.
+    std::string creditStatement(const Transaction& transaction, int slot) const {
+        const std::string& type = transaction.getType();
+        std::string amount = std::to_string(transaction.getAmount());
+        
+        return "INSERT INTO account_balance_slots (account_id, slot, day, balance, transaction_count, "
+            "deposit_total, transfer_in_total) VALUES (" + std::to_string(transaction.getAccountId()) + ", " +
+            std::to_string(slot) + ", '" + sqlEscape(transaction.getDateTime().substr(0, Clock::kDateLength)) +
+            "', " + amount + ", 1, " + (type == "Deposit" ? amount : std::string("0")) + ", " +
+            (type == "Transfer In" ? amount : std::string("0")) + ")"
+            " ON DUPLICATE KEY UPDATE balance = balance + VALUES(balance),"
+            " transaction_count = transaction_count + 1,"
+            " deposit_total = deposit_total + VALUES(deposit_total),"
+            " transfer_in_total = transfer_in_total + VALUES(transfer_in_total)";
+    }
+    
+    // Moves the slots into the account, for use inside a transaction. The slot
+    // rows are locked first, so credits landing meanwhile wait for the commit.
+    // Days are folded into the rollups in order; only credits reach slots and
+    // every debit folds first, so each day's closing balance comes out right.
+    std::vector<std::string> foldStatements(int accountId) const {
+        std::string account = std::to_string(accountId);
+        auto slotsThrough = [&account](const char* comparison) {
+            return "COALESCE((SELECT SUM(p.balance) FROM account_balance_slots p WHERE p.account_id=" + account +
+                " AND p.day " + comparison + " s.day), 0)";
+        };
+        
+        return {
+            "SELECT COALESCE(SUM(balance), 0) INTO @bms_fold FROM account_balance_slots "
+            "WHERE account_id=" + account + " FOR UPDATE",
+            "INSERT INTO account_daily_rollups (account_id, day, opening_balance, closing_balance, "
+            "transaction_count, deposit_total, withdrawal_total, transfer_in_total, transfer_out_total) "
+            "SELECT s.account_id, s.day, MAX(a.balance) + " + slotsThrough("<") + ", "
+            "MAX(a.balance) + " + slotsThrough("<=") + ", SUM(s.transaction_count), SUM(s.deposit_total), 0, "
+            "SUM(s.transfer_in_total), 0 FROM account_balance_slots s JOIN accounts a ON a.account_id = s.account_id "
+            "WHERE s.account_id=" + account + " GROUP BY s.account_id, s.day"
+            " ON DUPLICATE KEY UPDATE closing_balance = VALUES(closing_balance),"
+            " transaction_count = transaction_count + VALUES(transaction_count),"
+            " deposit_total = deposit_total + VALUES(deposit_total),"
+            " transfer_in_total = transfer_in_total + VALUES(transfer_in_total)",
+            "UPDATE accounts SET balance = balance + @bms_fold WHERE account_id=" + account,
+            "DELETE FROM account_balance_slots WHERE account_id=" + account
+        };
+    }
+    
+    bool fold(int accountId) {
+        std::vector<std::string> batch = { "START TRANSACTION" };
+        for (auto& statement : foldStatements(accountId)) {
+            batch.push_back(std::move(statement));
+        }
+        batch.push_back("COMMIT");
+        
+        std::vector<std::vector<std::vector<std::string>>> results;
+        return db->executeBatch(batch, results);
+    }
+    
+    // Accounts with slots waiting to be folded
+    std::vector<int> accountsWithSlots() {
+        std::vector<std::vector<std::string>> results;
+        std::vector<int> accounts;
+        
+        if (db->executeQuery("SELECT DISTINCT account_id FROM account_balance_slots", results)) {
+            for (const auto& row : results) {
+                accounts.push_back(std::stoi(row[0]));
+            }
+        }
+        return accounts;
+    }
+    
+    // The account row and its slots in one consistent read
+    bool getBalance(int accountId, double& balance) {
+        std::vector<std::vector<std::string>> results;
+        std::string query = "SELECT " + balanceExpression("a") + " FROM accounts a WHERE a.account_id=" +
+            std::to_string(accountId);
+        
+        if (!db->executeQuery(query, results) || results.empty()) {
+            return false;
+        }
+        balance = std::stod(results[0][0]);
+        return true;
+    }
+    
+    // SQL for an account's balance including slots not yet folded
+    static std::string balanceExpression(const std::string& accountAlias) {
+        return accountAlias + ".balance + COALESCE((SELECT SUM(hs.balance) FROM account_balance_slots hs "
+            "WHERE hs.account_id = " + accountAlias + ".account_id), 0)";
+    }
+};
+
+// Periodically folds the slots of hot accounts (see HotAccountRepository) so
+// that slot rows stay few, and reloads the set of hot accounts
+class HotAccountCompactor {
+private:
+    std::shared_ptr<HotAccountRepository> hotAccounts;
+    std::shared_ptr<TransactionRepository> transactionRepository;
+    std::chrono::milliseconds interval;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+    std::atomic<size_t> folds;
+    
+    void loop() {
+        ScopedPriority priority(RequestPriority::Batch);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, interval, [this] { return stopping; })) {
+            lock.unlock();
+            runOnce();
+            lock.lock();
+        }
+    }
+    
+public:
+    HotAccountCompactor(std::shared_ptr<HotAccountRepository> hotAccounts,
+                        std::shared_ptr<TransactionRepository> transactionRepository,
+                        std::chrono::milliseconds interval = std::chrono::milliseconds(1000))
+        : hotAccounts(hotAccounts), transactionRepository(transactionRepository), interval(interval),
+          stopping(false), folds(0) {}
+    
+    ~HotAccountCompactor() {
+        stop();
+    }
+    
+    // Returns the number of accounts folded
+    size_t runOnce() {
+        hotAccounts->load();
+        size_t folded = 0;
+        for (int accountId : hotAccounts->accountsWithSlots()) {
+            if (hotAccounts->fold(accountId)) {
+                transactionRepository->invalidateRollups(accountId);
+                folded++;
+            }
+        }
+        folds += folded;
+        return folded;
+    }
+    
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!worker.joinable()) {
+            stopping = false;
+            worker = std::thread(&HotAccountCompactor::loop, this);
+        }
+    }
+    
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    
+    size_t getFolds() const {
+        return folds;
+    }
+};
+
+// One account of a customer overview with its latest transactions, newest first
+struct AccountOverview {
+    AccountRecord account;
+    std::vector<Transaction> recentTransactions;
+};
+
+// A customer with all of their accounts, as shown on a customer details page
+struct CustomerOverview {
+    Customer customer;
+    std::vector<AccountOverview> accounts;
+    size_t recentLimit;     // transactions fetched per account
+    
+    CustomerOverview() : recentLimit(0) {}
+};
+
+// Loads a customer overview in one round trip of three set-based queries: the
+// customer, the accounts joined with their subtype tables, and the last N
+// transactions of every account through a LATERAL join that reads each
+// account's transactions index backwards. The work grows with the rows
+// returned, never with a query per account. Servers without LATERAL (MariaDB,
+// MySQL before 8.0.14) get a ROW_NUMBER() window query instead, which ranks
+// every transaction of the customer's accounts.
+class CustomerOverviewRepository {
+private:
+    std::shared_ptr<IDatabase> db;
+    std::shared_ptr<ArchiveStore> archive;
+    std::atomic<bool> lateralRejected;
+    
+    static std::string recentTransactionsQuery(const std::string& customerId, size_t limit, bool lateral) {
+        if (lateral) {
+            return "SELECT t.transaction_id, t.account_id, t.type, t.amount, t.date_time, t.description "
+                "FROM accounts a, LATERAL (SELECT transaction_id, account_id, type, amount, date_time, description "
+                "FROM transactions WHERE account_id = a.account_id "
+                "ORDER BY transaction_id DESC LIMIT " + std::to_string(limit) + ") t "
+                "WHERE a.customer_id=" + customerId + " ORDER BY t.account_id, t.transaction_id DESC";
+        }
+        return "SELECT transaction_id, account_id, type, amount, date_time, description FROM ("
+            "SELECT t.transaction_id, t.account_id, t.type, t.amount, t.date_time, t.description, "
+            "ROW_NUMBER() OVER (PARTITION BY t.account_id ORDER BY t.transaction_id DESC) AS recent_rank "
+            "FROM accounts a JOIN transactions t ON t.account_id = a.account_id "
+            "WHERE a.customer_id=" + customerId + ") r "
+            "WHERE recent_rank <= " + std::to_string(limit) + " ORDER BY account_id, transaction_id DESC";
+    }
+    
+    // Tops up accounts with fewer than limit live rows from the archive
+    void fillFromArchive(AccountOverview& overview, size_t limit) {
+        size_t missing = limit - overview.recentTransactions.size();
+        std::deque<Transaction> latest;
+        archive->forEachAccountEntry(overview.account.id, [&latest, missing](const Transaction& transaction) {
+            latest.push_back(transaction);
+            if (latest.size() > missing) {
+                latest.pop_front();
+            }
+            return true;
+        });
+        overview.recentTransactions.insert(overview.recentTransactions.end(), latest.rbegin(), latest.rend());
+    }
+    
+public:
+    CustomerOverviewRepository(std::shared_ptr<IDatabase> db, std::shared_ptr<ArchiveStore> archive = nullptr)
+        : db(db), archive(archive), lateralRejected(false) {}
+    
+    // found is false when the customer does not exist
+    bool load(int customerId, size_t recentLimit, CustomerOverview& overview, bool& found) {
+        std::string id = std::to_string(customerId);
+        std::vector<std::vector<std::vector<std::string>>> results;
+        std::vector<std::string> statements = {
+            "SELECT * FROM customers WHERE customer_id=" + id,
+            "SELECT a.account_id, a.customer_id, " + HotAccountRepository::balanceExpression("a") +
+            ", a.account_number, a.account_type, a.date_opened, s.interest_rate, c.overdraft_limit "
+            "FROM accounts a "
+            "LEFT JOIN savings_accounts s ON s.account_id = a.account_id "
+            "LEFT JOIN checking_accounts c ON c.account_id = a.account_id "
+            "WHERE a.customer_id=" + id + " ORDER BY a.account_id"
+        };
+        bool lateral = recentLimit > 0 && !lateralRejected;
+        if (recentLimit > 0) {
+            statements.push_back(recentTransactionsQuery(id, recentLimit, lateral));
+        }
+        
+        found = false;
+        bool loaded = db->executeBatch(statements, results);
+        if (!loaded && lateral) {
+            // Only switched for good once the window query works where LATERAL did not
+            statements.back() = recentTransactionsQuery(id, recentLimit, false);
+            loaded = db->executeBatch(statements, results);
+            if (loaded) {
+                lateralRejected = true;
+            }
+        }
+        if (!loaded) {
+            std::cerr << "Failed to load overview of customer " << customerId << std::endl;
+            return false;
+        }
+        if (results[0].empty()) {
+            return true;
+        }
+        
+        const auto& customerRow = results[0][0];
+        overview.customer = Customer(std::stoi(customerRow[0]), customerRow[1], customerRow[2],
+                                     customerRow[3], customerRow[4]);
+        overview.recentLimit = recentLimit;
+        overview.accounts.clear();
+        overview.accounts.reserve(results[1].size());
+        
+        std::unordered_map<int, size_t> positions;
+        for (const auto& row : results[1]) {
+            AccountKind kind = parseAccountKind(row[4]);
+            double extField = 0.0;
+            if (kind == AccountKind::Savings && row[6] != "NULL") {
+                extField = std::stod(row[6]);
+            } else if (kind == AccountKind::Checking && row[7] != "NULL") {
+                extField = std::stod(row[7]);
+            }
+            
+            AccountOverview account;
+            account.account = makeAccountRecord(std::stoi(row[0]), std::stoi(row[1]), std::stod(row[2]),
+                                                kind, row[3], row[5], extField, row[4]);
+            positions[account.account.id] = overview.accounts.size();
+            overview.accounts.push_back(std::move(account));
+        }
+        
+        if (recentLimit > 0) {
+            for (const auto& row : results[2]) {
+                auto position = positions.find(std::stoi(row[1]));
+                if (position != positions.end()) {
+                    overview.accounts[position->second].recentTransactions.emplace_back(
+                        std::stoi(row[0]), std::stoi(row[1]), row[2], std::stod(row[3]), row[4], row[5]);
+                }
+            }
+            if (archive) {
+                for (auto& account : overview.accounts) {
+                    if (account.recentTransactions.size() < recentLimit) {
+                        fillFromArchive(account, recentLimit);
+                    }
+                }
+            }
+        }
+        
+        found = true;
+        return true;
+    }
+};
+
+// Customer overviews kept between requests. An entry is dropped when a ledger
+// event touches one of its accounts (invalidateAccount), when the customer is
+// changed, or after ttl, which bounds how stale changes that publish no event,
+// such as opening an account, can be. A load that overlaps an invalidation of
+// the same customer is not kept.
+class CustomerOverviewCache : public IMetricsSource {
+private:
+    struct Entry {
+        std::shared_ptr<const CustomerOverview> overview;   // null while loading
+        std::uint64_t ticket;
+        std::chrono::steady_clock::time_point loadedAt;
+    };
+    
+    std::mutex mutex;
+    std::unordered_map<int, Entry> entries;
+    std::unordered_map<int, int> owners;    // account id -> customer id of cached entries
+    size_t capacity;
+    std::chrono::milliseconds ttl;
+    std::uint64_t nextTicket;
+    size_t loadsInFlight;
+    std::unordered_map<int, std::uint64_t> touched;    // account id -> ticket clock, kept while loading
+    std::atomic<size_t> hits;
+    std::atomic<size_t> misses;
+    
+    // Requires mutex
+    void erase(std::unordered_map<int, Entry>::iterator entry) {
+        if (entry->second.overview) {
+            for (const auto& account : entry->second.overview->accounts) {
+                owners.erase(account.account.id);
+            }
+        }
+        entries.erase(entry);
+    }
+    
+public:
+    CustomerOverviewCache(size_t capacity = 10000,
+                          std::chrono::milliseconds ttl = std::chrono::milliseconds(5000))
+        : capacity(capacity), ttl(ttl), nextTicket(1), loadsInFlight(0), hits(0), misses(0) {}
+    
+    // Copies out a fresh entry holding at least recentLimit transactions per account
+    bool get(int customerId, size_t recentLimit, CustomerOverview& overview) {
+        std::shared_ptr<const CustomerOverview> cached;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto entry = entries.find(customerId);
+            if (entry != entries.end() && entry->second.overview &&
+                std::chrono::steady_clock::now() - entry->second.loadedAt < ttl &&
+                entry->second.overview->recentLimit >= recentLimit) {
+                cached = entry->second.overview;
+            }
+        }
+        if (!cached) {
+            misses++;
+            return false;
+        }
+        
+        hits++;
+        overview.customer = cached->customer;
+        overview.recentLimit = recentLimit;
+        overview.accounts.clear();
+        overview.accounts.reserve(cached->accounts.size());
+        for (const auto& account : cached->accounts) {
+            AccountOverview copy;
+            copy.account = account.account;
+            size_t count = std::min(recentLimit, account.recentTransactions.size());
+            copy.recentTransactions.assign(account.recentTransactions.begin(),
+                                           account.recentTransactions.begin() + count);
+            overview.accounts.push_back(std::move(copy));
+        }
+        return true;
+    }
+    
+    // Call before reading the database and pass the ticket to finishLoad
+    std::uint64_t beginLoad(int customerId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto entry = entries.find(customerId);
+        if (entry != entries.end()) {
+            erase(entry);
+        } else if (entries.size() >= capacity && !entries.empty()) {
+            erase(entries.begin());
+        }
+        
+        Entry& loading = entries[customerId];
+        loading.ticket = nextTicket++;
+        loadsInFlight++;
+        return loading.ticket;
+    }
+    
+    // Stores the loaded overview unless it was invalidated meanwhile; loaded is
+    // null when the load failed
+    void finishLoad(int customerId, std::uint64_t ticket, const CustomerOverview* loaded) {
+        std::shared_ptr<const CustomerOverview> stored;
+        if (loaded) {
+            stored = std::make_shared<const CustomerOverview>(*loaded);
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        auto entry = entries.find(customerId);
+        bool current = entry != entries.end() && entry->second.ticket == ticket && !entry->second.overview;
+        if (current && stored) {
+            for (const auto& account : stored->accounts) {
+                auto touch = touched.find(account.account.id);
+                if (touch != touched.end() && touch->second > ticket) {
+                    stored.reset();
+                    break;
+                }
+            }
+        }
+        if (--loadsInFlight == 0) {
+            touched.clear();
+        }
+        if (!current) {
+            return;
+        }
+        if (!stored) {
+            entries.erase(entry);
+            return;
+        }
+        
+        entry->second.overview = stored;
+        entry->second.loadedAt = std::chrono::steady_clock::now();
+        for (const auto& account : stored->accounts) {
+            owners[account.account.id] = customerId;
+        }
+    }
+    
+    void invalidateCustomer(int customerId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto entry = entries.find(customerId);
+        if (entry != entries.end()) {
+            erase(entry);
+        }
+    }
+    
+    void invalidateAccount(int accountId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (loadsInFlight > 0) {
+            touched[accountId] = nextTicket++;
+        }
+        auto owner = owners.find(accountId);
+        if (owner == owners.end()) {
+            return;
+        }
+        auto entry = entries.find(owner->second);
+        if (entry != entries.end()) {
+            erase(entry);
+        } else {
+            owners.erase(owner);
+        }
+    }
+    
+    size_t getHits() const {
+        return hits;
+    }
+    
+    size_t getMisses() const {
+        return misses;
+    }
+    
+    void registerMetrics(MetricsRegistry& metrics, const std::string& labels) override {
+        std::string cacheLabels = MetricsRegistry::joinLabels(labels, "cache=\"customer_overview\"");
+        metrics.counterFunction("bank_cache_hits_total", "Cache lookups answered from memory", cacheLabels,
+                                [this] { return static_cast<double>(getHits()); });
+        metrics.counterFunction("bank_cache_misses_total", "Cache lookups that went to the database", cacheLabels,
+                                [this] { return static_cast<double>(getMisses()); });
+    }
+};
+
+// In-memory trigram index over customer name, email and phone. Slots are
+// append-only so posting lists stay sorted; updates and removals leave a
+// dead slot behind that is dropped when the index is compacted.
+class CustomerSearchIndex {
+private:
+    struct Entry {
+        Customer customer;
+        std::string key;  // normalised "name|email|phone digits|phone" used for matching
+        bool live;
+    };
+    
+    std::vector<Entry> entries;
+    std::unordered_map<int, std::uint32_t> slotById;
+    std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> postings;
+    size_t deadSlots;
+    bool loaded;
+    mutable std::shared_mutex mutex;
+    
+    static std::string lowercase(const std::string& value) {
+        std::string lowered(value);
+        for (auto& c : lowered) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        return lowered;
+    }
+    
+    static std::string digitsOnly(const std::string& value) {
+        std::string digits;
+        for (char c : value) {
+            if (std::isdigit(static_cast<unsigned char>(c))) {
+                digits += c;
+            }
+        }
+        return digits;
+    }
+    
+    // "555-0101" and "(555) 0101" should both find a phone stored as 5550101
+    static bool looksLikePhone(const std::string& query) {
+        bool hasDigit = false;
+        for (char c : query) {
+            if (std::isdigit(static_cast<unsigned char>(c))) {
+                hasDigit = true;
+            } else if (c != '+' && c != '-' && c != '(' && c != ')' && c != ' ' && c != '.') {
+                return false;
+            }
+        }
+        return hasDigit;
+    }
+    
+    static std::string normaliseQuery(const std::string& query) {
+        return looksLikePhone(query) ? digitsOnly(query) : lowercase(query);
+    }
+    
+    static std::string buildKey(const Customer& customer) {
+        return lowercase(customer.getName()) + '\x1f' + lowercase(customer.getEmail()) + '\x1f' +
+               digitsOnly(customer.getPhone()) + '\x1f' + lowercase(customer.getPhone());
+    }
+    
+    static std::uint32_t trigramCode(const std::string& text, size_t pos) {
+        return (static_cast<std::uint32_t>(static_cast<unsigned char>(text[pos])) << 16) |
+               (static_cast<std::uint32_t>(static_cast<unsigned char>(text[pos + 1])) << 8) |
+               static_cast<std::uint32_t>(static_cast<unsigned char>(text[pos + 2]));
+    }
+    
+    static std::vector<std::uint32_t> trigrams(const std::string& text) {
+        std::vector<std::uint32_t> codes;
+        for (size_t pos = 0; pos + 3 <= text.size(); pos++) {
+            codes.push_back(trigramCode(text, pos));
+        }
+        std::sort(codes.begin(), codes.end());
+        codes.erase(std::unique(codes.begin(), codes.end()), codes.end());
+        return codes;
+    }
+    
+    void insertLocked(const Customer& customer) {
+        auto existing = slotById.find(customer.getId());
+        if (existing != slotById.end()) {
+            entries[existing->second].live = false;
+            deadSlots++;
+        }
+        
+        std::uint32_t slot = static_cast<std::uint32_t>(entries.size());
+        Entry entry{ customer, buildKey(customer), true };
+        for (std::uint32_t code : trigrams(entry.key)) {
+            postings[code].push_back(slot);
+        }
+        entries.push_back(std::move(entry));
+        slotById[customer.getId()] = slot;
+    }
+    
+    void rebuildLocked(std::vector<Customer> customers) {
+        entries.clear();
+        slotById.clear();
+        postings.clear();
+        deadSlots = 0;
+        entries.reserve(customers.size());
+        for (const auto& customer : customers) {
+            insertLocked(customer);
+        }
+    }
+    
+    void compactIfNeededLocked() {
+        if (deadSlots < 1024 || deadSlots * 2 < entries.size()) {
+            return;
+        }
+        std::vector<Customer> live;
+        for (const auto& entry : entries) {
+            if (entry.live) {
+                live.push_back(entry.customer);
+            }
+        }
+        rebuildLocked(std::move(live));
+    }
+    
+public:
+    CustomerSearchIndex() : deadSlots(0), loaded(false) {}
+    
+    bool isLoaded() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return loaded;
+    }
+    
+    void rebuild(const std::vector<std::unique_ptr<Customer>>& customers) {
+        std::vector<Customer> copies;
+        copies.reserve(customers.size());
+        for (const auto& customer : customers) {
+            copies.push_back(*customer);
+        }
+        
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        rebuildLocked(std::move(copies));
+        loaded = true;
+    }
+    
+    void upsert(const Customer& customer) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        insertLocked(customer);
+        compactIfNeededLocked();
+    }
+    
+    void remove(int customerId) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto existing = slotById.find(customerId);
+        if (existing == slotById.end()) {
+            return;
+        }
+        entries[existing->second].live = false;
+        slotById.erase(existing);
+        deadSlots++;
+        compactIfNeededLocked();
+    }
+    
+    // Case-insensitive substring match on name, email or phone
+    std::vector<std::unique_ptr<Customer>> search(const std::string& query, size_t limit) const {
+        std::vector<std::unique_ptr<Customer>> matches;
+        std::string needle = normaliseQuery(query);
+        if (needle.empty() || limit == 0) {
+            return matches;
+        }
+        
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        
+        auto consider = [&](std::uint32_t slot) {
+            const Entry& entry = entries[slot];
+            if (entry.live && entry.key.find(needle) != std::string::npos) {
+                matches.push_back(std::make_unique<Customer>(entry.customer));
+            }
+            return matches.size() < limit;
+        };
+        
+        // Too short for a trigram: short queries match often, so a scan stops early
+        if (needle.size() < 3) {
+            for (std::uint32_t slot = 0; slot < entries.size(); slot++) {
+                if (!consider(slot)) {
+                    break;
+                }
+            }
+            return matches;
+        }
+        
+        std::vector<const std::vector<std::uint32_t>*> lists;
+        for (std::uint32_t code : trigrams(needle)) {
+            auto posting = postings.find(code);
+            if (posting == postings.end()) {
+                return matches;
+            }
+            lists.push_back(&posting->second);
+        }
+        
+        // Walk the rarest list and probe the others
+        std::sort(lists.begin(), lists.end(),
+                  [](const std::vector<std::uint32_t>* a, const std::vector<std::uint32_t>* b) {
+                      return a->size() < b->size();
+                  });
+        
+        for (std::uint32_t slot : *lists[0]) {
+            bool inAll = true;
+            for (size_t i = 1; i < lists.size() && inAll; i++) {
+                inAll = std::binary_search(lists[i]->begin(), lists[i]->end(), slot);
+            }
+            if (inAll && !consider(slot)) {
+                break;
+            }
+        }
+        
+        return matches;
+    }
+    
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return slotById.size();
+    }
+};
+
+// Snowflake-style id generator: 41 bits of milliseconds since kEpochMs, 10 bits
+// of node id and 12 bits of sequence. Lock-free - each id costs one CAS. When
+// a millisecond's 4096 sequence numbers run out the generator borrows the next
+// millisecond instead of waiting, so ids stay unique and strictly increasing.
+class IdGenerator {
+private:
+    static const std::uint64_t kEpochMs = 1704067200000ULL;  // 2024-01-01 00:00:00 UTC
+    static const unsigned int kNodeBits = 10;
+    static const unsigned int kSequenceBits = 12;
+    static const std::uint64_t kSequenceMask = (1ULL << kSequenceBits) - 1;
+    
+    std::uint64_t nodeId;
+    std::atomic<std::uint64_t> lastState;  // (milliseconds << kSequenceBits) | sequence
+    
+    static std::uint64_t currentMillis() {
+        auto sinceEpoch = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        std::uint64_t now = static_cast<std::uint64_t>(sinceEpoch);
+        return now > kEpochMs ? now - kEpochMs : 0;
+    }
+    
+public:
+    static const unsigned int kMaxNodeId = (1U << kNodeBits) - 1;
+    
+    explicit IdGenerator(unsigned int nodeId = 0)
+        : nodeId(nodeId & kMaxNodeId), lastState(0) {}
+    
+    std::uint64_t nextId() {
+        std::uint64_t now = currentMillis();
+        std::uint64_t current = lastState.load(std::memory_order_relaxed);
+        std::uint64_t next;
+        
+        do {
+            next = (now > (current >> kSequenceBits)) ? (now << kSequenceBits) : current + 1;
+        } while (!lastState.compare_exchange_weak(current, next, std::memory_order_relaxed));
+        
+        std::uint64_t millis = next >> kSequenceBits;
+        return (millis << (kNodeBits + kSequenceBits)) | (nodeId << kSequenceBits) | (next & kSequenceMask);
+    }
+    
+    // Luhn check digit for a string of decimal digits
+    static char checkDigit(const std::string& digits) {
+        int sum = 0;
+        bool doubleIt = true;
+        
+        for (auto it = digits.rbegin(); it != digits.rend(); ++it) {
+            int digit = *it - '0';
+            if (doubleIt) {
+                digit *= 2;
+                if (digit > 9) {
+                    digit -= 9;
+                }
+            }
+            sum += digit;
+            doubleIt = !doubleIt;
+        }
+        
+        return static_cast<char>('0' + (10 - sum % 10) % 10);
+    }
+    
+    static bool isValidAccountNumber(const std::string& accountNumber) {
+        if (accountNumber.size() < 2) {
+            return false;
+        }
+        for (char c : accountNumber) {
+            if (!std::isdigit(static_cast<unsigned char>(c))) {
+                return false;
+            }
+        }
+        std::string body = accountNumber.substr(0, accountNumber.size() - 1);
+        return checkDigit(body) == accountNumber.back();
+    }
+    
+    // At most 19 digits plus the check digit - fits accounts.account_number VARCHAR(20)
+    std::string nextAccountNumber() {
+        std::string body = std::to_string(nextId());
+        return body + checkDigit(body);
+    }
+};
+
+// Remembers the outcome of keyed money movements for a limited time so that
+// retries are answered without touching the database. Concurrent callers with
+// the same key wait for the first one to finish.
+class IdempotencyCache {
+public:
+    enum class Claim {
+        Acquired,   // caller must run the operation, then complete() or release()
+        Completed   // result holds the original outcome
+    };
+    
+private:
+    struct Entry {
+        bool done;
+        bool result;
+        std::chrono::steady_clock::time_point expires;
+    };
+    
+    struct Shard {
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::unordered_map<std::string, Entry> entries;
+        size_t completionsSinceSweep = 0;
+    };
+    
+    static const size_t kSweepEvery = 1024;
+    
+    std::chrono::milliseconds ttl;
+    std::vector<std::unique_ptr<Shard>> shards;
+    
+    Shard& shardFor(const std::string& key) {
+        return *shards[std::hash<std::string>()(key) % shards.size()];
+    }
+    
+    static void sweep(Shard& shard, std::chrono::steady_clock::time_point now) {
+        for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+            if (it->second.done && it->second.expires <= now) {
+                it = shard.entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        shard.completionsSinceSweep = 0;
+    }
+    
+public:
+    IdempotencyCache(std::chrono::milliseconds ttl = std::chrono::minutes(10), size_t shardCount = 16)
+        : ttl(ttl) {
+        for (size_t i = 0; i < std::max<size_t>(shardCount, 1); ++i) {
+            shards.push_back(std::unique_ptr<Shard>(new Shard()));
+        }
+    }
+    
+    Claim acquire(const std::string& key, bool& result) {
+        Shard& shard = shardFor(key);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        
+        while (true) {
+            auto it = shard.entries.find(key);
+            if (it == shard.entries.end() ||
+                (it->second.done && it->second.expires <= std::chrono::steady_clock::now())) {
+                shard.entries[key] = { false, false, std::chrono::steady_clock::time_point() };
+                return Claim::Acquired;
+            }
+            
+            if (it->second.done) {
+                result = it->second.result;
+                return Claim::Completed;
+            }
+            
+            shard.changed.wait(lock);
+        }
+    }
+    
+    void complete(const std::string& key, bool result) {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto now = std::chrono::steady_clock::now();
+        
+        shard.entries[key] = { true, result, now + ttl };
+        if (++shard.completionsSinceSweep >= kSweepEvery) {
+            sweep(shard, now);
+        }
+        shard.changed.notify_all();
+    }
+    
+    // Forgets an acquired key whose outcome is unknown so a retry runs again
+    void release(const std::string& key) {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        
+        shard.entries.erase(key);
+        shard.changed.notify_all();
+    }
+    
+    size_t size() {
+        size_t total = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            total += shard->entries.size();
+        }
+        return total;
+    }
+};
+
+// Outcome of screening a ledger entry, ordered by severity
+enum class RuleAction {
+    Allow,
+    Flag,
+    Block
+};
+
+// Sliding-window limit on the count or total amount of one transaction type,
+// per account or per customer. It fires when the window total including the
+// entry being screened exceeds limit.
+struct VelocityRule {
+    enum class Scope { Account, Customer };
+    enum class Measure { Count, Amount };
+    
+    std::string name;
+    Scope scope;
+    std::string transactionType;    // empty matches every type
+    Measure measure;
+    std::chrono::seconds window;
+    double limit;
+    RuleAction action;
+};
+
+struct RuleDecision {
+    RuleAction action;
+    std::string rule;               // name of the most severe rule that fired
+    std::uint64_t reservation = 0;  // entry counted by the check, 0 when blocked
+    std::int64_t micros = 0;        // time the entry was counted at
+};
+
+struct VelocityStats {
+    std::uint64_t evaluated;
+    std::uint64_t flagged;
+    std::uint64_t blocked;
+    double averageMicros;
+};
+
+// Evaluates velocity rules in memory on the money movement path. Account
+// rules read a fixed ring of that account's latest entries; customer rules
+// read time-bucketed counters, so each check costs a bounded, small amount
+// of work and never touches the database. The ring caps what an account
+// window can see: it holds the latest kRingSize (64) entries of every type,
+// so an account Count rule needs a limit below 64, and a window that saw
+// more entries than that (of any type) only counts or sums the latest 64.
+class VelocityRuleEngine : public IMetricsSource {
+private:
+    static constexpr size_t kRingSize = 64;  // account history kept per account
+    static const size_t kBuckets = 24;      // resolution of customer windows
+    static const size_t kShards = 16;
+    
+    struct Event {
+        std::int64_t micros;            // INT64_MIN once released
+        std::uint8_t type;
+        double amount;
+        std::uint64_t reservation;
+    };
+    
+    struct AccountWindow {
+        Event events[kRingSize];
+        size_t next = 0;
+        size_t size = 0;
+    };
+    
+    struct Bucket {
+        std::int64_t slot;
+        double count;
+        double amount;
+    };
+    
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<int, AccountWindow> accounts;
+        // Keyed by customer id and rule index
+        std::unordered_map<std::uint64_t, std::vector<Bucket>> customers;
+    };
+    
+    std::vector<VelocityRule> rules;
+    std::vector<std::uint8_t> ruleTypes;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<std::uint64_t> nextReservation;
+    
+    std::atomic<std::uint64_t> evaluated;
+    std::atomic<std::uint64_t> flagged;
+    std::atomic<std::uint64_t> blocked;
+    std::atomic<std::uint64_t> evaluationNanos;
+    
+    static std::uint8_t typeCode(const std::string& type) {
+        if (type.empty()) return 0;
+        if (type == "Deposit") return 1;
+        if (type == "Withdrawal") return 2;
+        if (type == "Transfer In") return 3;
+        if (type == "Transfer Out") return 4;
+        return 5;
+    }
+    
+    Shard& shardFor(int id) {
+        return *shards[static_cast<unsigned int>(id) % kShards];
+    }
+    
+    static std::uint64_t customerKey(int customerId, size_t ruleIndex) {
+        return (static_cast<std::uint64_t>(static_cast<unsigned int>(customerId)) << 16) | ruleIndex;
+    }
+    
+    static std::int64_t bucketWidth(const VelocityRule& rule) {
+        std::int64_t windowMicros = static_cast<std::int64_t>(rule.window.count()) * 1000000;
+        return std::max<std::int64_t>(windowMicros / static_cast<std::int64_t>(kBuckets), 1);
+    }
+    
+    // Caller holds the shard mutexes of accountId and customerId
+    double windowTotal(size_t ruleIndex, Shard& accountShard, Shard* customerShard, int accountId, int customerId,
+                       std::uint8_t type, std::int64_t now) {
+        const VelocityRule& rule = rules[ruleIndex];
+        bool counting = rule.measure == VelocityRule::Measure::Count;
+        double total = 0;
+        
+        if (rule.scope == VelocityRule::Scope::Account) {
+            std::int64_t since = now - static_cast<std::int64_t>(rule.window.count()) * 1000000;
+            auto it = accountShard.accounts.find(accountId);
+            if (it == accountShard.accounts.end()) {
+                return 0;
+            }
+            
+            const AccountWindow& window = it->second;
+            for (size_t i = 0; i < window.size; ++i) {
+                const Event& event = window.events[i];
+                if (event.micros > since && (ruleTypes[ruleIndex] == 0 || event.type == type)) {
+                    total += counting ? 1 : event.amount;
+                }
+            }
+        } else {
+            std::int64_t current = now / bucketWidth(rule);
+            auto it = customerShard->customers.find(customerKey(customerId, ruleIndex));
+            if (it == customerShard->customers.end()) {
+                return 0;
+            }
+            
+            for (const Bucket& bucket : it->second) {
+                if (bucket.slot > current - static_cast<std::int64_t>(kBuckets)) {
+                    total += counting ? bucket.count : bucket.amount;
+                }
+            }
+        }
+        
+        return total;
+    }
+    
+    // Adds (sign 1) or takes back (sign -1) an entry in the customer buckets of
+    // the matching rules; the caller holds the customer's shard mutex
+    void addToCustomer(Shard& shard, int customerId, std::uint8_t type, double amount,
+                       std::int64_t micros, int sign) {
+        for (size_t i = 0; i < rules.size(); ++i) {
+            if (rules[i].scope != VelocityRule::Scope::Customer || (ruleTypes[i] != 0 && ruleTypes[i] != type)) {
+                continue;
+            }
+            
+            std::vector<Bucket>& buckets = shard.customers[customerKey(customerId, i)];
+            if (buckets.empty()) {
+                buckets.assign(kBuckets, Bucket{ -1, 0, 0 });
+            }
+            
+            std::int64_t slot = micros / bucketWidth(rules[i]);
+            Bucket& bucket = buckets[static_cast<size_t>(slot % static_cast<std::int64_t>(kBuckets))];
+            if (bucket.slot != slot) {
+                if (sign < 0) {
+                    continue;   // the bucket has already rotated out of every window
+                }
+                bucket = { slot, 0, 0 };
+            }
+            bucket.count += sign;
+            bucket.amount += sign * amount;
+        }
+    }
+    
+public:
+    VelocityRuleEngine(std::vector<VelocityRule> rules = defaultRules())
+        : rules(std::move(rules)), nextReservation(1), evaluated(0), flagged(0), blocked(0), evaluationNanos(0) {
+        for (const auto& rule : this->rules) {
+            ruleTypes.push_back(typeCode(rule.transactionType));
+            if (rule.scope == VelocityRule::Scope::Account && rule.measure == VelocityRule::Measure::Count &&
+                rule.limit >= static_cast<double>(kRingSize)) {
+                std::cerr << "Velocity rule " << rule.name << " can never fire: account windows keep only the latest "
+                          << static_cast<unsigned int>(kRingSize) << " entries" << std::endl;
+            }
+        }
+        for (size_t i = 0; i < kShards; ++i) {
+            shards.push_back(std::unique_ptr<Shard>(new Shard()));
+        }
+    }
+    
+    static std::vector<VelocityRule> defaultRules() {
+        return {
+            { "withdrawals-per-account-10m", VelocityRule::Scope::Account, "Withdrawal",
+              VelocityRule::Measure::Count, std::chrono::minutes(10), 5, RuleAction::Block },
+            { "transfers-per-account-10m", VelocityRule::Scope::Account, "Transfer Out",
+              VelocityRule::Measure::Count, std::chrono::minutes(10), 10, RuleAction::Flag },
+            { "transfer-amount-per-customer-day", VelocityRule::Scope::Customer, "Transfer Out",
+              VelocityRule::Measure::Amount, std::chrono::hours(24), 10000, RuleAction::Flag },
+            { "withdrawal-amount-per-customer-day", VelocityRule::Scope::Customer, "Withdrawal",
+              VelocityRule::Measure::Amount, std::chrono::hours(24), 20000, RuleAction::Block }
+        };
+    }
+    
+    // Screens an entry before it is applied. Unless it is blocked, the entry is
+    // counted in the windows under the same locks, so concurrent checks against
+    // one account or customer see each other and cannot all pass a limit. The
+    // entry stays counted once applied; pass the decision to release() if the
+    // movement fails after all.
+    RuleDecision check(int accountId, int customerId, const std::string& type, double amount) {
+        auto started = std::chrono::steady_clock::now();
+        std::uint8_t code = typeCode(type);
+        std::int64_t now = Clock::epochMicros();
+        RuleDecision decision = { RuleAction::Allow, std::string() };
+        
+        Shard& accountShard = shardFor(accountId);
+        Shard* customerShard = customerId != 0 ? &shardFor(customerId) : nullptr;
+        std::unique_lock<std::mutex> accountLock(accountShard.mutex, std::defer_lock);
+        std::unique_lock<std::mutex> customerLock;
+        if (customerShard && customerShard != &accountShard) {
+            customerLock = std::unique_lock<std::mutex>(customerShard->mutex, std::defer_lock);
+            std::lock(accountLock, customerLock);
+        } else {
+            accountLock.lock();
+        }
+        
+        for (size_t i = 0; i < rules.size(); ++i) {
+            const VelocityRule& rule = rules[i];
+            if ((ruleTypes[i] != 0 && ruleTypes[i] != code) ||
+                (rule.scope == VelocityRule::Scope::Customer && customerId == 0) ||
+                rule.action <= decision.action) {
+                continue;
+            }
+            
+            double total = windowTotal(i, accountShard, customerShard, accountId, customerId, code, now) +
+                (rule.measure == VelocityRule::Measure::Count ? 1 : amount);
+            if (total > rule.limit) {
+                decision = { rule.action, rule.name };
+            }
+        }
+        
+        if (decision.action != RuleAction::Block) {
+            decision.reservation = nextReservation.fetch_add(1, std::memory_order_relaxed);
+            decision.micros = now;
+            AccountWindow& window = accountShard.accounts[accountId];
+            window.events[window.next] = { now, code, amount, decision.reservation };
+            window.next = (window.next + 1) % kRingSize;
+            window.size = std::min(window.size + 1, kRingSize);
+            if (customerShard) {
+                addToCustomer(*customerShard, customerId, code, amount, now, 1);
+            }
+        }
+        accountLock.unlock();
+        if (customerLock.owns_lock()) {
+            customerLock.unlock();
+        }
+        
+        evaluated.fetch_add(1, std::memory_order_relaxed);
+        if (decision.action == RuleAction::Flag) {
+            flagged.fetch_add(1, std::memory_order_relaxed);
+        } else if (decision.action == RuleAction::Block) {
+            blocked.fetch_add(1, std::memory_order_relaxed);
+        }
+        evaluationNanos.fetch_add(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started).count()), std::memory_order_relaxed);
+        
+        return decision;
+    }
+    
+    // Rolls back the entry check() counted for a movement that was not applied;
+    // arguments are the ones given to check()
+    void release(int accountId, int customerId, const std::string& type, double amount, const RuleDecision& decision) {
+        if (decision.reservation == 0) {
+            return;
+        }
+        
+        {
+            Shard& shard = shardFor(accountId);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.accounts.find(accountId);
+            if (it != shard.accounts.end()) {
+                // Not found when later entries have already pushed it out of the ring
+                for (size_t i = 0; i < it->second.size; ++i) {
+                    Event& event = it->second.events[i];
+                    if (event.reservation == decision.reservation) {
+                        event.micros = INT64_MIN;
+                        event.amount = 0;
+                        break;
+                    }
+                }
+            }
+        }
+        
+        if (customerId == 0) {
+            return;
+        }
+        
+        Shard& shard = shardFor(customerId);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        addToCustomer(shard, customerId, typeCode(type), amount, decision.micros, -1);
+    }
+    
+    VelocityStats stats() const {
+        std::uint64_t count = evaluated.load(std::memory_order_relaxed);
+        return {
+            count,
+            flagged.load(std::memory_order_relaxed),
+            blocked.load(std::memory_order_relaxed),
+            count == 0 ? 0.0 : evaluationNanos.load(std::memory_order_relaxed) / 1000.0 / count
+        };
+    }
+    
+    void report(std::ostream& out) const {
+        VelocityStats current = stats();
+        out << "\n------------ Velocity Rules ------------\n"
+            << "evaluated=" << current.evaluated
+            << ", flagged=" << current.flagged
+            << ", blocked=" << current.blocked
+            << ", avg check=" << std::fixed << std::setprecision(3) << current.averageMicros << " us\n";
+    }
+    
+    void registerMetrics(MetricsRegistry& metrics, const std::string& labels) override {
+        metrics.counterFunction("bank_velocity_checks_total", "Money movements checked against velocity rules",
+                                labels, [this] { return static_cast<double>(stats().evaluated); });
+        metrics.counterFunction("bank_velocity_flagged_total", "Money movements flagged by velocity rules",
+                                labels, [this] { return static_cast<double>(stats().flagged); });
+        metrics.counterFunction("bank_velocity_blocked_total", "Money movements blocked by velocity rules",
+                                labels, [this] { return static_cast<double>(stats().blocked); });
+    }
+};
+
+// One committed ledger row as seen by change-data-capture subscribers
+struct LedgerEvent {
+    std::uint64_t sequence = 0;
+    int transactionId = 0;
+    int accountId = 0;
+    int counterpartyAccountId = 0;      // other leg of a transfer, otherwise 0
+    std::string type;
+    long long amountCents = 0;
+    std::string dateTime;
+    std::string description;
+};
+
+// In-process change-data-capture stream of committed money movements, in the
+// style of the LMAX disruptor. Events live in a preallocated ring; publishers
+// claim sequence numbers with one atomic add and mark each slot published, and
+// every subscriber has its own cursor and thread, consuming whatever has been
+// published since its last batch. A publisher waits while the slowest
+// subscriber is a full ring behind, so slow consumers apply backpressure
+// instead of losing events. With a journal path every event is also appended
+// to a tab-separated tail file, and durable subscribers resume from the
+// sequence they last finished after a restart.
+class LedgerEventBus : public IMetricsSource {
+public:
+    // endOfBatch marks the last event currently available to the subscriber
+    using Handler = std::function<void(const LedgerEvent& event, bool endOfBatch)>;
+    
+private:
+    static const size_t kMaxSubscribers = 16;
+    static const size_t kMaxBatch = 256;
+    
+    struct Slot {
+        std::atomic<std::uint64_t> published{0};    // sequence + 1 once the slot holds that event
+        LedgerEvent event;
+    };
+    
+    struct Subscriber {
+        std::string name;
+        Handler handler;
+        std::string cursorFile;                     // durable subscribers only
+        alignas(64) std::atomic<std::uint64_t> cursor{0};   // next sequence to consume
+        std::thread thread;
+    };
+    
+    size_t capacity;
+    size_t mask;
+    std::unique_ptr<Slot[]> slots;
+    std::uint64_t firstSequence;
+    alignas(64) std::atomic<std::uint64_t> claimed;         // next sequence to hand out
+    alignas(64) std::atomic<std::uint64_t> gatingCache;     // a recent minimum of the cursors
+    
+    std::unique_ptr<Subscriber> subscribers[kMaxSubscribers];
+    std::atomic<size_t> subscriberCount;
+    std::mutex subscribeMutex;
+    std::atomic<bool> stopping;         // refuses new publishes and subscribers
+    std::atomic<int> publishing;        // publish calls past the stopping check
+    std::atomic<bool> closed;           // stopping and no publish left, so claimed is final
+    
+    std::mutex wakeMutex;
+    std::condition_variable wakeup;
+    std::atomic<int> sleepers;
+    
+    std::string journalPath;
+    std::ofstream journal;
+    
+    static void appendEscaped(std::string& line, const std::string& text) {
+        for (char c : text) {
+            switch (c) {
+                case '\t': line += "\\t"; break;
+                case '\n': line += "\\n"; break;
+                case '\r': line += "\\r"; break;
+                case '\\': line += "\\\\"; break;
+                default:   line += c;
+            }
+        }
+    }
+    
+    static std::string unescape(const std::string& text) {
+        std::string value;
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] != '\\' || i + 1 == text.size()) {
+                value += text[i];
+                continue;
+            }
+            char c = text[++i];
+            value += c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+        }
+        return value;
+    }
+    
+    static bool parseLine(const std::string& line, LedgerEvent& event) {
+        std::vector<std::string> fields;
+        size_t start = 0;
+        while (true) {
+            size_t tab = line.find('\t', start);
+            fields.push_back(line.substr(start, tab - start));
+            if (tab == std::string::npos) {
+                break;
+            }
+            start = tab + 1;
+        }
+        if (fields.size() != 8) {
+            return false;
+        }
+        
+        try {
+            event.sequence = std::stoull(fields[0]);
+            event.transactionId = std::stoi(fields[1]);
+            event.accountId = std::stoi(fields[2]);
+            event.counterpartyAccountId = std::stoi(fields[3]);
+            event.type = fields[4];
+            event.amountCents = std::stoll(fields[5]);
+        } catch (const std::exception&) {
+            return false;
+        }
+        event.dateTime = fields[6];
+        event.description = unescape(fields[7]);
+        return true;
+    }
+    
+    static bool readCursor(const std::string& path, std::uint64_t& cursor) {
+        std::ifstream in(path);
+        return static_cast<bool>(in >> cursor);
+    }
+    
+    static void writeCursor(const std::string& path, std::uint64_t cursor) {
+        std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::trunc);
+            out << cursor << "\n";
+        }
+        std::remove(path.c_str());
+        std::rename(temporary.c_str(), path.c_str());
+    }
+    
+    // Sequence after the last complete line of the journal; only its tail is read
+    static std::uint64_t journalEnd(const std::string& path) {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        std::string line;
+        std::streamoff size = in ? static_cast<std::streamoff>(in.tellg()) : 0;
+        in.seekg(std::max<std::streamoff>(0, size - 64 * 1024));
+        if (size > 64 * 1024) {
+            std::getline(in, line);     // partial line
+        }
+        LedgerEvent event;
+        std::uint64_t next = 0;
+        while (std::getline(in, line)) {
+            if (parseLine(line, event)) {
+                next = event.sequence + 1;
+            }
+        }
+        return next;
+    }
+    
+    std::uint64_t minimumCursor() const {
+        std::uint64_t minimum = claimed.load(std::memory_order_acquire);
+        size_t count = subscriberCount.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count; i++) {
+            minimum = std::min(minimum, subscribers[i]->cursor.load(std::memory_order_acquire));
+        }
+        return minimum;
+    }
+    
+    void waitForCapacity(std::uint64_t last) {
+        if (last < gatingCache.load(std::memory_order_acquire) + capacity) {
+            return;
+        }
+        
+        int spins = 0;
+        std::uint64_t gating;
+        while (last >= (gating = minimumCursor()) + capacity) {
+            if (++spins < 100) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+        gatingCache.store(gating, std::memory_order_release);
+    }
+    
+    // Replays journal lines from the subscriber's saved cursor up to the sequence
+    // the ring started at this run
+    void catchUp(Subscriber& subscriber) {
+        std::uint64_t resumeAt = 0;
+        if (!readCursor(subscriber.cursorFile, resumeAt) || resumeAt >= firstSequence) {
+            return;
+        }
+        
+        std::vector<LedgerEvent> pending;
+        auto deliver = [&subscriber, &pending](bool done) {
+            for (size_t i = 0; i < pending.size(); i++) {
+                subscriber.handler(pending[i], done && i + 1 == pending.size());
+            }
+            if (!pending.empty()) {
+                writeCursor(subscriber.cursorFile, pending.back().sequence + 1);
+            }
+            pending.clear();
+        };
+        
+        replay(resumeAt, [this, &pending, &deliver](const LedgerEvent& event) {
+            if (event.sequence >= firstSequence) {
+                return false;
+            }
+            pending.push_back(event);
+            if (pending.size() == kMaxBatch) {
+                deliver(false);
+            }
+            return true;
+        });
+        deliver(true);
+    }
+    
+    void consume(Subscriber& subscriber) {
+        if (!subscriber.cursorFile.empty()) {
+            catchUp(subscriber);
+        }
+        
+        std::uint64_t next = subscriber.cursor.load(std::memory_order_relaxed);
+        int idle = 0;
+        while (true) {
+            std::uint64_t available = next;
+            while (available - next < kMaxBatch &&
+                   slots[available & mask].published.load(std::memory_order_acquire) == available + 1) {
+                available++;
+            }
+            
+            if (available == next) {
+                if (closed.load(std::memory_order_acquire) && next == claimed.load(std::memory_order_acquire)) {
+                    return;
+                }
+                if (++idle < 64) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                sleepers.fetch_add(1);
+                {
+                    std::unique_lock<std::mutex> lock(wakeMutex);
+                    if (slots[next & mask].published.load(std::memory_order_acquire) != next + 1 &&
+                        !closed.load(std::memory_order_acquire)) {
+                        wakeup.wait_for(lock, std::chrono::milliseconds(1));
+                    }
+                }
+                sleepers.fetch_sub(1);
+                continue;
+            }
+            idle = 0;
+            
+            for (std::uint64_t sequence = next; sequence < available; sequence++) {
+                subscriber.handler(slots[sequence & mask].event, sequence + 1 == available);
+            }
+            next = available;
+            subscriber.cursor.store(next, std::memory_order_release);
+            if (!subscriber.cursorFile.empty()) {
+                writeCursor(subscriber.cursorFile, next);
+            }
+        }
+    }
+    
+    void writeJournal(const LedgerEvent& event, bool endOfBatch) {
+        std::string line;
+        line += std::to_string(event.sequence);
+        line += '\t';
+        line += std::to_string(event.transactionId);
+        line += '\t';
+        line += std::to_string(event.accountId);
+        line += '\t';
+        line += std::to_string(event.counterpartyAccountId);
+        line += '\t';
+        appendEscaped(line, event.type);
+        line += '\t';
+        line += std::to_string(event.amountCents);
+        line += '\t';
+        line += event.dateTime;
+        line += '\t';
+        appendEscaped(line, event.description);
+        line += '\n';
+        
+        journal << line;
+        if (endOfBatch) {
+            journal.flush();
+        }
+    }
+    
+    bool addSubscriber(const std::string& name, Handler handler, const std::string& cursorFile) {
+        std::lock_guard<std::mutex> lock(subscribeMutex);
+        size_t count = subscriberCount.load();
+        if (count == kMaxSubscribers || stopping) {
+            std::cerr << "Cannot add ledger event subscriber " << name << std::endl;
+            return false;
+        }
+        
+        std::unique_ptr<Subscriber> subscriber(new Subscriber());
+        subscriber->name = name;
+        subscriber->handler = std::move(handler);
+        subscriber->cursorFile = cursorFile;
+        subscriber->cursor.store(cursorFile.empty() ? claimed.load() : firstSequence);
+        
+        Subscriber* added = subscriber.get();
+        subscribers[count] = std::move(subscriber);
+        subscriberCount.store(count + 1, std::memory_order_release);
+        added->thread = std::thread(&LedgerEventBus::consume, this, std::ref(*added));
+        return true;
+    }
+    
+public:
+    // capacity is rounded up to a power of two
+    explicit LedgerEventBus(size_t requestedCapacity = 8192, const std::string& journalPath = "")
+        : capacity(1), firstSequence(0), claimed(0), gatingCache(0), subscriberCount(0), stopping(false),
+          publishing(0), closed(false), sleepers(0), journalPath(journalPath) {
+        while (capacity < std::max<size_t>(requestedCapacity, 2)) {
+            capacity <<= 1;
+        }
+        mask = capacity - 1;
+        slots.reset(new Slot[capacity]);
+        
+        if (!journalPath.empty()) {
+            firstSequence = journalEnd(journalPath);
+            claimed = firstSequence;
+            gatingCache = firstSequence;
+            journal.open(journalPath, std::ios::app | std::ios::binary);
+            if (!journal) {
+                std::cerr << "Cannot open ledger event journal " << journalPath << std::endl;
+            } else {
+                addSubscriber("journal", [this](const LedgerEvent& event, bool endOfBatch) {
+                    writeJournal(event, endOfBatch);
+                }, "");
+            }
+        }
+    }
+    
+    ~LedgerEventBus() {
+        stop();
+    }
+    
+    LedgerEventBus(const LedgerEventBus&) = delete;
+    LedgerEventBus& operator=(const LedgerEventBus&) = delete;
+    
+    // Receives events published from now on
+    bool subscribe(const std::string& name, Handler handler) {
+        return addSubscriber(name, std::move(handler), "");
+    }
+    
+    // Receives every journalled event it has not finished, then live events.
+    // Needs a journal; register durable subscribers before the first publish.
+    bool subscribeDurable(const std::string& name, Handler handler) {
+        if (journalPath.empty()) {
+            std::cerr << "Durable subscriber " << name << " needs a ledger event journal" << std::endl;
+            return false;
+        }
+        if (claimed.load() != firstSequence) {
+            std::cerr << "Durable subscriber " << name << " must subscribe before events are published" << std::endl;
+            return false;
+        }
+        return addSubscriber(name, std::move(handler), journalPath + "." + name + ".cursor");
+    }
+    
+    // Publishes events as consecutive sequences; blocks while the ring is full.
+    // Events published once stop() has begun are dropped.
+    void publish(const LedgerEvent* events, size_t count) {
+        if (count == 0) {
+            return;
+        }
+        // Announced before stopping is read: stop() either sees this call and
+        // waits for it, or this call sees stopping
+        publishing.fetch_add(1);
+        if (stopping.load()) {
+            publishing.fetch_sub(1);
+            return;
+        }
+        
+        std::uint64_t first = claimed.fetch_add(count, std::memory_order_acq_rel);
+        waitForCapacity(first + count - 1);
+        
+        for (size_t i = 0; i < count; i++) {
+            std::uint64_t sequence = first + i;
+            Slot& slot = slots[sequence & mask];
+            slot.event = events[i];
+            slot.event.sequence = sequence;
+            slot.published.store(sequence + 1, std::memory_order_release);
+        }
+        publishing.fetch_sub(1);
+        
+        if (sleepers.load() > 0) {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            wakeup.notify_all();
+        }
+    }
+    
+    // Reads the journal from a sequence on; visit returns false to stop
+    bool replay(std::uint64_t fromSequence, const std::function<bool(const LedgerEvent&)>& visit) const {
+        std::ifstream in(journalPath);
+        if (!in) {
+            return false;
+        }
+        std::string line;
+        LedgerEvent event;
+        while (std::getline(in, line)) {
+            if (parseLine(line, event) && event.sequence >= fromSequence && !visit(event)) {
+                break;
+            }
+        }
+        return true;
+    }
+    
+    // Lets subscribers drain everything already published, then joins them
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(subscribeMutex);
+            if (stopping.exchange(true)) {
+                return;
+            }
+        }
+        // Subscribers keep consuming meanwhile, so a publisher waiting for ring capacity gets it
+        while (publishing.load() > 0) {
+            std::this_thread::yield();
+        }
+        closed.store(true);
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            wakeup.notify_all();
+        }
+        size_t count = subscriberCount.load();
+        for (size_t i = 0; i < count; i++) {
+            subscribers[i]->thread.join();
+        }
+        if (journal.is_open()) {
+            journal.flush();
+        }
+    }
+    
+    std::uint64_t published() const {
+        return claimed.load() - firstSequence;
+    }
+    
+    void registerMetrics(MetricsRegistry& metrics, const std::string& labels) override {
+        metrics.counterFunction("bank_ledger_events_published_total", "Ledger events published on the event bus",
+                                labels, [this] { return static_cast<double>(published()); });
+    }
+    
+    void report(std::ostream& out) const {
+        std::uint64_t head = claimed.load();
+        out << "\n------------ Ledger Events ------------\n"
+            << "published=" << (head - firstSequence) << ", ring=" << capacity << "\n";
+        size_t count = subscriberCount.load();
+        for (size_t i = 0; i < count; i++) {
+            out << subscribers[i]->name << ": lag=" << (head - subscribers[i]->cursor.load()) << "\n";
+        }
+    }
+};
+
+// Service interfaces - Service Layer Pattern & Single Responsibility Principle
+class ICustomerService {
+public:
+    virtual ~ICustomerService() {}
+    virtual bool addCustomer(const Customer& customer) = 0;
+    virtual bool updateCustomer(const Customer& customer) = 0;
+    virtual bool removeCustomer(int customerId) = 0;
+    virtual std::unique_ptr<Customer> getCustomer(int customerId) = 0;
+    virtual std::vector<std::unique_ptr<Customer>> getAllCustomers() = 0;
+    virtual std::vector<std::unique_ptr<Customer>> searchCustomers(const std::string& query, size_t limit) = 0;
+    virtual bool forEachCustomer(const std::function<bool(const Customer&)>& visit) = 0;
+    // The customer, their accounts and the latest recentTransactions of each account;
+    // false when the customer does not exist or cannot be read
+    virtual bool getCustomerOverview(int customerId, size_t recentTransactions, CustomerOverview& overview) = 0;
+};
+
+class IAccountService {
+public:
+    virtual ~IAccountService() {}
+    // Assigns the account number (and opening date when empty) and stores the new id
+    virtual bool openAccount(Account& account) = 0;
+    virtual bool closeAccount(int accountId) = 0;
+    virtual bool deposit(int accountId, double amount) = 0;
+    virtual bool withdraw(int accountId, double amount) = 0;
+    virtual bool transfer(int fromAccountId, int toAccountId, double amount) = 0;
+    // Keyed variants: a repeated key returns the first call's result without
+    // applying the movement again; keys are at most 64 characters
+    virtual bool deposit(int accountId, double amount, const std::string& idempotencyKey) = 0;
+    virtual bool withdraw(int accountId, double amount, const std::string& idempotencyKey) = 0;
+    virtual bool transfer(int fromAccountId, int toAccountId, double amount,
+                          const std::string& idempotencyKey) = 0;
+    // Keyed transfer that tells a final refusal (insufficient funds, a rule,
+    // a missing account) from a failure worth retrying with the same key
+    virtual TransferLeg settleTransfer(int fromAccountId, int toAccountId, double amount,
+                                       const std::string& idempotencyKey) = 0;
+    virtual std::unique_ptr<Account> getAccount(int accountId) = 0;
+    // Sets found; false when the account's database could not be asked
+    virtual bool accountExists(int accountId, bool& found) = 0;
+    virtual std::vector<std::unique_ptr<Account>> getCustomerAccounts(int customerId) = 0;
+    virtual std::vector<AccountRecord> getCustomerAccountRecords(int customerId) = 0;
+    virtual double getBalance(int accountId) = 0;
+    // Balance at a past "YYYY-MM-DD[ HH:MM:SS[.ffffff]]"; a bare date means end of that day
+    virtual double getBalanceAsOf(int accountId, const std::string& timestamp) = 0;
+    
+    // Asynchronous variants - complete on the service's worker pool
+    virtual std::future<bool> depositAsync(int accountId, double amount) = 0;
+    virtual std::future<bool> withdrawAsync(int accountId, double amount) = 0;
+    virtual std::future<bool> transferAsync(int fromAccountId, int toAccountId, double amount) = 0;
+    virtual std::future<double> getBalanceAsync(int accountId) = 0;
+};
+
+class ITransactionService {
+public:
+    virtual ~ITransactionService() {}
+    virtual bool recordTransaction(const Transaction& transaction) = 0;
+    virtual std::vector<std::unique_ptr<Transaction>> getAccountTransactions(int accountId) = 0;
+    virtual std::unique_ptr<Transaction> getTransaction(int transactionId) = 0;
+    virtual bool forEachAccountTransaction(int accountId, const std::function<bool(const Transaction&)>& visit) = 0;
+    // Up to limit transactions posted after afterId; more says whether another page follows
+    virtual bool getTransactionPage(int accountId, int afterId, size_t limit,
+                                    std::vector<Transaction>& page, bool& more) = 0;
+    virtual std::vector<DailyRollup> getDailyRollups(int accountId, const std::string& fromDay,
+                                                     const std::string& toDay) = 0;
+};
+
+// Service implementations
+class CustomerService : public ICustomerService {
+private:
+    std::shared_ptr<CustomerRepository> repository;
+    std::shared_ptr<CustomerSearchIndex> searchIndex;
+    std::shared_ptr<CustomerOverviewRepository> overviews;
+    std::shared_ptr<CustomerOverviewCache> overviewCache;
+    std::mutex indexLoadMutex;
+    
+    void ensureIndexLoaded() {
+        if (searchIndex->isLoaded()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(indexLoadMutex);
+        if (!searchIndex->isLoaded()) {
+            searchIndex->rebuild(repository->getAll());
+        }
+    }
+    
+public:
+    CustomerService(std::shared_ptr<CustomerRepository> repository,
+                    std::shared_ptr<CustomerSearchIndex> searchIndex = nullptr,
+                    std::shared_ptr<CustomerOverviewRepository> overviews = nullptr,
+                    std::shared_ptr<CustomerOverviewCache> overviewCache = nullptr)
+        : repository(repository),
+          searchIndex(searchIndex ? searchIndex : std::make_shared<CustomerSearchIndex>()),
+          overviews(overviews), overviewCache(overviewCache) {}
+    
+    bool addCustomer(const Customer& customer) override {
+        int customerId = repository->addAndGetId(customer);
+        if (customerId == 0) {
+            return false;
+        }
+        
+        Customer stored(customer);
+        stored.setId(customerId);
+        searchIndex->upsert(stored);
+        return true;
+    }
+    
+    bool updateCustomer(const Customer& customer) override {
+        if (!repository->update(customer)) {
+            return false;
+        }
+        searchIndex->upsert(customer);
+        if (overviewCache) {
+            overviewCache->invalidateCustomer(customer.getId());
+        }
+        return true;
+    }
+    
+    bool removeCustomer(int customerId) override {
+        if (!repository->remove(customerId)) {
+            return false;
+        }
+        searchIndex->remove(customerId);
+        if (overviewCache) {
+            overviewCache->invalidateCustomer(customerId);
+        }
+        return true;
+    }
+    
+    std::unique_ptr<Customer> getCustomer(int customerId) override {
+        return repository->getById(customerId);
+    }
+    
+    std::vector<std::unique_ptr<Customer>> getAllCustomers() override {
+        return repository->getAll();
+    }
+    
+    // The index is loaded from the customers table on first use
+    std::vector<std::unique_ptr<Customer>> searchCustomers(const std::string& query, size_t limit) override {
+        ensureIndexLoaded();
+        return searchIndex->search(query, limit);
+    }
+    
+    bool forEachCustomer(const std::function<bool(const Customer&)>& visit) override {
+        return repository->forEach(visit);
+    }
+    
+    bool getCustomerOverview(int customerId, size_t recentTransactions, CustomerOverview& overview) override {
+        if (!overviews) {
+            std::cerr << "Customer overviews are not configured" << std::endl;
+            return false;
+        }
+        if (overviewCache && overviewCache->get(customerId, recentTransactions, overview)) {
+            return true;
+        }
+        
+        std::uint64_t ticket = overviewCache ? overviewCache->beginLoad(customerId) : 0;
+        bool found = false;
+        bool loaded = overviews->load(customerId, recentTransactions, overview, found) && found;
+        if (overviewCache) {
+            overviewCache->finishLoad(customerId, ticket, loaded ? &overview : nullptr);
+        }
+        return loaded;
+    }
+};
+
+class AccountService : public IAccountService {
+private:
+    std::shared_ptr<IDatabase> db;
+    std::shared_ptr<AccountRepository> accountRepository;
+    std::shared_ptr<TransactionRepository> transactionRepository;
+    std::shared_ptr<WorkerPool> executor;
+    std::shared_ptr<IdGenerator> idGenerator;
+    std::shared_ptr<IdempotencyCache> idempotencyCache;
+    std::shared_ptr<VelocityRuleEngine> ruleEngine;
+    std::shared_ptr<LedgerEventBus> eventBus;
+    std::shared_ptr<HotAccountRepository> hotAccounts;
+    
+    // Account owners for customer-scoped rules; owners never change
+    std::mutex ownerMutex;
+    std::unordered_map<int, int> accountOwners;
+    
+    static const size_t kMaxIdempotencyKeyLength = 64;
+    
+    // Customer owning the account, 0 when it does not exist
+    int ownerOf(int accountId) {
+        {
+            std::lock_guard<std::mutex> lock(ownerMutex);
+            auto it = accountOwners.find(accountId);
+            if (it != accountOwners.end()) {
+                return it->second;
+            }
+        }
+        
+        AccountRecord record;
+        if (!accountRepository->getRecordById(accountId, record)) {
+            return 0;
+        }
+        
+        std::lock_guard<std::mutex> lock(ownerMutex);
+        accountOwners[accountId] = record.customerId;
+        return record.customerId;
+    }
+    
+    template <typename Operation>
+    auto runAsync(Operation operation) -> std::future<decltype(operation())> {
+        if (executor) {
+            return executor->submit(std::move(operation));
+        }
+        
+        // No executor configured: complete on the calling thread
+        std::packaged_task<decltype(operation())()> task(std::move(operation));
+        auto future = task.get_future();
+        task();
+        return future;
+    }
+    
+    // Statements a movement's batch runs besides the balance change and ledger rows
+    struct MovementExtras {
+        std::vector<std::string> before;     // right after START TRANSACTION
+        std::vector<std::string> after;      // just before COMMIT; each carries its own applied guard
+        bool slotCredit;                     // the balance statement credits a hot-account slot
+        
+        MovementExtras() : slotCredit(false) {}
+    };
+    
+    int hotSlots(int accountId) {
+        return hotAccounts ? hotAccounts->slotsOf(accountId) : 0;
+    }
+    
+    // Folds the slots of whichever of the accounts are hot, in id order so that
+    // concurrent movements lock them in the same order
+    MovementExtras foldFirst(std::vector<int> accountIds) {
+        MovementExtras extras;
+        std::sort(accountIds.begin(), accountIds.end());
+        for (int accountId : accountIds) {
+            if (hotSlots(accountId) > 0) {
+                auto fold = hotAccounts->foldStatements(accountId);
+                extras.before.insert(extras.before.end(), fold.begin(), fold.end());
+            }
+        }
+        return extras;
+    }
+    
+    // Account values carry the slots of hot accounts in their balance
+    void addHotSlots(Account& account) {
+        double balance;
+        if (hotSlots(account.getId()) > 0 && hotAccounts->getBalance(account.getId(), balance)) {
+            account.setBalance(balance);
+        }
+    }
+    
+    // Runs a money movement as one round trip: the batch opens a transaction,
+    // applies the guarded balance change, records @bms_applied = ROW_COUNT(),
+    // writes ledger rows, balance checkpoints and daily rollups only if it
+    // applied, commits and returns @bms_applied. Velocity rules screen the
+    // ledger first. The idempotency key is bound to the first ledger row; executed
+    // reports whether the outcome is final (a rule blocked it or the batch ran).
+    // Committed rows go to the event bus with the ids the batch assigned them.
+    // A slot credit leaves the checkpoint and the rollup to the fold.
+    bool runMovement(const std::string& balanceStatement, const std::vector<Transaction>& ledger,
+                     int expectedRows, const std::string& idempotencyKey, bool& executed,
+                     const MovementExtras& extras = MovementExtras()) {
+        // Checks count the entries straight away; they are released unless the batch applies
+        std::vector<int> owners;
+        std::vector<RuleDecision> decisions;
+        auto releaseRules = [&] {
+            for (size_t i = 0; i < decisions.size(); ++i) {
+                ruleEngine->release(ledger[i].getAccountId(), owners[i], ledger[i].getType(),
+                                    ledger[i].getAmount(), decisions[i]);
+            }
+        };
+        if (ruleEngine) {
+            for (const auto& transaction : ledger) {
+                owners.push_back(ownerOf(transaction.getAccountId()));
+                RuleDecision decision = ruleEngine->check(transaction.getAccountId(), owners.back(),
+                                                          transaction.getType(), transaction.getAmount());
+                if (decision.action == RuleAction::Block) {
+                    std::cerr << transaction.getType() << " on account " << transaction.getAccountId()
+                              << " blocked by rule " << decision.rule << std::endl;
+                    releaseRules();
+                    executed = true;
+                    return false;
+                }
+                decisions.push_back(decision);
+                if (decision.action == RuleAction::Flag) {
+                    std::cerr << transaction.getType() << " on account " << transaction.getAccountId()
+                              << " flagged for review by rule " << decision.rule << std::endl;
+                }
+            }
+        }
+        
+        std::string applied = "@bms_applied = " + std::to_string(expectedRows);
+        std::vector<std::string> batch;
+        
+        batch.push_back("START TRANSACTION");
+        batch.insert(batch.end(), extras.before.begin(), extras.before.end());
+        batch.push_back(balanceStatement);
+        batch.push_back(extras.slotCredit ? "SET @bms_applied = LEAST(ROW_COUNT(), 1)" : "SET @bms_applied = ROW_COUNT()");
+        for (size_t i = 0; i < ledger.size(); ++i) {
+            const Transaction& transaction = ledger[i];
+            batch.push_back(transactionRepository->insertStatement(transaction, applied));
+            if (eventBus) {
+                batch.push_back("SET @bms_tx" + std::to_string(i) + " = LAST_INSERT_ID()");
+            }
+            if (i == 0 && !idempotencyKey.empty()) {
+                batch.push_back(transactionRepository->idempotencyKeyStatement(idempotencyKey,
+                                                                               transaction.getDateTime(), applied));
+            }
+            if (!extras.slotCredit) {
+                batch.push_back(transactionRepository->checkpointStatement(transaction, applied));
+                batch.push_back(transactionRepository->rollupStatement(transaction, applied, true));
+            }
+        }
+        batch.insert(batch.end(), extras.after.begin(), extras.after.end());
+        batch.push_back("COMMIT");
+        std::string select = "SELECT @bms_applied";
+        for (size_t i = 0; eventBus && i < ledger.size(); ++i) {
+            select += ", @bms_tx" + std::to_string(i);
+        }
+        batch.push_back(select);
+        
+        std::vector<std::vector<std::vector<std::string>>> results;
+        bool ok = db->executeBatch(batch, results);
+        executed = ok;
+        
+        for (const auto& transaction : ledger) {
+            transactionRepository->invalidateRollups(transaction.getAccountId());
+        }
+        
+        if (!ok) {
+            releaseRules();
+            return false;
+        }
+        
+        const auto& appliedRows = results.back();
+        if (appliedRows.empty() || appliedRows[0].empty() || appliedRows[0][0] != std::to_string(expectedRows)) {
+            releaseRules();
+            return false;
+        }
+        
+        if (eventBus) {
+            std::vector<LedgerEvent> events(ledger.size());
+            for (size_t i = 0; i < ledger.size(); ++i) {
+                const std::string& id = appliedRows[0].size() > i + 1 ? appliedRows[0][i + 1] : "NULL";
+                events[i].transactionId = id == "NULL" ? 0 : std::atoi(id.c_str());
+                events[i].accountId = ledger[i].getAccountId();
+                events[i].counterpartyAccountId = ledger.size() == 2 ? ledger[1 - i].getAccountId() : 0;
+                events[i].type = ledger[i].getType();
+                events[i].amountCents = std::llround(ledger[i].getAmount() * 100);
+                events[i].dateTime = ledger[i].getDateTime();
+                events[i].description = ledger[i].getDescription();
+            }
+            eventBus->publish(events.data(), events.size());
+        }
+        return true;
+    }
+    
+    // Runs movement(executed) at most once per key. A batch that failed outright
+    // is checked against the stored keys: a duplicate means an earlier call
+    // (possibly from another process) already applied it.
+    template <typename Movement>
+    bool runIdempotent(const std::string& idempotencyKey, Movement movement) {
+        bool executed = false;
+        return runIdempotent(idempotencyKey, movement, executed);
+    }
+    
+    // As above; executed tells whether the result is final or the call may be retried
+    template <typename Movement>
+    bool runIdempotent(const std::string& idempotencyKey, Movement movement, bool& executed) {
+        executed = false;
+        if (idempotencyKey.empty()) {
+            return movement(executed);
+        }
+        
+        if (idempotencyKey.size() > kMaxIdempotencyKeyLength) {
+            std::cerr << "Idempotency key is longer than " << kMaxIdempotencyKeyLength << " characters" << std::endl;
+            executed = true;
+            return false;
+        }
+        
+        bool result = false;
+        if (idempotencyCache->acquire(idempotencyKey, result) == IdempotencyCache::Claim::Completed) {
+            executed = true;
+            return result;
+        }
+        
+        result = movement(executed);
+        if (!executed && transactionRepository->hasIdempotencyKey(idempotencyKey)) {
+            result = executed = true;
+        }
+        
+        if (executed) {
+            idempotencyCache->complete(idempotencyKey, result);
+        } else {
+            idempotencyCache->release(idempotencyKey);
+        }
+        return result;
+    }
+    
+    std::string getCurrentDateTime() {
+        return Clock::nowText();
+    }
+    
+public:
+    AccountService(std::shared_ptr<IDatabase> db,
+                  std::shared_ptr<AccountRepository> accountRepo, 
+                  std::shared_ptr<TransactionRepository> transactionRepo,
+                  std::shared_ptr<WorkerPool> executor = nullptr,
+                  std::shared_ptr<IdGenerator> idGenerator = nullptr,
+                  std::shared_ptr<IdempotencyCache> idempotencyCache = nullptr,
+                  std::shared_ptr<VelocityRuleEngine> ruleEngine = nullptr,
+                  std::shared_ptr<LedgerEventBus> eventBus = nullptr,
+                  std::shared_ptr<HotAccountRepository> hotAccounts = nullptr)
+        : db(db), accountRepository(accountRepo), transactionRepository(transactionRepo), executor(executor),
+          idGenerator(idGenerator ? idGenerator : std::make_shared<IdGenerator>()),
+          idempotencyCache(idempotencyCache ? idempotencyCache : std::make_shared<IdempotencyCache>()),
+          ruleEngine(ruleEngine), eventBus(eventBus), hotAccounts(hotAccounts) {}
+    
+    bool openAccount(Account& account) override {
+        if (account.getAccountNumber().empty()) {
+            account.setAccountNumber(idGenerator->nextAccountNumber());
+        }
+        
+        if (account.getDateOpened().empty()) {
+            account.setDateOpened(Clock::today());
+        }
+        
+        // The opening balance is booked as a deposit so the ledger nets to the balance
+        double openingDeposit = account.getBalance();
+        if (openingDeposit > 0) {
+            account.setBalance(0);
+        }
+        
+        int accountId = accountRepository->addAndGetId(account);
+        if (accountId == 0) {
+            account.setBalance(openingDeposit);
+            return false;
+        }
+        
+        if (openingDeposit > 0) {
+            Transaction transaction(0, accountId, "Deposit", openingDeposit,
+                                   getCurrentDateTime(), "Opening deposit");
+            bool executed = false;
+            bool deposited = runMovement(accountRepository->creditStatement(accountId, openingDeposit),
+                                         { transaction }, 1, "", executed);
+            account.setBalance(openingDeposit);
+            
+            if (!deposited) {
+                accountRepository->remove(accountId);
+                return false;
+            }
+        }
+        
+        account.setId(accountId);
+        return true;
+    }
+    
+    bool closeAccount(int accountId) override {
+        if (hotSlots(accountId) > 0) {
+            foldHotAccount(accountId);
+        }
+        auto account = accountRepository->getById(accountId);
+        if (!account || account->getBalance() != 0) {
+            return false;
+        }
+        return accountRepository->remove(accountId);
+    }
+    
+    bool deposit(int accountId, double amount) override {
+        return deposit(accountId, amount, std::string());
+    }
+    
+    bool deposit(int accountId, double amount, const std::string& idempotencyKey) override {
+        if (amount <= 0) {
+            std::cerr << "Invalid deposit amount" << std::endl;
+            return false;
+        }
+        
+        Transaction transaction(0, accountId, "Deposit", amount, 
+                               getCurrentDateTime(), "Deposit to account");
+        
+        int slots = hotSlots(accountId);
+        return runIdempotent(idempotencyKey, [&](bool& executed) {
+            if (slots > 0) {
+                MovementExtras extras;
+                extras.slotCredit = true;
+                return runMovement(hotAccounts->creditStatement(transaction, HotAccountRepository::pickSlot(slots)),
+                                   { transaction }, 1, idempotencyKey, executed, extras);
+            }
+            return runMovement(accountRepository->creditStatement(accountId, amount), { transaction }, 1,
+                               idempotencyKey, executed);
+        });
+    }
+    
+    bool withdraw(int accountId, double amount) override {
+        return withdraw(accountId, amount, std::string());
+    }
+    
+    bool withdraw(int accountId, double amount, const std::string& idempotencyKey) override {
+        if (amount <= 0) {
+            std::cerr << "Invalid withdrawal amount" << std::endl;
+            return false;
+        }
+        
+        Transaction transaction(0, accountId, "Withdrawal", amount, 
+                               getCurrentDateTime(), "Withdrawal from account");
+        
+        return runIdempotent(idempotencyKey, [&](bool& executed) {
+            return runMovement(accountRepository->debitStatement(accountId, amount), { transaction }, 1,
+                               idempotencyKey, executed, foldFirst({ accountId }));
+        });
+    }
+    
+    bool transfer(int fromAccountId, int toAccountId, double amount) override {
+        return transfer(fromAccountId, toAccountId, amount, std::string());
+    }
+    
+    bool transfer(int fromAccountId, int toAccountId, double amount, const std::string& idempotencyKey) override {
+        return settleTransfer(fromAccountId, toAccountId, amount, idempotencyKey) == TransferLeg::Applied;
+    }
+    
+    TransferLeg settleTransfer(int fromAccountId, int toAccountId, double amount,
+                               const std::string& idempotencyKey) override {
+        if (amount <= 0) {
+            std::cerr << "Invalid withdrawal amount" << std::endl;
+            return TransferLeg::Refused;
+        }
+        
+        if (fromAccountId == toAccountId) {
+            std::cerr << "Cannot transfer to the same account" << std::endl;
+            return TransferLeg::Refused;
+        }
+        
+        std::string dateTime = getCurrentDateTime();
+        std::string description = "Transfer from account " + std::to_string(fromAccountId) + 
+                                 " to account " + std::to_string(toAccountId);
+        
+        Transaction fromTransaction(0, fromAccountId, "Transfer Out", amount, 
+                                  dateTime, description);
+        Transaction toTransaction(0, toAccountId, "Transfer In", amount, 
+                                dateTime, description);
+        
+        // Both balances change in one statement, so it applies to exactly two rows
+        bool executed = false;
+        bool applied = runIdempotent(idempotencyKey, [&](bool& executed) {
+            return runMovement(accountRepository->transferStatement(fromAccountId, toAccountId, amount),
+                               { fromTransaction, toTransaction }, 2, idempotencyKey, executed,
+                               foldFirst({ fromAccountId, toAccountId }));
+        }, executed);
+        return applied ? TransferLeg::Applied : executed ? TransferLeg::Refused : TransferLeg::Unreachable;
+    }
+    
+    // Steps of a transfer between shards (see DistributedAccountService), each one
+    // local transaction on this service's database that can safely be repeated.
+    
+    // Source side: debits the account, books the Transfer Out row and records the transfer as pending
+    TransferLeg transferOut(const CrossShardTransfer& transfer, const std::string& idempotencyKey) {
+        if (transfer.amount <= 0) {
+            std::cerr << "Invalid withdrawal amount" << std::endl;
+            return TransferLeg::Refused;
+        }
+        
+        Transaction transaction(0, transfer.fromAccountId, "Transfer Out", transfer.amount, transfer.createdAt,
+                                "Transfer from account " + std::to_string(transfer.fromAccountId) +
+                                " to account " + std::to_string(transfer.toAccountId));
+        CrossShardTransfer pending(transfer);
+        pending.state = "pending";
+        
+        MovementExtras extras = foldFirst({ transfer.fromAccountId });
+        extras.after.push_back(transactionRepository->transferRecordStatement(pending, "@bms_applied = 1"));
+        
+        bool executed = false;
+        bool applied = runIdempotent(idempotencyKey, [&](bool& executed) {
+            return runMovement(accountRepository->debitStatement(transfer.fromAccountId, transfer.amount),
+                               { transaction }, 1, idempotencyKey, executed, extras);
+        }, executed);
+        return applied ? TransferLeg::Applied : executed ? TransferLeg::Refused : TransferLeg::Unreachable;
+    }
+    
+    // Destination side: credits the account at most once per transfer id
+    TransferLeg transferIn(const CrossShardTransfer& transfer) {
+        Transaction transaction(0, transfer.toAccountId, "Transfer In", transfer.amount, transfer.createdAt,
+                                "Transfer from account " + std::to_string(transfer.fromAccountId) +
+                                " to account " + std::to_string(transfer.toAccountId));
+        CrossShardTransfer credited(transfer);
+        credited.state = "credited";
+        std::string creditOnce = accountRepository->creditStatement(transfer.toAccountId, transfer.amount) +
+            " AND NOT EXISTS (SELECT 1 FROM cross_shard_transfers WHERE transfer_id='" +
+            sqlEscape(transfer.transferId) + "')";
+        
+        // A hot destination is folded first: the checkpoint and rollup read the account's full balance
+        MovementExtras extras = foldFirst({ transfer.toAccountId });
+        extras.after.push_back(transactionRepository->transferRecordStatement(credited, "@bms_applied = 1"));
+        
+        bool executed = false;
+        if (runMovement(creditOnce, { transaction }, 1, "", executed, extras)) {
+            return TransferLeg::Applied;
+        }
+        
+        CrossShardTransfer recorded;
+        bool found = false;
+        if (!transactionRepository->getTransfer(transfer.transferId, recorded, found)) {
+            return TransferLeg::Unreachable;
+        }
+        if (found) {
+            return TransferLeg::Applied;
+        }
+        return executed ? TransferLeg::Refused : TransferLeg::Unreachable;
+    }
+    
+    bool completeTransfer(const std::string& transferId) {
+        return transactionRepository->setTransferState(transferId, "pending", "completed");
+    }
+    
+    // Source side, when the destination refused: credits the amount back and marks the transfer reversed
+    bool reverseTransferOut(const CrossShardTransfer& transfer) {
+        Transaction transaction(0, transfer.fromAccountId, "Transfer In", transfer.amount, getCurrentDateTime(),
+                                "Reversal of transfer " + transfer.transferId);
+        std::string reverse = "UPDATE accounts a JOIN cross_shard_transfers x ON x.from_account_id = a.account_id"
+            " SET a.balance = a.balance + x.amount, x.state = 'reversed'"
+            " WHERE x.transfer_id='" + sqlEscape(transfer.transferId) + "' AND x.state = 'pending'";
+        
+        // The account and the transfer record both change, so it applies to two rows
+        bool executed = false;
+        return runMovement(reverse, { transaction }, 2, "", executed, foldFirst({ transfer.fromAccountId }));
+    }
+    
+    bool findTransfer(const std::string& transferId, CrossShardTransfer& transfer, bool& found) {
+        return transactionRepository->getTransfer(transferId, transfer, found);
+    }
+    
+    std::vector<CrossShardTransfer> pendingTransfers() {
+        return transactionRepository->getTransfersInState("pending");
+    }
+    
+    // Hot accounts (see HotAccountRepository): credits go to slots; slots = 0 turns it off
+    bool setHotAccount(int accountId, int slots) {
+        if (!hotAccounts) {
+            std::cerr << "Hot accounts are not enabled" << std::endl;
+            return false;
+        }
+        if (slots > 0) {
+            return hotAccounts->enable(accountId, slots);
+        }
+        bool ok = hotAccounts->disable(accountId);
+        transactionRepository->invalidateRollups(accountId);
+        return ok;
+    }
+    
+    bool foldHotAccount(int accountId) {
+        bool ok = hotAccounts->fold(accountId);
+        transactionRepository->invalidateRollups(accountId);
+        return ok;
+    }
+    
+    std::unique_ptr<Account> getAccount(int accountId) override {
+        auto account = accountRepository->getById(accountId);
+        if (account) {
+            addHotSlots(*account);
+        }
+        return account;
+    }
+    
+    bool accountExists(int accountId, bool& found) override {
+        return accountRepository->exists(accountId, found);
+    }
+    
+    std::vector<std::unique_ptr<Account>> getCustomerAccounts(int customerId) override {
+        auto accounts = accountRepository->getByCustomerId(customerId);
+        for (auto& account : accounts) {
+            addHotSlots(*account);
+        }
+        return accounts;
+    }
+    
+    std::vector<AccountRecord> getCustomerAccountRecords(int customerId) override {
+        auto records = accountRepository->getRecordsByCustomerId(customerId);
+        for (auto& record : records) {
+            double balance;
+            if (hotSlots(record.id) > 0 && hotAccounts->getBalance(record.id, balance)) {
+                record.balance = balance;
+            }
+        }
+        return records;
+    }
+    
+    double getBalance(int accountId) override {
+        double balance;
+        if (hotSlots(accountId) > 0) {
+            return hotAccounts->getBalance(accountId, balance) ? balance : -1;
+        }
+        
+        AccountRecord account;
+        if (accountRepository->getRecordById(accountId, account)) {
+            return account.balance;
+        }
+        return -1; // Indicates error
+    }
+    
+    double getBalanceAsOf(int accountId, const std::string& timestamp) override {
+        // The ledger side is complete, but the current balance it starts from must be settled
+        if (hotSlots(accountId) > 0) {
+            foldHotAccount(accountId);
+        }
+        
+        std::string at = timestamp;
+        if (at.size() == Clock::kDateLength) {
+            at += " 23:59:59.999999";
+        }
+        
+        double balance;
+        if (transactionRepository->getBalanceAsOf(accountId, at, balance)) {
+            return balance;
+        }
+        return -1; // Indicates error
+    }
+    
+    std::future<bool> depositAsync(int accountId, double amount) override {
+        return runAsync([this, accountId, amount] { return deposit(accountId, amount); });
+    }
+    
+    std::future<bool> withdrawAsync(int accountId, double amount) override {
+        return runAsync([this, accountId, amount] { return withdraw(accountId, amount); });
+    }
+    
+    std::future<bool> transferAsync(int fromAccountId, int toAccountId, double amount) override {
+        return runAsync([this, fromAccountId, toAccountId, amount] {
+            return transfer(fromAccountId, toAccountId, amount);
+        });
+    }
+    
+    std::future<double> getBalanceAsync(int accountId) override {
+        return runAsync([this, accountId] { return getBalance(accountId); });
+    }
+};
+
+// Passes every call through to another account service; decorators override
+// only what they change
+class ForwardingAccountService : public IAccountService {
+protected:
+    std::shared_ptr<IAccountService> inner;
+    
+public:
+    explicit ForwardingAccountService(std::shared_ptr<IAccountService> inner) : inner(inner) {}
+    
+    bool openAccount(Account& account) override { return inner->openAccount(account); }
+    bool closeAccount(int accountId) override { return inner->closeAccount(accountId); }
+    bool deposit(int accountId, double amount) override { return inner->deposit(accountId, amount); }
+    bool withdraw(int accountId, double amount) override { return inner->withdraw(accountId, amount); }
+    
+    bool transfer(int fromAccountId, int toAccountId, double amount) override {
+        return inner->transfer(fromAccountId, toAccountId, amount);
+    }
+    
+    bool deposit(int accountId, double amount, const std::string& idempotencyKey) override {
+        return inner->deposit(accountId, amount, idempotencyKey);
+    }
+    
+    bool withdraw(int accountId, double amount, const std::string& idempotencyKey) override {
+        return inner->withdraw(accountId, amount, idempotencyKey);
+    }
+    
+    bool transfer(int fromAccountId, int toAccountId, double amount, const std::string& idempotencyKey) override {
+        return inner->transfer(fromAccountId, toAccountId, amount, idempotencyKey);
+    }
+    
+    TransferLeg settleTransfer(int fromAccountId, int toAccountId, double amount,
+                               const std::string& idempotencyKey) override {
+        return inner->settleTransfer(fromAccountId, toAccountId, amount, idempotencyKey);
+    }
+    
+    std::unique_ptr<Account> getAccount(int accountId) override { return inner->getAccount(accountId); }
+    
+    bool accountExists(int accountId, bool& found) override { return inner->accountExists(accountId, found); }
+    
+    std::vector<std::unique_ptr<Account>> getCustomerAccounts(int customerId) override {
+        return inner->getCustomerAccounts(customerId);
+    }
+    
+    std::vector<AccountRecord> getCustomerAccountRecords(int customerId) override {
+        return inner->getCustomerAccountRecords(customerId);
+    }
+    
+    double getBalance(int accountId) override { return inner->getBalance(accountId); }
+    
+    double getBalanceAsOf(int accountId, const std::string& timestamp) override {
+        return inner->getBalanceAsOf(accountId, timestamp);
+    }
+    
+    std::future<bool> depositAsync(int accountId, double amount) override {
+        return inner->depositAsync(accountId, amount);
+    }
+    
+    std::future<bool> withdrawAsync(int accountId, double amount) override {
+        return inner->withdrawAsync(accountId, amount);
+    }
+    
+    std::future<bool> transferAsync(int fromAccountId, int toAccountId, double amount) override {
+        return inner->transferAsync(fromAccountId, toAccountId, amount);
+    }
+    
+    std::future<double> getBalanceAsync(int accountId) override { return inner->getBalanceAsync(accountId); }
+};
+
+// Counts, fails and times the account operations of the service it wraps.
+// The asynchronous variants are passed through unmeasured.
+class MeteredAccountService : public ForwardingAccountService {
+private:
+    struct Operation {
+        std::shared_ptr<MetricsRegistry::Counter> calls;
+        std::shared_ptr<MetricsRegistry::Counter> failures;
+        std::shared_ptr<MetricsRegistry::Histogram> latency;
+    };
+    
+    Operation openings;
+    Operation closings;
+    Operation deposits;
+    Operation withdrawals;
+    Operation transfers;
+    Operation balances;
+    
+    static Operation operation(MetricsRegistry& metrics, const std::string& labels, const char* name) {
+        std::string operationLabels = MetricsRegistry::joinLabels(labels, std::string("operation=\"") + name + "\"");
+        return {
+            metrics.counter("bank_operations_total", "Account operations", operationLabels),
+            metrics.counter("bank_operation_errors_total", "Account operations that failed", operationLabels),
+            metrics.histogram("bank_operation_duration_seconds", "Account operation latency", operationLabels)
+        };
+    }
+    
+    template <typename Call>
+    static bool measure(Operation& metered, Call call) {
+        auto started = std::chrono::steady_clock::now();
+        bool success = call();
+        metered.latency->observe(std::chrono::steady_clock::now() - started);
+        metered.calls->increment();
+        if (!success) {
+            metered.failures->increment();
+        }
+        return success;
+    }
+    
+public:
+    MeteredAccountService(std::shared_ptr<IAccountService> inner, MetricsRegistry& metrics,
+                          const std::string& labels = "")
+        : ForwardingAccountService(inner),
+          openings(operation(metrics, labels, "open_account")),
+          closings(operation(metrics, labels, "close_account")),
+          deposits(operation(metrics, labels, "deposit")),
+          withdrawals(operation(metrics, labels, "withdraw")),
+          transfers(operation(metrics, labels, "transfer")),
+          balances(operation(metrics, labels, "get_balance")) {}
+    
+    bool openAccount(Account& account) override {
+        return measure(openings, [&] { return inner->openAccount(account); });
+    }
+    
+    bool closeAccount(int accountId) override {
+        return measure(closings, [&] { return inner->closeAccount(accountId); });
+    }
+    
+    bool deposit(int accountId, double amount) override {
+        return measure(deposits, [&] { return inner->deposit(accountId, amount); });
+    }
+    
+    bool withdraw(int accountId, double amount) override {
+        return measure(withdrawals, [&] { return inner->withdraw(accountId, amount); });
+    }
+    
+    bool transfer(int fromAccountId, int toAccountId, double amount) override {
+        return measure(transfers, [&] { return inner->transfer(fromAccountId, toAccountId, amount); });
+    }
+    
+    bool deposit(int accountId, double amount, const std::string& idempotencyKey) override {
+        return measure(deposits, [&] { return inner->deposit(accountId, amount, idempotencyKey); });
+    }
+    
+    bool withdraw(int accountId, double amount, const std::string& idempotencyKey) override {
+        return measure(withdrawals, [&] { return inner->withdraw(accountId, amount, idempotencyKey); });
+    }
+    
+    bool transfer(int fromAccountId, int toAccountId, double amount, const std::string& idempotencyKey) override {
+        return measure(transfers, [&] {
+            return inner->transfer(fromAccountId, toAccountId, amount, idempotencyKey);
+        });
+    }
+    
+    TransferLeg settleTransfer(int fromAccountId, int toAccountId, double amount,
+                               const std::string& idempotencyKey) override {
+        TransferLeg leg = TransferLeg::Unreachable;
+        measure(transfers, [&] {
+            leg = inner->settleTransfer(fromAccountId, toAccountId, amount, idempotencyKey);
+            return leg == TransferLeg::Applied;
+        });
+        return leg;
+    }
+    
+    // -1 marks an unknown account
+    double getBalance(int accountId) override {
+        double balance = -1;
+        measure(balances, [&] {
+            balance = inner->getBalance(accountId);
+            return balance != -1;
+        });
+        return balance;
+    }
+};
+
+// Bounded single-producer/single-consumer ring; neither side ever blocks
+template <typename T>
+class SpscQueue {
+private:
+    std::unique_ptr<T[]> items;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;   // next slot to pop, written by the consumer
+    size_t cachedTail;                      // consumer's last view of tail
+    alignas(64) std::atomic<size_t> tail;   // next slot to fill, written by the producer
+    size_t cachedHead;                      // producer's last view of head
+    
+public:
+    explicit SpscQueue(size_t requestedCapacity) : mask(1), head(0), cachedTail(0), tail(0), cachedHead(0) {
+        size_t capacity = 2;
+        while (capacity < requestedCapacity) {
+            capacity <<= 1;
+        }
+        items.reset(new T[capacity]);
+        mask = capacity - 1;
+    }
+    
+    bool push(T&& item) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        if (position - cachedHead > mask) {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (position - cachedHead > mask) {
+                return false;
+            }
+        }
+        items[position & mask] = std::move(item);
+        tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+    
+    bool pop(T& item) {
+        size_t position = head.load(std::memory_order_relaxed);
+        if (position == cachedTail) {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (position == cachedTail) {
+                return false;
+            }
+        }
+        item = std::move(items[position & mask]);
+        head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+    
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+};
+
+struct ShardedLedgerConfig {
+    size_t shards;                  // 0 means one per hardware thread
+    size_t clientLanes;             // caller threads are spread over this many queues per shard
+    size_t queueCapacity;
+    int flushIntervalMs;            // longest time a ledger row waits before it is written
+    size_t maxBatchRows;            // rows per database batch
+    size_t maxPendingRows;          // unwritten rows at which a shard stops taking new requests
+    int writeAttempts;              // tries per batch before its failure is reported and it is set aside
+    
+    ShardedLedgerConfig() : shards(0), clientLanes(32), queueCapacity(4096), flushIntervalMs(5),
+                            maxBatchRows(512), maxPendingRows(64 * 1024), writeAttempts(5) {}
+};
+
+// Single-writer execution of money movements. Accounts are hash-partitioned
+// over shard threads and every balance lives, exclusively, in its shard's
+// memory, so movements need neither row locks nor round trips. Callers reach
+// a shard through SPSC queues (one per caller lane) and shards talk to each
+// other through their own SPSC queues. A transfer between shards is two-phase:
+// the source reserves the amount, the destination credits it and answers, and
+// the source then confirms or releases the reservation. Ledger rows and
+// balance deltas are written behind, in batches of one database transaction
+// per shard; a crash loses at most the rows of the batches not yet written.
+// Account lifecycle and history reads pass through to the wrapped service.
+class ShardedAccountService : public ForwardingAccountService, public IMetricsSource {
+private:
+    enum class ShardOp : std::uint8_t {
+        Deposit,
+        Withdraw,
+        Reserve,        // transfer phase one, at the source
+        Credit,         // transfer phase two, at the destination
+        Confirm,        // destination credited; source books its leg
+        Release,        // destination refused; source returns the reservation
+        Balance,
+        Close,          // refuse further movements on a zero balance with nothing reserved
+        Reopen,         // the wrapped service did not close it; accept movements again
+        Forget,         // drop the cached account once nothing is reserved on it
+        Sync            // answer once everything accepted so far is written
+    };
+    
+    struct Reply {
+        std::promise<bool> done;
+        long long balanceCents = 0;
+    };
+    
+    struct Message {
+        ShardOp op = ShardOp::Balance;
+        int accountId = 0;
+        int otherAccountId = 0;
+        long long cents = 0;
+        std::shared_ptr<Reply> reply;
+        std::string idempotencyKey;
+        std::string dateTime;
+        RuleDecision rule;          // velocity entry of the source leg, released if the credit fails
+    };
+    
+    struct ShardAccount {
+        long long balanceCents;
+        long long floorCents;       // lowest allowed balance: minus the overdraft limit
+        long long reservedCents;    // taken by transfers still waiting for their destination
+        int customerId;
+        bool closed;
+    };
+    
+    struct LedgerRow {
+        Transaction transaction;
+        long long deltaCents;
+        int counterpartyAccountId;
+        std::string idempotencyKey;
+    };
+    
+    // Each batch commits its id to ledger_batches along with its rows
+    struct LedgerBatch {
+        std::uint64_t id = 0;
+        std::vector<LedgerRow> rows;
+        bool sent = false;          // an attempt reached the database, so it may have committed
+        int setAside = 0;
+        std::chrono::steady_clock::time_point retryAt;
+    };
+    
+    enum class BatchState {
+        Written,
+        Missing,
+        Unknown     // the lookup itself failed
+    };
+    
+    struct Shard {
+        std::unordered_map<int, ShardAccount> accounts;
+        // [0, shards) come from other shards, the rest from caller lanes
+        std::vector<std::unique_ptr<SpscQueue<Message>>> inbound;
+        std::unique_ptr<std::mutex[]> laneLocks;
+        std::vector<std::deque<Message>> overflow;      // to other shards whose queue was full
+        std::deque<LedgerRow> pending;
+        // Ran out of attempts; written before any newer row. Only touched while flushing is false.
+        std::shared_ptr<LedgerBatch> unwritten;
+        std::vector<std::shared_ptr<Reply>> syncWaiters;
+        std::chrono::steady_clock::time_point lastFlush;
+        std::atomic<bool> flushing{false};
+        std::atomic<bool> sleeping{false};
+        std::mutex wakeMutex;
+        std::condition_variable wakeup;
+        std::thread thread;
+    };
+    
+    std::shared_ptr<IDatabase> db;
+    std::shared_ptr<AccountRepository> accountRepository;
+    std::shared_ptr<TransactionRepository> transactionRepository;
+    std::shared_ptr<VelocityRuleEngine> ruleEngine;
+    std::shared_ptr<LedgerEventBus> eventBus;
+    std::shared_ptr<IdempotencyCache> idempotencyCache;
+    std::shared_ptr<IdGenerator> idGenerator;
+    std::shared_ptr<HotAccountRepository> hotAccounts;
+    ShardedLedgerConfig config;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::unique_ptr<WorkerPool> writers;
+    std::atomic<bool> stopping;
+    std::atomic<long> transfersInFlight;    // reserved at a source, not yet confirmed or released
+    std::atomic<std::uint64_t> rowsWritten;
+    std::atomic<std::uint64_t> batchesFailed;   // batches that used up their attempts
+    std::atomic<std::uint64_t> rowsDropped;     // given up on while stopping
+    
+    static constexpr int kRetryDelayMs = 200;
+    
+    static size_t laneOfThisThread() {
+        static std::atomic<size_t> nextLane(0);
+        thread_local size_t lane = nextLane.fetch_add(1);
+        return lane;
+    }
+    
+    size_t shardOf(int accountId) const {
+        // Fibonacci hashing spreads sequential ids evenly
+        return static_cast<size_t>((static_cast<std::uint64_t>(accountId) * 0x9E3779B97F4A7C15ULL) >> 32) %
+               shards.size();
+    }
+    
+    void wake(Shard& shard) {
+        if (shard.sleeping.load()) {
+            std::lock_guard<std::mutex> lock(shard.wakeMutex);
+            shard.wakeup.notify_one();
+        }
+    }
+    
+    // Caller side: waits for room rather than dropping the request
+    void send(Message&& message) {
+        send(shardOf(message.accountId), std::move(message));
+    }
+    
+    void send(size_t index, Message&& message) {
+        Shard& shard = *shards[index];
+        size_t lane = laneOfThisThread() % config.clientLanes;
+        SpscQueue<Message>& queue = *shard.inbound[shards.size() + lane];
+        {
+            std::lock_guard<std::mutex> lock(shard.laneLocks[lane]);
+            while (!queue.push(std::move(message))) {
+                wake(shard);
+                std::this_thread::yield();
+            }
+        }
+        wake(shard);
+    }
+    
+    // Shard side: never blocks, parks messages a full queue cannot take
+    void forward(size_t from, Message&& message) {
+        size_t to = shardOf(message.accountId);
+        if (to == from) {
+            process(from, message);
+            return;
+        }
+        Shard& source = *shards[from];
+        if (!source.overflow[to].empty() || !shards[to]->inbound[from]->push(std::move(message))) {
+            source.overflow[to].push_back(std::move(message));
+        }
+        wake(*shards[to]);
+    }
+    
+    void retryOverflow(size_t from) {
+        Shard& source = *shards[from];
+        for (size_t to = 0; to < shards.size(); to++) {
+            auto& parked = source.overflow[to];
+            while (!parked.empty() && shards[to]->inbound[from]->push(std::move(parked.front()))) {
+                parked.pop_front();
+            }
+        }
+    }
+    
+    // Shards book credits to the accounts row, so a hot account's slots are
+    // folded into it before its balance is cached
+    ShardAccount* find(Shard& shard, int accountId) {
+        auto it = shard.accounts.find(accountId);
+        if (it != shard.accounts.end()) {
+            return &it->second;
+        }
+        
+        if (hotAccounts && hotAccounts->slotsOf(accountId) > 0) {
+            if (!hotAccounts->fold(accountId)) {
+                std::cerr << "Could not fold the slots of hot account " << accountId << std::endl;
+                return nullptr;
+            }
+            transactionRepository->invalidateRollups(accountId);
+        }
+        AccountRecord record;
+        if (!accountRepository->getRecordById(accountId, record)) {
+            return nullptr;
+        }
+        ShardAccount account;
+        account.balanceCents = std::llround(record.balance * 100);
+        account.floorCents = record.kind == AccountKind::Checking ? -std::llround(record.ext.overdraftLimit * 100) : 0;
+        account.reservedCents = 0;
+        account.customerId = record.customerId;
+        account.closed = false;
+        return &shard.accounts.emplace(accountId, account).first->second;
+    }
+    
+    // The check counts the entry at once; callers apply it or release the decision
+    bool allowed(int accountId, const ShardAccount& account, const std::string& type, long long cents,
+                 RuleDecision& decision) {
+        if (!ruleEngine) {
+            return true;
+        }
+        decision = ruleEngine->check(accountId, account.customerId, type, cents / 100.0);
+        if (decision.action == RuleAction::Block) {
+            std::cerr << type << " on account " << accountId << " blocked by rule " << decision.rule << std::endl;
+            return false;
+        }
+        if (decision.action == RuleAction::Flag) {
+            std::cerr << type << " on account " << accountId << " flagged for review by rule "
+                      << decision.rule << std::endl;
+        }
+        return true;
+    }
+    
+    // Queues the ledger row for an applied movement; keyed rows carry the caller's idempotency key
+    void book(Shard& shard, const std::string& type, long long delta,
+              const Message& message, const std::string& description, bool keyed) {
+        int accountId = message.accountId;
+        LedgerRow row;
+        row.transaction = Transaction(0, accountId, type, std::llabs(delta) / 100.0, message.dateTime, description);
+        row.deltaCents = delta;
+        row.counterpartyAccountId = message.otherAccountId;
+        if (keyed) {
+            row.idempotencyKey = message.idempotencyKey;
+        }
+        shard.pending.push_back(std::move(row));
+    }
+    
+    static void answer(const Message& message, bool ok) {
+        if (message.reply) {
+            message.reply->done.set_value(ok);
+        }
+    }
+    
+    static std::string transferDescription(int fromAccountId, int toAccountId) {
+        return "Transfer from account " + std::to_string(fromAccountId) + " to account " +
+               std::to_string(toAccountId);
+    }
+    
+    void process(size_t index, Message& message) {
+        Shard& shard = *shards[index];
+        
+        if (message.op == ShardOp::Forget) {
+            // An outstanding reservation still needs the cached balance to confirm or release
+            auto cached = shard.accounts.find(message.accountId);
+            bool reserved = cached != shard.accounts.end() && cached->second.reservedCents != 0;
+            if (!reserved && cached != shard.accounts.end()) {
+                shard.accounts.erase(cached);
+            }
+            answer(message, !reserved);
+            return;
+        }
+        if (message.op == ShardOp::Sync) {
+            shard.syncWaiters.push_back(message.reply);
+            return;
+        }
+        
+        ShardAccount* account = find(shard, message.accountId);
+        bool usable = account && !account->closed;
+        
+        switch (message.op) {
+            case ShardOp::Deposit:
+                if (!usable || !allowed(message.accountId, *account, "Deposit", message.cents, message.rule)) {
+                    answer(message, false);
+                    return;
+                }
+                account->balanceCents += message.cents;
+                book(shard, "Deposit", message.cents, message, "Deposit to account", true);
+                answer(message, true);
+                return;
+            
+            case ShardOp::Withdraw:
+            case ShardOp::Reserve: {
+                const char* type = message.op == ShardOp::Withdraw ? "Withdrawal" : "Transfer Out";
+                if (!usable || account->balanceCents - message.cents < account->floorCents ||
+                    !allowed(message.accountId, *account, type, message.cents, message.rule)) {
+                    answer(message, false);
+                    return;
+                }
+                account->balanceCents -= message.cents;
+                if (message.op == ShardOp::Withdraw) {
+                    book(shard, type, -message.cents, message, "Withdrawal from account", true);
+                    answer(message, true);
+                    return;
+                }
+                
+                account->reservedCents += message.cents;
+                Message credit = std::move(message);
+                std::swap(credit.accountId, credit.otherAccountId);
+                credit.op = ShardOp::Credit;
+                transfersInFlight.fetch_add(1);
+                forward(index, std::move(credit));
+                return;
+            }
+            
+            case ShardOp::Credit: {
+                RuleDecision creditRule;
+                bool credited = usable && allowed(message.accountId, *account, "Transfer In", message.cents, creditRule);
+                if (credited) {
+                    account->balanceCents += message.cents;
+                    book(shard, "Transfer In", message.cents, message,
+                         transferDescription(message.otherAccountId, message.accountId), false);
+                }
+                
+                // The key travels back with the outcome and is bound to the source's row
+                Message outcome = std::move(message);
+                std::swap(outcome.accountId, outcome.otherAccountId);
+                outcome.op = credited ? ShardOp::Confirm : ShardOp::Release;
+                forward(index, std::move(outcome));
+                return;
+            }
+            
+            case ShardOp::Confirm:
+            case ShardOp::Release:
+                // The reservation pins the account: Close and Forget refuse while it is outstanding
+                transfersInFlight.fetch_sub(1);
+                if (!account) {
+                    std::cerr << "Transfer reservation of " << message.cents / 100.0 << " on account "
+                              << message.accountId << " outlived its account" << std::endl;
+                    answer(message, false);
+                    return;
+                }
+                account->reservedCents -= message.cents;
+                if (message.op == ShardOp::Confirm) {
+                    book(shard, "Transfer Out", -message.cents, message,
+                         transferDescription(message.accountId, message.otherAccountId), true);
+                    answer(message, true);
+                    return;
+                }
+                if (ruleEngine) {
+                    ruleEngine->release(message.accountId, account->customerId, "Transfer Out",
+                                        message.cents / 100.0, message.rule);
+                }
+                account->balanceCents += message.cents;
+                answer(message, false);
+                return;
+            
+            case ShardOp::Balance:
+                if (message.reply) {
+                    message.reply->balanceCents = usable ? account->balanceCents : 0;
+                }
+                answer(message, usable);
+                return;
+            
+            case ShardOp::Close:
+                if (!usable || account->balanceCents != 0 || account->reservedCents != 0) {
+                    answer(message, false);
+                    return;
+                }
+                account->closed = true;
+                answer(message, true);
+                return;
+            
+            case ShardOp::Reopen:
+                if (account) {
+                    account->closed = false;
+                }
+                answer(message, account != nullptr);
+                return;
+            
+            default:
+                answer(message, false);
+                return;
+        }
+    }
+    
+    void publish(const std::vector<LedgerRow>& rows, const std::vector<std::string>& transactionIds) {
+        std::vector<LedgerEvent> events(rows.size());
+        for (size_t i = 0; i < rows.size(); i++) {
+            const Transaction& transaction = rows[i].transaction;
+            const std::string& id = i < transactionIds.size() ? transactionIds[i] : "NULL";
+            events[i].transactionId = id == "NULL" ? 0 : std::atoi(id.c_str());
+            events[i].accountId = transaction.getAccountId();
+            events[i].counterpartyAccountId = rows[i].counterpartyAccountId;
+            events[i].type = transaction.getType();
+            events[i].amountCents = std::llabs(rows[i].deltaCents);
+            events[i].dateTime = transaction.getDateTime();
+            events[i].description = transaction.getDescription();
+        }
+        eventBus->publish(events.data(), events.size());
+    }
+    
+    // Writes one shard's rows: each row's balance delta, ledger row, checkpoint
+    // and rollup go out in a single multi-statement transaction, together with
+    // the batch id and the ids of the new ledger rows
+    bool persist(const LedgerBatch& batch) {
+        const std::vector<LedgerRow>& rows = batch.rows;
+        std::vector<std::string> statements;
+        statements.reserve(rows.size() * 6 + 4);
+        statements.push_back("START TRANSACTION");
+        std::string select = "SELECT 1";
+        std::string transactionIds = "CONCAT_WS(','";
+        
+        for (size_t i = 0; i < rows.size(); i++) {
+            const LedgerRow& row = rows[i];
+            const Transaction& transaction = row.transaction;
+            statements.push_back("UPDATE accounts SET balance = balance + " + std::to_string(row.deltaCents / 100.0) +
+                                 " WHERE account_id=" + std::to_string(transaction.getAccountId()));
+            statements.push_back(transactionRepository->insertStatement(transaction, "TRUE"));
+            if (eventBus) {
+                statements.push_back("SET @bms_tx" + std::to_string(i) + " = LAST_INSERT_ID()");
+                select += ", @bms_tx" + std::to_string(i);
+                transactionIds += ", @bms_tx" + std::to_string(i);
+            }
+            if (!row.idempotencyKey.empty()) {
+                statements.push_back(transactionRepository->idempotencyKeyStatement(row.idempotencyKey,
+                                                                                    transaction.getDateTime(), "TRUE"));
+            }
+            statements.push_back(transactionRepository->checkpointStatement(transaction, "TRUE"));
+            statements.push_back(transactionRepository->rollupStatement(transaction, "TRUE", true));
+        }
+        statements.push_back("INSERT INTO ledger_batches (batch_id, row_count, transaction_ids, written_at) VALUES (" +
+                             std::to_string(batch.id) + ", " + std::to_string(rows.size()) + ", " +
+                             (eventBus ? transactionIds + ")" : "NULL") + ", '" + Clock::nowText() + "')");
+        statements.push_back("COMMIT");
+        statements.push_back(select);
+        
+        std::vector<std::vector<std::vector<std::string>>> results;
+        bool ok = db->executeBatch(statements, results);
+        for (const auto& row : rows) {
+            transactionRepository->invalidateRollups(row.transaction.getAccountId());
+        }
+        if (!ok) {
+            return false;
+        }
+        rowsWritten.fetch_add(rows.size(), std::memory_order_relaxed);
+        
+        if (eventBus) {
+            const auto& ids = results.back();
+            std::vector<std::string> transactionIdList;
+            if (!ids.empty() && !ids[0].empty()) {
+                transactionIdList.assign(ids[0].begin() + 1, ids[0].end());
+            }
+            publish(rows, transactionIdList);
+        }
+        return true;
+    }
+    
+    // Tells whether an attempt whose answer was lost did commit; a committed
+    // batch is counted and its events published from the recorded row ids
+    BatchState lookup(const LedgerBatch& batch) {
+        std::vector<std::vector<std::string>> results;
+        if (!db->executeQuery("SELECT transaction_ids FROM ledger_batches WHERE batch_id=" +
+                              std::to_string(batch.id), results)) {
+            return BatchState::Unknown;
+        }
+        if (results.empty()) {
+            return BatchState::Missing;
+        }
+        rowsWritten.fetch_add(batch.rows.size(), std::memory_order_relaxed);
+        
+        if (eventBus) {
+            std::vector<std::string> transactionIds;
+            std::stringstream ids(results[0].empty() ? std::string() : results[0][0]);
+            std::string id;
+            while (std::getline(ids, id, ',')) {
+                transactionIds.push_back(id);
+            }
+            publish(batch.rows, transactionIds);
+        }
+        return BatchState::Written;
+    }
+    
+    // Resends the batch only when the database does not already hold it, so
+    // no retry applies a row twice
+    bool write(LedgerBatch& batch) {
+        for (int attempt = 1; ; attempt++) {
+            BatchState state = batch.sent ? lookup(batch) : BatchState::Missing;
+            if (state == BatchState::Written) {
+                return true;
+            }
+            if (state == BatchState::Missing) {
+                batch.sent = true;
+                if (persist(batch)) {
+                    return true;
+                }
+            }
+            if (attempt >= config.writeAttempts) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(kRetryDelayMs));
+        }
+    }
+    
+    void flush(Shard& shard) {
+        if (shard.flushing.load(std::memory_order_acquire)) {
+            return;
+        }
+        
+        // One batch in flight per shard keeps each shard's rows in order
+        if (shard.unwritten && !stopping && std::chrono::steady_clock::now() < shard.unwritten->retryAt) {
+            return;
+        }
+        std::shared_ptr<LedgerBatch> batch = std::move(shard.unwritten);
+        if (!batch) {
+            if (shard.pending.empty()) {
+                return;
+            }
+            batch = std::make_shared<LedgerBatch>();
+            batch->id = idGenerator->nextId();
+            size_t count = std::min(shard.pending.size(), config.maxBatchRows);
+            batch->rows.reserve(count);
+            for (size_t i = 0; i < count; i++) {
+                batch->rows.push_back(std::move(shard.pending.front()));
+                shard.pending.pop_front();
+            }
+        }
+        shard.flushing.store(true, std::memory_order_release);
+        shard.lastFlush = std::chrono::steady_clock::now();
+        
+        Shard* target = &shard;
+        writers->submit([this, target, batch] {
+            // Balances are already committed in memory, so a batch is only given up on while stopping
+            if (!write(*batch)) {
+                batchesFailed.fetch_add(1);
+                if (stopping) {
+                    rowsDropped.fetch_add(batch->rows.size());
+                    std::cerr << "Dropped ledger batch " << batch->id << " of " << batch->rows.size()
+                              << " rows after repeated write failures" << std::endl;
+                } else {
+                    // Backs off up to about 50 s between rounds of attempts
+                    int delayMs = kRetryDelayMs << std::min(++batch->setAside, 8);
+                    batch->retryAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs);
+                    std::cerr << "Ledger batch " << batch->id << " of " << batch->rows.size() << " rows not written after "
+                              << config.writeAttempts << " attempts; retrying in " << delayMs << " ms" << std::endl;
+                    target->unwritten = batch;
+                }
+            }
+            target->flushing.store(false, std::memory_order_release);
+            wake(*target);
+        });
+    }
+    
+    void run(size_t index) {
+        Shard& shard = *shards[index];
+        const auto interval = std::chrono::milliseconds(config.flushIntervalMs);
+        int idle = 0;
+        Message message;
+        
+        while (true) {
+            // Behind on writes: keep serving other shards, which may hold
+            // reservations, but leave callers waiting on full queues
+            size_t queues = shard.pending.size() >= config.maxPendingRows ? shards.size() : shard.inbound.size();
+            size_t handled = 0;
+            for (size_t q = 0; q < queues; q++) {
+                SpscQueue<Message>& queue = *shard.inbound[q];
+                for (int taken = 0; taken < 64 && queue.pop(message); taken++) {
+                    process(index, message);
+                    message = Message();
+                    handled++;
+                }
+            }
+            retryOverflow(index);
+            
+            bool idleFlush = !shard.pending.empty() && std::chrono::steady_clock::now() - shard.lastFlush >= interval;
+            bool setAside = !shard.flushing.load(std::memory_order_acquire) && shard.unwritten;
+            if (shard.pending.size() >= config.maxBatchRows || idleFlush || setAside || !shard.syncWaiters.empty() ||
+                stopping.load(std::memory_order_acquire)) {
+                flush(shard);
+            }
+            
+            bool written = shard.pending.empty() && !shard.flushing.load(std::memory_order_acquire) &&
+                           !shard.unwritten;
+            if (written && !shard.syncWaiters.empty()) {
+                for (auto& waiter : shard.syncWaiters) {
+                    waiter->done.set_value(true);
+                }
+                shard.syncWaiters.clear();
+            }
+            
+            if (handled > 0) {
+                idle = 0;
+                continue;
+            }
+            
+            bool parked = false;
+            for (const auto& queue : shard.overflow) {
+                parked = parked || !queue.empty();
+            }
+            if (stopping.load(std::memory_order_acquire) && written && !parked && transfersInFlight.load() == 0) {
+                bool drained = true;
+                for (const auto& queue : shard.inbound) {
+                    drained = drained && queue->empty();
+                }
+                if (drained) {
+                    return;
+                }
+            }
+            
+            if (++idle < 64) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(shard.wakeMutex);
+            shard.sleeping.store(true);
+            bool empty = true;
+            for (const auto& queue : shard.inbound) {
+                empty = empty && queue->empty();
+            }
+            if (empty) {
+                shard.wakeup.wait_for(lock, parked ? std::chrono::milliseconds(1) : interval);
+            }
+            shard.sleeping.store(false);
+        }
+    }
+    
+    std::future<bool> submitMovement(ShardOp op, int accountId, int otherAccountId, double amount,
+                                     const std::string& idempotencyKey) {
+        Message message;
+        message.op = op;
+        message.accountId = accountId;
+        message.otherAccountId = otherAccountId;
+        message.cents = std::llround(amount * 100);
+        message.reply = std::make_shared<Reply>();
+        message.idempotencyKey = idempotencyKey;
+        message.dateTime = Clock::nowText();
+        
+        std::future<bool> result = message.reply->done.get_future();
+        send(std::move(message));
+        return result;
+    }
+    
+    bool request(ShardOp op, int accountId, long long* balanceCents = nullptr) {
+        Message message;
+        message.op = op;
+        message.accountId = accountId;
+        message.reply = std::make_shared<Reply>();
+        std::shared_ptr<Reply> reply = message.reply;
+        
+        std::future<bool> result = reply->done.get_future();
+        send(std::move(message));
+        bool ok = result.get();
+        if (balanceCents) {
+            *balanceCents = reply->balanceCents;
+        }
+        return ok;
+    }
+    
+    static bool validMovement(double amount, int fromAccountId, int toAccountId) {
+        if (amount <= 0 || std::llround(amount * 100) <= 0) {
+            std::cerr << "Invalid amount" << std::endl;
+            return false;
+        }
+        if (toAccountId != 0 && fromAccountId == toAccountId) {
+            std::cerr << "Cannot transfer to the same account" << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // Same contract as AccountService::runIdempotent. Rows are written behind,
+    // so the stored keys are checked before the movement rather than after.
+    template <typename Movement>
+    bool runIdempotent(const std::string& idempotencyKey, Movement movement) {
+        if (idempotencyKey.empty()) {
+            return movement();
+        }
+        if (idempotencyKey.size() > 64) {
+            std::cerr << "Idempotency key is longer than 64 characters" << std::endl;
+            return false;
+        }
+        
+        bool result = false;
+        if (idempotencyCache->acquire(idempotencyKey, result) == IdempotencyCache::Claim::Completed) {
+            return result;
+        }
+        if (transactionRepository->hasIdempotencyKey(idempotencyKey)) {
+            idempotencyCache->complete(idempotencyKey, true);
+            return true;
+        }
+        
+        result = movement();
+        if (result) {
+            idempotencyCache->complete(idempotencyKey, result);
+        } else {
+            idempotencyCache->release(idempotencyKey);
+        }
+        return result;
+    }
+    
+public:
+    ShardedAccountService(std::shared_ptr<IAccountService> inner,
+                          std::shared_ptr<IDatabase> db,
+                          std::shared_ptr<AccountRepository> accountRepo,
+                          std::shared_ptr<TransactionRepository> transactionRepo,
+                          const ShardedLedgerConfig& shardConfig = ShardedLedgerConfig(),
+                          std::shared_ptr<VelocityRuleEngine> ruleEngine = nullptr,
+                          std::shared_ptr<LedgerEventBus> eventBus = nullptr,
+                          std::shared_ptr<IdGenerator> idGenerator = nullptr,
+                          std::shared_ptr<HotAccountRepository> hotAccounts = nullptr)
+        : ForwardingAccountService(inner), db(db), accountRepository(accountRepo),
+          transactionRepository(transactionRepo), ruleEngine(ruleEngine), eventBus(eventBus),
+          idempotencyCache(std::make_shared<IdempotencyCache>()),
+          idGenerator(idGenerator ? idGenerator : std::make_shared<IdGenerator>()), hotAccounts(hotAccounts),
+          config(shardConfig),
+          stopping(false), transfersInFlight(0), rowsWritten(0), batchesFailed(0), rowsDropped(0) {
+        size_t count = config.shards ? config.shards : std::max(1u, std::thread::hardware_concurrency());
+        config.clientLanes = std::max<size_t>(config.clientLanes, 1);
+        config.flushIntervalMs = std::max(config.flushIntervalMs, 1);
+        config.maxBatchRows = std::max<size_t>(config.maxBatchRows, 1);
+        config.writeAttempts = std::max(config.writeAttempts, 1);
+        writers.reset(new WorkerPool(std::min<size_t>(count, 4)));
+        
+        for (size_t i = 0; i < count; i++) {
+            std::unique_ptr<Shard> shard(new Shard());
+            for (size_t j = 0; j < count + config.clientLanes; j++) {
+                shard->inbound.emplace_back(new SpscQueue<Message>(config.queueCapacity));
+            }
+            shard->laneLocks.reset(new std::mutex[config.clientLanes]);
+            shard->overflow.resize(count);
+            shard->lastFlush = std::chrono::steady_clock::now();
+            shards.push_back(std::move(shard));
+        }
+        for (size_t i = 0; i < count; i++) {
+            shards[i]->thread = std::thread(&ShardedAccountService::run, this, i);
+        }
+    }
+    
+    ~ShardedAccountService() {
+        stop();
+    }
+    
+    // Finishes accepted movements and writes every pending row
+    void stop() {
+        if (stopping.exchange(true)) {
+            return;
+        }
+        for (auto& shard : shards) {
+            wake(*shard);
+        }
+        for (auto& shard : shards) {
+            shard->thread.join();
+        }
+        writers.reset();
+    }
+    
+    size_t shardCount() const { return shards.size(); }
+    std::uint64_t getRowsWritten() const { return rowsWritten.load(); }
+    std::uint64_t getBatchesFailed() const { return batchesFailed.load(); }
+    std::uint64_t getRowsDropped() const { return rowsDropped.load(); }
+    
+    void registerMetrics(MetricsRegistry& metrics, const std::string& labels) override {
+        metrics.counterFunction("bank_ledger_rows_written_total", "Ledger rows written behind by the shards", labels,
+                                [this] { return static_cast<double>(getRowsWritten()); });
+        metrics.counterFunction("bank_ledger_batch_failures_total",
+                                "Ledger batches that used up their write attempts", labels,
+                                [this] { return static_cast<double>(getBatchesFailed()); });
+        metrics.counterFunction("bank_ledger_rows_dropped_total", "Ledger rows given up on while stopping", labels,
+                                [this] { return static_cast<double>(getRowsDropped()); });
+    }
+    
+    // Waits until every movement accepted so far is in the database
+    void sync() {
+        std::vector<std::future<bool>> pending;
+        for (size_t i = 0; i < shards.size(); i++) {
+            Message message;
+            message.op = ShardOp::Sync;
+            message.reply = std::make_shared<Reply>();
+            pending.push_back(message.reply->done.get_future());
+            send(i, std::move(message));
+        }
+        for (auto& result : pending) {
+            result.get();
+        }
+    }
+    
+    // The shard refuses to close while a transfer from the account is
+    // outstanding; the cached account is only dropped once the wrapped
+    // service has closed it, and reopened if it did not
+    bool closeAccount(int accountId) override {
+        if (!request(ShardOp::Close, accountId)) {
+            return false;
+        }
+        sync();
+        if (!inner->closeAccount(accountId)) {
+            request(ShardOp::Reopen, accountId);
+            return false;
+        }
+        request(ShardOp::Forget, accountId);
+        return true;
+    }
+    
+    bool deposit(int accountId, double amount) override {
+        return deposit(accountId, amount, std::string());
+    }
+    
+    bool withdraw(int accountId, double amount) override {
+        return withdraw(accountId, amount, std::string());
+    }
+    
+    bool transfer(int fromAccountId, int toAccountId, double amount) override {
+        return transfer(fromAccountId, toAccountId, amount, std::string());
+    }
+    
+    bool deposit(int accountId, double amount, const std::string& idempotencyKey) override {
+        if (!validMovement(amount, accountId, 0)) {
+            return false;
+        }
+        return runIdempotent(idempotencyKey, [&] {
+            return submitMovement(ShardOp::Deposit, accountId, 0, amount, idempotencyKey).get();
+        });
+    }
+    
+    bool withdraw(int accountId, double amount, const std::string& idempotencyKey) override {
+        if (!validMovement(amount, accountId, 0)) {
+            return false;
+        }
+        return runIdempotent(idempotencyKey, [&] {
+            return submitMovement(ShardOp::Withdraw, accountId, 0, amount, idempotencyKey).get();
+        });
+    }
+    
+    bool transfer(int fromAccountId, int toAccountId, double amount, const std::string& idempotencyKey) override {
+        if (!validMovement(amount, fromAccountId, toAccountId)) {
+            return false;
+        }
+        return runIdempotent(idempotencyKey, [&] {
+            return submitMovement(ShardOp::Reserve, fromAccountId, toAccountId, amount, idempotencyKey).get();
+        });
+    }
+    
+    // The shards decide in memory, so a refusal is final unless an account could not be loaded
+    TransferLeg settleTransfer(int fromAccountId, int toAccountId, double amount,
+                               const std::string& idempotencyKey) override {
+        if (transfer(fromAccountId, toAccountId, amount, idempotencyKey)) {
+            return TransferLeg::Applied;
+        }
+        bool found = false;
+        if (!inner->accountExists(fromAccountId, found) || !inner->accountExists(toAccountId, found)) {
+            return TransferLeg::Unreachable;
+        }
+        return TransferLeg::Refused;
+    }
+    
+    std::unique_ptr<Account> getAccount(int accountId) override {
+        auto account = inner->getAccount(accountId);
+        long long cents;
+        if (account && request(ShardOp::Balance, accountId, &cents)) {
+            account->setBalance(cents / 100.0);
+        }
+        return account;
+    }
+    
+    std::vector<std::unique_ptr<Account>> getCustomerAccounts(int customerId) override {
+        auto accounts = inner->getCustomerAccounts(customerId);
+        long long cents;
+        for (auto& account : accounts) {
+            if (request(ShardOp::Balance, account->getId(), &cents)) {
+                account->setBalance(cents / 100.0);
+            }
+        }
+        return accounts;
+    }
+    
+    std::vector<AccountRecord> getCustomerAccountRecords(int customerId) override {
+        auto records = inner->getCustomerAccountRecords(customerId);
+        long long cents;
+        for (auto& record : records) {
+            if (request(ShardOp::Balance, record.id, &cents)) {
+                record.balance = cents / 100.0;
+            }
+        }
+        return records;
+    }
+    
+    double getBalance(int accountId) override {
+        long long cents;
+        return request(ShardOp::Balance, accountId, &cents) ? cents / 100.0 : -1;
+    }
+    
+    double getBalanceAsOf(int accountId, const std::string& timestamp) override {
+        sync();
+        return inner->getBalanceAsOf(accountId, timestamp);
+    }
+    
+    // Completed by the shard itself; no worker thread waits on them
+    std::future<bool> depositAsync(int accountId, double amount) override {
+        if (!validMovement(amount, accountId, 0)) {
+            std::promise<bool> rejected;
+            rejected.set_value(false);
+            return rejected.get_future();
+        }
+        return submitMovement(ShardOp::Deposit, accountId, 0, amount, std::string());
+    }
+    
+    std::future<bool> withdrawAsync(int accountId, double amount) override {
+        if (!validMovement(amount, accountId, 0)) {
+            std::promise<bool> rejected;
+            rejected.set_value(false);
+            return rejected.get_future();
+        }
+        return submitMovement(ShardOp::Withdraw, accountId, 0, amount, std::string());
+    }
+    
+    std::future<bool> transferAsync(int fromAccountId, int toAccountId, double amount) override {
+        if (!validMovement(amount, fromAccountId, toAccountId)) {
+            std::promise<bool> rejected;
+            rejected.set_value(false);
+            return rejected.get_future();
+        }
+        return submitMovement(ShardOp::Reserve, fromAccountId, toAccountId, amount, std::string());
+    }
+    
+    std::future<double> getBalanceAsync(int accountId) override {
+        return std::async(std::launch::deferred, [this, accountId] { return getBalance(accountId); });
+    }
+};
+
+class TransactionService : public ITransactionService {
+private:
+    std::shared_ptr<TransactionRepository> repository;
+    
+public:
+    TransactionService(std::shared_ptr<TransactionRepository> repository) 
+        : repository(repository) {}
+    
+    bool recordTransaction(const Transaction& transaction) override {
+        return repository->add(transaction);
+    }
+    
+    std::vector<std::unique_ptr<Transaction>> getAccountTransactions(int accountId) override {
+        return repository->getByAccountId(accountId);
+    }
+    
+    std::unique_ptr<Transaction> getTransaction(int transactionId) override {
+        return repository->getById(transactionId);
+    }
+    
+    bool forEachAccountTransaction(int accountId, const std::function<bool(const Transaction&)>& visit) override {
+        return repository->forEachByAccountId(accountId, visit);
+    }
+    
+    bool getTransactionPage(int accountId, int afterId, size_t limit,
+                            std::vector<Transaction>& page, bool& more) override {
+        return repository->getPageByAccountId(accountId, afterId, limit, page, more);
+    }
+    
+    std::vector<DailyRollup> getDailyRollups(int accountId, const std::string& fromDay,
+                                             const std::string& toDay) override {
+        return repository->getDailyRollups(accountId, fromDay, toDay);
+    }
+};
+
+// Customer service over several database shards (see ShardMap). New customers
+// are spread round robin; everything else goes to the shard named by the id.
+// Listings and searches ask every shard at once and merge the answers by id.
+class DistributedCustomerService : public ICustomerService {
+private:
+    std::vector<std::shared_ptr<ICustomerService>> shards;
+    std::shared_ptr<ShardMap> shardMap;
+    
+    ICustomerService& shardFor(int customerId) {
+        return *shards[shardMap->shardOf(customerId)];
+    }
+    
+    std::vector<std::unique_ptr<Customer>> gather(
+        const std::function<std::vector<std::unique_ptr<Customer>>(ICustomerService&)>& query) {
+        std::vector<std::vector<std::unique_ptr<Customer>>> parts(shards.size());
+        shardMap->scatter([&](size_t shard) {
+            parts[shard] = query(*shards[shard]);
+        });
+        
+        std::vector<std::unique_ptr<Customer>> customers;
+        for (auto& part : parts) {
+            std::move(part.begin(), part.end(), std::back_inserter(customers));
+        }
+        std::sort(customers.begin(), customers.end(),
+                  [](const std::unique_ptr<Customer>& a, const std::unique_ptr<Customer>& b) {
+                      return a->getId() < b->getId();
+                  });
+        return customers;
+    }
+    
+public:
+    DistributedCustomerService(std::vector<std::shared_ptr<ICustomerService>> shards,
+                               std::shared_ptr<ShardMap> shardMap)
+        : shards(std::move(shards)), shardMap(shardMap) {}
+    
+    bool addCustomer(const Customer& customer) override {
+        return shards[shardMap->shardForNewCustomer()]->addCustomer(customer);
+    }
+    
+    bool updateCustomer(const Customer& customer) override {
+        return shardFor(customer.getId()).updateCustomer(customer);
+    }
+    
+    bool removeCustomer(int customerId) override {
+        return shardFor(customerId).removeCustomer(customerId);
+    }
+    
+    std::unique_ptr<Customer> getCustomer(int customerId) override {
+        return shardFor(customerId).getCustomer(customerId);
+    }
+    
+    std::vector<std::unique_ptr<Customer>> getAllCustomers() override {
+        return gather([](ICustomerService& shard) { return shard.getAllCustomers(); });
+    }
+    
+    std::vector<std::unique_ptr<Customer>> searchCustomers(const std::string& query, size_t limit) override {
+        auto customers = gather([&](ICustomerService& shard) { return shard.searchCustomers(query, limit); });
+        if (customers.size() > limit) {
+            customers.resize(limit);
+        }
+        return customers;
+    }
+    
+    // Visits one shard after another, each in id order
+    bool forEachCustomer(const std::function<bool(const Customer&)>& visit) override {
+        bool more = true;
+        for (auto& shard : shards) {
+            bool ok = shard->forEachCustomer([&](const Customer& customer) {
+                more = visit(customer);
+                return more;
+            });
+            if (!ok) {
+                return false;
+            }
+            if (!more) {
+                break;
+            }
+        }
+        return true;
+    }
+    
+    // A customer's accounts and transactions live on the customer's shard
+    bool getCustomerOverview(int customerId, size_t recentTransactions, CustomerOverview& overview) override {
+        return shardFor(customerId).getCustomerOverview(customerId, recentTransactions, overview);
+    }
+};
+
+// Account service over several database shards (see ShardMap). Calls go to
+// the shard of the account, or of the customer for new accounts and listings.
+// A transfer within one shard is the usual single transaction. A transfer
+// between shards is a saga of local transactions: the source debits and
+// records the transfer as pending, the destination credits it at most once,
+// and the source marks it completed - or credits the money back when the
+// destination refuses (e.g. the account does not exist). A transfer whose
+// destination did not answer stays pending until recoverTransfers().
+class DistributedAccountService : public IAccountService {
+private:
+    std::vector<std::shared_ptr<AccountService>> shards;
+    std::shared_ptr<ShardMap> shardMap;
+    std::shared_ptr<WorkerPool> executor;
+    std::shared_ptr<IdGenerator> idGenerator;
+    
+    AccountService& shardFor(int accountId) {
+        return *shards[shardMap->shardOf(accountId)];
+    }
+    
+    template <typename Operation>
+    auto runAsync(Operation operation) -> std::future<decltype(operation())> {
+        if (executor) {
+            return executor->submit(std::move(operation));
+        }
+        
+        // No executor configured: complete on the calling thread
+        std::packaged_task<decltype(operation())()> task(std::move(operation));
+        auto future = task.get_future();
+        task();
+        return future;
+    }
+    
+    // Drives a transfer already debited at its source to its end
+    TransferLeg finishTransfer(const CrossShardTransfer& transfer) {
+        AccountService& source = shardFor(transfer.fromAccountId);
+        TransferLeg credit = shardFor(transfer.toAccountId).transferIn(transfer);
+        
+        if (credit == TransferLeg::Applied) {
+            if (!source.completeTransfer(transfer.transferId)) {
+                std::cerr << "Transfer " << transfer.transferId << " was credited but is still marked pending"
+                          << std::endl;
+            }
+        } else if (credit == TransferLeg::Refused) {
+            std::cerr << "Account " << transfer.toAccountId << " refused transfer " << transfer.transferId
+                      << "; returning the amount to account " << transfer.fromAccountId << std::endl;
+            if (!source.reverseTransferOut(transfer)) {
+                std::cerr << "Transfer " << transfer.transferId << " could not be reversed yet" << std::endl;
+                return TransferLeg::Unreachable;
+            }
+        } else {
+            std::cerr << "Transfer " << transfer.transferId
+                      << " is pending: the destination shard did not answer" << std::endl;
+        }
+        return credit;
+    }
+    
+public:
+    DistributedAccountService(std::vector<std::shared_ptr<AccountService>> shards,
+                              std::shared_ptr<ShardMap> shardMap,
+                              std::shared_ptr<WorkerPool> executor = nullptr,
+                              std::shared_ptr<IdGenerator> idGenerator = nullptr)
+        : shards(std::move(shards)), shardMap(shardMap), executor(executor),
+          idGenerator(idGenerator ? idGenerator : std::make_shared<IdGenerator>()) {}
+    
+    // Finishes transfers left pending by a crash or an unreachable shard.
+    // Returns how many are still pending.
+    size_t recoverTransfers() {
+        size_t stillPending = 0;
+        for (auto& shard : shards) {
+            for (const auto& transfer : shard->pendingTransfers()) {
+                if (finishTransfer(transfer) == TransferLeg::Unreachable) {
+                    stillPending++;
+                }
+            }
+        }
+        return stillPending;
+    }
+    
+    bool openAccount(Account& account) override {
+        return shards[shardMap->shardOf(account.getCustomerId())]->openAccount(account);
+    }
+    
+    bool closeAccount(int accountId) override {
+        return shardFor(accountId).closeAccount(accountId);
+    }
+    
+    bool deposit(int accountId, double amount) override {
+        return shardFor(accountId).deposit(accountId, amount);
+    }
+    
+    bool withdraw(int accountId, double amount) override {
+        return shardFor(accountId).withdraw(accountId, amount);
+    }
+    
+    bool transfer(int fromAccountId, int toAccountId, double amount) override {
+        return transfer(fromAccountId, toAccountId, amount, std::string());
+    }
+    
+    bool deposit(int accountId, double amount, const std::string& idempotencyKey) override {
+        return shardFor(accountId).deposit(accountId, amount, idempotencyKey);
+    }
+    
+    bool withdraw(int accountId, double amount, const std::string& idempotencyKey) override {
+        return shardFor(accountId).withdraw(accountId, amount, idempotencyKey);
+    }
+    
+    bool transfer(int fromAccountId, int toAccountId, double amount, const std::string& idempotencyKey) override {
+        return settleTransfer(fromAccountId, toAccountId, amount, idempotencyKey) == TransferLeg::Applied;
+    }
+    
+    // A keyed transfer is named after its key, so a retry resumes the first attempt.
+    // Unreachable covers a transfer left pending at its source: a retry finishes it.
+    TransferLeg settleTransfer(int fromAccountId, int toAccountId, double amount,
+                               const std::string& idempotencyKey) override {
+        AccountService& source = shardFor(fromAccountId);
+        if (shardMap->shardOf(fromAccountId) == shardMap->shardOf(toAccountId)) {
+            return source.settleTransfer(fromAccountId, toAccountId, amount, idempotencyKey);
+        }
+        
+        CrossShardTransfer transfer = {
+            idempotencyKey.empty() ? std::to_string(idGenerator->nextId()) : "key:" + idempotencyKey,
+            fromAccountId, toAccountId, amount, "pending", Clock::nowText()
+        };
+        
+        TransferLeg debit = source.transferOut(transfer, idempotencyKey);
+        if (debit != TransferLeg::Applied) {
+            return debit;
+        }
+        
+        if (!idempotencyKey.empty()) {
+            bool found = false;
+            if (!source.findTransfer(transfer.transferId, transfer, found) || !found) {
+                return TransferLeg::Unreachable;
+            }
+            if (transfer.state != "pending") {
+                return transfer.state == "completed" ? TransferLeg::Applied : TransferLeg::Refused;
+            }
+        }
+        
+        return finishTransfer(transfer);
+    }
+    
+    std::unique_ptr<Account> getAccount(int accountId) override {
+        return shardFor(accountId).getAccount(accountId);
+    }
+    
+    bool accountExists(int accountId, bool& found) override {
+        return shardFor(accountId).accountExists(accountId, found);
+    }
+    
+    std::vector<std::unique_ptr<Account>> getCustomerAccounts(int customerId) override {
+        return shards[shardMap->shardOf(customerId)]->getCustomerAccounts(customerId);
+    }
+    
+    std::vector<AccountRecord> getCustomerAccountRecords(int customerId) override {
+        return shards[shardMap->shardOf(customerId)]->getCustomerAccountRecords(customerId);
+    }
+    
+    double getBalance(int accountId) override {
+        return shardFor(accountId).getBalance(accountId);
+    }
+    
+    double getBalanceAsOf(int accountId, const std::string& timestamp) override {
+        return shardFor(accountId).getBalanceAsOf(accountId, timestamp);
+    }
+    
+    std::future<bool> depositAsync(int accountId, double amount) override {
+        return runAsync([this, accountId, amount] { return deposit(accountId, amount); });
+    }
+    
+    std::future<bool> withdrawAsync(int accountId, double amount) override {
+        return runAsync([this, accountId, amount] { return withdraw(accountId, amount); });
+    }
+    
+    std::future<bool> transferAsync(int fromAccountId, int toAccountId, double amount) override {
+        return runAsync([this, fromAccountId, toAccountId, amount] {
+            return transfer(fromAccountId, toAccountId, amount);
+        });
+    }
+    
+    std::future<double> getBalanceAsync(int accountId) override {
+        return runAsync([this, accountId] { return getBalance(accountId); });
+    }
+};
+
+// Transaction service over several database shards (see ShardMap); ledger
+// rows live on their account's shard
+class DistributedTransactionService : public ITransactionService {
+private:
+    std::vector<std::shared_ptr<ITransactionService>> shards;
+    std::shared_ptr<ShardMap> shardMap;
+    
+    ITransactionService& shardFor(int id) {
+        return *shards[shardMap->shardOf(id)];
+    }
+    
+public:
+    DistributedTransactionService(std::vector<std::shared_ptr<ITransactionService>> shards,
+                                  std::shared_ptr<ShardMap> shardMap)
+        : shards(std::move(shards)), shardMap(shardMap) {}
+    
+    bool recordTransaction(const Transaction& transaction) override {
+        return shardFor(transaction.getAccountId()).recordTransaction(transaction);
+    }
+    
+    std::vector<std::unique_ptr<Transaction>> getAccountTransactions(int accountId) override {
+        return shardFor(accountId).getAccountTransactions(accountId);
+    }
+    
+    std::unique_ptr<Transaction> getTransaction(int transactionId) override {
+        return shardFor(transactionId).getTransaction(transactionId);
+    }
+    
+    bool forEachAccountTransaction(int accountId, const std::function<bool(const Transaction&)>& visit) override {
+        return shardFor(accountId).forEachAccountTransaction(accountId, visit);
+    }
+    
+    bool getTransactionPage(int accountId, int afterId, size_t limit,
+                            std::vector<Transaction>& page, bool& more) override {
+        return shardFor(accountId).getTransactionPage(accountId, afterId, limit, page, more);
+    }
+    
+    std::vector<DailyRollup> getDailyRollups(int accountId, const std::string& fromDay,
+                                             const std::string& toDay) override {
+        return shardFor(accountId).getDailyRollups(accountId, fromDay, toDay);
+    }
+};
+
+struct TransactionPartition {
+    std::string name;           // pYYYYMM, or pmax for the catch-all
+    std::string month;          // "YYYY-MM"; empty for pmax
+};
+
+// Monthly RANGE COLUMNS(date_time) partitions of `transactions`. The
+// partition pYYYYMM holds rows before the first day of the following month
+// (the oldest one also holds anything earlier), and pmax catches the rest
+// until ensurePartitioned() splits new months off it.
+class TransactionPartitions {
+private:
+    std::shared_ptr<IDatabase> db;
+    
+    static std::string nameFor(const std::string& month) {
+        return "p" + month.substr(0, 4) + month.substr(5, 2);
+    }
+    
+    // Partition clauses for months first..last inclusive
+    static bool monthClauses(const std::string& first, const std::string& last, std::string& clauses) {
+        std::string month = first;
+        while (month <= last) {
+            std::string next;
+            if (!shiftMonth(month, 1, next)) {
+                return false;
+            }
+            clauses += "PARTITION " + nameFor(month) + " VALUES LESS THAN ('" + next + "-01'), ";
+            month = next;
+        }
+        return true;
+    }
+    
+    bool columnExists(const std::string& column) {
+        std::vector<std::vector<std::string>> results;
+        return db->executeQuery("SELECT COUNT(*) FROM information_schema.columns WHERE table_schema = DATABASE() "
+                                "AND table_name = 'transactions' AND column_name = '" + column + "'", results) &&
+               !results.empty() && results[0][0] != "0";
+    }
+    
+    // Partitioned InnoDB tables allow no foreign keys, and every unique key
+    // must include date_time, so the first conversion rewrites those keys
+    bool partitionTable(const std::string& lastMonth) {
+        std::vector<std::vector<std::string>> results;
+        
+        if (!db->executeQuery("SELECT CONSTRAINT_NAME FROM information_schema.referential_constraints "
+                              "WHERE constraint_schema = DATABASE() AND table_name = 'transactions'", results)) {
+            return false;
+        }
+        for (const auto& row : results) {
+            if (!db->executeQuery("ALTER TABLE transactions DROP FOREIGN KEY " + row[0])) {
+                return false;
+            }
+        }
+        
+        // Idempotency keys used to live on the ledger row itself
+        if (columnExists("idempotency_key")) {
+            if (!db->executeQuery("INSERT IGNORE INTO idempotency_keys (idempotency_key, transaction_id, created_at) "
+                                  "SELECT idempotency_key, transaction_id, date_time FROM transactions "
+                                  "WHERE idempotency_key IS NOT NULL") ||
+                !db->executeQuery("ALTER TABLE transactions DROP COLUMN idempotency_key")) {
+                return false;
+            }
+        }
+        
+        results.clear();
+        if (!db->executeQuery("SELECT COUNT(*) FROM information_schema.key_column_usage WHERE "
+                              "table_schema = DATABASE() AND table_name = 'transactions' "
+                              "AND constraint_name = 'PRIMARY'", results) || results.empty()) {
+            return false;
+        }
+        if (results[0][0] == "1" &&
+            !db->executeQuery("ALTER TABLE transactions DROP PRIMARY KEY, ADD PRIMARY KEY (transaction_id, date_time)")) {
+            return false;
+        }
+        
+        // Start at the oldest month on file so existing rows spread over their months
+        std::string firstMonth = lastMonth;
+        results.clear();
+        if (!db->executeQuery("SELECT MIN(date_time) FROM transactions", results)) {
+            return false;
+        }
+        std::string oldest;
+        if (!results.empty() && results[0][0] != "NULL" && shiftMonth(results[0][0].substr(0, 7), 0, oldest) &&
+            oldest < firstMonth) {
+            firstMonth = oldest;
+        }
+        std::string thisMonth = Clock::today().substr(0, 7);
+        if (thisMonth < firstMonth) {
+            firstMonth = thisMonth;
+        }
+        
+        std::string clauses;
+        if (!monthClauses(firstMonth, lastMonth, clauses)) {
+            return false;
+        }
+        
+        return db->executeQuery("ALTER TABLE transactions PARTITION BY RANGE COLUMNS(date_time) (" + clauses +
+                                "PARTITION pmax VALUES LESS THAN (MAXVALUE))");
+    }
+    
+public:
+    TransactionPartitions(std::shared_ptr<IDatabase> db) : db(db) {}
+    
+    // Partitions in range order; empty while the table is not partitioned
+    bool list(std::vector<TransactionPartition>& partitions) {
+        std::vector<std::vector<std::string>> results;
+        
+        if (!db->executeQuery("SELECT PARTITION_NAME FROM information_schema.partitions WHERE "
+                              "table_schema = DATABASE() AND table_name = 'transactions' "
+                              "ORDER BY PARTITION_ORDINAL_POSITION", results)) {
+            return false;
+        }
+        
+        partitions.clear();
+        for (const auto& row : results) {
+            const std::string& name = row[0];
+            if (name == "NULL") {
+                continue;
+            }
+            std::string month;
+            if (name.size() == 7 && name[0] == 'p' && name != "pmax") {
+                month = name.substr(1, 4) + "-" + name.substr(5, 2);
+            }
+            partitions.push_back({ name, month });
+        }
+        
+        return true;
+    }
+    
+    // Partitions the table on first use and keeps monthsAhead months split off pmax
+    bool ensurePartitioned(int monthsAhead = 3) {
+        std::string lastMonth;
+        if (!shiftMonth(Clock::today().substr(0, 7), monthsAhead, lastMonth)) {
+            return false;
+        }
+        
+        std::vector<TransactionPartition> partitions;
+        if (!list(partitions)) {
+            return false;
+        }
+        if (partitions.empty()) {
+            return partitionTable(lastMonth);
+        }
+        
+        std::string newest;
+        for (const auto& partition : partitions) {
+            if (!partition.month.empty()) {
+                newest = partition.month;
+            }
+        }
+        
+        std::string first;
+        if (newest.empty() || !shiftMonth(newest, 1, first) || first > lastMonth) {
+            return true;
+        }
+        
+        std::string clauses;
+        if (!monthClauses(first, lastMonth, clauses)) {
+            return false;
+        }
+        return db->executeQuery("ALTER TABLE transactions REORGANIZE PARTITION pmax INTO (" + clauses +
+                                "PARTITION pmax VALUES LESS THAN (MAXVALUE))");
+    }
+    
+    bool drop(const std::string& name) {
+        return db->executeQuery("ALTER TABLE transactions DROP PARTITION " + name);
+    }
+};
+
+// Helper for creating database schema
+class DatabaseSetup {
+private:
+    std::shared_ptr<IDatabase> db;
+    
+public:
+    DatabaseSetup(std::shared_ptr<IDatabase> db) : db(db) {}
+    
+    bool createSchema() {
+        // Create customers table
+        std::string createCustomersTable = 
+            "CREATE TABLE IF NOT EXISTS customers ("
+            "customer_id INT AUTO_INCREMENT PRIMARY KEY, "
+            "name VARCHAR(100) NOT NULL, "
+            "address VARCHAR(200), "
+            "phone VARCHAR(20), "
+            "email VARCHAR(100) UNIQUE"
+            ")";
+        
+        if (!db->executeQuery(createCustomersTable)) {
+            return false;
+        }
+        
+        // Create accounts table
+        std::string createAccountsTable = 
+            "CREATE TABLE IF NOT EXISTS accounts ("
+            "account_id INT AUTO_INCREMENT PRIMARY KEY, "
+            "customer_id INT NOT NULL, "
+            "balance DECIMAL(15,2) DEFAULT 0.00, "
+            "account_number VARCHAR(20) UNIQUE NOT NULL, "
+            "account_type VARCHAR(20) NOT NULL, "
+            "date_opened VARCHAR(20) NOT NULL, "
+            "FOREIGN KEY (customer_id) REFERENCES customers(customer_id) ON DELETE CASCADE"
+            ")";
+        
+        if (!db->executeQuery(createAccountsTable)) {
+            return false;
+        }
+        
+        // Create savings_accounts table
+        std::string createSavingsAccountsTable = 
+            "CREATE TABLE IF NOT EXISTS savings_accounts ("
+            "savings_id INT AUTO_INCREMENT PRIMARY KEY, "
+            "account_id INT NOT NULL, "
+            "interest_rate DECIMAL(5,2) DEFAULT 0.00, "
+            "FOREIGN KEY (account_id) REFERENCES accounts(account_id) ON DELETE CASCADE"
+            ")";
+        
+        if (!db->executeQuery(createSavingsAccountsTable)) {
+            return false;
+        }
+        
+        // Create checking_accounts table
+        std::string createCheckingAccountsTable = 
+            "CREATE TABLE IF NOT EXISTS checking_accounts ("
+            "checking_id INT AUTO_INCREMENT PRIMARY KEY, "
+            "account_id INT NOT NULL, "
+            "overdraft_limit DECIMAL(15,2) DEFAULT 0.00, "
+            "FOREIGN KEY (account_id) REFERENCES accounts(account_id) ON DELETE CASCADE"
+            ")";
+        
+        if (!db->executeQuery(createCheckingAccountsTable)) {
+            return false;
+        }
+        
+        // Create transactions table
+        std::string createTransactionsTable = 
+            "CREATE TABLE IF NOT EXISTS transactions ("
+            "transaction_id INT AUTO_INCREMENT, "
+            "account_id INT NOT NULL, "
+            "type VARCHAR(50) NOT NULL, "
+            "amount DECIMAL(15,2) NOT NULL, "
+            "date_time VARCHAR(26) NOT NULL, "
+            "description VARCHAR(200), "
+            "PRIMARY KEY (transaction_id, date_time), "
+            "KEY idx_transactions_account (account_id, transaction_id)"
+            ")";
+        
+        if (!db->executeQuery(createTransactionsTable)) {
+            return false;
+        }
+        
+        // Create idempotency_keys table, one row per keyed money movement
+        std::string createIdempotencyKeysTable = 
+            "CREATE TABLE IF NOT EXISTS idempotency_keys ("
+            "idempotency_key VARCHAR(64) PRIMARY KEY, "
+            "transaction_id INT NOT NULL, "
+            "created_at VARCHAR(26) NOT NULL"
+            ")";
+        
+        if (!db->executeQuery(createIdempotencyKeysTable)) {
+            return false;
+        }
+        
+        // Create cross_shard_transfers table; each side of a transfer between shards keeps its own row
+        std::string createCrossShardTransfersTable = 
+            "CREATE TABLE IF NOT EXISTS cross_shard_transfers ("
+            "transfer_id VARCHAR(72) PRIMARY KEY, "
+            "from_account_id INT NOT NULL, "
+            "to_account_id INT NOT NULL, "
+            "amount DECIMAL(15,2) NOT NULL, "
+            "state VARCHAR(10) NOT NULL, "
+            "created_at VARCHAR(26) NOT NULL, "
+            "KEY idx_cross_shard_state (state)"
+            ")";
+        
+        if (!db->executeQuery(createCrossShardTransfersTable)) {
+            return false;
+        }
+        
+        // Create standing_orders table; times are Unix seconds
+        std::string createStandingOrdersTable = 
+            "CREATE TABLE IF NOT EXISTS standing_orders ("
+            "order_id INT AUTO_INCREMENT PRIMARY KEY, "
+            "from_account_id INT NOT NULL, "
+            "to_account_id INT NOT NULL, "
+            "amount DECIMAL(15,2) NOT NULL, "
+            "period VARCHAR(8) NOT NULL, "
+            "every INT NOT NULL, "
+            "first_run BIGINT NOT NULL, "
+            "runs_done INT NOT NULL DEFAULT 0, "
+            "next_run BIGINT NOT NULL, "
+            "active TINYINT NOT NULL DEFAULT 1, "
+            "KEY idx_standing_orders_due (active, next_run), "
+            "KEY idx_standing_orders_account (from_account_id), "
+            "FOREIGN KEY (from_account_id) REFERENCES accounts(account_id) ON DELETE CASCADE"
+            ")";
+        
+        if (!db->executeQuery(createStandingOrdersTable)) {
+            return false;
+        }
+        
+        // Monthly partitions; older tables lose their foreign key to accounts on conversion
+        if (!ensureIndex("transactions", "idx_transactions_account", "account_id, transaction_id") ||
+            !TransactionPartitions(db).ensurePartitioned()) {
+            return false;
+        }
+        
+        // Create account_daily_rollups table, maintained with every ledger write
+        std::string createDailyRollupsTable = 
+            "CREATE TABLE IF NOT EXISTS account_daily_rollups ("
+            "account_id INT NOT NULL, "
+            "day DATE NOT NULL, "
+            "opening_balance DECIMAL(15,2) NOT NULL, "
+            "closing_balance DECIMAL(15,2) NOT NULL, "
+            "transaction_count INT NOT NULL DEFAULT 0, "
+            "deposit_total DECIMAL(15,2) NOT NULL DEFAULT 0.00, "
+            "withdrawal_total DECIMAL(15,2) NOT NULL DEFAULT 0.00, "
+            "transfer_in_total DECIMAL(15,2) NOT NULL DEFAULT 0.00, "
+            "transfer_out_total DECIMAL(15,2) NOT NULL DEFAULT 0.00, "
+            "PRIMARY KEY (account_id, day), "
+            "FOREIGN KEY (account_id) REFERENCES accounts(account_id) ON DELETE CASCADE"
+            ")";
+        
+        if (!db->executeQuery(createDailyRollupsTable)) {
+            return false;
+        }
+        
+        // Create balance_checkpoints table, written every few ledger rows per account
+        std::string createBalanceCheckpointsTable = 
+            "CREATE TABLE IF NOT EXISTS balance_checkpoints ("
+            "account_id INT NOT NULL, "
+            "transaction_id INT NOT NULL, "
+            "date_time VARCHAR(26) NOT NULL, "
+            "balance_after DECIMAL(15,2) NOT NULL, "
+            "PRIMARY KEY (account_id, transaction_id), "
+            "KEY idx_checkpoints_time (account_id, date_time), "
+            "FOREIGN KEY (account_id) REFERENCES accounts(account_id) ON DELETE CASCADE"
+            ")";
+        
+        if (!db->executeQuery(createBalanceCheckpointsTable)) {
+            return false;
+        }
+        
+        // Create hot_accounts table, accounts whose credits go to sub-balance slots
+        std::string createHotAccountsTable = 
+            "CREATE TABLE IF NOT EXISTS hot_accounts ("
+            "account_id INT PRIMARY KEY, "
+            "slots INT NOT NULL, "
+            "FOREIGN KEY (account_id) REFERENCES accounts(account_id) ON DELETE CASCADE"
+            ")";
+        
+        if (!db->executeQuery(createHotAccountsTable)) {
+            return false;
+        }
+        
+        // Create account_balance_slots table, credits to hot accounts not yet folded into the balance
+        std::string createBalanceSlotsTable = 
+            "CREATE TABLE IF NOT EXISTS account_balance_slots ("
+            "account_id INT NOT NULL, "
+            "slot INT NOT NULL, "
+            "day DATE NOT NULL, "
+            "balance DECIMAL(15,2) NOT NULL, "
+            "transaction_count INT NOT NULL, "
+            "deposit_total DECIMAL(15,2) NOT NULL, "
+            "transfer_in_total DECIMAL(15,2) NOT NULL, "
+            "PRIMARY KEY (account_id, slot, day), "
+            "FOREIGN KEY (account_id) REFERENCES accounts(account_id) ON DELETE CASCADE"
+            ")";
+        
+        if (!db->executeQuery(createBalanceSlotsTable)) {
+            return false;
+        }
+        
+        // Create ledger_batches table; a sharded ledger batch commits its id here so a retry can tell it landed
+        std::string createLedgerBatchesTable = 
+            "CREATE TABLE IF NOT EXISTS ledger_batches ("
+            "batch_id BIGINT UNSIGNED PRIMARY KEY, "
+            "row_count INT NOT NULL, "
+            "transaction_ids TEXT, "
+            "written_at VARCHAR(26) NOT NULL"
+            ")";
+        
+        if (!db->executeQuery(createLedgerBatchesTable)) {
+            return false;
+        }
+        
+        // Transaction stamps carry microseconds since the shared Clock was introduced
+        if (!ensureColumnLength("transactions", "date_time", Clock::kMicrosLength, "NOT NULL")) {
+            return false;
+        }
+        
+        // Lookup indexes for customer search
+        return ensureIndex("customers", "idx_customers_name", "name") &&
+               ensureIndex("customers", "idx_customers_phone", "phone");
+    }
+    
+    // Widens a VARCHAR column created by an older schema version
+    bool ensureColumnLength(const std::string& table, const std::string& column, size_t length,
+                            const std::string& constraints) {
+        std::string checkQuery =
+            "SELECT CHARACTER_MAXIMUM_LENGTH FROM information_schema.columns WHERE table_schema = DATABASE() "
+            "AND table_name = '" + table + "' AND column_name = '" + column + "'";
+        std::vector<std::vector<std::string>> results;
+        
+        if (!db->executeQuery(checkQuery, results) || results.empty()) {
+            return false;
+        }
+        
+        if (results[0][0] != "NULL" && std::stoul(results[0][0]) >= length) {
+            return true;
+        }
+        
+        return db->executeQuery("ALTER TABLE " + table + " MODIFY " + column + " VARCHAR(" +
+                                std::to_string(length) + ") " + constraints);
+    }
+    
+    // CREATE INDEX has no IF NOT EXISTS in MySQL, so check information_schema first
+    bool ensureIndex(const std::string& table, const std::string& indexName, const std::string& columns) {
+        std::string checkQuery =
+            "SELECT COUNT(*) FROM information_schema.statistics WHERE table_schema = DATABASE() "
+            "AND table_name = '" + table + "' AND index_name = '" + indexName + "'";
+        std::vector<std::vector<std::string>> results;
+        
+        if (!db->executeQuery(checkQuery, results) || results.empty()) {
+            return false;
+        }
+        
+        if (results[0][0] != "0") {
+            return true;
+        }
+        
+        return db->executeQuery("CREATE INDEX " + indexName + " ON " + table + " (" + columns + ")");
+    }
+};
+
+// Report output modes for listing screens
+enum class ReportFormat {
+    Table,
+    Csv,
+    Json
+};
+
+struct ReportColumn {
+    std::string name;    // table header
+    std::string key;     // CSV header and JSON field name
+    int width;           // table mode only
+    bool numeric;        // right-aligned in tables, unquoted in JSON
+};
+
+// Writes all of data to a file descriptor, retrying short writes
+inline bool writeFully(int fd, const char* data, size_t size) {
+    while (size > 0) {
+#ifdef _WIN32
+        int written = _write(fd, data, static_cast<unsigned int>(size));
+#else
+        ssize_t written = ::write(fd, data, size);
+#endif
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+inline int openOutputFile(const std::string& path) {
+#ifdef _WIN32
+    return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+}
+
+inline void closeOutputFile(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+inline void appendJsonEscaped(std::string& out, const char* text, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xf];
+                } else {
+                    out += static_cast<char>(c);
+                }
+        }
+    }
+}
+
+inline void appendInteger(std::string& out, long long value) {
+    char digits[24];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr);
+}
+
+// Exact parse of a DECIMAL(15,2) column into cents
+inline long long parseCents(const std::string& value) {
+    long long units = 0;
+    long long fraction = 0;
+    int fractionDigits = 0;
+    bool negative = false;
+    bool inFraction = false;
+    
+    for (char c : value) {
+        if (c == '-') {
+            negative = true;
+        } else if (c == '.') {
+            inFraction = true;
+        } else if (c >= '0' && c <= '9') {
+            if (!inFraction) {
+                units = units * 10 + (c - '0');
+            } else if (fractionDigits < 2) {
+                fraction = fraction * 10 + (c - '0');
+                fractionDigits++;
+            }
+        }
+    }
+    
+    if (fractionDigits == 1) {
+        fraction *= 10;
+    }
+    
+    long long cents = units * 100 + fraction;
+    return negative ? -cents : cents;
+}
+
+// Fixed two-decimal rendering without iostream or locale
+inline void appendMoney(std::string& out, double value) {
+    long long cents = std::llround(value * 100.0);
+    if (cents < 0) {
+        out += '-';
+        cents = -cents;
+    }
+    appendInteger(out, cents / 100);
+    out += '.';
+    out += static_cast<char>('0' + (cents % 100) / 10);
+    out += static_cast<char>('0' + cents % 10);
+}
+
+// Formats report rows into a large buffer and hands it to the OS in one
+// write() per chunk, instead of a formatted, flushed iostream call per field
+class ReportWriter {
+private:
+    int fd;
+    ReportFormat format;
+    size_t chunkSize;
+    std::string buffer;
+    std::string cellText;
+    std::vector<ReportColumn> columns;
+    size_t column;
+    size_t rows;
+    bool finished;
+    
+    void flushIfFull() {
+        if (buffer.size() >= chunkSize) {
+            flush();
+        }
+    }
+    
+    void appendPadded(const std::string& text, const ReportColumn& spec) {
+        size_t width = spec.width > 0 ? static_cast<size_t>(spec.width) : 0;
+        size_t padding = text.size() < width ? width - text.size() : 0;
+        if (spec.numeric) {
+            buffer.append(padding, ' ');
+            buffer += text;
+        } else {
+            buffer += text;
+            buffer.append(padding, ' ');
+        }
+    }
+    
+    void appendCsv(const std::string& text) {
+        if (text.find_first_of(",\"\r\n") == std::string::npos) {
+            buffer += text;
+            return;
+        }
+        buffer += '"';
+        for (char c : text) {
+            if (c == '"') {
+                buffer += '"';
+            }
+            buffer += c;
+        }
+        buffer += '"';
+    }
+    
+    // Every cell funnels through here; quoted says whether JSON needs a string
+    void emitCell(const std::string& text, bool quoted, bool isNull) {
+        if (column >= columns.size()) {
+            return;
+        }
+        const ReportColumn& spec = columns[column];
+        
+        switch (format) {
+            case ReportFormat::Table:
+                if (column > 0) {
+                    buffer += " | ";
+                }
+                appendPadded(text, spec);
+                break;
+            case ReportFormat::Csv:
+                if (column > 0) {
+                    buffer += ',';
+                }
+                appendCsv(text);
+                break;
+            case ReportFormat::Json:
+                buffer += column == 0 ? (rows == 0 ? "\n  {\"" : ",\n  {\"") : ", \"";
+                appendJsonEscaped(buffer, spec.key.data(), spec.key.size());
+                buffer += "\": ";
+                if (isNull) {
+                    buffer += "null";
+                } else if (quoted) {
+                    buffer += '"';
+                    appendJsonEscaped(buffer, text.data(), text.size());
+                    buffer += '"';
+                } else {
+                    buffer += text;
+                }
+                break;
+        }
+        
+        column++;
+    }
+    
+public:
+    ReportWriter(int fd, ReportFormat format, size_t chunkSize = 64 * 1024)
+        : fd(fd), format(format), chunkSize(chunkSize), column(0), rows(0), finished(false) {
+        buffer.reserve(chunkSize + 4096);
+    }
+    
+    ~ReportWriter() {
+        finish();
+    }
+    
+    ReportWriter(const ReportWriter&) = delete;
+    ReportWriter& operator=(const ReportWriter&) = delete;
+    
+    void begin(const std::string& title, const std::vector<ReportColumn>& reportColumns) {
+        columns = reportColumns;
+        
+        switch (format) {
+            case ReportFormat::Table: {
+                buffer += "\n------------ " + title + " ------------\n";
+                size_t lineWidth = 0;
+                for (size_t i = 0; i < columns.size(); i++) {
+                    if (i > 0) {
+                        buffer += " | ";
+                        lineWidth += 3;
+                    }
+                    appendPadded(columns[i].name, columns[i]);
+                    lineWidth += std::max(columns[i].name.size(), static_cast<size_t>(std::max(columns[i].width, 0)));
+                }
+                buffer += '\n';
+                buffer.append(lineWidth, '-');
+                buffer += '\n';
+                break;
+            }
+            case ReportFormat::Csv:
+                for (size_t i = 0; i < columns.size(); i++) {
+                    if (i > 0) {
+                        buffer += ',';
+                    }
+                    appendCsv(columns[i].key);
+                }
+                buffer += '\n';
+                break;
+            case ReportFormat::Json:
+                buffer += '[';
+                break;
+        }
+    }
+    
+    ReportWriter& text(const std::string& value) {
+        emitCell(value, true, false);
+        return *this;
+    }
+    
+    ReportWriter& integer(long long value) {
+        cellText.clear();
+        appendInteger(cellText, value);
+        emitCell(cellText, false, false);
+        return *this;
+    }
+    
+    ReportWriter& money(double value) {
+        cellText.clear();
+        appendMoney(cellText, value);
+        emitCell(cellText, false, false);
+        return *this;
+    }
+    
+    ReportWriter& empty() {
+        emitCell("", false, true);
+        return *this;
+    }
+    
+    void endRow() {
+        buffer += format == ReportFormat::Json ? "}" : "\n";
+        column = 0;
+        rows++;
+        flushIfFull();
+    }
+    
+    void flush() {
+        if (buffer.empty()) {
+            return;
+        }
+        if (fd == 1) {
+            // Keep ordering with anything already sitting in std::cout
+            std::cout.flush();
+        }
+        writeFully(fd, buffer.data(), buffer.size());
+        buffer.clear();
+    }
+    
+    void finish() {
+        if (finished) {
+            return;
+        }
+        finished = true;
+        
+        if (format == ReportFormat::Json) {
+            buffer += rows ? "\n]\n" : "]\n";
+        } else if (format == ReportFormat::Table) {
+            buffer += "(" + std::to_string(rows) + (rows == 1 ? " row)\n" : " rows)\n");
+        }
+        flush();
+    }
+    
+    size_t rowCount() const { return rows; }
+};
+
+// Settings for one monthly statement run
+struct StatementJobConfig {
+    std::string period;            // "YYYY-MM"
+    std::string outputDirectory;   // must exist
+    std::string checkpointFile;    // completed chunks are recorded here; empty disables resume
+    unsigned int threads;
+    int customersPerChunk;
+    
+    StatementJobConfig() : threads(4), customersPerChunk(500) {}
+};
+
+struct StatementJobResult {
+    bool success;
+    size_t statements;
+    size_t chunksDone;
+    size_t chunksSkipped;
+    size_t chunksFailed;
+    double seconds;
+    
+    double statementsPerSecond() const { return seconds > 0 ? statements / seconds : 0.0; }
+};
+
+// Produces one statement file per account for a calendar month. The customer
+// id range is cut into chunks that worker threads claim in turn; each chunk
+// costs two range scans (its accounts, then their ledger rows from the start
+// of the period) instead of per-customer and per-account queries.
+class StatementGenerator {
+private:
+    struct LedgerLine {
+        long long transactionId;
+        std::string type;
+        long long amountCents;
+        std::string dateTime;
+        std::string description;
+    };
+    
+    struct AccountState {
+        int accountId;
+        std::string accountNumber;
+        std::string accountType;
+        std::string customerName;
+        long long balanceCents;      // current balance
+        long long netAfterPeriod;    // movements after the period, to roll back to its end
+        long long netInPeriod;
+        long long depositsCents;
+        long long withdrawalsCents;
+        long long transfersInCents;
+        long long transfersOutCents;
+        std::vector<LedgerLine> lines;
+    };
+    
+    std::shared_ptr<IDatabase> db;
+    
+    static std::string chunkKey(const std::string& period, int first, int last) {
+        return period + " " + std::to_string(first) + " " + std::to_string(last);
+    }
+    
+    std::set<std::string> loadCheckpoint(const std::string& path) {
+        std::set<std::string> done;
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!line.empty()) {
+                done.insert(line);
+            }
+        }
+        return done;
+    }
+    
+    bool writeStatement(const AccountState& account, const StatementJobConfig& config) {
+        std::string path = config.outputDirectory + "/statement_" + config.period + "_" +
+                           account.accountNumber + ".txt";
+        int fd = openOutputFile(path);
+        if (fd < 0) {
+            std::cerr << "Cannot write statement " << path << std::endl;
+            return false;
+        }
+        
+        long long closing = account.balanceCents - account.netAfterPeriod;
+        long long opening = closing - account.netInPeriod;
+        
+        {
+            ReportWriter report(fd, ReportFormat::Table);
+            std::string header = "ACCOUNT STATEMENT " + config.period + "\n" +
+                "Customer: " + account.customerName + "\n" +
+                "Account Number: " + account.accountNumber + " (" + account.accountType + ")\n" +
+                "Opening Balance: ";
+            appendMoney(header, opening / 100.0);
+            header += "\n";
+            writeFully(fd, header.data(), header.size());
+            
+            report.begin("Transactions", {
+                { "Transaction ID", "transaction_id", 14, true },
+                { "Date/Time", "date_time", 26, false },
+                { "Type", "type", 12, false },
+                { "Amount", "amount", 14, true },
+                { "Description", "description", 0, false }
+            });
+            for (const auto& line : account.lines) {
+                report.integer(line.transactionId)
+                      .text(line.dateTime)
+                      .text(line.type)
+                      .money(line.amountCents / 100.0)
+                      .text(line.description);
+                report.endRow();
+            }
+            report.finish();
+        }
+        
+        std::string footer = "\nDeposits: ";
+        appendMoney(footer, account.depositsCents / 100.0);
+        footer += "\nWithdrawals: ";
+        appendMoney(footer, account.withdrawalsCents / 100.0);
+        footer += "\nTransfers In: ";
+        appendMoney(footer, account.transfersInCents / 100.0);
+        footer += "\nTransfers Out: ";
+        appendMoney(footer, account.transfersOutCents / 100.0);
+        footer += "\nClosing Balance: ";
+        appendMoney(footer, closing / 100.0);
+        footer += "\n";
+        bool ok = writeFully(fd, footer.data(), footer.size());
+        
+        closeOutputFile(fd);
+        return ok;
+    }
+    
+    bool processChunk(int first, int last, const std::string& periodStart, const std::string& periodEnd,
+                      const StatementJobConfig& config, size_t& written) {
+        std::string range = " BETWEEN " + std::to_string(first) + " AND " + std::to_string(last);
+        std::vector<std::vector<std::string>> rows;
+        
+        if (!db->executeQuery(
+                "SELECT a.account_id, a.account_number, a.account_type, " +
+                HotAccountRepository::balanceExpression("a") + ", c.name "
+                "FROM accounts a JOIN customers c ON c.customer_id = a.customer_id "
+                "WHERE a.customer_id" + range + " ORDER BY a.account_id", rows)) {
+            return false;
+        }
+        if (rows.empty()) {
+            return true;
+        }
+        
+        std::vector<AccountState> accounts;
+        accounts.reserve(rows.size());
+        for (const auto& row : rows) {
+            AccountState state = { std::stoi(row[0]), row[1], row[2], row[4], parseCents(row[3]),
+                                   0, 0, 0, 0, 0, 0, {} };
+            accounts.push_back(std::move(state));
+        }
+        
+        // Ledger rows arrive in account order, so a forward cursor finds each owner
+        size_t cursor = 0;
+        bool ok = db->streamQuery(
+            "SELECT t.account_id, t.transaction_id, t.type, t.amount, t.date_time, t.description "
+            "FROM transactions t JOIN accounts a ON a.account_id = t.account_id "
+            "WHERE a.customer_id" + range + " AND t.date_time >= '" + periodStart + "' "
+            "ORDER BY t.account_id, t.transaction_id",
+            [&](const std::vector<std::string>& row) {
+                int accountId = std::stoi(row[0]);
+                while (cursor < accounts.size() && accounts[cursor].accountId < accountId) {
+                    cursor++;
+                }
+                if (cursor == accounts.size() || accounts[cursor].accountId != accountId) {
+                    return true;
+                }
+                
+                AccountState& account = accounts[cursor];
+                long long cents = parseCents(row[3]);
+                long long signedCents = ledgerDirection(row[2]) * cents;
+                
+                if (row[4] >= periodEnd) {
+                    account.netAfterPeriod += signedCents;
+                    return true;
+                }
+                
+                account.netInPeriod += signedCents;
+                if (row[2] == "Deposit") {
+                    account.depositsCents += cents;
+                } else if (row[2] == "Withdrawal") {
+                    account.withdrawalsCents += cents;
+                } else if (row[2] == "Transfer In") {
+                    account.transfersInCents += cents;
+                } else if (row[2] == "Transfer Out") {
+                    account.transfersOutCents += cents;
+                }
+                account.lines.push_back({ std::stoll(row[1]), row[2], cents, row[4], row[5] });
+                return true;
+            });
+        
+        if (!ok) {
+            return false;
+        }
+        
+        for (const auto& account : accounts) {
+            if (!writeStatement(account, config)) {
+                return false;
+            }
+            written++;
+        }
+        
+        return true;
+    }
+    
+public:
+    StatementGenerator(std::shared_ptr<IDatabase> db) : db(db) {}
+    
+    // Runs at batch priority (see RequestScheduler)
+    StatementJobResult run(const StatementJobConfig& config) {
+        ScopedPriority priority(RequestPriority::Batch);
+        StatementJobResult result = { false, 0, 0, 0, 0, 0.0 };
+        auto started = std::chrono::steady_clock::now();
+        
+        std::string next;
+        if (!shiftMonth(config.period, 1, next)) {
+            std::cerr << "Invalid statement period " << config.period << " (expected YYYY-MM)" << std::endl;
+            return result;
+        }
+        std::string periodStart = config.period + "-01 00:00:00";
+        std::string periodEnd = next + "-01 00:00:00";
+        
+        std::vector<std::vector<std::string>> bounds;
+        if (!db->executeQuery("SELECT MIN(customer_id), MAX(customer_id) FROM customers", bounds) ||
+            bounds.empty()) {
+            return result;
+        }
+        if (bounds[0][0] == "NULL") {
+            result.success = true;
+            return result;
+        }
+        
+        int minId = std::stoi(bounds[0][0]);
+        int maxId = std::stoi(bounds[0][1]);
+        int chunkSize = std::max(config.customersPerChunk, 1);
+        std::vector<std::pair<int, int>> chunks;
+        for (long long first = minId; first <= maxId; first += chunkSize) {
+            chunks.push_back({ static_cast<int>(first),
+                               static_cast<int>(std::min<long long>(first + chunkSize - 1, maxId)) });
+        }
+        
+        std::set<std::string> done;
+        if (!config.checkpointFile.empty()) {
+            done = loadCheckpoint(config.checkpointFile);
+        }
+        
+        std::atomic<size_t> nextChunk(0);
+        std::atomic<size_t> statements(0);
+        std::atomic<size_t> chunksDone(0);
+        std::atomic<size_t> chunksSkipped(0);
+        std::atomic<size_t> chunksFailed(0);
+        std::mutex checkpointMutex;
+        
+        auto worker = [&]() {
+            ScopedPriority batch(RequestPriority::Batch);
+            size_t index;
+            while ((index = nextChunk.fetch_add(1)) < chunks.size()) {
+                const auto& chunk = chunks[index];
+                std::string key = chunkKey(config.period, chunk.first, chunk.second);
+                if (done.count(key)) {
+                    chunksSkipped++;
+                    continue;
+                }
+                
+                size_t written = 0;
+                if (!processChunk(chunk.first, chunk.second, periodStart, periodEnd, config, written)) {
+                    chunksFailed++;
+                    continue;
+                }
+                statements += written;
+                chunksDone++;
+                
+                if (!config.checkpointFile.empty()) {
+                    std::lock_guard<std::mutex> lock(checkpointMutex);
+                    std::ofstream checkpoint(config.checkpointFile, std::ios::app);
+                    checkpoint << key << '\n';
+                }
+            }
+        };
+        
+        std::vector<std::thread> workers;
+        unsigned int threadCount = std::max(config.threads, 1u);
+        for (unsigned int i = 0; i < threadCount; i++) {
+            workers.emplace_back(worker);
+        }
+        for (auto& thread : workers) {
+            thread.join();
+        }
+        
+        result.statements = statements;
+        result.chunksDone = chunksDone;
+        result.chunksSkipped = chunksSkipped;
+        result.chunksFailed = chunksFailed;
+        result.success = chunksFailed == 0;
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return result;
+    }
+};
+
+struct ReconciliationConfig {
+    unsigned int threads;
+    int accountsPerChunk;
+    
+    ReconciliationConfig() : threads(4), accountsPerChunk(20000) {}
+};
+
+struct AccountMismatch {
+    int accountId;
+    long long balanceCents;     // accounts.balance
+    long long ledgerCents;      // net of the account's ledger rows
+};
+
+struct ReconciliationResult {
+    bool success;
+    size_t accounts;
+    size_t ledgerRows;
+    size_t chunksFailed;
+    double seconds;
+    std::vector<AccountMismatch> mismatches;   // ordered by account id
+    
+    double rowsPerSecond() const { return seconds > 0 ? ledgerRows / seconds : 0.0; }
+};
+
+// Checks every account balance against the net of its ledger rows. The
+// account id range is cut into chunks that worker threads claim in turn; each
+// chunk is one streamed statement returning the chunk's balances and ledger
+// rows together, so both sides come from the same consistent read. Ledger
+// amounts are parsed into fixed-size column blocks and folded into a dense
+// per-account array in cents.
+class LedgerReconciler {
+private:
+    static const size_t kBlockRows = 4096;
+    static const int kBalanceRow = 2;   // marker in the sign column for the account row itself
+    
+    std::shared_ptr<IDatabase> db;
+    std::shared_ptr<ArchiveStore> archive;
+    
+    // Adds a block of signed amounts into net, indexed by account offset
+    static void accumulateBlock(const std::int32_t* offsets, const std::int64_t* cents, size_t count,
+                                std::int64_t* net) {
+        for (size_t i = 0; i < count; ++i) {
+            net[offsets[i]] += cents[i];
+        }
+    }
+    
+    static bool parseInt(const std::string& text, long long& value) {
+        auto parsed = std::from_chars(text.data(), text.data() + text.size(), value);
+        return parsed.ec == std::errc();
+    }
+    
+    bool processChunk(int first, int last, std::vector<AccountMismatch>& mismatches,
+                      size_t& accounts, size_t& ledgerRows) {
+        size_t span = static_cast<size_t>(last - first) + 1;
+        std::vector<std::int64_t> balance(span, 0);
+        std::vector<std::int64_t> net(span, 0);
+        std::vector<char> present(span, 0);
+        
+        std::int32_t offsets[kBlockRows];
+        std::int64_t cents[kBlockRows];
+        size_t filled = 0;
+        bool malformed = false;
+        
+        std::string range = " BETWEEN " + std::to_string(first) + " AND " + std::to_string(last);
+        bool ok = db->streamQuery(
+            "SELECT account_id, " + std::to_string(kBalanceRow) + ", " +
+            HotAccountRepository::balanceExpression("a") + " FROM accounts a "
+            "WHERE account_id" + range +
+            " UNION ALL "
+            "SELECT account_id, CASE WHEN type IN ('Deposit', 'Transfer In') THEN 1 "
+            "WHEN type IN ('Withdrawal', 'Transfer Out') THEN -1 ELSE 0 END, amount FROM transactions "
+            "WHERE account_id" + range,
+            [&](const std::vector<std::string>& row) {
+                long long accountId;
+                long long sign;
+                if (!parseInt(row[0], accountId) || !parseInt(row[1], sign) ||
+                    accountId < first || accountId > last) {
+                    malformed = true;
+                    return false;
+                }
+                
+                std::int32_t offset = static_cast<std::int32_t>(accountId - first);
+                if (sign == kBalanceRow) {
+                    balance[offset] = parseCents(row[2]);
+                    present[offset] = 1;
+                    return true;
+                }
+                
+                offsets[filled] = offset;
+                cents[filled] = sign * parseCents(row[2]);
+                if (++filled == kBlockRows) {
+                    accumulateBlock(offsets, cents, filled, net.data());
+                    ledgerRows += filled;
+                    filled = 0;
+                }
+                return true;
+            });
+        
+        if (!ok || malformed) {
+            return false;
+        }
+        accumulateBlock(offsets, cents, filled, net.data());
+        ledgerRows += filled;
+        
+        for (size_t i = 0; i < span; ++i) {
+            if (!present[i]) {
+                continue;
+            }
+            accounts++;
+            if (archive) {
+                net[i] += archive->accountNetCents(first + static_cast<int>(i));
+            }
+            if (balance[i] != net[i]) {
+                mismatches.push_back({ first + static_cast<int>(i), balance[i], net[i] });
+            }
+        }
+        
+        return true;
+    }
+    
+public:
+    LedgerReconciler(std::shared_ptr<IDatabase> db, std::shared_ptr<ArchiveStore> archive = nullptr)
+        : db(db), archive(archive) {}
+    
+    // Runs at batch priority (see RequestScheduler)
+    ReconciliationResult run(const ReconciliationConfig& config) {
+        ScopedPriority priority(RequestPriority::Batch);
+        ReconciliationResult result = { false, 0, 0, 0, 0.0, {} };
+        auto started = std::chrono::steady_clock::now();
+        
+        std::vector<std::vector<std::string>> bounds;
+        if (!db->executeQuery("SELECT MIN(account_id), MAX(account_id) FROM accounts", bounds) ||
+            bounds.empty()) {
+            return result;
+        }
+        if (bounds[0][0] == "NULL") {
+            result.success = true;
+            return result;
+        }
+        
+        int minId = std::stoi(bounds[0][0]);
+        int maxId = std::stoi(bounds[0][1]);
+        int chunkSize = std::max(config.accountsPerChunk, 1);
+        std::vector<std::pair<int, int>> chunks;
+        for (long long first = minId; first <= maxId; first += chunkSize) {
+            chunks.push_back({ static_cast<int>(first),
+                               static_cast<int>(std::min<long long>(first + chunkSize - 1, maxId)) });
+        }
+        
+        std::atomic<size_t> nextChunk(0);
+        std::atomic<size_t> chunksFailed(0);
+        std::mutex resultMutex;
+        
+        auto worker = [&]() {
+            ScopedPriority batch(RequestPriority::Batch);
+            std::vector<AccountMismatch> mismatches;
+            size_t accounts = 0;
+            size_t ledgerRows = 0;
+            size_t index;
+            
+            while ((index = nextChunk.fetch_add(1)) < chunks.size()) {
+                size_t chunkAccounts = 0;
+                size_t chunkRows = 0;
+                size_t mismatchesBefore = mismatches.size();
+                if (!processChunk(chunks[index].first, chunks[index].second, mismatches, chunkAccounts, chunkRows)) {
+                    mismatches.resize(mismatchesBefore);
+                    chunksFailed++;
+                    continue;
+                }
+                accounts += chunkAccounts;
+                ledgerRows += chunkRows;
+            }
+            
+            std::lock_guard<std::mutex> lock(resultMutex);
+            result.accounts += accounts;
+            result.ledgerRows += ledgerRows;
+            result.mismatches.insert(result.mismatches.end(), mismatches.begin(), mismatches.end());
+        };
+        
+        std::vector<std::thread> workers;
+        unsigned int threadCount = std::max(config.threads, 1u);
+        for (unsigned int i = 0; i < threadCount; i++) {
+            workers.emplace_back(worker);
+        }
+        for (auto& thread : workers) {
+            thread.join();
+        }
+        
+        std::sort(result.mismatches.begin(), result.mismatches.end(),
+                  [](const AccountMismatch& a, const AccountMismatch& b) { return a.accountId < b.accountId; });
+        result.chunksFailed = chunksFailed;
+        result.success = chunksFailed == 0;
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return result;
+    }
+};
+
+struct ArchiveJobConfig {
+    int keepMonths;             // closed months kept in the live table
+    
+    ArchiveJobConfig() : keepMonths(12) {}
+};
+
+struct ArchiveJobResult {
+    bool success;
+    size_t partitionsArchived;
+    size_t rows;
+    size_t bytes;
+    double seconds;
+};
+
+// Moves the oldest monthly partitions of `transactions` into archive files
+// (see ArchiveStore for the format) and drops them from the live table. A
+// partition is dropped only after its file has been read back and
+// registered, and a month already registered is just dropped, so an
+// interrupted run can be repeated.
+class TransactionArchiver {
+private:
+    std::shared_ptr<IDatabase> db;
+    std::shared_ptr<ArchiveStore> store;
+    
+    struct BlockEncoder {
+        std::string columns[5];
+        std::int64_t previousId = 0;
+        std::int64_t previousTime = 0;
+        std::uint64_t rows = 0;
+        long long netCents = 0;
+    };
+    
+    bool archivePartition(const TransactionPartition& partition, size_t& rows, size_t& bytes) {
+        std::unordered_map<std::string, std::uint64_t> codes;
+        std::vector<std::string> dictionary;
+        auto code = [&codes, &dictionary](const std::string& text) {
+            auto it = codes.find(text);
+            if (it != codes.end()) {
+                return it->second;
+            }
+            codes.emplace(text, dictionary.size());
+            dictionary.push_back(text);
+            return static_cast<std::uint64_t>(dictionary.size() - 1);
+        };
+        
+        std::string index;
+        std::string data;
+        std::uint64_t accountCount = 0;
+        std::uint64_t outOfMonthRows = 0;
+        std::int64_t minId = 0;
+        std::int64_t maxId = 0;
+        std::int64_t previousAccount = 0;
+        int currentAccount = -1;
+        BlockEncoder block;
+        
+        auto flush = [&]() {
+            if (block.rows == 0) {
+                return;
+            }
+            std::string encoded;
+            for (const auto& column : block.columns) {
+                encoded += column;
+            }
+            ArchiveStore::putVarint(index, ArchiveStore::zigzag(currentAccount - previousAccount));
+            ArchiveStore::putVarint(index, block.rows);
+            ArchiveStore::putVarint(index, ArchiveStore::zigzag(block.netCents));
+            ArchiveStore::putVarint(index, encoded.size());
+            data += encoded;
+            previousAccount = currentAccount;
+            accountCount++;
+            block = BlockEncoder();
+        };
+        
+        bool ok = db->streamQuery(
+            "SELECT transaction_id, account_id, type, amount, date_time, description "
+            "FROM transactions PARTITION (" + partition.name + ") ORDER BY account_id, transaction_id",
+            [&](const std::vector<std::string>& row) {
+                std::int64_t id = std::stoll(row[0]);
+                int accountId = std::stoi(row[1]);
+                if (accountId != currentAccount) {
+                    flush();
+                    currentAccount = accountId;
+                }
+                
+                std::int64_t time;
+                if (!ArchiveStore::encodeTime(partition.month, row[4], time)) {
+                    time = static_cast<std::int64_t>(code(row[4])) * 4 + 2;
+                    outOfMonthRows++;
+                }
+                long long cents = parseCents(row[3]);
+                
+                ArchiveStore::putVarint(block.columns[0], ArchiveStore::zigzag(id - block.previousId));
+                ArchiveStore::putVarint(block.columns[1], ArchiveStore::zigzag(time - block.previousTime));
+                ArchiveStore::putVarint(block.columns[2], code(row[2]));
+                ArchiveStore::putVarint(block.columns[3], ArchiveStore::zigzag(cents));
+                ArchiveStore::putVarint(block.columns[4], code(row[5] == "NULL" ? std::string() : row[5]));
+                block.previousId = id;
+                block.previousTime = time;
+                block.netCents += ledgerDirection(row[2]) * cents;
+                block.rows++;
+                
+                minId = rows == 0 ? id : std::min(minId, id);
+                maxId = rows == 0 ? id : std::max(maxId, id);
+                rows++;
+                return true;
+            });
+        if (!ok) {
+            return false;
+        }
+        flush();
+        
+        std::string header;
+        ArchiveStore::putString(header, partition.month);
+        ArchiveStore::putVarint(header, rows);
+        ArchiveStore::putVarint(header, ArchiveStore::zigzag(minId));
+        ArchiveStore::putVarint(header, ArchiveStore::zigzag(maxId));
+        ArchiveStore::putVarint(header, outOfMonthRows);
+        ArchiveStore::putVarint(header, dictionary.size());
+        for (const auto& entry : dictionary) {
+            ArchiveStore::putString(header, entry);
+        }
+        ArchiveStore::putVarint(header, accountCount);
+        header += index;
+        
+        std::string prefix(ArchiveStore::kMagic, 4);
+        prefix.push_back(static_cast<char>(ArchiveStore::kVersion));
+        for (int i = 0; i < 8; ++i) {
+            prefix.push_back(static_cast<char>((static_cast<std::uint64_t>(header.size()) >> (8 * i)) & 0xFF));
+        }
+        
+        std::string path = store->pathFor(partition.month);
+        std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            if (!out.write(prefix.data(), prefix.size()) || !out.write(header.data(), header.size()) ||
+                !out.write(data.data(), data.size())) {
+                std::cerr << "Cannot write archive " << temporary << std::endl;
+                return false;
+            }
+        }
+        std::remove(path.c_str());
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::cerr << "Cannot move archive into place: " << path << std::endl;
+            return false;
+        }
+        
+        bytes += prefix.size() + header.size() + data.size();
+        return store->registerArchive(partition.month, rows);
+    }
+    
+public:
+    TransactionArchiver(std::shared_ptr<IDatabase> db, std::shared_ptr<ArchiveStore> store)
+        : db(db), store(store) {}
+    
+    // Runs at batch priority (see RequestScheduler)
+    ArchiveJobResult run(const ArchiveJobConfig& config) {
+        ScopedPriority priority(RequestPriority::Batch);
+        ArchiveJobResult result = { false, 0, 0, 0, 0.0 };
+        auto started = std::chrono::steady_clock::now();
+        TransactionPartitions partitions(db);
+        
+        std::string cutoff;
+        if (!store->ensureDirectory() || !partitions.ensurePartitioned() ||
+            !shiftMonth(Clock::today().substr(0, 7), -std::max(config.keepMonths, 1), cutoff)) {
+            return result;
+        }
+        
+        std::vector<TransactionPartition> current;
+        if (!partitions.list(current)) {
+            return result;
+        }
+        
+        // Oldest first; always leave at least one monthly partition in place
+        result.success = true;
+        for (size_t i = 0; i + 2 < current.size() && !current[i].month.empty() && current[i].month < cutoff; ++i) {
+            size_t rows = 0;
+            if (!store->isArchived(current[i].month) && !archivePartition(current[i], rows, result.bytes)) {
+                result.success = false;
+                break;
+            }
+            if (!partitions.drop(current[i].name)) {
+                result.success = false;
+                break;
+            }
+            result.rows += rows;
+            result.partitionsArchived++;
+        }
+        
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return result;
+    }
+};
+
+// A recurring transfer. Run k (counting from 0) is due at firstRun plus k
+// periods; times are Unix seconds and months follow the UTC calendar, with
+// the day clamped to the end of shorter months.
+struct StandingOrder {
+    int id;
+    int fromAccountId;
+    int toAccountId;
+    double amount;
+    std::string period;              // second, day, week or month
+    int every;                       // number of periods between runs
+    std::int64_t firstRun;
+    int runsDone;
+    std::int64_t nextRun;
+};
+
+// Standing Order Repository
+class StandingOrderRepository {
+private:
+    std::shared_ptr<IDatabase> db;
+    
+    static StandingOrder rowToOrder(const std::vector<std::string>& row) {
+        return { std::stoi(row[0]), std::stoi(row[1]), std::stoi(row[2]), std::stod(row[3]), row[4],
+                 std::stoi(row[5]), std::stoll(row[6]), std::stoi(row[7]), std::stoll(row[8]) };
+    }
+    
+public:
+    static constexpr const char* kColumns =
+        "order_id, from_account_id, to_account_id, amount, period, every, first_run, runs_done, next_run";
+    
+    StandingOrderRepository(std::shared_ptr<IDatabase> db) : db(db) {}
+    
+    // Stores a new active order and returns its id, or 0 on failure
+    int addAndGetId(const StandingOrder& order) {
+        std::string query = "INSERT INTO standing_orders (from_account_id, to_account_id, amount, period, every, "
+            "first_run, runs_done, next_run, active) VALUES (" + std::to_string(order.fromAccountId) + ", " +
+            std::to_string(order.toAccountId) + ", " + std::to_string(order.amount) + ", '" +
+            sqlEscape(order.period) + "', " + std::to_string(order.every) + ", " +
+            std::to_string(order.firstRun) + ", " + std::to_string(order.runsDone) + ", " +
+            std::to_string(order.nextRun) + ", 1)";
+        std::vector<std::vector<std::vector<std::string>>> results;
+        
+        if (db->executeBatch({ query, "SELECT LAST_INSERT_ID()" }, results) &&
+            !results[1].empty() && !results[1][0].empty()) {
+            return std::stoi(results[1][0][0]);
+        }
+        
+        return 0;
+    }
+    
+    bool deactivate(int orderId) {
+        return db->executeQuery("UPDATE standing_orders SET active = 0 WHERE order_id=" + std::to_string(orderId));
+    }
+    
+    // Records that run runsDone has been executed; false when another
+    // scheduler got there first or the order was cancelled
+    bool advance(const StandingOrder& order, int runsDone, std::int64_t nextRun) {
+        std::vector<std::vector<std::vector<std::string>>> results;
+        std::string query = "UPDATE standing_orders SET runs_done=" + std::to_string(runsDone) +
+            ", next_run=" + std::to_string(nextRun) +
+            " WHERE order_id=" + std::to_string(order.id) + " AND active = 1 AND runs_done=" +
+            std::to_string(order.runsDone);
+        
+        return db->executeBatch({ query, "SELECT ROW_COUNT()" }, results) &&
+               !results[1].empty() && results[1][0][0] == "1";
+    }
+    
+    std::vector<StandingOrder> getByAccountId(int accountId) {
+        std::vector<std::vector<std::string>> results;
+        std::vector<StandingOrder> orders;
+        std::string query = std::string("SELECT ") + kColumns + " FROM standing_orders WHERE active = 1 AND "
+            "from_account_id=" + std::to_string(accountId) + " ORDER BY order_id";
+        
+        if (db->executeQuery(query, results)) {
+            for (const auto& row : results) {
+                orders.push_back(rowToOrder(row));
+            }
+        }
+        return orders;
+    }
+    
+    // Streams every active order due before the given time
+    bool forEachDueBefore(std::int64_t before, const std::function<bool(const StandingOrder&)>& visit) {
+        std::string query = std::string("SELECT ") + kColumns + " FROM standing_orders WHERE active = 1 AND "
+            "next_run < " + std::to_string(before);
+        
+        return db->streamQuery(query, [&visit](const std::vector<std::string>& row) {
+            return visit(rowToOrder(row));
+        });
+    }
+};
+
+// Hierarchical timing wheel with one-second ticks. Four levels of 256 slots
+// cover 2^32 seconds; a timer sits in the lowest level whose span reaches
+// its due time and moves down a level each time its slot comes round, so it
+// is touched at most four times. Timers are nodes of a pool linked into slot
+// lists, which makes adding, cancelling and expiring each O(1).
+class TimerWheel {
+private:
+    static const int kLevels = 4;
+    static const int kSlotBits = 8;
+    static const std::uint32_t kSlots = 1u << kSlotBits;
+    static constexpr std::uint32_t kNone = 0xFFFFFFFFu;
+    
+    struct Node {
+        std::uint64_t id;
+        std::int64_t due;
+        std::uint32_t prev;
+        std::uint32_t next;
+        std::uint32_t* head;         // list the node is linked into
+    };
+    
+    std::vector<Node> nodes;
+    std::vector<std::uint32_t> freeNodes;
+    std::uint32_t slots[kLevels][kSlots];
+    std::unordered_map<std::uint64_t, std::uint32_t> nodeOf;
+    std::int64_t current;            // last second processed
+    
+    // earliest is the first second whose slot has not been processed yet
+    void link(std::uint32_t index, std::int64_t earliest) {
+        Node& node = nodes[index];
+        std::int64_t due = std::max(node.due, earliest);
+        std::int64_t delta = due - current;
+        
+        int level = 0;
+        while (level < kLevels - 1 && delta >= (std::int64_t(1) << (kSlotBits * (level + 1)))) {
+            level++;
+        }
+        std::uint32_t* head = &slots[level][(due >> (kSlotBits * level)) & (kSlots - 1)];
+        
+        node.head = head;
+        node.prev = kNone;
+        node.next = *head;
+        if (*head != kNone) {
+            nodes[*head].prev = index;
+        }
+        *head = index;
+    }
+    
+    void unlink(std::uint32_t index) {
+        Node& node = nodes[index];
+        if (node.prev != kNone) {
+            nodes[node.prev].next = node.next;
+        } else {
+            *node.head = node.next;
+        }
+        if (node.next != kNone) {
+            nodes[node.next].prev = node.prev;
+        }
+    }
+    
+    // Re-files every timer of a higher-level slot against the current time
+    void cascade(int level) {
+        std::uint32_t& head = slots[level][(current >> (kSlotBits * level)) & (kSlots - 1)];
+        std::uint32_t index = head;
+        head = kNone;
+        while (index != kNone) {
+            std::uint32_t next = nodes[index].next;
+            link(index, current);
+            index = next;
+        }
+    }
+    
+public:
+    explicit TimerWheel(std::int64_t now = 0) : current(now) {
+        for (auto& level : slots) {
+            std::fill(std::begin(level), std::end(level), kNone);
+        }
+    }
+    
+    size_t size() const {
+        return nodeOf.size();
+    }
+    
+    bool contains(std::uint64_t id) const {
+        return nodeOf.count(id) != 0;
+    }
+    
+    // Timers already due fire on the next tick; an id is scheduled at most once
+    bool add(std::uint64_t id, std::int64_t due) {
+        if (contains(id)) {
+            return false;
+        }
+        
+        std::uint32_t index;
+        if (!freeNodes.empty()) {
+            index = freeNodes.back();
+            freeNodes.pop_back();
+        } else {
+            index = static_cast<std::uint32_t>(nodes.size());
+            nodes.push_back(Node());
+        }
+        nodes[index].id = id;
+        nodes[index].due = due;
+        link(index, current + 1);
+        nodeOf[id] = index;
+        return true;
+    }
+    
+    bool cancel(std::uint64_t id) {
+        auto it = nodeOf.find(id);
+        if (it == nodeOf.end()) {
+            return false;
+        }
+        unlink(it->second);
+        freeNodes.push_back(it->second);
+        nodeOf.erase(it);
+        return true;
+    }
+    
+    // Moves time forward to now and hands every expired timer to onExpired(id, due)
+    void advance(std::int64_t now, const std::function<void(std::uint64_t, std::int64_t)>& onExpired) {
+        while (current < now) {
+            current++;
+            for (int level = 1; level < kLevels; level++) {
+                if (((current >> (kSlotBits * (level - 1))) & (kSlots - 1)) != 0) {
+                    break;
+                }
+                cascade(level);
+            }
+            
+            std::uint32_t& head = slots[0][current & (kSlots - 1)];
+            std::uint32_t index = head;
+            head = kNone;
+            while (index != kNone) {
+                Node& node = nodes[index];
+                std::uint32_t next = node.next;
+                nodeOf.erase(node.id);
+                freeNodes.push_back(index);
+                onExpired(node.id, node.due);
+                index = next;
+            }
+        }
+    }
+};
+
+struct StandingOrderConfig {
+    int lookaheadSeconds;            // orders due within this window are held in the wheel
+    size_t batchSize;                // orders per worker task
+    int maxCatchUpRuns;              // missed runs executed per order per pass
+    int retrySeconds;                // delay before retrying a run whose transfer got no answer
+    
+    StandingOrderConfig() : lookaheadSeconds(3600), batchSize(64), maxCatchUpRuns(1000), retrySeconds(60) {}
+};
+
+// Executes standing orders. Orders due within the lookahead window are loaded
+// into a TimerWheel, and a ticker thread hands each second's expired orders to
+// a worker pool in batches. Each run is a keyed AccountService transfer
+// ("standing-order:<id>:<run>"), so a run repeated after a crash is not paid
+// twice. Runs missed while the program was down are due at start-up and are
+// executed one after another until the order is current. A run the bank
+// refused (e.g. insufficient funds) is counted and skipped; when it was refused
+// because the destination account is gone, the order is deactivated instead.
+// A run whose transfer got no answer (a lost connection, a rolled-back batch,
+// a shed request) stays due and is retried under the same key. Lag is the time from a
+// run's due time to the start of its transfer.
+class StandingOrderScheduler {
+private:
+    std::shared_ptr<StandingOrderRepository> repository;
+    std::shared_ptr<IAccountService> accountService;
+    std::shared_ptr<WorkerPool> workers;
+    StandingOrderConfig config;
+    
+    std::mutex mutex;                // guards wheel, scheduled, running, loadedUntil and stopping
+    TimerWheel wheel;
+    std::unordered_map<int, StandingOrder> scheduled;
+    std::unordered_set<int> running;  // handed to a worker, not yet back in the wheel
+    std::int64_t loadedUntil;
+    bool stopping;
+    std::condition_variable wake;
+    std::thread ticker;
+    
+    std::mutex batchMutex;
+    std::condition_variable batchesDone;
+    size_t batchesInFlight;
+    
+    std::atomic<std::uint64_t> runsExecuted;
+    std::atomic<std::uint64_t> runsFailed;
+    std::atomic<std::uint64_t> runsRetried;
+    std::atomic<std::uint64_t> lagTotalMs;
+    std::atomic<std::uint64_t> lagMaxMs;
+    
+    static std::int64_t nowSeconds() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+    
+    static std::int64_t nowMillis() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+    
+    // Days since 1970-01-01 for a proleptic Gregorian date, and back
+    static std::int64_t daysFromCivil(std::int64_t year, int month, int day) {
+        year -= month <= 2;
+        std::int64_t era = (year >= 0 ? year : year - 399) / 400;
+        std::int64_t yearOfEra = year - era * 400;
+        std::int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        std::int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return era * 146097 + dayOfEra - 719468;
+    }
+    
+    static void civilFromDays(std::int64_t days, std::int64_t& year, int& month, int& day) {
+        days += 719468;
+        std::int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+        std::int64_t dayOfEra = days - era * 146097;
+        std::int64_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        std::int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        std::int64_t monthIndex = (5 * dayOfYear + 2) / 153;
+        day = static_cast<int>(dayOfYear - (153 * monthIndex + 2) / 5 + 1);
+        month = static_cast<int>(monthIndex < 10 ? monthIndex + 3 : monthIndex - 9);
+        year = yearOfEra + era * 400 + (month <= 2);
+    }
+    
+    void recordLag(std::int64_t lagMs) {
+        std::uint64_t lag = static_cast<std::uint64_t>(std::max<std::int64_t>(0, lagMs));
+        lagTotalMs += lag;
+        std::uint64_t seen = lagMaxMs.load();
+        while (lag > seen && !lagMaxMs.compare_exchange_weak(seen, lag)) {
+        }
+    }
+    
+    // Executes the order's due runs (all missed ones too, up to maxCatchUpRuns)
+    // and puts it back in the wheel when its next run falls inside the window
+    void execute(StandingOrder order) {
+        for (int caughtUp = 0; caughtUp < config.maxCatchUpRuns && order.nextRun <= nowSeconds(); caughtUp++) {
+            recordLag(nowMillis() - order.nextRun * 1000);
+            std::string key = "standing-order:" + std::to_string(order.id) + ":" + std::to_string(order.runsDone);
+            
+            TransferLeg leg = accountService->settleTransfer(order.fromAccountId, order.toAccountId,
+                                                             order.amount, key);
+            if (leg == TransferLeg::Applied) {
+                runsExecuted++;
+            } else if (leg == TransferLeg::Unreachable) {
+                // runs_done and next_run stay as they are, so the run is still due
+                runsRetried++;
+                std::cerr << "Standing order " << order.id << " run " << order.runsDone
+                          << " got no answer; retrying in " << config.retrySeconds << " s" << std::endl;
+                std::int64_t retryAt = nowSeconds() + std::max(config.retrySeconds, 1);
+                std::lock_guard<std::mutex> lock(mutex);
+                running.erase(order.id);
+                if (!stopping && retryAt < loadedUntil) {
+                    scheduled[order.id] = order;
+                    wheel.add(static_cast<std::uint64_t>(order.id), retryAt);
+                }
+                return;
+            } else {
+                runsFailed++;
+                std::cerr << "Standing order " << order.id << " run " << order.runsDone << " failed" << std::endl;
+                
+                // No foreign key can cover the destination, which may be on another shard,
+                // so a closed destination is noticed here. An unanswered lookup keeps the order.
+                bool found = true;
+                if (accountService->accountExists(order.toAccountId, found) && !found) {
+                    std::cerr << "Standing order " << order.id << " cancelled: account " << order.toAccountId
+                              << " no longer exists" << std::endl;
+                    repository->deactivate(order.id);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    running.erase(order.id);
+                    return;
+                }
+            }
+            
+            std::int64_t nextRun = runTime(order, order.runsDone + 1);
+            if (!repository->advance(order, order.runsDone + 1, nextRun)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                running.erase(order.id);
+                return;
+            }
+            order.runsDone++;
+            order.nextRun = nextRun;
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        running.erase(order.id);
+        if (!stopping && order.nextRun < loadedUntil) {
+            scheduled[order.id] = order;
+            wheel.add(static_cast<std::uint64_t>(order.id), order.nextRun);
+        }
+    }
+    
+    void dispatch(std::vector<StandingOrder>& due) {
+        for (size_t start = 0; start < due.size(); start += config.batchSize) {
+            size_t end = std::min(due.size(), start + config.batchSize);
+            auto batch = std::make_shared<std::vector<StandingOrder>>(due.begin() + start, due.begin() + end);
+            {
+                std::lock_guard<std::mutex> lock(batchMutex);
+                batchesInFlight++;
+            }
+            workers->submit([this, batch] {
+                for (const auto& order : *batch) {
+                    execute(order);
+                }
+                std::lock_guard<std::mutex> lock(batchMutex);
+                if (--batchesInFlight == 0) {
+                    batchesDone.notify_all();
+                }
+            });
+        }
+        due.clear();
+    }
+    
+    // Loads orders due before until that are not in the wheel yet
+    bool loadWindow(std::int64_t until) {
+        std::vector<StandingOrder> orders;
+        if (!repository->forEachDueBefore(until, [&orders](const StandingOrder& order) {
+                orders.push_back(order);
+                return true;
+            })) {
+            return false;
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& order : orders) {
+            if (!running.count(order.id) && scheduled.emplace(order.id, order).second) {
+                wheel.add(static_cast<std::uint64_t>(order.id), order.nextRun);
+            }
+        }
+        loadedUntil = until;
+        return true;
+    }
+    
+    // Payments are submitted from here, so they run at batch priority too
+    void tick() {
+        ScopedPriority priority(RequestPriority::Batch);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            std::int64_t now = nowSeconds();
+            std::vector<StandingOrder> due;
+            wheel.advance(now, [this, &due](std::uint64_t id, std::int64_t) {
+                auto it = scheduled.find(static_cast<int>(id));
+                if (it != scheduled.end()) {
+                    due.push_back(it->second);
+                    running.insert(it->first);
+                    scheduled.erase(it);
+                }
+            });
+            bool reload = now + config.lookaheadSeconds / 2 >= loadedUntil;
+            lock.unlock();
+            
+            dispatch(due);
+            if (reload) {
+                loadWindow(now + config.lookaheadSeconds);
+            }
+            
+            lock.lock();
+            wake.wait_until(lock, std::chrono::system_clock::time_point(std::chrono::seconds(now + 1)),
+                            [this] { return stopping; });
+        }
+    }
+    
+public:
+    StandingOrderScheduler(std::shared_ptr<StandingOrderRepository> repository,
+                           std::shared_ptr<IAccountService> accountService,
+                           std::shared_ptr<WorkerPool> workers,
+                           const StandingOrderConfig& config = StandingOrderConfig())
+        : repository(repository), accountService(accountService), workers(workers), config(config),
+          wheel(nowSeconds()), loadedUntil(0), stopping(false), batchesInFlight(0),
+          runsExecuted(0), runsFailed(0), runsRetried(0), lagTotalMs(0), lagMaxMs(0) {}
+    
+    ~StandingOrderScheduler() {
+        stop();
+    }
+    
+    // Due time of the given run, in Unix seconds
+    static std::int64_t runTime(const StandingOrder& order, int run) {
+        std::int64_t steps = static_cast<std::int64_t>(run) * order.every;
+        if (order.period == "day") {
+            return order.firstRun + steps * 86400;
+        }
+        if (order.period == "week") {
+            return order.firstRun + steps * 7 * 86400;
+        }
+        if (order.period != "month") {
+            return order.firstRun + steps;
+        }
+        
+        std::int64_t days = order.firstRun / 86400 - (order.firstRun % 86400 < 0);
+        std::int64_t timeOfDay = order.firstRun - days * 86400;
+        std::int64_t year;
+        int month, day;
+        civilFromDays(days, year, month, day);
+        
+        std::int64_t monthIndex = year * 12 + (month - 1) + steps;
+        year = monthIndex / 12;
+        month = static_cast<int>(monthIndex % 12) + 1;
+        int lastDay = static_cast<int>(daysFromCivil(month == 12 ? year + 1 : year, month == 12 ? 1 : month + 1, 1) -
+                                       daysFromCivil(year, month, 1));
+        return daysFromCivil(year, month, std::min(day, lastDay)) * 86400 + timeOfDay;
+    }
+    
+    // Catches up on missed runs and starts executing orders as they fall due
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!ticker.joinable()) {
+            stopping = false;
+            ticker = std::thread(&StandingOrderScheduler::tick, this);
+        }
+    }
+    
+    // Waits for the batches already handed to workers
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (ticker.joinable()) {
+            ticker.join();
+        }
+        
+        std::unique_lock<std::mutex> lock(batchMutex);
+        batchesDone.wait(lock, [this] { return batchesInFlight == 0; });
+    }
+    
+    // Stores a new order; firstRun 0 means now. Returns the order id, 0 on failure.
+    int addOrder(int fromAccountId, int toAccountId, double amount, const std::string& period, int every,
+                 std::int64_t firstRun = 0) {
+        if (amount <= 0 || every <= 0 || fromAccountId == toAccountId ||
+            (period != "second" && period != "day" && period != "week" && period != "month")) {
+            std::cerr << "Invalid standing order" << std::endl;
+            return 0;
+        }
+        
+        StandingOrder order = { 0, fromAccountId, toAccountId, amount, period, every,
+                                firstRun > 0 ? firstRun : nowSeconds(), 0, 0 };
+        order.nextRun = order.firstRun;
+        order.id = repository->addAndGetId(order);
+        if (order.id == 0) {
+            return 0;
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        if (order.nextRun < loadedUntil) {
+            scheduled[order.id] = order;
+            wheel.add(static_cast<std::uint64_t>(order.id), order.nextRun);
+        }
+        return order.id;
+    }
+    
+    bool cancelOrder(int orderId) {
+        if (!repository->deactivate(orderId)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        wheel.cancel(static_cast<std::uint64_t>(orderId));
+        scheduled.erase(orderId);
+        return true;
+    }
+    
+    std::vector<StandingOrder> getAccountOrders(int accountId) {
+        return repository->getByAccountId(accountId);
+    }
+    
+    void report(std::ostream& out) {
+        std::uint64_t runs = runsExecuted + runsFailed + runsRetried;
+        size_t waiting;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            waiting = wheel.size();
+        }
+        out << "Standing orders: " << runsExecuted << " runs executed, " << runsFailed << " failed, "
+            << runsRetried << " retried, " << waiting << " waiting; lag avg " << std::fixed << std::setprecision(1)
+            << (runs ? static_cast<double>(lagTotalMs) / runs : 0.0) << " ms, max " << lagMaxMs << " ms\n";
+    }
+};
+
+// Back-office batch jobs reachable from the console, one of each per
+// database: a single entry, or one per shard in shard order (see ShardMap)
+struct BackOfficeJobs {
+    std::vector<std::shared_ptr<StatementGenerator>> statements;
+    std::vector<std::shared_ptr<LedgerReconciler>> reconcilers;
+    std::vector<std::shared_ptr<TransactionArchiver>> archivers;
+    std::vector<std::shared_ptr<StandingOrderScheduler>> standingOrders;
+    std::shared_ptr<ShardMap> shardMap;     // null with a single database
+    
+    // Standing orders live with their source account, and every id names its shard
+    size_t shardOf(int id) const {
+        return shardMap ? shardMap->shardOf(id) : 0;
+    }
+};
+
+// UI interface - follows Interface Segregation Principle
+class IUserInterface {
+public:
+    virtual ~IUserInterface() {}
+    virtual void start() = 0;
+};
+
+// User class for authentication
+class User {
+private:
+    std::string username;
+    std::string password;
+
+public:
+    User(const std::string& user, const std::string& pass) : username(user), password(pass) {}
+
+    bool authenticate(const std::string& user, const std::string& pass) {
+        return username == user && password == pass;
+    }
+};
+
+// Console UI implementation - follows Single Responsibility Principle
+class ConsoleUI : public IUserInterface {
+private:
+    std::shared_ptr<ICustomerService> customerService;
+    std::shared_ptr<IAccountService> accountService;
+    std::shared_ptr<ITransactionService> transactionService;
+    BackOfficeJobs jobs;
+    std::shared_ptr<User> currentUser;
+    ReportFormat reportFormat;
+    std::string reportPath;  // empty writes reports to the screen
+    
+    void displayMainMenu() {
+        std::cout << "\n========= BANK MANAGEMENT SYSTEM =========\n";
+        std::cout << "1. Customer Management\n";
+        std::cout << "2. Account Management\n";
+        std::cout << "3. Transaction Management\n";
+        std::cout << "4. Report Settings\n";
+        std::cout << "0. Exit\n";
+        std::cout << "Enter your choice: ";
+    }
+    
+    void displayCustomerMenu() {
+        std::cout << "\n========= CUSTOMER MANAGEMENT =========\n";
+        std::cout << "1. Add New Customer\n";
+        std::cout << "2. Update Customer Information\n";
+        std::cout << "3. Remove Customer\n";
+        std::cout << "4. View Customer Details\n";
+        std::cout << "5. List All Customers\n";
+        std::cout << "6. Search Customers\n";
+        std::cout << "0. Back to Main Menu\n";
+        std::cout << "Enter your choice: ";
+    }
+    
+    void displayAccountMenu() {
+        std::cout << "\n========= ACCOUNT MANAGEMENT =========\n";
+        std::cout << "1. Open New Account\n";
+        std::cout << "2. Close Account\n";
+        std::cout << "3. Deposit\n";
+        std::cout << "4. Withdraw\n";
+        std::cout << "5. Transfer\n";
+        std::cout << "6. View Account Details\n";
+        std::cout << "7. List Customer Accounts\n";
+        std::cout << "8. Balance As Of Date\n";
+        std::cout << "9. Standing Orders\n";
+        std::cout << "0. Back to Main Menu\n";
+        std::cout << "Enter your choice: ";
+    }
+    
+    void displayTransactionMenu() {
+        std::cout << "\n========= TRANSACTION MANAGEMENT =========\n";
+        std::cout << "1. View Transaction Details\n";
+        std::cout << "2. View Account Transactions\n";
+        std::cout << "3. Generate Monthly Statements\n";
+        std::cout << "4. View Daily Balance History\n";
+        std::cout << "5. Reconcile Balances With Ledger\n";
+        std::cout << "6. Archive Old Transactions\n";
+        std::cout << "0. Back to Main Menu\n";
+        std::cout << "Enter your choice: ";
+    }
+    
+    void handleCustomerManagement() {
+        int choice = -1;
+        
+        while (choice != 0) {
+            displayCustomerMenu();
+            std::cin >> choice;
+            
+            switch (choice) {
+                case 1:
+                    addCustomer();
+                    break;
+                case 2:
+                    updateCustomer();
+                    break;
+                case 3:
+                    removeCustomer();
+                    break;
+                case 4:
+                    viewCustomerDetails();
+                    break;
+                case 5:
+                    listAllCustomers();
+                    break;
+                case 6:
+                    searchCustomers();
+                    break;
+                case 0:
+                    std::cout << "Returning to main menu...\n";
+                    break;
+                default:
+                    std::cout << "Invalid choice. Please try again.\n";
+            }
+        }
+    }
+    
+    void handleAccountManagement() {
+        int choice = -1;
+        
+        while (choice != 0) {
+            displayAccountMenu();
+            std::cin >> choice;
+            
+            switch (choice) {
+                case 1:
+                    openAccount();
+                    break;
+                case 2:
+                    closeAccount();
+                    break;
+                case 3:
+                    deposit();
+                    break;
+                case 4:
+                    withdraw();
+                    break;
+                case 5:
+                    transfer();
+                    break;
+                case 6:
+                    viewAccountDetails();
+                    break;
+                case 7:
+                    listCustomerAccounts();
+                    break;
+                case 8:
+                    viewBalanceAsOf();
+                    break;
+                case 9:
+                    manageStandingOrders();
+                    break;
+                case 0:
+                    std::cout << "Returning to main menu...\n";
+                    break;
+                default:
+                    std::cout << "Invalid choice. Please try again.\n";
+            }
+        }
+    }
+    
+    void handleTransactionManagement() {
+        int choice = -1;
+        
+        while (choice != 0) {
+            displayTransactionMenu();
+            std::cin >> choice;
+            
+            switch (choice) {
+                case 1:
+                    viewTransactionDetails();
+                    break;
+                case 2:
+                    viewAccountTransactions();
+                    break;
+                case 3:
+                    generateStatements();
+                    break;
+                case 4:
+                    viewDailyBalanceHistory();
+                    break;
+                case 5:
+                    reconcileLedger();
+                    break;
+                case 6:
+                    archiveTransactions();
+                    break;
+                case 0:
+                    std::cout << "Returning to main menu...\n";
+                    break;
+                default:
+                    std::cout << "Invalid choice. Please try again.\n";
+            }
+        }
+    }
+    
+    // Customer management functions
+    void addCustomer() {
+        std::string name, address, phone, email;
+        
+        std::cin.ignore();
+        std::cout << "Enter customer name: ";
+        std::getline(std::cin, name);
+        
+        std::cout << "Enter address: ";
+        std::getline(std::cin, address);
+        
+        std::cout << "Enter phone number: ";
+        std::getline(std::cin, phone);
+        
+        std::cout << "Enter email: ";
+        std::getline(std::cin, email);
+        
+        Customer customer(0, name, address, phone, email);
+        
+        if (customerService->addCustomer(customer)) {
+            std::cout << "Customer added successfully.\n";
+        } else {
+            std::cout << "Failed to add customer.\n";
+        }
+    }
+    
+    void updateCustomer() {
+        int customerId;
+        std::cout << "Enter customer ID: ";
+        std::cin >> customerId;
+        
+        auto customer = customerService->getCustomer(customerId);
+        
+        if (!customer) {
+            std::cout << "Customer not found.\n";
+            return;
+        }
+        
+        std::string name, address, phone, email;
+        
+        std::cin.ignore();
+        std::cout << "Enter new name (current: " << customer->getName() << "): ";
+        std::getline(std::cin, name);
+        if (!name.empty()) customer->setName(name);
+        
+        std::cout << "Enter new address (current: " << customer->getAddress() << "): ";
+        std::getline(std::cin, address);
+        if (!address.empty()) customer->setAddress(address);
+        
+        std::cout << "Enter new phone (current: " << customer->getPhone() << "): ";
+        std::getline(std::cin, phone);
+        if (!phone.empty()) customer->setPhone(phone);
+        
+        std::cout << "Enter new email (current: " << customer->getEmail() << "): ";
+        std::getline(std::cin, email);
+        if (!email.empty()) customer->setEmail(email);
+        
+        if (customerService->updateCustomer(*customer)) {
+            std::cout << "Customer updated successfully.\n";
+        } else {
+            std::cout << "Failed to update customer.\n";
+        }
+    }
+    
+    void removeCustomer() {
+        int customerId;
+        std::cout << "Enter customer ID: ";
+        std::cin >> customerId;
+        
+        if (customerService->removeCustomer(customerId)) {
+            std::cout << "Customer removed successfully.\n";
+        } else {
+            std::cout << "Failed to remove customer.\n";
+        }
+    }
+    
+    void viewCustomerDetails() {
+        const size_t recentTransactions = 5;
+        int customerId;
+        std::cout << "Enter customer ID: ";
+        std::cin >> customerId;
+        
+        CustomerOverview overview;
+        if (!customerService->getCustomerOverview(customerId, recentTransactions, overview)) {
+            std::cout << "Customer not found.\n";
+            return;
+        }
+        
+        std::cout << "\n------------ Customer Details ------------\n";
+        overview.customer.display();
+        
+        if (overview.accounts.empty()) {
+            std::cout << "No accounts found for this customer.\n";
+            return;
+        }
+        
+        std::cout << "\nCustomer Accounts:\n";
+        for (const auto& account : overview.accounts) {
+            std::cout << "Account Number: " << account.account.accountNumber
+                      << ", Type: " << accountTypeName(account.account)
+                      << ", Balance: $" << std::fixed << std::setprecision(2)
+                      << account.account.balance << std::endl;
+            for (const auto& transaction : account.recentTransactions) {
+                std::cout << "    " << transaction.getDateTime() << "  " << std::left << std::setw(14)
+                          << transaction.getType() << std::right << std::setw(12) << transaction.getAmount()
+                          << "  " << transaction.getDescription() << std::endl;
+            }
+        }
+    }
+    
+    void listAllCustomers() {
+        runReport([this](ReportWriter& report) {
+            report.begin("All Customers", {
+                { "ID", "customer_id", 8, true },
+                { "Name", "name", 24, false },
+                { "Phone", "phone", 16, false },
+                { "Email", "email", 30, false }
+            });
+            
+            customerService->forEachCustomer([&report](const Customer& customer) {
+                report.integer(customer.getId())
+                      .text(customer.getName())
+                      .text(customer.getPhone())
+                      .text(customer.getEmail());
+                report.endRow();
+                return true;
+            });
+        });
+    }
+    
+    void searchCustomers() {
+        const size_t maxResults = 20;
+        std::string query;
+        
+        std::cin.ignore();
+        std::cout << "Enter name, email or phone (or part of it): ";
+        std::getline(std::cin, query);
+        
+        auto customers = customerService->searchCustomers(query, maxResults);
+        
+        if (customers.empty()) {
+            std::cout << "No matching customers found.\n";
+            return;
+        }
+        
+        std::cout << "\n------------ Matching Customers ------------\n";
+        for (const auto& customer : customers) {
+            std::cout << "ID: " << customer->getId()
+                      << ", Name: " << customer->getName()
+                      << ", Phone: " << customer->getPhone()
+                      << ", Email: " << customer->getEmail() << std::endl;
+        }
+        
+        if (customers.size() == maxResults) {
+            std::cout << "(showing first " << maxResults << " matches)\n";
+        }
+    }
+    
+    // Account management functions
+    void openAccount() {
+        int customerId;
+        int accountType;
+        double initialDeposit;
+        
+        std::cout << "Enter customer ID: ";
+        std::cin >> customerId;
+        
+        auto customer = customerService->getCustomer(customerId);
+        
+        if (!customer) {
+            std::cout << "Customer not found.\n";
+            return;
+        }
+        
+        std::cout << "Select account type:\n";
+        std::cout << "1. Savings Account\n";
+        std::cout << "2. Checking Account\n";
+        std::cout << "Enter choice: ";
+        std::cin >> accountType;
+        
+        std::cout << "Enter initial deposit amount: $";
+        std::cin >> initialDeposit;
+        
+        if (initialDeposit <= 0) {
+            std::cout << "Initial deposit must be greater than zero.\n";
+            return;
+        }
+        
+        // Account number and opening date are assigned by the account service
+        if (accountType == 1) {
+            // Savings account
+            double interestRate;
+            std::cout << "Enter interest rate (%): ";
+            std::cin >> interestRate;
+            
+            SavingsAccount account(0, customerId, initialDeposit, "", "", interestRate);
+            
+            if (accountService->openAccount(account)) {
+                std::cout << "Savings account opened successfully.\n";
+                std::cout << "Account Number: " << account.getAccountNumber() << std::endl;
+            } else {
+                std::cout << "Failed to open savings account.\n";
+            }
+        } else if (accountType == 2) {
+            // Checking account
+            double overdraftLimit;
+            std::cout << "Enter overdraft limit: $";
+            std::cin >> overdraftLimit;
+            
+            CheckingAccount account(0, customerId, initialDeposit, "", "", overdraftLimit);
+            
+            if (accountService->openAccount(account)) {
+                std::cout << "Checking account opened successfully.\n";
+                std::cout << "Account Number: " << account.getAccountNumber() << std::endl;
+            } else {
+                std::cout << "Failed to open checking account.\n";
+            }
+        } else {
+            std::cout << "Invalid account type.\n";
+        }
+    }
+    
+    void closeAccount() {
+        int accountId;
+        std::cout << "Enter account ID: ";
+        std::cin >> accountId;
+        
+        auto account = accountService->getAccount(accountId);
+        
+        if (!account) {
+            std::cout << "Account not found.\n";
+            return;
+        }
+        
+        if (account->getBalance() > 0) {
+            std::cout << "Account has a balance of $" << std::fixed << std::setprecision(2) 
+                     << account->getBalance() << ". Withdraw before closing.\n";
+            return;
+        }
+        
+        if (accountService->closeAccount(accountId)) {
+            std::cout << "Account closed successfully.\n";
+        } else {
+            std::cout << "Failed to close account.\n";
+        }
+    }
+    
+    void deposit() {
+        int accountId;
+        double amount;
+        
+        std::cout << "Enter account ID: ";
+        std::cin >> accountId;
+        
+        auto account = accountService->getAccount(accountId);
+        
+        if (!account) {
+            std::cout << "Account not found.\n";
+            return;
+        }
+        
+        std::cout << "Enter deposit amount: $";
+        std::cin >> amount;
+        
+        if (amount <= 0) {
+            std::cout << "Deposit amount must be greater than zero.\n";
+            return;
+        }
+        
+        if (accountService->deposit(accountId, amount)) {
+            std::cout << "Deposit successful.\n";
+            std::cout << "New balance: $" << std::fixed << std::setprecision(2) 
+                     << accountService->getBalance(accountId) << std::endl;
+        } else {
+            std::cout << "Deposit failed.\n";
+        }
+    }
+    
+    void withdraw() {
+        int accountId;
+        double amount;
+        
+        std::cout << "Enter account ID: ";
+        std::cin >> accountId;
+        
+        auto account = accountService->getAccount(accountId);
+        
+        if (!account) {
+            std::cout << "Account not found.\n";
+            return;
+        }
+        
+        std::cout << "Enter withdrawal amount: $";
+        std::cin >> amount;
+        
+        if (amount <= 0) {
+            std::cout << "Withdrawal amount must be greater than zero.\n";
+            return;
+        }
+        
+        if (accountService->withdraw(accountId, amount)) {
+            std::cout << "Withdrawal successful.\n";
+            std::cout << "New balance: $" << std::fixed << std::setprecision(2) 
+                     << accountService->getBalance(accountId) << std::endl;
+        } else {
+            std::cout << "Withdrawal failed. Insufficient funds or exceeded overdraft limit.\n";
+        }
+    }
+    
+    void transfer() {
+        int fromAccountId, toAccountId;
+        double amount;
+        
+        std::cout << "Enter source account ID: ";
+        std::cin >> fromAccountId;
+        
+        auto fromAccount = accountService->getAccount(fromAccountId);
+        
+        if (!fromAccount) {
+            std::cout << "Source account not found.\n";
+            return;
+        }
+        
+        std::cout << "Enter destination account ID: ";
+        std::cin >> toAccountId;
+        
+        auto toAccount = accountService->getAccount(toAccountId);
+        
+        if (!toAccount) {
+            std::cout << "Destination account not found.\n";
+            return;
+        }
+        
+        std::cout << "Enter transfer amount: $";
+        std::cin >> amount;
+        
+        if (amount <= 0) {
+            std::cout << "Transfer amount must be greater than zero.\n";
+            return;
+        }
+        
+        if (accountService->transfer(fromAccountId, toAccountId, amount)) {
+            std::cout << "Transfer successful.\n";
+            std::cout << "Source account balance: $" << std::fixed << std::setprecision(2) 
+                     << accountService->getBalance(fromAccountId) << std::endl;
+            std::cout << "Destination account balance: $" << std::fixed << std::setprecision(2) 
+                     << accountService->getBalance(toAccountId) << std::endl;
+        } else {
+            std::cout << "Transfer failed. Insufficient funds or exceeded overdraft limit.\n";
+        }
+    }
+    
+    void manageStandingOrders() {
+        if (jobs.standingOrders.empty()) {
+            std::cout << "Standing orders are not available.\n";
+            return;
+        }
+        
+        int accountId;
+        std::cout << "Enter source account ID: ";
+        std::cin >> accountId;
+        
+        StandingOrderScheduler& standingOrders = *jobs.standingOrders[jobs.shardOf(accountId)];
+        auto orders = standingOrders.getAccountOrders(accountId);
+        if (orders.empty()) {
+            std::cout << "No standing orders from this account.\n";
+        }
+        for (const auto& order : orders) {
+            std::time_t next = static_cast<std::time_t>(order.nextRun);
+            std::cout << "Order " << order.id << ": $" << std::fixed << std::setprecision(2) << order.amount
+                      << " to account " << order.toAccountId << " every " << order.every << " " << order.period
+                      << ", next " << std::put_time(std::localtime(&next), "%Y-%m-%d %H:%M") << "\n";
+        }
+        
+        int choice;
+        std::cout << "1. New standing order  2. Cancel a standing order  0. Back: ";
+        std::cin >> choice;
+        
+        if (choice == 1) {
+            int toAccountId, every;
+            double amount;
+            std::string period;
+            std::cout << "Enter destination account ID: ";
+            std::cin >> toAccountId;
+            std::cout << "Enter amount: $";
+            std::cin >> amount;
+            std::cout << "Repeat every (number and day, week or month, e.g. 1 month): ";
+            std::cin >> every >> period;
+            if (!period.empty() && period.back() == 's') {
+                period.pop_back();
+            }
+            
+            if (!accountService->getAccount(toAccountId)) {
+                std::cout << "Destination account not found.\n";
+                return;
+            }
+            
+            int orderId = standingOrders.addOrder(accountId, toAccountId, amount, period, every);
+            if (orderId != 0) {
+                std::cout << "Standing order " << orderId << " created; the first payment runs now.\n";
+            } else {
+                std::cout << "Failed to create standing order.\n";
+            }
+        } else if (choice == 2) {
+            int orderId;
+            std::cout << "Enter order ID: ";
+            std::cin >> orderId;
+            bool owned = std::any_of(orders.begin(), orders.end(),
+                                     [orderId](const StandingOrder& order) { return order.id == orderId; });
+            if (owned && standingOrders.cancelOrder(orderId)) {
+                std::cout << "Standing order cancelled.\n";
+            } else {
+                std::cout << "Standing order not found.\n";
+            }
+        }
+    }
+    
+    void viewBalanceAsOf() {
+        int accountId;
+        std::string timestamp;
+        
+        std::cout << "Enter account ID: ";
+        std::cin >> accountId;
+        std::cin.ignore();
+        std::cout << "Enter date (YYYY-MM-DD) or date and time (YYYY-MM-DD HH:MM:SS): ";
+        std::getline(std::cin, timestamp);
+        
+        double balance = accountService->getBalanceAsOf(accountId, timestamp);
+        
+        if (balance < 0) {
+            std::cout << "Failed to determine balance for that account and time.\n";
+        } else {
+            std::cout << "Balance as of " << timestamp << ": $" << std::fixed << std::setprecision(2)
+                      << balance << std::endl;
+        }
+    }
+    
+    void viewAccountDetails() {
+        int accountId;
+        std::cout << "Enter account ID: ";
+        std::cin >> accountId;
+        
+        auto account = accountService->getAccount(accountId);
+        
+        if (account) {
+            std::cout << "\n------------ Account Details ------------\n";
+            account->display();
+        } else {
+            std::cout << "Account not found.\n";
+        }
+    }
+    
+    void listCustomerAccounts() {
+        int customerId;
+        std::cout << "Enter customer ID: ";
+        std::cin >> customerId;
+        
+        auto customer = customerService->getCustomer(customerId);
+        
+        if (!customer) {
+            std::cout << "Customer not found.\n";
+            return;
+        }
+        
+        auto accounts = accountService->getCustomerAccountRecords(customerId);
+        
+        if (accounts.empty()) {
+            std::cout << "No accounts found for this customer.\n";
+            return;
+        }
+        
+        runReport([&](ReportWriter& report) {
+            report.begin("Accounts of " + customer->getName(), {
+                { "Account ID", "account_id", 10, true },
+                { "Account Number", "account_number", 20, false },
+                { "Type", "account_type", 8, false },
+                { "Balance", "balance", 14, true },
+                { "Date Opened", "date_opened", 11, false },
+                { "Interest %", "interest_rate", 10, true },
+                { "Overdraft", "overdraft_limit", 12, true }
+            });
+            
+            for (const auto& account : accounts) {
+                report.integer(account.id)
+                      .text(account.accountNumber)
+                      .text(accountTypeName(account))
+                      .money(account.balance)
+                      .text(account.dateOpened);
+                
+                switch (account.kind) {
+                    case AccountKind::Savings:
+                        report.money(account.ext.interestRate).empty();
+                        break;
+                    case AccountKind::Checking:
+                        report.empty().money(account.ext.overdraftLimit);
+                        break;
+                    default:
+                        report.empty().empty();
+                        break;
+                }
+                report.endRow();
+            }
+        });
+    }
+    
+    // Transaction management functions
+    void viewTransactionDetails() {
+        int transactionId;
+        std::cout << "Enter transaction ID: ";
+        std::cin >> transactionId;
+        
+        auto transaction = transactionService->getTransaction(transactionId);
+        
+        if (transaction) {
+            std::cout << "\n------------ Transaction Details ------------\n";
+            transaction->display();
+        } else {
+            std::cout << "Transaction not found.\n";
+        }
+    }
+    
+    void viewAccountTransactions() {
+        int accountId;
+        std::cout << "Enter account ID: ";
+        std::cin >> accountId;
+        
+        auto account = accountService->getAccount(accountId);
+        
+        if (!account) {
+            std::cout << "Account not found.\n";
+            return;
+        }
+        
+        runReport([&](ReportWriter& report) {
+            report.begin("Transactions of account " + account->getAccountNumber(), {
+                { "Transaction ID", "transaction_id", 14, true },
+                { "Type", "type", 12, false },
+                { "Amount", "amount", 14, true },
+                { "Date/Time", "date_time", 26, false },
+                { "Description", "description", 0, false }
+            });
+            
+            transactionService->forEachAccountTransaction(accountId, [&report](const Transaction& transaction) {
+                report.integer(transaction.getId())
+                      .text(transaction.getType())
+                      .money(transaction.getAmount())
+                      .text(transaction.getDateTime())
+                      .text(transaction.getDescription());
+                report.endRow();
+                return true;
+            });
+        });
+    }
+    
+    void viewDailyBalanceHistory() {
+        int accountId;
+        std::string fromDay, toDay;
+        
+        std::cout << "Enter account ID: ";
+        std::cin >> accountId;
+        std::cout << "Enter start date (YYYY-MM-DD): ";
+        std::cin >> fromDay;
+        std::cout << "Enter end date (YYYY-MM-DD): ";
+        std::cin >> toDay;
+        
+        auto history = transactionService->getDailyRollups(accountId, fromDay, toDay);
+        
+        if (history.empty()) {
+            std::cout << "No activity found for this account in that range.\n";
+            return;
+        }
+        
+        runReport([&](ReportWriter& report) {
+            report.begin("Daily balances of account " + std::to_string(accountId), {
+                { "Day", "day", 10, false },
+                { "Opening", "opening_balance", 14, true },
+                { "Closing", "closing_balance", 14, true },
+                { "Count", "transaction_count", 6, true },
+                { "Deposits", "deposit_total", 12, true },
+                { "Withdrawals", "withdrawal_total", 12, true },
+                { "Transfers In", "transfer_in_total", 12, true },
+                { "Transfers Out", "transfer_out_total", 13, true }
+            });
+            
+            for (const auto& day : history) {
+                report.text(day.day)
+                      .money(day.openingBalance)
+                      .money(day.closingBalance)
+                      .integer(day.transactionCount)
+                      .money(day.depositTotal)
+                      .money(day.withdrawalTotal)
+                      .money(day.transferInTotal)
+                      .money(day.transferOutTotal);
+                report.endRow();
+            }
+        });
+    }
+    
+    void generateStatements() {
+        if (jobs.statements.empty()) {
+            std::cout << "Statement generation is not available.\n";
+            return;
+        }
+        
+        StatementJobConfig config;
+        std::cout << "Enter statement month (YYYY-MM): ";
+        std::cin >> config.period;
+        std::cout << "Enter output directory: ";
+        std::cin >> config.outputDirectory;
+        std::cout << "Enter number of worker threads: ";
+        std::cin >> config.threads;
+        config.checkpointFile = config.outputDirectory + "/.statements_" + config.period + ".checkpoint";
+        
+        // Shards run one after another, each resuming from its own checkpoint file
+        StatementJobResult result = { true, 0, 0, 0, 0, 0.0 };
+        for (size_t i = 0; i < jobs.statements.size(); i++) {
+            StatementJobConfig shardConfig = config;
+            if (jobs.statements.size() > 1) {
+                shardConfig.checkpointFile += "." + std::to_string(i + 1);
+            }
+            StatementJobResult part = jobs.statements[i]->run(shardConfig);
+            result.success = result.success && part.success;
+            result.statements += part.statements;
+            result.chunksDone += part.chunksDone;
+            result.chunksSkipped += part.chunksSkipped;
+            result.chunksFailed += part.chunksFailed;
+            result.seconds += part.seconds;
+        }
+        
+        std::cout << "Statements written: " << result.statements
+                  << " (" << result.chunksDone << " chunks done, " << result.chunksSkipped
+                  << " resumed from checkpoint, " << result.chunksFailed << " failed)\n";
+        std::cout << "Elapsed: " << std::fixed << std::setprecision(2) << result.seconds << " s, "
+                  << result.statementsPerSecond() << " statements/s\n";
+        if (!result.success) {
+            std::cout << "Some statements were not generated. Run again to resume.\n";
+        }
+    }
+    
+    void reconcileLedger() {
+        if (jobs.reconcilers.empty()) {
+            std::cout << "Ledger reconciliation is not available.\n";
+            return;
+        }
+        
+        ReconciliationConfig config;
+        std::cout << "Enter number of worker threads: ";
+        std::cin >> config.threads;
+        
+        ReconciliationResult result = { true, 0, 0, 0, 0.0, {} };
+        for (const auto& reconciler : jobs.reconcilers) {
+            ReconciliationResult part = reconciler->run(config);
+            result.success = result.success && part.success;
+            result.accounts += part.accounts;
+            result.ledgerRows += part.ledgerRows;
+            result.chunksFailed += part.chunksFailed;
+            result.seconds += part.seconds;
+            result.mismatches.insert(result.mismatches.end(), part.mismatches.begin(), part.mismatches.end());
+        }
+        std::sort(result.mismatches.begin(), result.mismatches.end(),
+                  [](const AccountMismatch& a, const AccountMismatch& b) { return a.accountId < b.accountId; });
+        
+        std::cout << "Accounts checked: " << result.accounts << ", ledger rows: " << result.ledgerRows
+                  << ", mismatches: " << result.mismatches.size() << "\n";
+        std::cout << "Elapsed: " << std::fixed << std::setprecision(2) << result.seconds << " s, "
+                  << result.rowsPerSecond() << " rows/s\n";
+        if (!result.success) {
+            std::cout << result.chunksFailed << " account ranges could not be read. Run again.\n";
+        }
+        
+        if (result.mismatches.empty()) {
+            return;
+        }
+        
+        runReport([&](ReportWriter& report) {
+            report.begin("Balance mismatches", {
+                { "Account ID", "account_id", 10, true },
+                { "Balance", "balance", 15, true },
+                { "Ledger Net", "ledger_net", 15, true },
+                { "Difference", "difference", 15, true }
+            });
+            
+            for (const auto& mismatch : result.mismatches) {
+                report.integer(mismatch.accountId)
+                      .money(mismatch.balanceCents / 100.0)
+                      .money(mismatch.ledgerCents / 100.0)
+                      .money((mismatch.balanceCents - mismatch.ledgerCents) / 100.0);
+                report.endRow();
+            }
+        });
+    }
+    
+    void archiveTransactions() {
+        if (jobs.archivers.empty()) {
+            std::cout << "Transaction archiving is not available.\n";
+            return;
+        }
+        
+        ArchiveJobConfig config;
+        std::cout << "Keep how many months in the live table: ";
+        std::cin >> config.keepMonths;
+        
+        ArchiveJobResult result = { true, 0, 0, 0, 0.0 };
+        for (const auto& archiver : jobs.archivers) {
+            ArchiveJobResult part = archiver->run(config);
+            result.success = result.success && part.success;
+            result.partitionsArchived += part.partitionsArchived;
+            result.rows += part.rows;
+            result.bytes += part.bytes;
+            result.seconds += part.seconds;
+        }
+        
+        std::cout << "Months archived: " << result.partitionsArchived << ", rows: " << result.rows
+                  << ", archive bytes: " << result.bytes << "\n";
+        std::cout << "Elapsed: " << std::fixed << std::setprecision(2) << result.seconds << " s\n";
+        if (!result.success) {
+            std::cout << "Archiving stopped early. Run again to continue.\n";
+        }
+    }
+    
+    // Report settings and output
+    void configureReports() {
+        int choice;
+        std::cout << "Select report format:\n";
+        std::cout << "1. Table\n";
+        std::cout << "2. CSV\n";
+        std::cout << "3. JSON\n";
+        std::cout << "Enter choice: ";
+        std::cin >> choice;
+        
+        switch (choice) {
+            case 1:
+                reportFormat = ReportFormat::Table;
+                break;
+            case 2:
+                reportFormat = ReportFormat::Csv;
+                break;
+            case 3:
+                reportFormat = ReportFormat::Json;
+                break;
+            default:
+                std::cout << "Invalid format. Keeping the current one.\n";
+        }
+        
+        std::cin.ignore();
+        std::cout << "Report output file (leave blank for screen): ";
+        std::getline(std::cin, reportPath);
+        
+        std::cout << "Report settings saved.\n";
+    }
+    
+    void runReport(const std::function<void(ReportWriter&)>& produce) {
+        int fd = 1;
+        
+        if (!reportPath.empty()) {
+            fd = openOutputFile(reportPath);
+            if (fd < 0) {
+                std::cout << "Cannot open report file " << reportPath << ".\n";
+                return;
+            }
+        }
+        
+        size_t rows;
+        {
+            ReportWriter report(fd, reportFormat);
+            produce(report);
+            report.finish();
+            rows = report.rowCount();
+        }
+        
+        if (fd != 1) {
+            closeOutputFile(fd);
+            std::cout << rows << " rows written to " << reportPath << ".\n";
+        }
+    }
+    
+    // Login method
+    void login() {
+        std::string username, password;
+        int attempts = 0;
+        const int maxAttempts = 3;
+        const int lockoutDuration = 60; // Lockout duration in seconds
+
+        while (attempts < maxAttempts) {
+            std::cout << "Enter username: ";
+            std::cin >> username;
+            std::cout << "Enter password: ";
+            std::cin >> password;
+
+            // Simple hardcoded user for demonstration
+            User user("admin", "password123");
+            currentUser = std::make_shared<User>(user);
+
+            if (currentUser->authenticate(username, password)) {
+                std::cout << "Login successful!\n";
+                return; // Exit the loop on successful login
+            } else {
+                attempts++;
+                std::cout << "Invalid credentials. Attempts left: " << (maxAttempts - attempts) << "\n";
+            }
+
+            if (attempts == maxAttempts) {
+                std::cout << "Too many failed attempts. Please wait " << lockoutDuration << " seconds before trying again.\n";
+                std::this_thread::sleep_for(std::chrono::seconds(lockoutDuration)); // Lockout timer
+                attempts = 0; // Reset attempts after lockout
+            }
+        }
+
+        std::cout << "Access denied. Exiting...\n";
+        exit(0); // Exit if authentication fails after max attempts
+    }
+    
+public:
+    ConsoleUI(std::shared_ptr<ICustomerService> customerSvc,
+             std::shared_ptr<IAccountService> accountSvc,
+             std::shared_ptr<ITransactionService> transactionSvc,
+             const BackOfficeJobs& jobs = BackOfficeJobs())
+        : customerService(customerSvc), accountService(accountSvc), transactionService(transactionSvc),
+          jobs(jobs), reportFormat(ReportFormat::Table) {}
+    
+    void start() override {
+        login(); // Call login before showing the main menu
+        int choice = -1;
+        
+        while (choice != 0) {
+            displayMainMenu();
+            std::cin >> choice;
+            
+            switch (choice) {
+                case 1:
+                    handleCustomerManagement();
+                    break;
+                case 2:
+                    handleAccountManagement();
+                    break;
+                case 3:
+                    handleTransactionManagement();
+                    break;
+                case 4:
+                    configureReports();
+                    break;
+                case 0:
+                    std::cout << "Thank you for using the Bank Management System. Goodbye!\n";
+                    break;
+                default:
+                    std::cout << "Invalid choice. Please try again.\n";
+            }
+        }
+    }
+};
+
+// Portable socket layer for the network front ends: epoll on Linux, WSAPoll on
+// Windows and poll() elsewhere, behind one small readiness interface
+#ifdef _WIN32
+using SocketHandle = SOCKET;
+const SocketHandle kInvalidSocket = INVALID_SOCKET;
+#else
+using SocketHandle = int;
+const SocketHandle kInvalidSocket = -1;
+#endif
+
+inline bool initSockets() {
+#ifdef _WIN32
+    static const bool started = [] {
+        WSADATA data;
+        return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+    }();
+    return started;
+#else
+    // Writes to a peer that went away must fail with EPIPE rather than end the process
+    std::signal(SIGPIPE, SIG_IGN);
+    return true;
+#endif
+}
+
+inline void closeSocket(SocketHandle socket) {
+#ifdef _WIN32
+    closesocket(socket);
+#else
+    ::close(socket);
+#endif
+}
+
+inline bool setNonBlocking(SocketHandle socket) {
+#ifdef _WIN32
+    u_long enabled = 1;
+    return ioctlsocket(socket, FIONBIO, &enabled) == 0;
+#else
+    int flags = fcntl(socket, F_GETFL, 0);
+    return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+inline void setNoDelay(SocketHandle socket) {
+    int enabled = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&enabled), sizeof(enabled));
+}
+
+inline bool socketWouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+inline long sendSome(SocketHandle socket, const char* data, size_t size) {
+#ifdef _WIN32
+    return send(socket, data, static_cast<int>(std::min<size_t>(size, INT_MAX)), 0);
+#else
+    return static_cast<long>(::send(socket, data, size, 0));
+#endif
+}
+
+inline long receiveSome(SocketHandle socket, char* buffer, size_t size) {
+#ifdef _WIN32
+    return recv(socket, buffer, static_cast<int>(std::min<size_t>(size, INT_MAX)), 0);
+#else
+    return static_cast<long>(::recv(socket, buffer, size, 0));
+#endif
+}
+
+inline bool sendAll(SocketHandle socket, const char* data, size_t size) {
+    while (size > 0) {
+        long sent = sendSome(socket, data, size);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+// Address the servers listen on unless told otherwise. They do no
+// authentication of their own, so only local processes may reach them.
+const char* const kLoopbackHost = "127.0.0.1";
+
+// Listening socket on host, e.g. kLoopbackHost or "0.0.0.0" for every IPv4
+// interface; port 0 picks a free port
+inline SocketHandle listenOn(const std::string& host, unsigned short port, int backlog = 128) {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0) {
+        return kInvalidSocket;
+    }
+    
+    SocketHandle listener = kInvalidSocket;
+    for (addrinfo* candidate = found; candidate; candidate = candidate->ai_next) {
+        listener = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (listener == kInvalidSocket) {
+            continue;
+        }
+        
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+        if (bind(listener, candidate->ai_addr, static_cast<int>(candidate->ai_addrlen)) == 0 &&
+            listen(listener, backlog) == 0) {
+            break;
+        }
+        closeSocket(listener);
+        listener = kInvalidSocket;
+    }
+    freeaddrinfo(found);
+    return listener;
+}
+
+inline SocketHandle connectTo(const std::string& host, unsigned short port) {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    
+    addrinfo* found = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0) {
+        return kInvalidSocket;
+    }
+    
+    SocketHandle connection = kInvalidSocket;
+    for (addrinfo* candidate = found; candidate; candidate = candidate->ai_next) {
+        connection = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (connection == kInvalidSocket) {
+            continue;
+        }
+        if (connect(connection, candidate->ai_addr, static_cast<int>(candidate->ai_addrlen)) == 0) {
+            break;
+        }
+        closeSocket(connection);
+        connection = kInvalidSocket;
+    }
+    freeaddrinfo(found);
+    
+    if (connection != kInvalidSocket) {
+        setNoDelay(connection);
+    }
+    return connection;
+}
+
+// Connected loopback pair, used to wake a poller from other threads
+inline bool makeWakePair(SocketHandle& readEnd, SocketHandle& writeEnd) {
+    SocketHandle listener = listenOn(kLoopbackHost, 0, 1);
+    if (listener == kInvalidSocket) {
+        return false;
+    }
+    
+    sockaddr_in address;
+    socklen_t length = sizeof(address);
+    getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length);
+    writeEnd = connectTo(kLoopbackHost, ntohs(address.sin_port));
+    readEnd = writeEnd == kInvalidSocket ? kInvalidSocket : accept(listener, nullptr, nullptr);
+    closeSocket(listener);
+    
+    if (readEnd == kInvalidSocket) {
+        if (writeEnd != kInvalidSocket) {
+            closeSocket(writeEnd);
+        }
+        return false;
+    }
+    return setNonBlocking(readEnd) && setNonBlocking(writeEnd);
+}
+
+class SocketPoller {
+public:
+    struct Event {
+        SocketHandle socket;
+        bool readable;
+        bool writable;
+        bool failed;
+    };
+    
+private:
+#ifdef __linux__
+    int epollFd;
+    std::vector<epoll_event> ready;
+    
+    static std::uint32_t mask(bool read, bool write) {
+        return (read ? EPOLLIN : 0u) | (write ? EPOLLOUT : 0u) | EPOLLRDHUP;
+    }
+#else
+#ifdef _WIN32
+    using PollEntry = WSAPOLLFD;
+#else
+    using PollEntry = pollfd;
+#endif
+    std::vector<PollEntry> entries;
+    
+    static short mask(bool read, bool write) {
+        return static_cast<short>((read ? POLLIN : 0) | (write ? POLLOUT : 0));
+    }
+#endif
+    
+public:
+    SocketPoller() {
+#ifdef __linux__
+        epollFd = epoll_create1(0);
+        ready.resize(256);
+#endif
+    }
+    
+    ~SocketPoller() {
+#ifdef __linux__
+        if (epollFd >= 0) {
+            ::close(epollFd);
+        }
+#endif
+    }
+    
+    SocketPoller(const SocketPoller&) = delete;
+    SocketPoller& operator=(const SocketPoller&) = delete;
+    
+    bool add(SocketHandle socket, bool read, bool write) {
+#ifdef __linux__
+        epoll_event event = {};
+        event.events = mask(read, write);
+        event.data.fd = socket;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event) == 0;
+#else
+        PollEntry entry = {};
+        entry.fd = socket;
+        entry.events = mask(read, write);
+        entries.push_back(entry);
+        return true;
+#endif
+    }
+    
+    bool update(SocketHandle socket, bool read, bool write) {
+#ifdef __linux__
+        epoll_event event = {};
+        event.events = mask(read, write);
+        event.data.fd = socket;
+        return epoll_ctl(epollFd, EPOLL_CTL_MOD, socket, &event) == 0;
+#else
+        for (auto& entry : entries) {
+            if (entry.fd == socket) {
+                entry.events = mask(read, write);
+                return true;
+            }
+        }
+        return false;
+#endif
+    }
+    
+    void remove(SocketHandle socket) {
+#ifdef __linux__
+        epoll_event event = {};
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, &event);
+#else
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].fd == socket) {
+                entries[i] = entries.back();
+                entries.pop_back();
+                break;
+            }
+        }
+#endif
+    }
+    
+    // Fills events with ready sockets; returns false on a poller error
+    bool wait(int timeoutMs, std::vector<Event>& events) {
+        events.clear();
+#ifdef __linux__
+        int count = epoll_wait(epollFd, ready.data(), static_cast<int>(ready.size()), timeoutMs);
+        if (count < 0) {
+            return errno == EINTR;
+        }
+        for (int i = 0; i < count; ++i) {
+            std::uint32_t flags = ready[i].events;
+            events.push_back({ ready[i].data.fd, (flags & (EPOLLIN | EPOLLRDHUP)) != 0, (flags & EPOLLOUT) != 0,
+                               (flags & (EPOLLERR | EPOLLHUP)) != 0 });
+        }
+#else
+        if (entries.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+            return true;
+        }
+#ifdef _WIN32
+        int count = WSAPoll(entries.data(), static_cast<ULONG>(entries.size()), timeoutMs);
+#else
+        int count = ::poll(entries.data(), static_cast<nfds_t>(entries.size()), timeoutMs);
+#endif
+        if (count < 0) {
+            return socketWouldBlock() || errno == EINTR;
+        }
+        for (const auto& entry : entries) {
+            if (entry.revents != 0) {
+                events.push_back({ entry.fd, (entry.revents & (POLLIN | POLLHUP)) != 0,
+                                   (entry.revents & POLLOUT) != 0, (entry.revents & (POLLERR | POLLNVAL)) != 0 });
+            }
+        }
+#endif
+        return true;
+    }
+};
+
+// Binary protocol shared by BinaryProtocolServer and LoadGenerator.
+// A frame is [u32 length][u32 request id][u8 code][body], little-endian, where
+// length counts everything after itself. Requests carry a WireOp, responses a
+// WireStatus and echo the request id. Integers are fixed width, money is i64
+// cents, rates are f64 and strings are u16 length + bytes.
+enum class WireOp : std::uint8_t {
+    Ping = 1,
+    AddCustomer = 10,       // name, address, phone, email
+    GetCustomer = 11,       // i32 id -> i32 id, name, address, phone, email
+    SearchCustomers = 12,   // query, u16 limit -> u16 count, (i32 id, name, phone)*
+    OpenAccount = 20,       // i32 customer, u8 kind (1 savings, 2 checking), i64 cents, f64 rate/limit -> i32 id, number
+    CloseAccount = 21,      // i32 account
+    Deposit = 22,           // i32 account, i64 cents, idempotency key
+    Withdraw = 23,          // i32 account, i64 cents, idempotency key
+    Transfer = 24,          // i32 from, i32 to, i64 cents, idempotency key
+    GetBalance = 25,        // i32 account -> i64 cents
+    GetAccount = 26,        // i32 account -> i32 id, i32 customer, number, type, i64 cents, date opened
+    GetTransactions = 30,   // i32 account, u16 limit -> u16 count, (i32 id, type, i64 cents, date/time, description)*
+    GetTransaction = 31     // i32 id -> i32 id, i32 account, type, i64 cents, date/time, description
+};
+
+enum class WireStatus : std::uint8_t {
+    Ok = 0,
+    Failed = 1,
+    NotFound = 2,
+    BadRequest = 3
+};
+
+class WireWriter {
+private:
+    std::string& out;
+    size_t start;
+    
+    void putRaw(std::uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i) {
+            out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+        }
+    }
+    
+public:
+    // Appends a frame header to out; finish() fills in its length
+    WireWriter(std::string& out, std::uint32_t requestId, std::uint8_t code) : out(out), start(out.size()) {
+        putRaw(0, 4);
+        putRaw(requestId, 4);
+        out.push_back(static_cast<char>(code));
+    }
+    
+    WireWriter& u8(std::uint8_t value) { putRaw(value, 1); return *this; }
+    WireWriter& u16(std::uint16_t value) { putRaw(value, 2); return *this; }
+    WireWriter& i32(std::int32_t value) { putRaw(static_cast<std::uint32_t>(value), 4); return *this; }
+    WireWriter& i64(std::int64_t value) { putRaw(static_cast<std::uint64_t>(value), 8); return *this; }
+    
+    WireWriter& f64(double value) {
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        putRaw(bits, 8);
+        return *this;
+    }
+    
+    WireWriter& str(const std::string& value) {
+        size_t length = std::min<size_t>(value.size(), 0xFFFF);
+        putRaw(length, 2);
+        out.append(value, 0, length);
+        return *this;
+    }
+    
+    void finish() {
+        std::uint32_t length = static_cast<std::uint32_t>(out.size() - start - 4);
+        for (int i = 0; i < 4; ++i) {
+            out[start + i] = static_cast<char>((length >> (8 * i)) & 0xFF);
+        }
+    }
+};
+
+class WireReader {
+private:
+    const char* p;
+    const char* end;
+    bool ok;
+    
+    std::uint64_t getRaw(int bytes) {
+        if (end - p < bytes) {
+            ok = false;
+            return 0;
+        }
+        std::uint64_t value = 0;
+        for (int i = 0; i < bytes; ++i) {
+            value |= static_cast<std::uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+        }
+        p += bytes;
+        return value;
+    }
+    
+public:
+    WireReader(const char* data, size_t size) : p(data), end(data + size), ok(true) {}
+    
+    // Length of the complete frame at data, 0 while more bytes are needed
+    static size_t frameLength(const char* data, size_t available) {
+        if (available < 4) {
+            return 0;
+        }
+        WireReader reader(data, 4);
+        size_t length = 4 + static_cast<size_t>(reader.u32());
+        return available >= length ? length : 0;
+    }
+    
+    std::uint8_t u8() { return static_cast<std::uint8_t>(getRaw(1)); }
+    std::uint16_t u16() { return static_cast<std::uint16_t>(getRaw(2)); }
+    std::uint32_t u32() { return static_cast<std::uint32_t>(getRaw(4)); }
+    std::int32_t i32() { return static_cast<std::int32_t>(getRaw(4)); }
+    std::int64_t i64() { return static_cast<std::int64_t>(getRaw(8)); }
+    
+    double f64() {
+        std::uint64_t bits = getRaw(8);
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    
+    std::string str() {
+        size_t length = static_cast<size_t>(getRaw(2));
+        if (!ok || static_cast<size_t>(end - p) < length) {
+            ok = false;
+            return std::string();
+        }
+        std::string value(p, length);
+        p += length;
+        return value;
+    }
+    
+    bool good() const { return ok; }
+};
+
+// Recycled byte buffers; a buffer keeps its capacity between uses
+class BufferPool {
+private:
+    std::mutex mutex;
+    std::vector<std::string> buffers;
+    size_t maxPooled;
+    size_t maxCapacity;             // larger buffers are freed rather than kept
+    
+public:
+    explicit BufferPool(size_t maxPooled = 256, size_t maxCapacity = 256 * 1024)
+        : maxPooled(maxPooled), maxCapacity(maxCapacity) {}
+    
+    std::string acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (buffers.empty()) {
+            return std::string();
+        }
+        std::string buffer = std::move(buffers.back());
+        buffers.pop_back();
+        return buffer;
+    }
+    
+    void release(std::string&& buffer) {
+        if (buffer.capacity() == 0 || buffer.capacity() > maxCapacity) {
+            return;
+        }
+        buffer.clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (buffers.size() < maxPooled) {
+            buffers.push_back(std::move(buffer));
+        }
+    }
+};
+
+// TCP front end for request/response protocols. One thread owns every socket
+// through a SocketPoller; requests run on a fixed worker pool. Connections stay
+// open across requests and clients may pipeline: complete requests are handed
+// to a worker as one batch, handled strictly in order and answered in that
+// same order. Subclasses only frame and handle requests.
+class PipelinedSocketServer : public IUserInterface {
+private:
+    struct Connection {
+        SocketHandle socket;
+        std::string input;                  // bytes after the last complete request
+        std::string ready;                  // complete requests not yet handed to a worker
+        std::vector<size_t> readyLengths;
+        std::string output;
+        size_t outputSent = 0;
+        bool busy = false;                  // a worker is handling this connection's requests
+        bool peerClosed = false;
+        bool closing = false;               // close once the output is flushed
+        bool reading = true;
+        bool writing = false;
+    };
+    
+    struct Batch {
+        std::string data;
+        std::vector<size_t> lengths;
+    };
+    
+    struct Completion {
+        std::uint64_t connectionId;
+        std::string responses;
+        bool close;
+    };
+    
+    static const size_t kMaxQueued = 1024;      // stop reading a connection beyond this backlog
+    static const size_t kReadChunk = 64 * 1024;
+    
+    std::shared_ptr<WorkerPool> workers;
+    unsigned short port;
+    std::string host;
+    
+    std::atomic<bool> stopping;
+    std::atomic<std::uint64_t> requestsServed;
+    SocketPoller poller;
+    SocketHandle listener;
+    SocketHandle wakeRead;
+    SocketHandle wakeWrite;
+    std::unordered_map<std::uint64_t, Connection> connections;
+    std::unordered_map<SocketHandle, std::uint64_t> connectionBySocket;
+    std::uint64_t nextConnectionId;
+    
+    std::mutex completionMutex;
+    std::vector<Completion> completions;
+    
+    static std::atomic<bool>& stopSignal() {
+        static std::atomic<bool> signalled(false);
+        return signalled;
+    }
+    
+    void wake() {
+        char signal = 1;
+        sendSome(wakeWrite, &signal, 1);
+    }
+    
+    void dispatch(std::uint64_t id, Connection& connection) {
+        if (connection.busy || connection.closing || connection.readyLengths.empty()) {
+            return;
+        }
+        
+        auto batch = std::make_shared<Batch>();
+        batch->data.swap(connection.ready);
+        batch->lengths.swap(connection.readyLengths);
+        connection.busy = true;
+        
+        workers->submit([this, id, batch] {
+            std::string responses = buffers.acquire();
+            bool keepOpen = true;
+            size_t offset = 0;
+            size_t handled = 0;
+            for (size_t length : batch->lengths) {
+                handled++;
+                if (!handle(batch->data.data() + offset, length, responses)) {
+                    keepOpen = false;
+                    break;
+                }
+                offset += length;
+            }
+            buffers.release(std::move(batch->data));
+            requestsServed.fetch_add(handled, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock(completionMutex);
+                completions.push_back({ id, std::move(responses), !keepOpen });
+            }
+            wake();
+        });
+    }
+    
+    void closeConnection(std::uint64_t id) {
+        auto it = connections.find(id);
+        if (it == connections.end()) {
+            return;
+        }
+        poller.remove(it->second.socket);
+        closeSocket(it->second.socket);
+        connectionBySocket.erase(it->second.socket);
+        connections.erase(it);
+    }
+    
+    // Sends what it can, adjusts poller interest and closes finished connections
+    void settle(std::uint64_t id, Connection& connection) {
+        while (connection.outputSent < connection.output.size()) {
+            long sent = sendSome(connection.socket, connection.output.data() + connection.outputSent,
+                                 connection.output.size() - connection.outputSent);
+            if (sent > 0) {
+                connection.outputSent += static_cast<size_t>(sent);
+            } else if (sent < 0 && socketWouldBlock()) {
+                break;
+            } else {
+                closeConnection(id);
+                return;
+            }
+        }
+        if (!connection.output.empty() && connection.outputSent == connection.output.size()) {
+            buffers.release(std::move(connection.output));
+            connection.output.clear();
+            connection.outputSent = 0;
+        }
+        
+        bool drained = !connection.busy && connection.output.empty();
+        if (drained && (connection.closing || (connection.peerClosed && connection.readyLengths.empty()))) {
+            closeConnection(id);
+            return;
+        }
+        
+        bool reading = !connection.peerClosed && !connection.closing && connection.readyLengths.size() < kMaxQueued;
+        bool writing = !connection.output.empty();
+        if (reading != connection.reading || writing != connection.writing) {
+            connection.reading = reading;
+            connection.writing = writing;
+            poller.update(connection.socket, reading, writing);
+        }
+    }
+    
+    void acceptConnections() {
+        while (true) {
+            SocketHandle socket = accept(listener, nullptr, nullptr);
+            if (socket == kInvalidSocket) {
+                return;
+            }
+            if (!setNonBlocking(socket) || !poller.add(socket, true, false)) {
+                closeSocket(socket);
+                continue;
+            }
+            setNoDelay(socket);
+            
+            std::uint64_t id = nextConnectionId++;
+            connections[id].socket = socket;
+            connectionBySocket[socket] = id;
+        }
+    }
+    
+    void readFrom(std::uint64_t id, Connection& connection) {
+        char buffer[kReadChunk];
+        while (connection.readyLengths.size() < kMaxQueued) {
+            long received = receiveSome(connection.socket, buffer, sizeof(buffer));
+            if (received > 0) {
+                connection.input.append(buffer, static_cast<size_t>(received));
+            } else if (received < 0 && socketWouldBlock()) {
+                break;
+            } else {
+                connection.peerClosed = true;
+                break;
+            }
+            
+            size_t consumed = 0;
+            size_t length;
+            bool malformed = false;
+            while ((length = frameLength(connection.input.data() + consumed,
+                                         connection.input.size() - consumed, malformed)) > 0) {
+                connection.readyLengths.push_back(length);
+                consumed += length;
+            }
+            if (malformed) {
+                closeConnection(id);
+                return;
+            }
+            if (consumed == 0) {
+                continue;
+            }
+            
+            // Complete requests move to the ready buffer; usually by swapping
+            // buffers, so only a trailing partial request is copied
+            if (connection.ready.empty()) {
+                connection.ready.swap(connection.input);
+                connection.input.assign(connection.ready, consumed, std::string::npos);
+                connection.ready.resize(consumed);
+            } else {
+                connection.ready.append(connection.input, 0, consumed);
+                connection.input.erase(0, consumed);
+            }
+        }
+        
+        dispatch(id, connection);
+        settle(id, connection);
+    }
+    
+    void deliverCompletions() {
+        char drain[256];
+        while (receiveSome(wakeRead, drain, sizeof(drain)) > 0) {
+        }
+        
+        std::vector<Completion> finished;
+        {
+            std::lock_guard<std::mutex> lock(completionMutex);
+            finished.swap(completions);
+        }
+        
+        for (auto& completion : finished) {
+            auto it = connections.find(completion.connectionId);
+            if (it == connections.end()) {
+                buffers.release(std::move(completion.responses));
+                continue;
+            }
+            Connection& connection = it->second;
+            if (connection.output.empty()) {
+                connection.output.swap(completion.responses);
+            } else {
+                connection.output += completion.responses;
+            }
+            buffers.release(std::move(completion.responses));
+            
+            connection.busy = false;
+            if (completion.close) {
+                connection.closing = true;
+            }
+            dispatch(completion.connectionId, connection);
+            settle(completion.connectionId, connection);
+        }
+    }
+    
+    bool anyBusy() const {
+        for (const auto& entry : connections) {
+            if (entry.second.busy) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+protected:
+    BufferPool buffers;
+    
+    // Length of the complete request at data, 0 while more bytes are needed;
+    // sets malformed when the stream cannot be a valid request
+    virtual size_t frameLength(const char* data, size_t size, bool& malformed) const = 0;
+    
+    // Appends the response to one request; false closes the connection after it
+    virtual bool handle(const char* request, size_t size, std::string& responses) = 0;
+    
+    virtual const char* serverName() const = 0;
+    
+    // False for listeners that run beside the console and are stopped with stop()
+    virtual bool stopsOnCtrlC() const {
+        return true;
+    }
+    
+public:
+    // Listens on loopback only unless host names a wider address
+    PipelinedSocketServer(unsigned short port, std::shared_ptr<WorkerPool> workers,
+                          const std::string& host = kLoopbackHost)
+        : workers(workers), port(port), host(host), stopping(false), requestsServed(0), listener(kInvalidSocket),
+          wakeRead(kInvalidSocket), wakeWrite(kInvalidSocket), nextConnectionId(1) {}
+    
+    // Safe to call from a signal handler
+    static void signalStop() {
+        stopSignal() = true;
+    }
+    
+    void stop() {
+        stopping = true;
+    }
+    
+    std::uint64_t getRequestsServed() const {
+        return requestsServed.load(std::memory_order_relaxed);
+    }
+    
+    void start() override {
+        if (!initSockets()) {
+            std::cerr << "Socket initialization failed" << std::endl;
+            return;
+        }
+        
+        listener = listenOn(host, port);
+        if (listener == kInvalidSocket || !setNonBlocking(listener) || !makeWakePair(wakeRead, wakeWrite) ||
+            !poller.add(listener, true, false) || !poller.add(wakeRead, true, false)) {
+            std::cerr << "Cannot listen on " << host << ":" << port << std::endl;
+            return;
+        }
+        std::cout << serverName() << " listening on " << host << ":" << port << (stopsOnCtrlC() ? " (Ctrl+C to stop)" : "") << "\n";
+        
+        std::vector<SocketPoller::Event> events;
+        while (!stopping && !stopSignal()) {
+            if (!poller.wait(200, events)) {
+                std::cerr << "Socket poller failed" << std::endl;
+                break;
+            }
+            
+            for (const auto& event : events) {
+                if (event.socket == listener) {
+                    acceptConnections();
+                    continue;
+                }
+                if (event.socket == wakeRead) {
+                    deliverCompletions();
+                    continue;
+                }
+                
+                auto found = connectionBySocket.find(event.socket);
+                if (found == connectionBySocket.end()) {
+                    continue;
+                }
+                std::uint64_t id = found->second;
+                Connection& connection = connections[id];
+                
+                if (event.failed) {
+                    closeConnection(id);
+                } else if (event.readable) {
+                    readFrom(id, connection);
+                } else if (event.writable) {
+                    settle(id, connection);
+                }
+            }
+        }
+        
+        // Let in-flight requests finish before the sockets go away
+        while (anyBusy()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            deliverCompletions();
+        }
+        
+        std::vector<std::uint64_t> open;
+        for (const auto& entry : connections) {
+            open.push_back(entry.first);
+        }
+        for (std::uint64_t id : open) {
+            closeConnection(id);
+        }
+        closeSocket(listener);
+        closeSocket(wakeRead);
+        closeSocket(wakeWrite);
+        
+        std::cout << serverName() << " stopped after " << getRequestsServed() << " requests\n";
+    }
+};
+
+// Serves the binary wire protocol (see WireOp) to other programs
+class BinaryProtocolServer : public PipelinedSocketServer {
+private:
+    static const size_t kMaxFrame = 1 << 20;
+    
+    std::shared_ptr<ICustomerService> customerService;
+    std::shared_ptr<IAccountService> accountService;
+    std::shared_ptr<ITransactionService> transactionService;
+    
+    static std::int64_t toCents(double amount) {
+        return static_cast<std::int64_t>(std::llround(amount * 100));
+    }
+    
+    WireStatus execute(WireOp op, WireReader& in, WireWriter& out) {
+        switch (op) {
+            case WireOp::Ping:
+                return WireStatus::Ok;
+            
+            case WireOp::AddCustomer: {
+                std::string name = in.str(), address = in.str(), phone = in.str(), email = in.str();
+                if (!in.good()) return WireStatus::BadRequest;
+                return customerService->addCustomer(Customer(0, name, address, phone, email))
+                    ? WireStatus::Ok : WireStatus::Failed;
+            }
+            
+            case WireOp::GetCustomer: {
+                int id = in.i32();
+                if (!in.good()) return WireStatus::BadRequest;
+                auto customer = customerService->getCustomer(id);
+                if (!customer) return WireStatus::NotFound;
+                out.i32(customer->getId()).str(customer->getName()).str(customer->getAddress())
+                   .str(customer->getPhone()).str(customer->getEmail());
+                return WireStatus::Ok;
+            }
+            
+            case WireOp::SearchCustomers: {
+                std::string query = in.str();
+                size_t limit = in.u16();
+                if (!in.good()) return WireStatus::BadRequest;
+                auto found = customerService->searchCustomers(query, limit);
+                out.u16(static_cast<std::uint16_t>(found.size()));
+                for (const auto& customer : found) {
+                    out.i32(customer->getId()).str(customer->getName()).str(customer->getPhone());
+                }
+                return WireStatus::Ok;
+            }
+            
+            case WireOp::OpenAccount: {
+                int customerId = in.i32();
+                std::uint8_t kind = in.u8();
+                double opening = in.i64() / 100.0;
+                double rateOrLimit = in.f64();
+                if (!in.good() || (kind != 1 && kind != 2) || opening < 0) return WireStatus::BadRequest;
+                
+                std::unique_ptr<Account> account;
+                if (kind == 1) {
+                    account.reset(new SavingsAccount(0, customerId, opening, "", "", rateOrLimit));
+                } else {
+                    account.reset(new CheckingAccount(0, customerId, opening, "", "", rateOrLimit));
+                }
+                if (!accountService->openAccount(*account)) return WireStatus::Failed;
+                out.i32(account->getId()).str(account->getAccountNumber());
+                return WireStatus::Ok;
+            }
+            
+            case WireOp::CloseAccount: {
+                int id = in.i32();
+                if (!in.good()) return WireStatus::BadRequest;
+                return accountService->closeAccount(id) ? WireStatus::Ok : WireStatus::Failed;
+            }
+            
+            case WireOp::Deposit:
+            case WireOp::Withdraw: {
+                int id = in.i32();
+                double amount = in.i64() / 100.0;
+                std::string key = in.str();
+                if (!in.good()) return WireStatus::BadRequest;
+                bool ok = op == WireOp::Deposit ? accountService->deposit(id, amount, key)
+                                                : accountService->withdraw(id, amount, key);
+                return ok ? WireStatus::Ok : WireStatus::Failed;
+            }
+            
+            case WireOp::Transfer: {
+                int from = in.i32();
+                int to = in.i32();
+                double amount = in.i64() / 100.0;
+                std::string key = in.str();
+                if (!in.good()) return WireStatus::BadRequest;
+                return accountService->transfer(from, to, amount, key) ? WireStatus::Ok : WireStatus::Failed;
+            }
+            
+            case WireOp::GetBalance: {
+                int id = in.i32();
+                if (!in.good()) return WireStatus::BadRequest;
+                double balance = accountService->getBalance(id);
+                if (balance == -1) return WireStatus::NotFound;
+                out.i64(toCents(balance));
+                return WireStatus::Ok;
+            }
+            
+            case WireOp::GetAccount: {
+                int id = in.i32();
+                if (!in.good()) return WireStatus::BadRequest;
+                auto account = accountService->getAccount(id);
+                if (!account) return WireStatus::NotFound;
+                out.i32(account->getId()).i32(account->getCustomerId()).str(account->getAccountNumber())
+                   .str(account->getAccountType()).i64(toCents(account->getBalance())).str(account->getDateOpened());
+                return WireStatus::Ok;
+            }
+            
+            case WireOp::GetTransactions: {
+                int accountId = in.i32();
+                size_t limit = in.u16();
+                if (!in.good()) return WireStatus::BadRequest;
+                
+                std::vector<Transaction> rows;
+                bool ok = transactionService->forEachAccountTransaction(accountId, [&](const Transaction& transaction) {
+                    if (rows.size() == limit) {
+                        return false;
+                    }
+                    rows.push_back(transaction);
+                    return true;
+                });
+                if (!ok) return WireStatus::Failed;
+                
+                out.u16(static_cast<std::uint16_t>(rows.size()));
+                for (const auto& transaction : rows) {
+                    out.i32(transaction.getId()).str(transaction.getType()).i64(toCents(transaction.getAmount()))
+                       .str(transaction.getDateTime()).str(transaction.getDescription());
+                }
+                return WireStatus::Ok;
+            }
+            
+            case WireOp::GetTransaction: {
+                int id = in.i32();
+                if (!in.good()) return WireStatus::BadRequest;
+                auto transaction = transactionService->getTransaction(id);
+                if (!transaction) return WireStatus::NotFound;
+                out.i32(transaction->getId()).i32(transaction->getAccountId()).str(transaction->getType())
+                   .i64(toCents(transaction->getAmount())).str(transaction->getDateTime())
+                   .str(transaction->getDescription());
+                return WireStatus::Ok;
+            }
+        }
+        
+        return WireStatus::BadRequest;
+    }
+    
+protected:
+    size_t frameLength(const char* data, size_t size, bool& malformed) const override {
+        if (size >= 4) {
+            WireReader header(data, 4);
+            size_t length = 4 + static_cast<size_t>(header.u32());
+            if (length < 9 || length > kMaxFrame) {
+                malformed = true;
+                return 0;
+            }
+        }
+        return WireReader::frameLength(data, size);
+    }
+    
+    bool handle(const char* frame, size_t size, std::string& responses) override {
+        WireReader in(frame + 4, size - 4);
+        std::uint32_t requestId = in.u32();
+        WireOp op = static_cast<WireOp>(in.u8());
+        
+        size_t start = responses.size();
+        WireWriter out(responses, requestId, static_cast<std::uint8_t>(WireStatus::Ok));
+        WireStatus status = execute(op, in, out);
+        
+        if (status != WireStatus::Ok) {
+            // Failures carry no body
+            responses.resize(start);
+            WireWriter(responses, requestId, static_cast<std::uint8_t>(status)).finish();
+            return true;
+        }
+        out.finish();
+        return true;
+    }
+    
+    const char* serverName() const override {
+        return "Binary protocol server";
     }
+    
+public:
+    BinaryProtocolServer(std::shared_ptr<ICustomerService> customerSvc,
+                         std::shared_ptr<IAccountService> accountSvc,
+                         std::shared_ptr<ITransactionService> transactionSvc,
+                         unsigned short port, std::shared_ptr<WorkerPool> workers,
+                         const std::string& host = kLoopbackHost)
+        : PipelinedSocketServer(port, workers, host), customerService(customerSvc), accountService(accountSvc),
+          transactionService(transactionSvc) {}
 };
 
-// Console UI implementation - follows Single Responsibility Principle
-class ConsoleUI : public IUserInterface {
+// Streams JSON text straight into a caller's buffer
+class JsonWriter {
 private:
-    std::shared_ptr<ICustomerService> customerService;
-    std::shared_ptr<IAccountService> accountService;
-    std::shared_ptr<ITransactionService> transactionService;
-    std::shared_ptr<User> currentUser;
+    std::string& out;
+    bool needComma;
     
-    void displayMainMenu() {
-        std::cout << "\n========= BANK MANAGEMENT SYSTEM =========\n";
-        std::cout << "1. Customer Management\n";
-        std::cout << "2. Account Management\n";
-        std::cout << "3. Transaction Management\n";
-        std::cout << "0. Exit\n";
-        std::cout << "Enter your choice: ";
+    void separate() {
+        if (needComma) {
+            out += ',';
+        }
+        needComma = false;
     }
     
-    void displayCustomerMenu() {
-        std::cout << "\n========= CUSTOMER MANAGEMENT =========\n";
-        std::cout << "1. Add New Customer\n";
-        std::cout << "2. Update Customer Information\n";
-        std::cout << "3. Remove Customer\n";
-        std::cout << "4. View Customer Details\n";
-        std::cout << "5. List All Customers\n";
-        std::cout << "0. Back to Main Menu\n";
-        std::cout << "Enter your choice: ";
+public:
+    explicit JsonWriter(std::string& out) : out(out), needComma(false) {}
+    
+    JsonWriter& beginObject() { separate(); out += '{'; return *this; }
+    JsonWriter& endObject() { out += '}'; needComma = true; return *this; }
+    JsonWriter& beginArray() { separate(); out += '['; return *this; }
+    JsonWriter& endArray() { out += ']'; needComma = true; return *this; }
+    
+    JsonWriter& key(const char* name) {
+        separate();
+        out += '"';
+        out += name;
+        out += "\":";
+        return *this;
     }
     
-    void displayAccountMenu() {
-        std::cout << "\n========= ACCOUNT MANAGEMENT =========\n";
-        std::cout << "1. Open New Account\n";
-        std::cout << "2. Close Account\n";
-        std::cout << "3. Deposit\n";
-        std::cout << "4. Withdraw\n";
-        std::cout << "5. Transfer\n";
-        std::cout << "6. View Account Details\n";
-        std::cout << "7. List Customer Accounts\n";
-        std::cout << "0. Back to Main Menu\n";
-        std::cout << "Enter your choice: ";
+    JsonWriter& string(const std::string& value) {
+        separate();
+        out += '"';
+        appendJsonEscaped(out, value.data(), value.size());
+        out += '"';
+        needComma = true;
+        return *this;
     }
     
-    void displayTransactionMenu() {
-        std::cout << "\n========= TRANSACTION MANAGEMENT =========\n";
-        std::cout << "1. View Transaction Details\n";
-        std::cout << "2. View Account Transactions\n";
-        std::cout << "0. Back to Main Menu\n";
-        std::cout << "Enter your choice: ";
+    JsonWriter& integer(long long value) {
+        separate();
+        appendInteger(out, value);
+        needComma = true;
+        return *this;
     }
     
-    void handleCustomerManagement() {
-        int choice = -1;
-        
-        while (choice != 0) {
-            displayCustomerMenu();
-            std::cin >> choice;
-            
-            switch (choice) {
-                case 1:
-                    addCustomer();
-                    break;
-                case 2:
-                    updateCustomer();
-                    break;
-                case 3:
-                    removeCustomer();
-                    break;
-                case 4:
-                    viewCustomerDetails();
-                    break;
-                case 5:
-                    listAllCustomers();
-                    break;
-                case 0:
-                    std::cout << "Returning to main menu...\n";
-                    break;
-                default:
-                    std::cout << "Invalid choice. Please try again.\n";
-            }
+    JsonWriter& money(double value) {
+        separate();
+        appendMoney(out, value);
+        needComma = true;
+        return *this;
+    }
+    
+    JsonWriter& boolean(bool value) {
+        separate();
+        out += value ? "true" : "false";
+        needComma = true;
+        return *this;
+    }
+    
+    JsonWriter& null() {
+        separate();
+        out += "null";
+        needComma = true;
+        return *this;
+    }
+};
+
+inline bool headerNameIs(std::string_view line, std::string_view name) {
+    if (line.size() <= name.size() || line[name.size()] != ':') {
+        return false;
+    }
+    for (size_t i = 0; i < name.size(); i++) {
+        if (std::tolower(static_cast<unsigned char>(line[i])) != std::tolower(static_cast<unsigned char>(name[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline std::string_view headerValue(std::string_view line) {
+    size_t start = line.find(':') + 1;
+    while (start < line.size() && (line[start] == ' ' || line[start] == '\t')) {
+        start++;
+    }
+    size_t end = line.size();
+    while (end > start && (line[end - 1] == ' ' || line[end - 1] == '\t')) {
+        end--;
+    }
+    return line.substr(start, end - start);
+}
+
+inline bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))) {
+            return false;
         }
     }
+    return true;
+}
+
+// Length of the complete HTTP/1.1 message (request or response) at data, 0
+// while more bytes are needed. Bodies must be sized by Content-Length; chunked
+// bodies and oversized headers are reported as malformed.
+inline size_t httpMessageLength(const char* data, size_t size, bool& malformed) {
+    static const size_t kMaxHeader = 16 * 1024;
+    static const size_t kMaxBody = 1 << 20;
     
-    void handleAccountManagement() {
-        int choice = -1;
-        
-        while (choice != 0) {
-            displayAccountMenu();
-            std::cin >> choice;
-            
-            switch (choice) {
-                case 1:
-                    openAccount();
-                    break;
-                case 2:
-                    closeAccount();
-                    break;
-                case 3:
-                    deposit();
-                    break;
-                case 4:
-                    withdraw();
-                    break;
-                case 5:
-                    transfer();
-                    break;
-                case 6:
-                    viewAccountDetails();
-                    break;
-                case 7:
-                    listCustomerAccounts();
-                    break;
-                case 0:
-                    std::cout << "Returning to main menu...\n";
-                    break;
-                default:
-                    std::cout << "Invalid choice. Please try again.\n";
+    std::string_view text(data, std::min(size, kMaxHeader));
+    size_t headerEnd = text.find("\r\n\r\n");
+    if (headerEnd == std::string_view::npos) {
+        malformed = size > kMaxHeader;
+        return 0;
+    }
+    headerEnd += 4;
+    
+    size_t bodyLength = 0;
+    size_t lineStart = text.find("\r\n") + 2;
+    while (lineStart < headerEnd - 2) {
+        size_t lineEnd = text.find("\r\n", lineStart);
+        std::string_view line = text.substr(lineStart, lineEnd - lineStart);
+        if (headerNameIs(line, "Content-Length")) {
+            std::string_view value = headerValue(line);
+            auto parsed = std::from_chars(value.data(), value.data() + value.size(), bodyLength);
+            if (parsed.ec != std::errc() || parsed.ptr != value.data() + value.size() || bodyLength > kMaxBody) {
+                malformed = true;
+                return 0;
             }
+        } else if (headerNameIs(line, "Transfer-Encoding")) {
+            malformed = true;
+            return 0;
         }
+        lineStart = lineEnd + 2;
     }
     
-    void handleTransactionManagement() {
-        int choice = -1;
-        
-        while (choice != 0) {
-            displayTransactionMenu();
-            std::cin >> choice;
-            
-            switch (choice) {
-                case 1:
-                    viewTransactionDetails();
-                    break;
-                case 2:
-                    viewAccountTransactions();
-                    break;
-                case 0:
-                    std::cout << "Returning to main menu...\n";
-                    break;
-                default:
-                    std::cout << "Invalid choice. Please try again.\n";
+    size_t length = headerEnd + bodyLength;
+    return size >= length ? length : 0;
+}
+
+// A request parsed in place: every field points into the received bytes
+struct HttpRequest {
+    std::string_view method;
+    std::string_view path;
+    std::string_view query;
+    std::string_view body;
+    std::string_view idempotencyKey;
+    bool keepAlive = true;
+};
+
+inline bool parseHttpRequest(const char* data, size_t size, HttpRequest& request) {
+    std::string_view text(data, size);
+    size_t headerEnd = text.find("\r\n\r\n");
+    size_t lineEnd = text.find("\r\n");
+    
+    std::string_view requestLine = text.substr(0, lineEnd);
+    size_t methodEnd = requestLine.find(' ');
+    size_t targetEnd = requestLine.rfind(' ');
+    if (methodEnd == std::string_view::npos || targetEnd <= methodEnd) {
+        return false;
+    }
+    request.method = requestLine.substr(0, methodEnd);
+    std::string_view target = requestLine.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+    std::string_view version = requestLine.substr(targetEnd + 1);
+    if (target.empty() || target[0] != '/' || version.substr(0, 5) != "HTTP/") {
+        return false;
+    }
+    
+    size_t question = target.find('?');
+    request.path = target.substr(0, question);
+    request.query = question == std::string_view::npos ? std::string_view() : target.substr(question + 1);
+    request.keepAlive = version != "HTTP/1.0";
+    
+    size_t lineStart = lineEnd + 2;
+    while (lineStart < headerEnd) {
+        lineEnd = text.find("\r\n", lineStart);
+        std::string_view line = text.substr(lineStart, lineEnd - lineStart);
+        if (headerNameIs(line, "Connection")) {
+            std::string_view value = headerValue(line);
+            if (equalsIgnoreCase(value, "close")) {
+                request.keepAlive = false;
+            } else if (equalsIgnoreCase(value, "keep-alive")) {
+                request.keepAlive = true;
             }
+        } else if (headerNameIs(line, "Idempotency-Key")) {
+            request.idempotencyKey = headerValue(line);
         }
+        lineStart = lineEnd + 2;
     }
     
-    // Customer management functions
-    void addCustomer() {
-        std::string name, address, phone, email;
-        
-        std::cin.ignore();
-        std::cout << "Enter customer name: ";
-        std::getline(std::cin, name);
-        
-        std::cout << "Enter address: ";
-        std::getline(std::cin, address);
-        
-        std::cout << "Enter phone number: ";
-        std::getline(std::cin, phone);
-        
-        std::cout << "Enter email: ";
-        std::getline(std::cin, email);
-        
-        Customer customer(0, name, address, phone, email);
-        
-        if (customerService->addCustomer(customer)) {
-            std::cout << "Customer added successfully.\n";
-        } else {
-            std::cout << "Failed to add customer.\n";
+    request.body = text.substr(headerEnd + 4);
+    return true;
+}
+
+// Looks up one field of an application/x-www-form-urlencoded string
+inline bool formValue(std::string_view form, std::string_view name, std::string& value) {
+    while (!form.empty()) {
+        size_t end = form.find('&');
+        std::string_view pair = form.substr(0, end);
+        form = end == std::string_view::npos ? std::string_view() : form.substr(end + 1);
+        
+        size_t equals = pair.find('=');
+        if (pair.substr(0, equals) != name) {
+            continue;
+        }
+        std::string_view encoded = equals == std::string_view::npos ? std::string_view() : pair.substr(equals + 1);
+        
+        value.clear();
+        for (size_t i = 0; i < encoded.size(); i++) {
+            char c = encoded[i];
+            if (c == '+') {
+                value += ' ';
+            } else if (c == '%' && i + 2 < encoded.size() &&
+                       std::isxdigit(static_cast<unsigned char>(encoded[i + 1])) &&
+                       std::isxdigit(static_cast<unsigned char>(encoded[i + 2]))) {
+                char hex[3] = { encoded[i + 1], encoded[i + 2], 0 };
+                value += static_cast<char>(std::strtol(hex, nullptr, 16));
+                i += 2;
+            } else {
+                value += c;
+            }
         }
+        return true;
+    }
+    return false;
+}
+
+inline const char* httpReason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 422: return "Unprocessable Entity";
+        default:  return "Internal Server Error";
     }
+}
+
+// Writes one response into the connection's output buffer. Headers go out
+// first with a blank Content-Length that finish() fills in once the body has
+// been serialized behind them, so the body is never copied.
+class HttpReply {
+private:
+    static const size_t kLengthWidth = 10;
     
-    void updateCustomer() {
-        int customerId;
-        std::cout << "Enter customer ID: ";
-        std::cin >> customerId;
-        
-        auto customer = customerService->getCustomer(customerId);
-        
-        if (!customer) {
-            std::cout << "Customer not found.\n";
-            return;
+    std::string& out;
+    bool keepAlive;
+    size_t lengthAt;
+    size_t bodyStart;
+    JsonWriter json;
+    bool started;
+    
+public:
+    HttpReply(std::string& out, bool keepAlive)
+        : out(out), keepAlive(keepAlive), lengthAt(0), bodyStart(0), json(out), started(false) {}
+    
+    bool isKeepAlive() const { return keepAlive; }
+    
+    JsonWriter& begin(int status) {
+        started = true;
+        out += "HTTP/1.1 ";
+        appendInteger(out, status);
+        out += ' ';
+        out += httpReason(status);
+        out += keepAlive ? "\r\nConnection: keep-alive" : "\r\nConnection: close";
+        out += "\r\nContent-Type: application/json\r\nContent-Length: ";
+        lengthAt = out.size();
+        out.append(kLengthWidth, ' ');
+        out += "\r\n\r\n";
+        bodyStart = out.size();
+        return json;
+    }
+    
+    void error(int status, const char* message) {
+        begin(status).beginObject().key("error").string(message).endObject();
+    }
+    
+    void finish() {
+        if (!started) {
+            error(500, "no response");
         }
-        
-        std::string name, address, phone, email;
-        
-        std::cin.ignore();
-        std::cout << "Enter new name (current: " << customer->getName() << "): ";
-        std::getline(std::cin, name);
-        if (!name.empty()) customer->setName(name);
-        
-        std::cout << "Enter new address (current: " << customer->getAddress() << "): ";
-        std::getline(std::cin, address);
-        if (!address.empty()) customer->setAddress(address);
-        
-        std::cout << "Enter new phone (current: " << customer->getPhone() << "): ";
-        std::getline(std::cin, phone);
-        if (!phone.empty()) customer->setPhone(phone);
-        
-        std::cout << "Enter new email (current: " << customer->getEmail() << "): ";
-        std::getline(std::cin, email);
-        if (!email.empty()) customer->setEmail(email);
-        
-        if (customerService->updateCustomer(*customer)) {
-            std::cout << "Customer updated successfully.\n";
-        } else {
-            std::cout << "Failed to update customer.\n";
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), out.size() - bodyStart);
+        size_t width = static_cast<size_t>(result.ptr - digits);
+        // Right-aligned; the padding reads as optional whitespace after the colon
+        std::memcpy(&out[lengthAt + kLengthWidth - width], digits, width);
+    }
+};
+
+// Embedded HTTP/1.1 API with JSON responses. Request fields come from the
+// query string or a form-encoded body; money moves honour an Idempotency-Key
+// header. Routes:
+//   GET    /health
+//   GET    /customers?q=&limit=              POST /customers (name, address, phone, email)
+//   GET    /customers/{id}                   GET  /customers/{id}/accounts
+//   GET    /customers/{id}/overview?recent=  (accounts with their latest transactions)
+//   POST   /accounts (customerId, type=savings|checking, balance, rate | overdraft)
+//   GET    /accounts/{id}                    DELETE /accounts/{id}
+//   GET    /accounts/{id}/balance
+//   POST   /accounts/{id}/deposit (amount)   POST /accounts/{id}/withdraw (amount)
+//   GET    /accounts/{id}/transactions?after={transaction id}&limit=
+//   POST   /transfers (from, to, amount)
+//   GET    /transactions/{id}
+class HttpApiServer : public PipelinedSocketServer {
+private:
+    static const size_t kMaxSegments = 3;
+    static const size_t kDefaultPage = 50;
+    static const size_t kMaxPage = 500;
+    static const size_t kDefaultRecent = 10;
+    static const size_t kMaxRecent = 100;
+    
+    std::shared_ptr<ICustomerService> customerService;
+    std::shared_ptr<IAccountService> accountService;
+    std::shared_ptr<ITransactionService> transactionService;
+    
+    static bool parseInt(std::string_view text, long long& value) {
+        auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == std::errc() && result.ptr == text.data() + text.size();
+    }
+    
+    static bool parseId(std::string_view text, int& id) {
+        long long value;
+        if (!parseInt(text, value) || value <= 0 || value > INT_MAX) {
+            return false;
         }
+        id = static_cast<int>(value);
+        return true;
     }
     
-    void removeCustomer() {
-        int customerId;
-        std::cout << "Enter customer ID: ";
-        std::cin >> customerId;
-        
-        if (customerService->removeCustomer(customerId)) {
-            std::cout << "Customer removed successfully.\n";
-        } else {
-            std::cout << "Failed to remove customer.\n";
+    static bool formInt(std::string_view form, const char* name, long long& value) {
+        std::string text;
+        return formValue(form, name, text) && parseInt(text, value);
+    }
+    
+    static bool formAmount(std::string_view form, const char* name, double& value) {
+        std::string text;
+        if (!formValue(form, name, text) || text.empty()) {
+            return false;
         }
+        char* end = nullptr;
+        value = std::strtod(text.c_str(), &end);
+        return end == text.c_str() + text.size() && std::isfinite(value);
     }
     
-    void viewCustomerDetails() {
-        int customerId;
-        std::cout << "Enter customer ID: ";
-        std::cin >> customerId;
-        
-        auto customer = customerService->getCustomer(customerId);
-        
-        if (customer) {
-            std::cout << "\n------------ Customer Details ------------\n";
-            customer->display();
+    static void writeCustomer(JsonWriter& json, const Customer& customer) {
+        json.beginObject()
+            .key("id").integer(customer.getId())
+            .key("name").string(customer.getName())
+            .key("address").string(customer.getAddress())
+            .key("phone").string(customer.getPhone())
+            .key("email").string(customer.getEmail())
+            .endObject();
+    }
+    
+    static void writeAccount(JsonWriter& json, const Account& account) {
+        json.beginObject()
+            .key("id").integer(account.getId())
+            .key("customerId").integer(account.getCustomerId())
+            .key("accountNumber").string(account.getAccountNumber())
+            .key("type").string(account.getAccountType())
+            .key("balance").money(account.getBalance())
+            .key("dateOpened").string(account.getDateOpened())
+            .endObject();
+    }
+    
+    static void writeTransaction(JsonWriter& json, const Transaction& transaction) {
+        json.beginObject()
+            .key("id").integer(transaction.getId())
+            .key("accountId").integer(transaction.getAccountId())
+            .key("type").string(transaction.getType())
+            .key("amount").money(transaction.getAmount())
+            .key("dateTime").string(transaction.getDateTime())
+            .key("description").string(transaction.getDescription())
+            .endObject();
+    }
+    
+    void customers(const HttpRequest& request, std::string_view form, HttpReply& reply) {
+        if (request.method == "GET") {
+            std::string query;
+            std::string text;
+            long long limit = 20;
+            formValue(form, "q", query);
+            if (formValue(form, "limit", text) && !formInt(form, "limit", limit)) {
+                reply.error(400, "limit must be a number");
+                return;
+            }
+            auto found = customerService->searchCustomers(query,
+                                                          static_cast<size_t>(std::max(1LL, std::min(limit, 100LL))));
             
-            // Display customer accounts
-            auto accounts = accountService->getCustomerAccounts(customerId);
+            JsonWriter& json = reply.begin(200).beginArray();
+            for (const auto& customer : found) {
+                writeCustomer(json, *customer);
+            }
+            json.endArray();
+        } else if (request.method == "POST") {
+            std::string name, address, phone, email;
+            if (!formValue(form, "name", name) || name.empty()) {
+                reply.error(400, "name is required");
+                return;
+            }
+            formValue(form, "address", address);
+            formValue(form, "phone", phone);
+            formValue(form, "email", email);
             
-            if (!accounts.empty()) {
-                std::cout << "\nCustomer Accounts:\n";
-                for (const auto& account : accounts) {
-                    std::cout << "Account Number: " << account->getAccountNumber()
-                              << ", Type: " << account->getAccountType()
-                              << ", Balance: $" << std::fixed << std::setprecision(2) 
-                              << account->getBalance() << std::endl;
-                }
-            } else {
-                std::cout << "No accounts found for this customer.\n";
+            if (!customerService->addCustomer(Customer(0, name, address, phone, email))) {
+                reply.error(422, "customer was not added");
+                return;
             }
+            reply.begin(201).beginObject().key("created").boolean(true).endObject();
         } else {
-            std::cout << "Customer not found.\n";
+            reply.error(405, "use GET or POST");
         }
     }
     
-    void listAllCustomers() {
-        auto customers = customerService->getAllCustomers();
+    void openAccount(std::string_view form, HttpReply& reply) {
+        long long customerId = 0;
+        std::string type;
+        double balance = 0.0;
+        double rateOrLimit = 0.0;
+        if (!formInt(form, "customerId", customerId) || !formValue(form, "type", type)) {
+            reply.error(400, "customerId and type are required");
+            return;
+        }
+        std::string text;
+        if (formValue(form, "balance", text) && !formAmount(form, "balance", balance)) {
+            reply.error(400, "balance must be an amount");
+            return;
+        }
         
-        if (customers.empty()) {
-            std::cout << "No customers found.\n";
+        std::unique_ptr<Account> account;
+        if (equalsIgnoreCase(type, "savings")) {
+            formAmount(form, "rate", rateOrLimit);
+            account.reset(new SavingsAccount(0, static_cast<int>(customerId), balance, "", "", rateOrLimit));
+        } else if (equalsIgnoreCase(type, "checking")) {
+            formAmount(form, "overdraft", rateOrLimit);
+            account.reset(new CheckingAccount(0, static_cast<int>(customerId), balance, "", "", rateOrLimit));
+        } else {
+            reply.error(400, "type must be savings or checking");
             return;
         }
         
-        std::cout << "\n------------ All Customers ------------\n";
-        for (const auto& customer : customers) {
-            std::cout << "ID: " << customer->getId()
-                      << ", Name: " << customer->getName()
-                      << ", Phone: " << customer->getPhone()
-                      << ", Email: " << customer->getEmail() << std::endl;
+        if (balance < 0 || !accountService->openAccount(*account)) {
+            reply.error(422, "account was not opened");
+            return;
         }
+        writeAccount(reply.begin(201), *account);
     }
     
-    // Account management functions
-    void openAccount() {
-        int customerId;
-        int accountType;
-        double initialDeposit;
-        
-        std::cout << "Enter customer ID: ";
-        std::cin >> customerId;
-        
-        auto customer = customerService->getCustomer(customerId);
-        
-        if (!customer) {
-            std::cout << "Customer not found.\n";
+    void moveMoney(const HttpRequest& request, std::string_view form, int accountId, std::string_view action,
+                   HttpReply& reply) {
+        double amount;
+        if (!formAmount(form, "amount", amount)) {
+            reply.error(400, "amount is required");
             return;
         }
+        std::string key(request.idempotencyKey);
         
-        std::cout << "Select account type:\n";
-        std::cout << "1. Savings Account\n";
-        std::cout << "2. Checking Account\n";
-        std::cout << "Enter choice: ";
-        std::cin >> accountType;
-        
-        std::cout << "Enter initial deposit amount: $";
-        std::cin >> initialDeposit;
-        
-        if (initialDeposit <= 0) {
-            std::cout << "Initial deposit must be greater than zero.\n";
-            return;
+        bool ok = false;
+        if (action == "deposit") {
+            ok = accountService->deposit(accountId, amount, key);
+        } else if (action == "withdraw") {
+            ok = accountService->withdraw(accountId, amount, key);
+        } else {
+            long long to = 0;
+            if (!formInt(form, "to", to) || to <= 0 || to > INT_MAX) {
+                reply.error(400, "to is required");
+                return;
+            }
+            ok = accountService->transfer(accountId, static_cast<int>(to), amount, key);
         }
         
-        // Generate account number (simple implementation for demonstration)
-        auto now = std::time(nullptr);
-        std::string accountNumber = std::to_string(customerId) + std::to_string(now);
-        
-        // Get current date
-        auto tm = *std::localtime(&now);
-        std::ostringstream oss;
-        oss << std::put_time(&tm, "%Y-%m-%d");
-        std::string dateOpened = oss.str();
-        
-        if (accountType == 1) {
-            // Savings account
-            double interestRate;
-            std::cout << "Enter interest rate (%): ";
-            std::cin >> interestRate;
-            
-            SavingsAccount account(0, customerId, initialDeposit, accountNumber, dateOpened, interestRate);
-            
-            if (accountService->openAccount(account)) {
-                std::cout << "Savings account opened successfully.\n";
-                std::cout << "Account Number: " << accountNumber << std::endl;
-            } else {
-                std::cout << "Failed to open savings account.\n";
-            }
-        } else if (accountType == 2) {
-            // Checking account
-            double overdraftLimit;
-            std::cout << "Enter overdraft limit: $";
-            std::cin >> overdraftLimit;
-            
-            CheckingAccount account(0, customerId, initialDeposit, accountNumber, dateOpened, overdraftLimit);
-            
-            if (accountService->openAccount(account)) {
-                std::cout << "Checking account opened successfully.\n";
-                std::cout << "Account Number: " << accountNumber << std::endl;
-            } else {
-                std::cout << "Failed to open checking account.\n";
-            }
-        } else {
-            std::cout << "Invalid account type.\n";
+        if (!ok) {
+            reply.error(422, "money movement was rejected");
+            return;
         }
+        reply.begin(200).beginObject().key("accountId").integer(accountId).key("ok").boolean(true).endObject();
     }
     
-    void closeAccount() {
-        int accountId;
-        std::cout << "Enter account ID: ";
-        std::cin >> accountId;
-        
-        auto account = accountService->getAccount(accountId);
-        
-        if (!account) {
-            std::cout << "Account not found.\n";
+    void customerOverview(int customerId, std::string_view form, HttpReply& reply) {
+        long long recent = static_cast<long long>(kDefaultRecent);
+        std::string text;
+        if (formValue(form, "recent", text) && !formInt(form, "recent", recent)) {
+            reply.error(400, "recent must be a number");
             return;
         }
+        recent = std::max(0LL, std::min(recent, static_cast<long long>(kMaxRecent)));
         
-        if (account->getBalance() > 0) {
-            std::cout << "Account has a balance of $" << std::fixed << std::setprecision(2) 
-                     << account->getBalance() << ". Withdraw before closing.\n";
+        CustomerOverview overview;
+        if (!customerService->getCustomerOverview(customerId, static_cast<size_t>(recent), overview)) {
+            reply.error(404, "customer not found");
             return;
         }
         
-        if (accountService->closeAccount(accountId)) {
-            std::cout << "Account closed successfully.\n";
-        } else {
-            std::cout << "Failed to close account.\n";
+        JsonWriter& json = reply.begin(200).beginObject().key("customer");
+        writeCustomer(json, overview.customer);
+        json.key("accounts").beginArray();
+        for (const auto& account : overview.accounts) {
+            json.beginObject()
+                .key("id").integer(account.account.id)
+                .key("accountNumber").string(account.account.accountNumber)
+                .key("type").string(accountTypeName(account.account))
+                .key("balance").money(account.account.balance)
+                .key("dateOpened").string(account.account.dateOpened)
+                .key("recentTransactions").beginArray();
+            for (const auto& transaction : account.recentTransactions) {
+                writeTransaction(json, transaction);
+            }
+            json.endArray().endObject();
         }
+        json.endArray().endObject();
     }
     
-    void deposit() {
-        int accountId;
-        double amount;
-        
-        std::cout << "Enter account ID: ";
-        std::cin >> accountId;
-        
-        auto account = accountService->getAccount(accountId);
-        
-        if (!account) {
-            std::cout << "Account not found.\n";
+    void transactionsPage(int accountId, std::string_view form, HttpReply& reply) {
+        long long after = 0;
+        long long limit = static_cast<long long>(kDefaultPage);
+        std::string text;
+        if ((formValue(form, "after", text) && !formInt(form, "after", after)) ||
+            (formValue(form, "limit", text) && !formInt(form, "limit", limit))) {
+            reply.error(400, "after and limit must be numbers");
             return;
         }
+        limit = std::max(1LL, std::min(limit, static_cast<long long>(kMaxPage)));
         
-        std::cout << "Enter deposit amount: $";
-        std::cin >> amount;
-        
-        if (amount <= 0) {
-            std::cout << "Deposit amount must be greater than zero.\n";
+        std::vector<Transaction> page;
+        bool more = false;
+        int afterId = static_cast<int>(std::max(0LL, std::min(after, static_cast<long long>(INT_MAX))));
+        if (!transactionService->getTransactionPage(accountId, afterId, static_cast<size_t>(limit), page, more)) {
+            reply.error(500, "transactions unavailable");
             return;
         }
         
-        if (accountService->deposit(accountId, amount)) {
-            std::cout << "Deposit successful.\n";
-            std::cout << "New balance: $" << std::fixed << std::setprecision(2) 
-                     << accountService->getBalance(accountId) << std::endl;
+        JsonWriter& json = reply.begin(200).beginObject().key("accountId").integer(accountId).key("items").beginArray();
+        for (const auto& transaction : page) {
+            writeTransaction(json, transaction);
+        }
+        json.endArray().key("nextAfter");
+        if (more && !page.empty()) {
+            json.integer(page.back().getId());
         } else {
-            std::cout << "Deposit failed.\n";
+            json.null();
         }
+        json.endObject();
     }
     
-    void withdraw() {
-        int accountId;
-        double amount;
-        
-        std::cout << "Enter account ID: ";
-        std::cin >> accountId;
-        
-        auto account = accountService->getAccount(accountId);
-        
-        if (!account) {
-            std::cout << "Account not found.\n";
-            return;
+    void route(const HttpRequest& request, HttpReply& reply) {
+        std::string_view segments[kMaxSegments];
+        size_t count = 0;
+        std::string_view path = request.path;
+        while (!path.empty()) {
+            path.remove_prefix(1);
+            size_t slash = path.find('/');
+            std::string_view segment = path.substr(0, slash);
+            path = slash == std::string_view::npos ? std::string_view() : path.substr(slash);
+            if (segment.empty()) {
+                continue;
+            }
+            if (count == kMaxSegments) {
+                reply.error(404, "no such resource");
+                return;
+            }
+            segments[count++] = segment;
         }
         
-        std::cout << "Enter withdrawal amount: $";
-        std::cin >> amount;
-        
-        if (amount <= 0) {
-            std::cout << "Withdrawal amount must be greater than zero.\n";
+        std::string_view form = request.body.empty() ? request.query : request.body;
+        bool get = request.method == "GET";
+        bool post = request.method == "POST";
+        int id = 0;
+        if (count >= 2 && !parseId(segments[1], id)) {
+            reply.error(404, "no such resource");
             return;
         }
         
-        if (accountService->withdraw(accountId, amount)) {
-            std::cout << "Withdrawal successful.\n";
-            std::cout << "New balance: $" << std::fixed << std::setprecision(2) 
-                     << accountService->getBalance(accountId) << std::endl;
+        if (count == 1 && segments[0] == "health") {
+            reply.begin(200).beginObject().key("status").string("ok").endObject();
+        } else if (count == 1 && segments[0] == "customers") {
+            customers(request, form, reply);
+        } else if (count == 1 && segments[0] == "accounts" && post) {
+            openAccount(form, reply);
+        } else if (count == 1 && segments[0] == "transfers" && post) {
+            long long from = 0;
+            if (!formInt(form, "from", from) || from <= 0 || from > INT_MAX) {
+                reply.error(400, "from is required");
+                return;
+            }
+            moveMoney(request, form, static_cast<int>(from), "transfer", reply);
+        } else if (count == 2 && segments[0] == "customers" && get) {
+            auto customer = customerService->getCustomer(id);
+            if (!customer) {
+                reply.error(404, "customer not found");
+                return;
+            }
+            writeCustomer(reply.begin(200), *customer);
+        } else if (count == 3 && segments[0] == "customers" && segments[2] == "accounts" && get) {
+            auto accounts = accountService->getCustomerAccounts(id);
+            JsonWriter& json = reply.begin(200).beginArray();
+            for (const auto& account : accounts) {
+                writeAccount(json, *account);
+            }
+            json.endArray();
+        } else if (count == 3 && segments[0] == "customers" && segments[2] == "overview" && get) {
+            customerOverview(id, form, reply);
+        } else if (count == 2 && segments[0] == "accounts" && get) {
+            auto account = accountService->getAccount(id);
+            if (!account) {
+                reply.error(404, "account not found");
+                return;
+            }
+            writeAccount(reply.begin(200), *account);
+        } else if (count == 2 && segments[0] == "accounts" && request.method == "DELETE") {
+            if (!accountService->closeAccount(id)) {
+                reply.error(422, "account was not closed");
+                return;
+            }
+            reply.begin(200).beginObject().key("closed").boolean(true).endObject();
+        } else if (count == 3 && segments[0] == "accounts" && segments[2] == "balance" && get) {
+            double balance = accountService->getBalance(id);
+            if (balance == -1) {
+                reply.error(404, "account not found");
+                return;
+            }
+            reply.begin(200).beginObject().key("accountId").integer(id).key("balance").money(balance).endObject();
+        } else if (count == 3 && segments[0] == "accounts" && post &&
+                   (segments[2] == "deposit" || segments[2] == "withdraw")) {
+            moveMoney(request, form, id, segments[2], reply);
+        } else if (count == 3 && segments[0] == "accounts" && segments[2] == "transactions" && get) {
+            transactionsPage(id, form, reply);
+        } else if (count == 2 && segments[0] == "transactions" && get) {
+            auto transaction = transactionService->getTransaction(id);
+            if (!transaction) {
+                reply.error(404, "transaction not found");
+                return;
+            }
+            writeTransaction(reply.begin(200), *transaction);
         } else {
-            std::cout << "Withdrawal failed. Insufficient funds or exceeded overdraft limit.\n";
+            reply.error(404, "no such resource");
         }
     }
     
-    void transfer() {
-        int fromAccountId, toAccountId;
-        double amount;
-        
-        std::cout << "Enter source account ID: ";
-        std::cin >> fromAccountId;
-        
-        auto fromAccount = accountService->getAccount(fromAccountId);
-        
-        if (!fromAccount) {
-            std::cout << "Source account not found.\n";
-            return;
-        }
-        
-        std::cout << "Enter destination account ID: ";
-        std::cin >> toAccountId;
-        
-        auto toAccount = accountService->getAccount(toAccountId);
-        
-        if (!toAccount) {
-            std::cout << "Destination account not found.\n";
-            return;
+protected:
+    size_t frameLength(const char* data, size_t size, bool& malformed) const override {
+        return httpMessageLength(data, size, malformed);
+    }
+    
+    bool handle(const char* data, size_t size, std::string& responses) override {
+        HttpRequest request;
+        if (!parseHttpRequest(data, size, request)) {
+            HttpReply reply(responses, false);
+            reply.error(400, "malformed request");
+            reply.finish();
+            return false;
         }
         
-        std::cout << "Enter transfer amount: $";
-        std::cin >> amount;
-        
-        if (amount <= 0) {
-            std::cout << "Transfer amount must be greater than zero.\n";
+        HttpReply reply(responses, request.keepAlive);
+        route(request, reply);
+        reply.finish();
+        return request.keepAlive;
+    }
+    
+    const char* serverName() const override {
+        return "HTTP API server";
+    }
+    
+public:
+    HttpApiServer(std::shared_ptr<ICustomerService> customerSvc,
+                  std::shared_ptr<IAccountService> accountSvc,
+                  std::shared_ptr<ITransactionService> transactionSvc,
+                  unsigned short port, std::shared_ptr<WorkerPool> workers,
+                  const std::string& host = kLoopbackHost)
+        : PipelinedSocketServer(port, workers, host), customerService(customerSvc), accountService(accountSvc),
+          transactionService(transactionSvc) {}
+};
+
+// Serves the metrics registry as GET /metrics for Prometheus to scrape. Runs
+// beside the console or the API servers on its own thread (see BankApplication).
+class MetricsServer : public PipelinedSocketServer {
+private:
+    std::shared_ptr<MetricsRegistry> metrics;
+    
+protected:
+    size_t frameLength(const char* data, size_t size, bool& malformed) const override {
+        return httpMessageLength(data, size, malformed);
+    }
+    
+    bool handle(const char* data, size_t size, std::string& responses) override {
+        HttpRequest request;
+        bool parsed = parseHttpRequest(data, size, request);
+        int status = !parsed ? 400 : request.path != "/metrics" ? 404 : request.method != "GET" ? 405 : 200;
+        std::string body = status == 200 ? metrics->render() : std::string(httpReason(status)) + "\n";
+        bool keepAlive = parsed && request.keepAlive;
+        
+        responses += "HTTP/1.1 " + std::to_string(status) + " " + httpReason(status);
+        responses += keepAlive ? "\r\nConnection: keep-alive" : "\r\nConnection: close";
+        responses += "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+        responses += std::to_string(body.size()) + "\r\n\r\n" + body;
+        return keepAlive;
+    }
+    
+    const char* serverName() const override {
+        return "Metrics endpoint";
+    }
+    
+    bool stopsOnCtrlC() const override {
+        return false;
+    }
+    
+public:
+    MetricsServer(std::shared_ptr<MetricsRegistry> metrics, unsigned short port,
+                  const std::string& host = kLoopbackHost)
+        : PipelinedSocketServer(port, std::make_shared<WorkerPool>(1), host), metrics(metrics) {}
+};
+
+enum class LoadProtocol {
+    Binary,
+    Http
+};
+
+struct LoadGenConfig {
+    LoadProtocol protocol;
+    std::string host;
+    unsigned short port;
+    unsigned int connections;
+    unsigned int pipelineDepth;     // requests kept in flight per connection
+    double seconds;
+    WireOp op;                      // Ping, GetBalance or Deposit
+    int accountId;
+    
+    LoadGenConfig() : protocol(LoadProtocol::Binary), host("127.0.0.1"), port(7070), connections(4),
+                      pipelineDepth(16), seconds(10.0), op(WireOp::Ping), accountId(1) {}
+};
+
+struct LoadGenResult {
+    std::uint64_t requests;
+    std::uint64_t failures;         // non-Ok responses
+    double seconds;
+    double p50Micros;
+    double p99Micros;
+    double p999Micros;
+    double maxMicros;
+    bool connected;
+    
+    double requestsPerSecond() const { return seconds > 0 ? requests / seconds : 0.0; }
+};
+
+// Loopback load generator for BinaryProtocolServer and HttpApiServer: every
+// connection keeps pipelineDepth requests outstanding for the configured time
+// and records the latency of each response.
+class LoadGenerator {
+private:
+    static void writeRequest(std::string& out, std::uint32_t requestId, const LoadGenConfig& config) {
+        if (config.protocol == LoadProtocol::Http) {
+            std::string account = std::to_string(config.accountId);
+            if (config.op == WireOp::GetBalance) {
+                out += "GET /accounts/" + account + "/balance HTTP/1.1\r\nHost: " + config.host + "\r\n\r\n";
+            } else if (config.op == WireOp::Deposit) {
+                out += "POST /accounts/" + account + "/deposit HTTP/1.1\r\nHost: " + config.host +
+                       "\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+                       "Content-Length: 11\r\n\r\namount=0.01";
+            } else {
+                out += "GET /health HTTP/1.1\r\nHost: " + config.host + "\r\n\r\n";
+            }
             return;
         }
         
-        if (accountService->transfer(fromAccountId, toAccountId, amount)) {
-            std::cout << "Transfer successful.\n";
-            std::cout << "Source account balance: $" << std::fixed << std::setprecision(2) 
-                     << accountService->getBalance(fromAccountId) << std::endl;
-            std::cout << "Destination account balance: $" << std::fixed << std::setprecision(2) 
-                     << accountService->getBalance(toAccountId) << std::endl;
-        } else {
-            std::cout << "Transfer failed. Insufficient funds or exceeded overdraft limit.\n";
+        WireWriter request(out, requestId, static_cast<std::uint8_t>(config.op));
+        if (config.op == WireOp::GetBalance) {
+            request.i32(config.accountId);
+        } else if (config.op == WireOp::Deposit) {
+            request.i32(config.accountId).i64(1).str("");
         }
+        request.finish();
     }
     
-    void viewAccountDetails() {
-        int accountId;
-        std::cout << "Enter account ID: ";
-        std::cin >> accountId;
-        
-        auto account = accountService->getAccount(accountId);
-        
-        if (account) {
-            std::cout << "\n------------ Account Details ------------\n";
-            account->display();
-        } else {
-            std::cout << "Account not found.\n";
+    static size_t responseLength(const LoadGenConfig& config, const char* data, size_t size, bool& ok) {
+        if (config.protocol == LoadProtocol::Binary) {
+            return WireReader::frameLength(data, size);
         }
+        bool malformed = false;
+        size_t length = httpMessageLength(data, size, malformed);
+        ok = ok && !malformed;
+        return length;
     }
     
-    void listCustomerAccounts() {
-        int customerId;
-        std::cout << "Enter customer ID: ";
-        std::cin >> customerId;
-        
-        auto customer = customerService->getCustomer(customerId);
-        
-        if (!customer) {
-            std::cout << "Customer not found.\n";
-            return;
+    static bool succeeded(const LoadGenConfig& config, const char* response, size_t length) {
+        if (config.protocol == LoadProtocol::Binary) {
+            WireReader reader(response + 4, length - 4);
+            reader.u32();
+            return reader.u8() == static_cast<std::uint8_t>(WireStatus::Ok);
         }
-        
-        auto accounts = accountService->getCustomerAccounts(customerId);
-        
-        if (accounts.empty()) {
-            std::cout << "No accounts found for this customer.\n";
-            return;
+        // "HTTP/1.1 2xx"
+        return length > 9 && response[9] == '2';
+    }
+    
+    static bool runConnection(const LoadGenConfig& config, std::chrono::steady_clock::time_point deadline,
+                              std::vector<std::uint32_t>& latencies, std::uint64_t& failures) {
+        SocketHandle socket = connectTo(config.host, config.port);
+        if (socket == kInvalidSocket) {
+            return false;
         }
         
-        std::cout << "\n------------ Customer Accounts ------------\n";
-        std::cout << "Customer: " << customer->getName() << std::endl;
-        
-        for (const auto& account : accounts) {
-            std::cout << "\nAccount ID: " << account->getId() << std::endl;
-            std::cout << "Account Number: " << account->getAccountNumber() << std::endl;
-            std::cout << "Account Type: " << account->getAccountType() << std::endl;
-            std::cout << "Balance: $" << std::fixed << std::setprecision(2) << account->getBalance() << std::endl;
-            std::cout << "Date Opened: " << account->getDateOpened() << std::endl;
+        std::deque<std::chrono::steady_clock::time_point> sentAt;
+        std::string input;
+        std::string batch;
+        std::string httpRequest;
+        writeRequest(httpRequest, 0, config);
+        std::uint32_t nextId = 1;
+        char buffer[64 * 1024];
+        bool ok = true;
+        
+        while (ok) {
+            auto now = std::chrono::steady_clock::now();
+            bool sending = now < deadline;
             
-            if (account->getAccountType() == "Savings") {
-                auto savingsAccount = dynamic_cast<SavingsAccount*>(account.get());
-                if (savingsAccount) {
-                    std::cout << "Interest Rate: " << savingsAccount->getInterestRate() << "%" << std::endl;
+            batch.clear();
+            while (sending && sentAt.size() < config.pipelineDepth) {
+                if (config.protocol == LoadProtocol::Http) {
+                    batch += httpRequest;
+                } else {
+                    writeRequest(batch, nextId++, config);
                 }
-            } else if (account->getAccountType() == "Checking") {
-                auto checkingAccount = dynamic_cast<CheckingAccount*>(account.get());
-                if (checkingAccount) {
-                    std::cout << "Overdraft Limit: $" << std::fixed << std::setprecision(2)
-                             << checkingAccount->getOverdraftLimit() << std::endl;
+                sentAt.push_back(now);
+            }
+            if (!batch.empty() && !sendAll(socket, batch.data(), batch.size())) {
+                ok = false;
+                break;
+            }
+            if (sentAt.empty()) {
+                break;
+            }
+            
+            long received = receiveSome(socket, buffer, sizeof(buffer));
+            if (received <= 0) {
+                ok = false;
+                break;
+            }
+            input.append(buffer, static_cast<size_t>(received));
+            
+            auto arrived = std::chrono::steady_clock::now();
+            size_t consumed = 0;
+            size_t length;
+            while ((length = responseLength(config, input.data() + consumed, input.size() - consumed, ok)) > 0) {
+                if (!succeeded(config, input.data() + consumed, length)) {
+                    failures++;
                 }
+                latencies.push_back(static_cast<std::uint32_t>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(arrived - sentAt.front()).count()));
+                sentAt.pop_front();
+                consumed += length;
             }
+            input.erase(0, consumed);
         }
-    }
-    
-    // Transaction management functions
-    void viewTransactionDetails() {
-        int transactionId;
-        std::cout << "Enter transaction ID: ";
-        std::cin >> transactionId;
         
-        auto transaction = transactionService->getTransaction(transactionId);
-        
-        if (transaction) {
-            std::cout << "\n------------ Transaction Details ------------\n";
-            transaction->display();
-        } else {
-            std::cout << "Transaction not found.\n";
-        }
+        closeSocket(socket);
+        return ok;
     }
     
-    void viewAccountTransactions() {
-        int accountId;
-        std::cout << "Enter account ID: ";
-        std::cin >> accountId;
-        
-        auto account = accountService->getAccount(accountId);
-        
-        if (!account) {
-            std::cout << "Account not found.\n";
-            return;
+public:
+    LoadGenResult run(const LoadGenConfig& config) {
+        LoadGenResult result = { 0, 0, 0.0, 0.0, 0.0, 0.0, 0.0, false };
+        if (!initSockets()) {
+            return result;
         }
         
-        auto transactions = transactionService->getAccountTransactions(accountId);
-        
-        if (transactions.empty()) {
-            std::cout << "No transactions found for this account.\n";
-            return;
-        }
+        unsigned int connectionCount = std::max(config.connections, 1u);
+        std::vector<std::vector<std::uint32_t>> latencies(connectionCount);
+        std::vector<std::uint64_t> failures(connectionCount, 0);
+        std::atomic<unsigned int> connected(0);
         
-        std::cout << "\n------------ Account Transactions ------------\n";
-        std::cout << "Account: " << account->getAccountNumber() << std::endl;
+        auto started = std::chrono::steady_clock::now();
+        auto deadline = started + std::chrono::microseconds(static_cast<long long>(config.seconds * 1e6));
         
-        for (const auto& transaction : transactions) {
-            std::cout << "\nTransaction ID: " << transaction->getId() << std::endl;
-            std::cout << "Type: " << transaction->getType() << std::endl;
-            std::cout << "Amount: $" << std::fixed << std::setprecision(2) << transaction->getAmount() << std::endl;
-            std::cout << "Date/Time: " << transaction->getDateTime() << std::endl;
-            std::cout << "Description: " << transaction->getDescription() << std::endl;
+        std::vector<std::thread> threads;
+        for (unsigned int i = 0; i < connectionCount; ++i) {
+            threads.emplace_back([&, i] {
+                if (runConnection(config, deadline, latencies[i], failures[i])) {
+                    connected++;
+                }
+            });
         }
-    }
-    
-    // Login method
-    void login() {
-        std::string username, password;
-        int attempts = 0;
-        const int maxAttempts = 3;
-        const int lockoutDuration = 60; // Lockout duration in seconds
-
-        while (attempts < maxAttempts) {
-            std::cout << "Enter username: ";
-            std::cin >> username;
-            std::cout << "Enter password: ";
-            std::cin >> password;
-
-            // Simple hardcoded user for demonstration
-            User user("admin", "password123");
-            currentUser = std::make_shared<User>(user);
-
-            if (currentUser->authenticate(username, password)) {
-                std::cout << "Login successful!\n";
-                return; // Exit the loop on successful login
-            } else {
-                attempts++;
-                std::cout << "Invalid credentials. Attempts left: " << (maxAttempts - attempts) << "\n";
-            }
-
-            if (attempts == maxAttempts) {
-                std::cout << "Too many failed attempts. Please wait " << lockoutDuration << " seconds before trying again.\n";
-                std::this_thread::sleep_for(std::chrono::seconds(lockoutDuration)); // Lockout timer
-                attempts = 0; // Reset attempts after lockout
-            }
+        for (auto& thread : threads) {
+            thread.join();
         }
-
-        std::cout << "Access denied. Exiting...\n";
-        exit(0); // Exit if authentication fails after max attempts
-    }
-    
-public:
-    ConsoleUI(std::shared_ptr<ICustomerService> customerSvc,
-             std::shared_ptr<IAccountService> accountSvc,
-             std::shared_ptr<ITransactionService> transactionSvc)
-        : customerService(customerSvc), accountService(accountSvc), transactionService(transactionSvc) {}
-    
-    void start() override {
-        login(); // Call login before showing the main menu
-        int choice = -1;
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
         
-        while (choice != 0) {
-            displayMainMenu();
-            std::cin >> choice;
-            
-            switch (choice) {
-                case 1:
-                    handleCustomerManagement();
-                    break;
-                case 2:
-                    handleAccountManagement();
-                    break;
-                case 3:
-                    handleTransactionManagement();
-                    break;
-                case 0:
-                    std::cout << "Thank you for using the Bank Management System. Goodbye!\n";
-                    break;
-                default:
-                    std::cout << "Invalid choice. Please try again.\n";
-            }
+        std::vector<std::uint32_t> all;
+        for (unsigned int i = 0; i < connectionCount; ++i) {
+            all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+            result.failures += failures[i];
+        }
+        result.connected = connected == connectionCount;
+        result.requests = all.size();
+        if (all.empty()) {
+            return result;
         }
+        
+        std::sort(all.begin(), all.end());
+        auto percentile = [&all](double fraction) {
+            return static_cast<double>(all[std::min(all.size() - 1, static_cast<size_t>(fraction * all.size()))]);
+        };
+        result.p50Micros = percentile(0.50);
+        result.p99Micros = percentile(0.99);
+        result.p999Micros = percentile(0.999);
+        result.maxMicros = all.back();
+        return result;
     }
 };
 
@@ -1702,24 +12677,59 @@ public:
 class BankApplication {
 private:
     std::shared_ptr<IUserInterface> ui;
-    std::shared_ptr<IDatabase> db;
+    // The database, or every shard of a sharded deployment
+    std::vector<std::shared_ptr<IDatabase>> databases;
+    std::shared_ptr<MetricsRegistry> metrics;
+    std::vector<std::pair<std::shared_ptr<IMetricsSource>, std::string>> metricSources;
+    unsigned short metricsPort;
+    std::string metricsHost;
+    std::shared_ptr<MetricsServer> metricsServer;
+    std::thread metricsThread;
     
 public:
     BankApplication(std::shared_ptr<IUserInterface> ui, std::shared_ptr<IDatabase> db)
-        : ui(ui), db(db) {}
+        : ui(ui), databases{ db }, metricsPort(0) {}
+    
+    BankApplication(std::shared_ptr<IUserInterface> ui, std::vector<std::shared_ptr<IDatabase>> databases)
+        : ui(ui), databases(std::move(databases)), metricsPort(0) {}
+    
+    // Serves the registry on host:port from initialize() on; port 0 keeps it unexposed
+    void enableMetrics(std::shared_ptr<MetricsRegistry> registry, unsigned short port,
+                       const std::string& host = kLoopbackHost) {
+        metrics = registry;
+        metricsPort = port;
+        metricsHost = host;
+    }
+    
+    // Registered by initialize(); labels are added to every series of the source
+    void addMetricsSource(std::shared_ptr<IMetricsSource> source, const std::string& labels = "") {
+        metricSources.push_back({ source, labels });
+    }
     
     bool initialize() {
-        // Connect to database
-        if (!db->connect()) {
-            std::cerr << "Failed to connect to database\n";
-            return false;
+        for (auto& db : databases) {
+            // Connect to database
+            if (!db->connect()) {
+                std::cerr << "Failed to connect to database\n";
+                return false;
+            }
+            
+            // Setup database schema
+            DatabaseSetup setup(db);
+            if (!setup.createSchema()) {
+                std::cerr << "Failed to create database schema\n";
+                return false;
+            }
         }
         
-        // Setup database schema
-        DatabaseSetup setup(db);
-        if (!setup.createSchema()) {
-            std::cerr << "Failed to create database schema\n";
-            return false;
+        if (metrics) {
+            for (auto& source : metricSources) {
+                source.first->registerMetrics(*metrics, source.second);
+            }
+            if (metricsPort != 0) {
+                metricsServer = std::make_shared<MetricsServer>(metrics, metricsPort, metricsHost);
+                metricsThread = std::thread([this] { metricsServer->start(); });
+            }
         }
         
         std::cout << "Bank Management System initialized successfully\n";
@@ -1731,37 +12741,757 @@ public:
     }
     
     void shutdown() {
-        db->disconnect();
+        if (metricsServer) {
+            metricsServer->stop();
+            metricsThread.join();
+        }
+        for (auto& db : databases) {
+            db->disconnect();
+        }
         std::cout << "Bank Management System shut down\n";
     }
 };
 
 // Main function
-int main() {
+static void stopServerOnSignal(int) {
+    PipelinedSocketServer::signalStop();
+}
+
+static int runLoadGenerator(int argc, char* argv[], LoadProtocol protocol) {
+    LoadGenConfig config;
+    config.protocol = protocol;
+    if (protocol == LoadProtocol::Http) {
+        config.port = 8080;
+    }
+    if (argc > 2) config.host = argv[2];
+    if (argc > 3) config.port = static_cast<unsigned short>(std::atoi(argv[3]));
+    if (argc > 4) config.connections = static_cast<unsigned int>(std::max(1, std::atoi(argv[4])));
+    if (argc > 5) config.pipelineDepth = static_cast<unsigned int>(std::max(1, std::atoi(argv[5])));
+    if (argc > 6) config.seconds = std::max(0.1, std::atof(argv[6]));
+    if (argc > 7) {
+        std::string op = argv[7];
+        if (op == "balance") {
+            config.op = WireOp::GetBalance;
+        } else if (op == "deposit") {
+            config.op = WireOp::Deposit;
+        } else if (op != "ping") {
+            std::cerr << "Unknown load operation: " << op << " (ping, balance or deposit)" << std::endl;
+            return 1;
+        }
+    }
+    if (argc > 8) config.accountId = std::atoi(argv[8]);
+    
+    std::cout << "Load: " << config.connections << " connections x " << config.pipelineDepth
+              << " in flight against " << config.host << ":" << config.port << " for "
+              << config.seconds << "s\n";
+    
+    LoadGenerator generator;
+    LoadGenResult result = generator.run(config);
+    if (!result.connected) {
+        std::cerr << "Could not keep every connection to " << config.host << ":" << config.port << std::endl;
+    }
+    
+    std::cout << std::fixed << std::setprecision(0)
+              << "Requests: " << result.requests << " (" << result.failures << " failed)\n"
+              << "Throughput: " << result.requestsPerSecond() << " req/s\n"
+              << "Latency us: p50 " << result.p50Micros << ", p99 " << result.p99Micros
+              << ", p99.9 " << result.p999Micros << ", max " << result.maxMicros << "\n";
+    return result.connected ? 0 : 1;
+}
+
+// Seeds one account with a long synthetic ledger and times
+// TransactionRepository::getBalanceAsOf at several depths behind its newest
+// row. Amounts are kept in cents so every answer is checked exactly against
+// the prefix sums; a full SUM over the account is timed for contrast.
+static int runBalanceAsOfBenchmark(int argc, char* argv[]) {
+    const long long rows = argc > 2 ? std::max(1LL, std::atoll(argv[2])) : 1000000;
+    const int samples = argc > 3 ? std::max(1, std::atoi(argv[3])) : 200;
+    const int checkpointInterval = 256;
+    const long long insertBatch = 1000;
+    // 2020-01-02 00:00 UTC, one row per second; a January window avoids DST gaps
+    const std::int64_t baseMicros = 1577923200LL * 1000000;
+    
+    auto db = std::make_shared<MySQLDatabase>(DBConfig());
+    if (!db->connect() || !DatabaseSetup(db).createSchema()) {
+        std::cerr << "Failed to prepare database for the benchmark\n";
+        return 1;
+    }
+    
+    CustomerRepository customers(db);
+    AccountRepository accounts(db);
+    int customerId = customers.addAndGetId(Customer(0, "As-of Benchmark", "-", "-", "-"));
+    int accountId = customerId ? accounts.addAndGetId(Account(0, customerId, 0.0, "ASOF-" + std::to_string(customerId), "Checking", Clock::today())) : 0;
+    if (accountId == 0) {
+        std::cerr << "Failed to create the benchmark account\n";
+        return 1;
+    }
+    const std::string account = std::to_string(accountId);
+    
+    auto centsText = [](long long cents) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%lld.%02lld", cents / 100, cents % 100);
+        return std::string(text);
+    };
+    auto stampOf = [&](long long row) {
+        char text[Clock::kMicrosLength + 1];
+        Clock::formatMicros(baseMicros + row * 1000000, text);
+        return std::string(text);
+    };
+    
+    // Two deposits of 10.00-16.00 then one 5.00 withdrawal, so the balance never dips
+    std::vector<long long> balanceAfter(static_cast<size_t>(rows));
+    long long running = 0;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = true;
+    for (long long first = 0; ok && first < rows; first += insertBatch) {
+        std::string insert = "INSERT INTO transactions (account_id, type, amount, date_time, description) VALUES ";
+        for (long long i = first; i < std::min(rows, first + insertBatch); i++) {
+            bool withdrawal = i % 3 == 2;
+            long long cents = withdrawal ? 500 : 1000 + (i % 7) * 100;
+            running += withdrawal ? -cents : cents;
+            balanceAfter[static_cast<size_t>(i)] = running;
+            insert += (i == first ? "(" : ",(") + account + (withdrawal ? ",'Withdrawal'," : ",'Deposit',") +
+                      centsText(cents) + ",'" + stampOf(i) + "','benchmark')";
+        }
+        ok = db->executeQuery(insert);
+    }
+    
+    // Checkpoints as TransactionRepository would have written them, every checkpointInterval rows
+    std::vector<std::string> transactionIds;
+    transactionIds.reserve(static_cast<size_t>(rows));
+    ok = ok && db->streamQuery("SELECT transaction_id FROM transactions WHERE account_id=" + account +
+                               " ORDER BY transaction_id", [&](const std::vector<std::string>& row) {
+        transactionIds.push_back(row[0]);
+        return true;
+    }) && static_cast<long long>(transactionIds.size()) == rows;
+    std::string checkpoints;
+    for (long long i = checkpointInterval - 1; ok && i < rows; i += checkpointInterval) {
+        checkpoints += (checkpoints.empty() ? "(" : ",(") + account + "," + transactionIds[static_cast<size_t>(i)] +
+                       ",'" + stampOf(i) + "'," + centsText(balanceAfter[static_cast<size_t>(i)]) + ")";
+        if (checkpoints.size() > 256 * 1024 || i + checkpointInterval >= rows) {
+            ok = db->executeQuery("INSERT INTO balance_checkpoints (account_id, transaction_id, date_time, balance_after) "
+                                  "VALUES " + checkpoints);
+            checkpoints.clear();
+        }
+    }
+    ok = ok && db->executeQuery("UPDATE accounts SET balance=" + centsText(running) + " WHERE account_id=" + account);
+    double seedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    int exitCode = 1;
+    if (!ok) {
+        std::cerr << "Failed to seed the benchmark ledger\n";
+    } else {
+        std::cout << "Seeded " << rows << " ledger rows for account " << accountId << " in "
+                  << std::fixed << std::setprecision(1) << seedSeconds << "s\n";
+        
+        TransactionRepository repository(db, true, checkpointInterval);
+        std::vector<long long> depths = { 1, 100, 10000, 100000, 500000, rows - 1 };
+        long long mismatches = 0;
+        std::mt19937_64 random(42);
+        for (long long depth : depths) {
+            if (depth < 1 || depth >= rows) {
+                continue;
+            }
+            // Sample rows in a small window around the depth so cached pages don't flatter one row
+            long long spread = std::min(depth, 1000LL);
+            LatencyHistogram latency;
+            for (int s = 0; s < samples; s++) {
+                long long row = rows - 1 - depth + static_cast<long long>(random() % static_cast<unsigned long long>(spread));
+                double balance = 0.0;
+                auto begin = std::chrono::steady_clock::now();
+                bool found = repository.getBalanceAsOf(accountId, stampOf(row), balance);
+                latency.record(std::chrono::steady_clock::now() - begin);
+                if (!found || std::llround(balance * 100) != balanceAfter[static_cast<size_t>(row)]) {
+                    mismatches++;
+                }
+            }
+            std::cout << "Depth " << depth << " rows: p50 " << latency.percentileMicros(0.50)
+                      << " us, p99 " << latency.percentileMicros(0.99)
+                      << " us, max " << latency.getMaxMicros() << " us\n";
+        }
+        
+        std::vector<std::vector<std::string>> results;
+        auto begin = std::chrono::steady_clock::now();
+        db->executeQuery("SELECT COUNT(*), SUM(amount) FROM transactions WHERE account_id=" + account, results);
+        std::cout << "Full-account scan for contrast: "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count()
+                  << " us\n"
+                  << "Mismatched balances: " << mismatches << "\n";
+        exitCode = mismatches == 0 ? 0 : 1;
+    }
+    
+    if (!customers.remove(customerId)) {
+        std::cerr << "Failed to remove benchmark customer " << customerId << "\n";
+    }
+    db->disconnect();
+    return exitCode;
+}
+
+// Checks that a standing order run whose transfer batch fails on the way to
+// the database stays due, and is paid once under the same key when the
+// database answers again. Uses the database from DBConfig.
+static int runStandingOrderCheck() {
+    // Fails the next failBatches batches without sending them, as a dropped connection would
+    struct DroppingDatabase : public IDatabase {
+        std::shared_ptr<IDatabase> inner;
+        std::atomic<int> failBatches{0};
+        
+        explicit DroppingDatabase(std::shared_ptr<IDatabase> inner) : inner(inner) {}
+        bool connect() override { return inner->connect(); }
+        bool disconnect() override { return inner->disconnect(); }
+        bool executeQuery(const std::string& query) override { return inner->executeQuery(query); }
+        bool executeQuery(const std::string& query, std::vector<std::vector<std::string>>& results) override {
+            return inner->executeQuery(query, results);
+        }
+        bool executeBatch(const std::vector<std::string>& statements,
+                          std::vector<std::vector<std::vector<std::string>>>& results) override {
+            if (failBatches.fetch_sub(1) > 0) {
+                results.clear();
+                return false;
+            }
+            return inner->executeBatch(statements, results);
+        }
+    };
+    
+    auto db = std::make_shared<MySQLDatabase>(DBConfig());
+    if (!db->connect() || !DatabaseSetup(db).createSchema()) {
+        std::cerr << "Failed to prepare database for the check\n";
+        return 1;
+    }
+    auto dropping = std::make_shared<DroppingDatabase>(db);
+    auto accounts = std::make_shared<AccountService>(dropping, std::make_shared<AccountRepository>(dropping),
+                                                     std::make_shared<TransactionRepository>(dropping));
+    auto repository = std::make_shared<StandingOrderRepository>(db);
+    auto workers = std::make_shared<WorkerPool>(1);
+    StandingOrderConfig config;
+    config.retrySeconds = 3600;
+    
+    CustomerRepository customers(db);
+    int customerId = customers.addAndGetId(Customer(0, "Standing Order Check", "-", "-", "-"));
+    Account from(0, customerId, 100.0, "", "Savings", "");
+    Account to(0, customerId, 0.0, "", "Savings", "");
+    if (customerId == 0 || !accounts->openAccount(from) || !accounts->openAccount(to)) {
+        std::cerr << "Failed to create the check accounts\n";
+        return 1;
+    }
+    
+    int failures = 0;
+    auto check = [&failures](bool ok, const std::string& what) {
+        std::cout << (ok ? "PASS " : "FAIL ") << what << "\n";
+        failures += ok ? 0 : 1;
+    };
+    auto runsDone = [&] {
+        auto orders = repository->getByAccountId(from.getId());
+        return orders.size() == 1 ? orders[0].runsDone : -1;
+    };
+    auto runFor = [&](int seconds) {
+        StandingOrderScheduler scheduler(repository, accounts, workers, config);
+        scheduler.start();
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        scheduler.stop();
+        scheduler.report(std::cout);
+    };
+    
+    {
+        StandingOrderScheduler scheduler(repository, accounts, workers, config);
+        check(scheduler.addOrder(from.getId(), to.getId(), 10.0, "day", 1) != 0, "add an order due now");
+    }
+    
+    dropping->failBatches = 1;
+    runFor(2);
+    check(runsDone() == 0 && accounts->getBalance(from.getId()) == 100.0,
+          "a run whose transfer got no answer is not advanced");
+    
+    runFor(2);
+    check(runsDone() == 1 && accounts->getBalance(from.getId()) == 90.0 &&
+          accounts->getBalance(to.getId()) == 10.0,
+          "the run is paid once when the database answers again");
+    
+    if (!customers.remove(customerId)) {
+        std::cerr << "Failed to remove check customer " << customerId << "\n";
+    }
+    std::cout << (failures == 0 ? "Standing order check passed" : "Standing order check failed") << "\n";
+    return failures == 0 ? 0 : 1;
+}
+
+// Measures VelocityRuleEngine::check with the default rules; needs no
+// database. Threads check withdrawals and transfers against random accounts
+// spread over a tenth as many customers, then many threads race withdrawals
+// on one fresh account to show the per-account limit holds under contention.
+static int runVelocityBenchmark(int argc, char* argv[]) {
+    const unsigned int threads = argc > 2 ? static_cast<unsigned int>(std::max(1, std::atoi(argv[2]))) : 4;
+    const double seconds = argc > 3 ? std::max(0.1, std::atof(argv[3])) : 5.0;
+    const int accounts = argc > 4 ? std::max(10, std::atoi(argv[4])) : 100000;
+    
+    VelocityRuleEngine engine;
+    LatencyHistogram latency;
+    std::atomic<bool> running(true);
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            std::mt19937 random(t + 1);
+            while (running.load(std::memory_order_relaxed)) {
+                int accountId = static_cast<int>(random() % static_cast<unsigned int>(accounts)) + 1;
+                const char* type = random() % 2 ? "Withdrawal" : "Transfer Out";
+                auto begin = std::chrono::steady_clock::now();
+                engine.check(accountId, accountId / 10 + 1, type, 20.0 + random() % 200);
+                latency.record(std::chrono::steady_clock::now() - begin);
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    running = false;
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    VelocityStats stats = engine.stats();
+    std::cout << std::fixed << std::setprecision(0)
+              << "Checks: " << stats.evaluated << " on " << threads << " threads over " << accounts << " accounts ("
+              << stats.flagged << " flagged, " << stats.blocked << " blocked)\n"
+              << "Throughput: " << stats.evaluated / elapsed << " checks/s\n"
+              << std::setprecision(3) << "Average check: " << stats.averageMicros << " us\n"
+              << "Latency us: p50 " << latency.percentileMicros(0.50) << ", p99 " << latency.percentileMicros(0.99)
+              << ", max " << latency.getMaxMicros() << "\n";
+    
+    // withdrawals-per-account-10m blocks the sixth withdrawal; none of the racers may slip past it
+    const int racers = 64;
+    const int raceAccount = accounts + 1;
+    std::atomic<int> passed(0);
+    std::vector<std::thread> race;
+    for (int i = 0; i < racers; i++) {
+        race.emplace_back([&] {
+            if (engine.check(raceAccount, 0, "Withdrawal", 1.0).action != RuleAction::Block) {
+                passed.fetch_add(1);
+            }
+        });
+    }
+    for (auto& racer : race) {
+        racer.join();
+    }
+    std::cout << "Concurrent withdrawals allowed on one account: " << passed.load() << " of " << racers
+              << " (limit 5)\n";
+    return passed.load() == 5 ? 0 : 1;
+}
+
+// Exercises cross-shard transfers against real servers, one per shard, each
+// given as host:port with an empty `bank` database. saga_check.sh starts
+// local instances and runs the phases in this order:
+//   setup    creates the schema and accounts SAGA-A (first shard) and SAGA-B (second), 100.00 each
+//   basic    a completed transfer, a refused one that is reversed, and a retried keyed transfer
+//   strand   with the second shard stopped: the transfer stays pending and a retry debits only once
+//   recover  with the second shard back: recoverTransfers() completes it, and a retry moves nothing
+static int runSagaCheck(int argc, char* argv[]) {
+    if (argc < 5) {
+        std::cerr << "Usage: --saga-check setup|basic|strand|recover host:port host:port [host:port ...]\n";
+        return 1;
+    }
+    std::string phase = argv[2];
+    
+    // DBConfig keeps the host pointer, so every host string is in place before any config is made
+    std::vector<std::string> hosts;
+    std::vector<unsigned int> ports;
+    for (int i = 3; i < argc; i++) {
+        std::string address = argv[i];
+        size_t colon = address.rfind(':');
+        hosts.push_back(address.substr(0, colon));
+        ports.push_back(colon == std::string::npos ? 3306 : static_cast<unsigned int>(std::atoi(address.c_str() + colon + 1)));
+    }
+    std::vector<DBConfig> configs;
+    for (size_t i = 0; i < hosts.size(); i++) {
+        configs.push_back(DBConfig(hosts[i].c_str(), ports[i]));
+    }
+    ShardMap::assignIdSpaces(configs);
+    auto shardMap = std::make_shared<ShardMap>(configs.size());
+    auto idGenerator = std::make_shared<IdGenerator>(1);
+    
+    std::vector<std::shared_ptr<IDatabase>> dbs;
+    std::vector<std::shared_ptr<AccountService>> accountShards;
+    for (size_t i = 0; i < configs.size(); i++) {
+        auto db = std::make_shared<MySQLDatabase>(configs[i]);
+        // A stopped shard stays unconnected, so its calls fail the way a lost connection does
+        if (!db->connect() || !DatabaseSetup(db).createSchema()) {
+            std::cout << "Shard " << i + 1 << " (" << argv[i + 3] << ") is unreachable\n";
+        }
+        dbs.push_back(db);
+        accountShards.push_back(std::make_shared<AccountService>(
+            db, std::make_shared<AccountRepository>(db), std::make_shared<TransactionRepository>(db),
+            nullptr, idGenerator));
+    }
+    DistributedAccountService accounts(accountShards, shardMap, nullptr, idGenerator);
+    
+    int failures = 0;
+    auto check = [&failures](bool ok, const std::string& what) {
+        std::cout << (ok ? "PASS " : "FAIL ") << what << "\n";
+        failures += ok ? 0 : 1;
+    };
+    auto balanceIs = [&accounts](int accountId, double expected) {
+        return std::llround(accounts.getBalance(accountId) * 100) == std::llround(expected * 100);
+    };
+    auto findTransfer = [&](int fromAccountId, const std::string& key, CrossShardTransfer& transfer) {
+        bool found = false;
+        return accountShards[shardMap->shardOf(fromAccountId)]->findTransfer("key:" + key, transfer, found) && found;
+    };
+    auto stateOf = [&](int fromAccountId, const std::string& key) {
+        CrossShardTransfer transfer;
+        return findTransfer(fromAccountId, key, transfer) ? transfer.state : std::string("missing");
+    };
+    
+    if (phase == "setup") {
+        for (size_t shard = 0; shard < 2; shard++) {
+            int customerId = CustomerRepository(dbs[shard]).addAndGetId(Customer(0, "Saga Check", "-", "-", "-"));
+            Account account(0, customerId, 100.0, shard == 0 ? "SAGA-A" : "SAGA-B", "Savings", "");
+            check(customerId != 0 && shardMap->shardOf(customerId) == shard && accounts.openAccount(account),
+                  "open " + account.getAccountNumber() + " with 100.00 on shard " + std::to_string(shard + 1));
+        }
+    } else {
+        // SAGA-B is looked up through the first transfer, so the second shard may be down
+        std::vector<std::vector<std::string>> rows;
+        int a = dbs[0]->executeQuery("SELECT account_id FROM accounts WHERE account_number='SAGA-A'", rows) &&
+                !rows.empty() ? std::atoi(rows[0][0].c_str()) : 0;
+        int b = 0;
+        if (phase == "basic") {
+            rows.clear();
+            b = dbs[1]->executeQuery("SELECT account_id FROM accounts WHERE account_number='SAGA-B'", rows) &&
+                !rows.empty() ? std::atoi(rows[0][0].c_str()) : 0;
+        } else {
+            CrossShardTransfer first;
+            b = findTransfer(a, "saga-complete", first) ? first.toAccountId : 0;
+        }
+        if (a == 0 || b == 0) {
+            std::cerr << "Accounts SAGA-A and SAGA-B not found; run the setup phase on fresh servers first\n";
+            return 1;
+        }
+        
+        if (phase == "basic") {
+            check(accounts.transfer(a, b, 10.0, "saga-complete") && balanceIs(a, 90.0) && balanceIs(b, 110.0) &&
+                  stateOf(a, "saga-complete") == "completed",
+                  "transfer of 10.00 completes on both shards");
+            
+            // Same shard as SAGA-B, but no such account
+            int missing = b + static_cast<int>(shardMap->size()) * 1000;
+            check(!accounts.transfer(a, missing, 5.0, "saga-refuse") && balanceIs(a, 90.0) &&
+                  stateOf(a, "saga-refuse") == "reversed",
+                  "transfer to a missing account is refused and the 5.00 returned");
+            
+            bool first = accounts.transfer(a, b, 7.0, "saga-retry");
+            bool retry = accounts.transfer(a, b, 7.0, "saga-retry");
+            check(first && retry && balanceIs(a, 83.0) && balanceIs(b, 117.0),
+                  "keyed transfer retried after success moves 7.00 once");
+        } else if (phase == "strand") {
+            bool first = accounts.transfer(a, b, 3.0, "saga-strand");
+            bool retry = accounts.transfer(a, b, 3.0, "saga-strand");
+            check(!first && !retry && balanceIs(a, 80.0) && stateOf(a, "saga-strand") == "pending",
+                  "transfer to a stopped shard debits 3.00 once and stays pending");
+            check(accounts.recoverTransfers() == 1, "recovery leaves it pending while the shard is down");
+        } else if (phase == "recover") {
+            check(accounts.recoverTransfers() == 0 && stateOf(a, "saga-strand") == "completed" &&
+                  balanceIs(a, 80.0) && balanceIs(b, 120.0),
+                  "recoverTransfers completes the stranded transfer");
+            check(accounts.transfer(a, b, 3.0, "saga-strand") && balanceIs(a, 80.0) && balanceIs(b, 120.0),
+                  "retry after recovery succeeds without moving money");
+        } else {
+            std::cerr << "Unknown phase: " << phase << std::endl;
+            return 1;
+        }
+    }
+    
+    std::cout << "Phase " << phase << ": " << (failures == 0 ? "passed" : std::to_string(failures) + " checks failed")
+              << "\n";
+    return failures == 0 ? 0 : 1;
+}
+
+// Node id of this instance for IdGenerator, from the BMS_NODE_ID environment
+// variable; 1 when unset. False, with a message, for anything but a number up
+// to IdGenerator::kMaxNodeId.
+static bool configuredNodeId(unsigned int& nodeId) {
+    nodeId = 1;
+    const char* text = std::getenv("BMS_NODE_ID");
+    if (!text || !*text) {
+        return true;
+    }
+    
+    char* end = nullptr;
+    unsigned long value = std::strtoul(text, &end, 10);
+    if (*end != '\0' || !std::isdigit(static_cast<unsigned char>(text[0])) || value > IdGenerator::kMaxNodeId) {
+        std::cerr << "BMS_NODE_ID must be a number from 0 to " << static_cast<unsigned int>(IdGenerator::kMaxNodeId)
+                  << std::endl;
+        return false;
+    }
+    nodeId = static_cast<unsigned int>(value);
+    return true;
+}
+
+// Usage:
+//   BankManagementSystem                      interactive console
+//   BankManagementSystem --serve [port host]  binary protocol server (default port 7070)
+//   BankManagementSystem --http [port host]   HTTP/JSON API (default port 8080)
+//     Both listen on 127.0.0.1 unless host says otherwise, e.g. 0.0.0.0; they do not authenticate
+//   BankManagementSystem --loadgen [host port connections depth seconds ping|balance|deposit accountId]
+//   BankManagementSystem --http-loadgen [same arguments, default port 8080]
+//   BankManagementSystem --asof-bench [rows samples]   getBalanceAsOf latency on a seeded account
+//   BankManagementSystem --velocity-bench [threads seconds accounts]   velocity rule checks, no database
+//   BankManagementSystem --saga-check phase host:port host:port...   cross-shard transfers (saga_check.sh)
+//   BankManagementSystem --standing-order-check   a failed transfer leaves its standing order run due
+// Instances that open accounts against the same database need different
+// BMS_NODE_ID values (0-1023), or their account numbers can collide.
+int main(int argc, char* argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "--loadgen" || mode == "--http-loadgen") {
+        return runLoadGenerator(argc, argv, mode == "--loadgen" ? LoadProtocol::Binary : LoadProtocol::Http);
+    }
+    if (mode == "--asof-bench") {
+        return runBalanceAsOfBenchmark(argc, argv);
+    }
+    if (mode == "--velocity-bench") {
+        return runVelocityBenchmark(argc, argv);
+    }
+    if (mode == "--saga-check") {
+        return runSagaCheck(argc, argv);
+    }
+    if (mode == "--standing-order-check") {
+        return runStandingOrderCheck();
+    }
+    if (!mode.empty() && mode != "--serve" && mode != "--http") {
+        std::cerr << "Unknown option: " << mode << std::endl;
+        return 1;
+    }
+    
+    // Prometheus metrics, served as GET /metrics on this port; 0 keeps them unexposed.
+    // Loopback only unless metricsHost is widened, e.g. to "0.0.0.0" for a remote scraper.
+    const unsigned short metricsPort = 9464;
+    const std::string metricsHost = kLoopbackHost;
+    auto metrics = std::make_shared<MetricsRegistry>();
+    // Components with their own statistics, registered by BankApplication::initialize
+    std::vector<std::pair<std::shared_ptr<IMetricsSource>, std::string>> metricSources;
+    
     // Create database connection
     DBConfig config;
-    auto db = std::make_shared<MySQLDatabase>(config);
+    const size_t connectionPoolSize = 4;
+    const RequestSchedulerConfig schedulerConfig(connectionPoolSize);
+    auto pool = std::make_shared<ConnectionPoolDatabase>(config, schedulerConfig.connections());
+    std::shared_ptr<IDatabase> db = std::make_shared<MeteredDatabase>(pool, *metrics, "database=\"primary\"");
+    
+    // Read replicas, e.g. DBConfig("127.0.0.1", 3307); reads stay on the primary when empty
+    std::vector<DBConfig> replicaConfigs;
+    std::shared_ptr<ReplicaRoutingDatabase> router;
     
-    // Create repositories
-    auto customerRepo = std::make_shared<CustomerRepository>(db);
-    auto accountRepo = std::make_shared<AccountRepository>(db);
-    auto transactionRepo = std::make_shared<TransactionRepository>(db);
+    if (!replicaConfigs.empty()) {
+        router = std::make_shared<ReplicaRoutingDatabase>(db);
+        for (size_t i = 0; i < replicaConfigs.size(); i++) {
+            std::string name = "replica-" + std::to_string(i + 1);
+            auto replica = std::make_shared<MySQLDatabase>(replicaConfigs[i]);
+            router->addReplica(name, std::make_shared<MeteredDatabase>(replica, *metrics, "database=\"" + name + "\""));
+        }
+        db = router;
+    }
+    
+    // Shards, e.g. DBConfig("10.0.0.1", 3306) and DBConfig("10.0.0.2", 3306), each
+    // starting out empty; customers and their data are then spread over them
+    // (see ShardMap). Everything stays in the database above when empty.
+    std::vector<DBConfig> shardConfigs;
+    
+    // Node id keeps account numbers unique when several instances open accounts
+    // against the same database, so each of them must be given its own
+    unsigned int nodeId;
+    if (!configuredNodeId(nodeId)) {
+        return 1;
+    }
+    auto idGenerator = std::make_shared<IdGenerator>(nodeId);
+    
+    auto serviceExecutor = std::make_shared<WorkerPool>(connectionPoolSize);
+    auto ruleEngine = std::make_shared<VelocityRuleEngine>();
+    // Committed money movements for downstream consumers; durable subscribers
+    // (eventBus->subscribeDurable) must be added here, before any publishing
+    auto eventBus = std::make_shared<LedgerEventBus>(8192, "ledger_events.log");
+    
+    // Customer overviews are cached until a ledger event touches one of their accounts
+    auto overviewCache = std::make_shared<CustomerOverviewCache>();
+    eventBus->subscribe("customer-overviews", [overviewCache](const LedgerEvent& event, bool) {
+        overviewCache->invalidateAccount(event.accountId);
+    });
+    
+    std::shared_ptr<ICustomerService> customerService;
+    std::shared_ptr<IAccountService> accountService;
+    std::shared_ptr<ITransactionService> transactionService;
+    std::shared_ptr<ShardedAccountService> shardedLedger;
+    std::shared_ptr<DistributedAccountService> distributedAccounts;
+    std::vector<std::shared_ptr<HotAccountCompactor>> hotCompactors;
+    std::vector<std::shared_ptr<IDatabase>> databases;
+    // Back-office jobs run at batch priority and only get what interactive work leaves over
+    std::vector<std::shared_ptr<RequestScheduler>> requestSchedulers;
+    BackOfficeJobs jobs;
     
-    // Create services
-    auto customerService = std::make_shared<CustomerService>(customerRepo);
-    auto accountService = std::make_shared<AccountService>(accountRepo, transactionRepo);
-    auto transactionService = std::make_shared<TransactionService>(transactionRepo);
+    if (shardConfigs.empty()) {
+        requestSchedulers.push_back(std::make_shared<RequestScheduler>(schedulerConfig));
+        db = std::make_shared<PrioritizedDatabase>(db, requestSchedulers.back());
+        metricSources.push_back({ pool, "database=\"primary\"" });
+        metricSources.push_back({ requestSchedulers.back(), "database=\"primary\"" });
+        
+        // Create repositories
+        auto customerRepo = std::make_shared<CustomerRepository>(db);
+        auto accountRepo = std::make_shared<AccountRepository>(db);
+        // Closed months of the ledger are archived here (Transaction menu)
+        auto archive = std::make_shared<ArchiveStore>("transaction_archive");
+        auto transactionRepo = std::make_shared<TransactionRepository>(db, true, 256, archive);
+        
+        // Accounts listed in hot_accounts take credits into sub-balance slots,
+        // folded into their balance by the compactor
+        auto hotAccounts = std::make_shared<HotAccountRepository>(db);
+        hotCompactors.push_back(std::make_shared<HotAccountCompactor>(hotAccounts, transactionRepo));
+        
+        // Create services
+        customerService = std::make_shared<CustomerService>(
+            customerRepo, nullptr, std::make_shared<CustomerOverviewRepository>(db, archive), overviewCache);
+        accountService = std::make_shared<AccountService>(
+            db, accountRepo, transactionRepo, serviceExecutor, idGenerator, nullptr, ruleEngine, eventBus,
+            hotAccounts);
+        
+        // Single-writer sharded execution: balances live in shard threads and the
+        // ledger is written behind in batches. 0 keeps every movement a synchronous
+        // database transaction.
+        const size_t ledgerShards = 0;
+        if (ledgerShards > 0) {
+            ShardedLedgerConfig shardConfig;
+            shardConfig.shards = ledgerShards;
+            shardedLedger = std::make_shared<ShardedAccountService>(accountService, db, accountRepo, transactionRepo,
+                                                                    shardConfig, ruleEngine, eventBus, idGenerator,
+                                                                    hotAccounts);
+            accountService = shardedLedger;
+            metricSources.push_back({ shardedLedger, "" });
+        }
+        accountService = std::make_shared<MeteredAccountService>(accountService, *metrics);
+        transactionService = std::make_shared<TransactionService>(transactionRepo);
+        
+        // Create back-office jobs
+        jobs.statements.push_back(std::make_shared<StatementGenerator>(db));
+        jobs.reconcilers.push_back(std::make_shared<LedgerReconciler>(db, archive));
+        jobs.archivers.push_back(std::make_shared<TransactionArchiver>(db, archive));
+        // Recurring transfers run on their own workers so they never queue behind interactive work
+        jobs.standingOrders.push_back(std::make_shared<StandingOrderScheduler>(
+            std::make_shared<StandingOrderRepository>(db), accountService,
+            std::make_shared<WorkerPool>(connectionPoolSize)));
+        databases.push_back(db);
+    } else {
+        // One repository, service stack and set of back-office jobs per shard
+        ShardMap::assignIdSpaces(shardConfigs);
+        auto shardMap = std::make_shared<ShardMap>(shardConfigs.size(), serviceExecutor);
+        jobs.shardMap = shardMap;
+        std::vector<std::shared_ptr<ICustomerService>> customerShards;
+        std::vector<std::shared_ptr<AccountService>> accountShards;
+        std::vector<std::shared_ptr<ITransactionService>> transactionShards;
+        
+        for (const auto& shardConfig : shardConfigs) {
+            std::string shardLabels = "database=\"shard-" + std::to_string(databases.size() + 1) + "\"";
+            auto shardPool = std::make_shared<ConnectionPoolDatabase>(shardConfig, schedulerConfig.connections());
+            requestSchedulers.push_back(std::make_shared<RequestScheduler>(schedulerConfig));
+            auto shardDb = std::make_shared<PrioritizedDatabase>(
+                std::make_shared<MeteredDatabase>(shardPool, *metrics, shardLabels), requestSchedulers.back());
+            metricSources.push_back({ shardPool, shardLabels });
+            metricSources.push_back({ requestSchedulers.back(), shardLabels });
+            // Each shard archives its own closed months into its own directory
+            auto archive = std::make_shared<ArchiveStore>("transaction_archive_shard" +
+                                                          std::to_string(databases.size() + 1));
+            auto transactionRepo = std::make_shared<TransactionRepository>(shardDb, true, 256, archive);
+            // Hot accounts are marked in the hot_accounts table of their own shard
+            auto hotAccounts = std::make_shared<HotAccountRepository>(shardDb);
+            hotCompactors.push_back(std::make_shared<HotAccountCompactor>(hotAccounts, transactionRepo));
+            customerShards.push_back(std::make_shared<CustomerService>(
+                std::make_shared<CustomerRepository>(shardDb), nullptr,
+                std::make_shared<CustomerOverviewRepository>(shardDb, archive), overviewCache));
+            accountShards.push_back(std::make_shared<AccountService>(
+                shardDb, std::make_shared<AccountRepository>(shardDb), transactionRepo, serviceExecutor,
+                idGenerator, nullptr, ruleEngine, eventBus, hotAccounts));
+            transactionShards.push_back(std::make_shared<TransactionService>(transactionRepo));
+            jobs.statements.push_back(std::make_shared<StatementGenerator>(shardDb));
+            jobs.reconcilers.push_back(std::make_shared<LedgerReconciler>(shardDb, archive));
+            jobs.archivers.push_back(std::make_shared<TransactionArchiver>(shardDb, archive));
+            databases.push_back(shardDb);
+        }
+        
+        customerService = std::make_shared<DistributedCustomerService>(customerShards, shardMap);
+        distributedAccounts = std::make_shared<DistributedAccountService>(accountShards, shardMap,
+                                                                          serviceExecutor, idGenerator);
+        accountService = std::make_shared<MeteredAccountService>(distributedAccounts, *metrics);
+        transactionService = std::make_shared<DistributedTransactionService>(transactionShards, shardMap);
+        
+        // A shard's scheduler runs the orders from its accounts; destinations may be on any shard
+        for (const auto& shardDb : databases) {
+            jobs.standingOrders.push_back(std::make_shared<StandingOrderScheduler>(
+                std::make_shared<StandingOrderRepository>(shardDb), accountService,
+                std::make_shared<WorkerPool>(connectionPoolSize)));
+        }
+    }
     
     // Create UI
-    auto ui = std::make_shared<ConsoleUI>(customerService, accountService, transactionService);
+    std::shared_ptr<IUserInterface> ui;
+    if (mode == "--serve" || mode == "--http") {
+        unsigned short defaultPort = mode == "--http" ? 8080 : 7070;
+        unsigned short port = static_cast<unsigned short>(argc > 2 ? std::atoi(argv[2]) : defaultPort);
+        std::string host = argc > 3 ? argv[3] : kLoopbackHost;
+        // Request handlers block on the database, so one worker per pooled connection
+        auto requestWorkers = std::make_shared<WorkerPool>(connectionPoolSize);
+        if (mode == "--http") {
+            ui = std::make_shared<HttpApiServer>(customerService, accountService, transactionService,
+                                                 port, requestWorkers, host);
+        } else {
+            ui = std::make_shared<BinaryProtocolServer>(customerService, accountService, transactionService,
+                                                        port, requestWorkers, host);
+        }
+        std::signal(SIGINT, stopServerOnSignal);
+    } else {
+        ui = std::make_shared<ConsoleUI>(customerService, accountService, transactionService, jobs);
+    }
     
     // Create and run the application
-    BankApplication app(ui, db);
+    BankApplication app(ui, databases);
+    metricSources.push_back({ overviewCache, "" });
+    metricSources.push_back({ ruleEngine, "" });
+    metricSources.push_back({ eventBus, "" });
+    app.enableMetrics(metrics, metricsPort, metricsHost);
+    for (const auto& source : metricSources) {
+        app.addMetricsSource(source.first, source.second);
+    }
     
     if (app.initialize()) {
+        if (distributedAccounts) {
+            size_t stillPending = distributedAccounts->recoverTransfers();
+            if (stillPending > 0) {
+                std::cerr << stillPending << " cross-shard transfers are still pending\n";
+            }
+        }
+        for (const auto& hotCompactor : hotCompactors) {
+            hotCompactor->start();
+        }
+        for (const auto& standingOrders : jobs.standingOrders) {
+            standingOrders->start();
+        }
         app.run();
     }
     
+    for (const auto& standingOrders : jobs.standingOrders) {
+        standingOrders->stop();
+        standingOrders->report(std::cout);
+    }
+    for (const auto& hotCompactor : hotCompactors) {
+        hotCompactor->stop();
+    }
+    
+    if (router) {
+        router->reportLoad(std::cout);
+    }
+    for (const auto& scheduler : requestSchedulers) {
+        scheduler->report(std::cout);
+    }
+    ruleEngine->report(std::cout);
+    if (shardedLedger) {
+        shardedLedger->stop();
+    }
+    eventBus->stop();
+    eventBus->report(std::cout);
+    
     app.shutdown();
     
     return 0;
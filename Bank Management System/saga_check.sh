@@ -0,0 +1,89 @@
+#!/usr/bin/env bash
+# Runs the cross-shard transfer checks against three throwaway local MySQL or MariaDB servers.
+#
+#   ./saga_check.sh                 build ./main if needed and run every phase
+#   SAGA_PORTS="3407 3408 3409" ./saga_check.sh
+#
+# Needs mysqld, mysqladmin and mysql on PATH. The servers use a temporary data directory that is
+# removed on exit, listen on 127.0.0.1 only, and are stopped when the script ends.
+set -eu
+
+cd "$(dirname "$0")"
+PORTS=(${SAGA_PORTS:-3407 3408 3409})
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/saga_check.XXXXXX")
+USER_OPT=()
+if [ "$(id -u)" = 0 ]; then
+    USER_OPT=(--user="$(whoami)")
+fi
+
+if [ ! -x ./main ]; then
+    echo "Building ./main"
+    g++ -std=c++17 -O2 -o main main.cpp $(mysql_config --cflags --libs) -lpthread
+fi
+
+cleanup() {
+    for i in "${!PORTS[@]}"; do
+        mysqladmin -S "$WORK/$i/mysqld.sock" -uroot shutdown >/dev/null 2>&1 || true
+    done
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+start_server() {
+    local i=$1
+    mysqld --no-defaults --datadir="$WORK/$i/data" --port="${PORTS[$i]}" --socket="$WORK/$i/mysqld.sock" \
+        --pid-file="$WORK/$i/mysqld.pid" --bind-address=127.0.0.1 --skip-name-resolve \
+        --log-error="$WORK/$i/error.log" ${USER_OPT[@]+"${USER_OPT[@]}"} >/dev/null 2>&1 &
+    for _ in $(seq 60); do
+        if mysqladmin -S "$WORK/$i/mysqld.sock" -uroot ping >/dev/null 2>&1; then
+            return 0
+        fi
+        sleep 1
+    done
+    echo "Server on port ${PORTS[$i]} did not start; see $WORK/$i/error.log" >&2
+    cat "$WORK/$i/error.log" >&2 || true
+    exit 1
+}
+
+stop_server() {
+    mysqladmin -S "$WORK/$1/mysqld.sock" -uroot shutdown
+    while [ -e "$WORK/$1/mysqld.pid" ]; do
+        sleep 1
+    done
+}
+
+for i in "${!PORTS[@]}"; do
+    mkdir -p "$WORK/$i/data"
+    if mysqld --version | grep -qi mariadb; then
+        install_db=$(command -v mariadb-install-db || command -v mysql_install_db)
+        "$install_db" --no-defaults --datadir="$WORK/$i/data" --auth-root-authentication-method=normal \
+            ${USER_OPT[@]+"${USER_OPT[@]}"} >"$WORK/$i/install.log" 2>&1
+    else
+        mysqld --no-defaults --initialize-insecure --datadir="$WORK/$i/data" ${USER_OPT[@]+"${USER_OPT[@]}"} \
+            >"$WORK/$i/install.log" 2>&1
+    fi
+    start_server "$i"
+    # The program connects over TCP as root with the password in DBConfig
+    mysql -S "$WORK/$i/mysqld.sock" -uroot -e "
+        CREATE DATABASE bank;
+        CREATE USER 'root'@'127.0.0.1' IDENTIFIED BY '030910';
+        GRANT ALL ON *.* TO 'root'@'127.0.0.1' WITH GRANT OPTION;"
+done
+
+ADDRS=()
+for port in "${PORTS[@]}"; do
+    ADDRS+=("127.0.0.1:$port")
+done
+
+./main --saga-check setup "${ADDRS[@]}"
+./main --saga-check basic "${ADDRS[@]}"
+
+echo "Stopping the second shard"
+stop_server 1
+./main --saga-check strand "${ADDRS[@]}"
+
+echo "Restarting the second shard"
+start_server 1
+./main --saga-check recover "${ADDRS[@]}"
+
+echo "All saga checks passed"